@@ -56,6 +56,13 @@ esp_err_t ina219_init(ina219_t *dev)
         return ESP_FAIL;
     }
 
+    if (dev->dev_handle == NULL && i2c_add_device(dev->i2c_addr, &dev->dev_handle) != ESP_OK)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR ADDING I2C DEVICE"));
+        LOG_MESSAGE_E(TAG, "ERROR ADDING I2C DEVICE");
+        return ESP_FAIL;
+    }
+
     return ina219_write_register(dev, INA219_REG_CONFIG, INA219_CONFIG_DEFAULT);
 }
 
@@ -72,79 +79,19 @@ static esp_err_t ina219_write_register(ina219_t *dev, uint8_t reg, uint16_t valu
     DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Enviando a dirección: 0x%02X, Registro: 0x%02X, MSB: 0x%02X, LSB: 0x%02X",
              dev->i2c_addr, reg, (value >> 8) & 0xFF, value & 0xFF));
 
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Obteniendo bus"));
-
-    if (!i2c_get_bus())
+    if (dev->dev_handle == NULL)
     {
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "BUS BUSY"));
-        LOG_MESSAGE_E(TAG,  "BUS BUSY");
-        return ESP_FAIL; 
+        return ESP_ERR_INVALID_STATE;
     }
 
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Bus obtenido"));
-
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (!cmd)
-    {
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "CMD NULL"));
-        LOG_MESSAGE_E(TAG, "CMD NULL");
-        i2c_give_bus();
-        return ESP_ERR_NO_MEM;
-    }
-
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "CMD CREADO"));
-
-    esp_err_t ret = ESP_OK;
     uint8_t data[] = {reg, (value >> 8) & 0xFF, value & 0xFF};
 
-    ret = i2c_master_start(cmd);
-    if (ret != ESP_OK)
-    {
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error en i2c_master_start: %s", esp_err_to_name(ret)));
-        LOG_MESSAGE_E(TAG, "Error en i2c_master_start");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return ret;
-    }
-
-    ret = i2c_master_write_byte(cmd, (dev->i2c_addr << 1) | I2C_MASTER_WRITE, true);
-    if (ret != ESP_OK)
-    {
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error enviando dirección: %s", esp_err_to_name(ret)));
-        LOG_MESSAGE_E(TAG, "Error enviando dirección");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return ret;
-    }
-
-    ret = i2c_master_write(cmd, data, sizeof(data), true);
-    if (ret != ESP_OK)
-    {
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error enviando datos: %s", esp_err_to_name(ret)));
-        LOG_MESSAGE_E(TAG, "Error enviando datos");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return ret;
-    }
-
-    ret = i2c_master_stop(cmd);
-    if (ret != ESP_OK)
-    {
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error en i2c_master_stop: %s", esp_err_to_name(ret)));
-        LOG_MESSAGE_E(TAG, "Error en i2c_master_stop");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return ret;
-    }
-
-    ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS(1000));
+    esp_err_t ret = i2c_transfer(I2C_CLIENT_BATTERY, dev->dev_handle, data, sizeof(data), NULL, 0);
     if (ret != ESP_OK)
     {
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error en i2c_master_cmd_begin: %s", esp_err_to_name(ret)));
-        LOG_MESSAGE_E(TAG, "Error en i2c_master_cmd_begin");
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error en i2c_transfer: %s", esp_err_to_name(ret)));
+        LOG_MESSAGE_E(TAG, "Error en i2c_transfer");
     }
-    i2c_cmd_link_delete(cmd);
-    i2c_give_bus();
 
     return ret;
 }
@@ -152,49 +99,23 @@ static esp_err_t ina219_write_register(ina219_t *dev, uint8_t reg, uint16_t valu
 /**
  * @brief Reads a 16-bit value from a specific register of the INA219 sensor.
  * 
+ * The register pointer write and the read are done in one transaction with a
+ * repeated start.
+ * 
  * @param dev Pointer to the INA219 device structure.
  * @param reg Register address to read from.
  * @param value Pointer to store the read 16-bit value.
  * @return ESP_OK on success, ESP_FAIL on failure.
- */static esp_err_t ina219_read_register(ina219_t *dev, uint8_t reg, uint16_t *value)
+ */
+static esp_err_t ina219_read_register(ina219_t *dev, uint8_t reg, uint16_t *value)
 {
-    if (value == NULL || !i2c_get_bus())
+    if (value == NULL || dev->dev_handle == NULL)
     {
         return ESP_ERR_INVALID_ARG;
     }
 
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (!cmd)
-    {
-        i2c_give_bus();
-        return ESP_ERR_NO_MEM;
-    }
-
-    esp_err_t ret = ESP_OK;
-
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (dev->i2c_addr << 1) | I2C_MASTER_WRITE, true);
-    i2c_master_write_byte(cmd, reg, true);
-    i2c_master_stop(cmd);
-
-    ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
-    if (ret != ESP_OK)
-    {
-        i2c_give_bus();
-        return ret;
-    }
-
-    cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (dev->i2c_addr << 1) | I2C_MASTER_READ, true);
     uint8_t data[2];
-    i2c_master_read(cmd, data, sizeof(data), I2C_MASTER_LAST_NACK);
-    i2c_master_stop(cmd);
-
-    ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
-    i2c_give_bus();
+    esp_err_t ret = i2c_transfer(I2C_CLIENT_BATTERY, dev->dev_handle, &reg, 1, data, sizeof(data));
 
     if (ret == ESP_OK)
     {
@@ -15,7 +15,7 @@
 #define _INA219V2_H_
 
 #include "esp_err.h"
-#include "driver/i2c.h"
+#include "driver/i2c_master.h"
 
 /** @brief Default I2C address of the INA219 sensor */
 #define INA219_ADDRESS 0x40
@@ -36,6 +36,7 @@
  */
 typedef struct {
     uint8_t i2c_addr; // Dirección I2C del dispositivo
+    i2c_master_dev_handle_t dev_handle; // Handle del dispositivo en el bus, creado en ina219_init
 } ina219_t;
 
 /**
@@ -45,6 +45,35 @@ esp_err_t gpio_init(void)
     return ESP_OK;
 }
 
+/**
+ * @brief Configures an additional GPIO pin as output, starting low.
+ *
+ * @param gpio The GPIO pin to configure.
+ * @return ESP_OK on success, ESP_FAIL on error.
+ */
+esp_err_t gpio_init_output(gpio_t gpio)
+{
+    gpio_config_t io_conf = {
+        .pin_bit_mask = (1ULL << gpio),                 /**< Pin bitmask for output configuration. */
+        .mode = GPIO_MODE_OUTPUT,                       /**< Set mode to output. */
+        .pull_up_en = GPIO_PULLUP_DISABLE,              /**< Disable internal pull-up resistor. */
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,          /**< Disable internal pull-down resistor. */
+        .intr_type = GPIO_INTR_DISABLE                  /**< Disable interrupts. */
+    };
+
+    if (gpio_config(&io_conf) != ESP_OK) {
+        ESP_LOGE(TAG, "Error en el inicio del GPIO: direction %d", gpio);
+        return ESP_FAIL;
+    }
+
+    if (gpio_set_level(gpio, 0) != ESP_OK) {
+        ESP_LOGE(TAG, "Error en el inicio del GPIO: level %d", gpio);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
 /**
  * @brief Sets the output state of a specified GPIO pin.
  *
@@ -62,3 +91,43 @@ esp_err_t gpio_set_output(gpio_t gpio, bool enable)
     ESP_LOGE(TAG, "Error en el seteo del GPIO: fallo al setear el nivel de XSHUT_FIRST");
     return ESP_FAIL;
 }
+
+/**
+ * @brief Configures a GPIO pin as a falling edge interrupt input.
+ *
+ * The GPIO ISR service is shared with other modules (e.g. the limit switch),
+ * so an already installed service is not treated as an error.
+ *
+ * @param gpio The GPIO pin to configure.
+ * @param isr Handler executed on each falling edge.
+ * @param arg Argument passed to the handler.
+ * @return ESP_OK on success, ESP_FAIL on error.
+ */
+esp_err_t gpio_init_interrupt(gpio_t gpio, gpio_isr_t isr, void *arg)
+{
+    gpio_config_t io_conf = {
+        .pin_bit_mask = (1ULL << gpio),                 /**< Pin bitmask for input configuration. */
+        .mode = GPIO_MODE_INPUT,                        /**< Set mode to input. */
+        .pull_up_en = GPIO_PULLUP_ENABLE,               /**< Line is open drain on the sensor side. */
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,          /**< Disable internal pull-down resistor. */
+        .intr_type = GPIO_INTR_NEGEDGE                  /**< Interrupt on falling edge. */
+    };
+
+    if (gpio_config(&io_conf) != ESP_OK) {
+        ESP_LOGE(TAG, "Error en el inicio del GPIO: interrupcion %d", gpio);
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Error instalando el servicio de ISR: %s", esp_err_to_name(err));
+        return ESP_FAIL;
+    }
+
+    if (gpio_isr_handler_add(gpio, isr, arg) != ESP_OK) {
+        ESP_LOGE(TAG, "Error agregando el handler de ISR al GPIO %d", gpio);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
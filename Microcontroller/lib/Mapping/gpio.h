@@ -24,7 +24,10 @@
 typedef enum {
     GPIO_XSHUT_FIRST = GPIO_NUM_23, 
     GPIO_XSHUT_SECOND = GPIO_NUM_1,
-    GPIO_XSHUT_THIRD = GPIO_NUM_2
+    GPIO_XSHUT_THIRD = GPIO_NUM_2,
+    GPIO_INT_FIRST = GPIO_NUM_26,       /**< VL53L0X GPIO1 (new sample ready, active low). */
+    GPIO_INT_SECOND = GPIO_NUM_27,
+    GPIO_INT_THIRD = GPIO_NUM_32
 } gpio_t;
 
 /**
@@ -37,6 +40,16 @@ typedef enum {
  */
 esp_err_t gpio_init(void);
 
+/**
+ * @brief Configures an additional GPIO pin as output, starting low.
+ *
+ * Used for the XSHUT pins of the optional sensors.
+ *
+ * @param gpio The GPIO pin to configure.
+ * @return ESP_OK on success, ESP_FAIL on error.
+ */
+esp_err_t gpio_init_output(gpio_t gpio);
+
 /**
  * @brief Sets the output state of a specified GPIO pin.
  *
@@ -48,4 +61,17 @@ esp_err_t gpio_init(void);
  */
 esp_err_t gpio_set_output(gpio_t gpio, bool enable);
 
+/**
+ * @brief Configures a GPIO pin as a falling edge interrupt input.
+ *
+ * The pin is set as input with pull-up enabled and the handler is attached
+ * through the shared GPIO ISR service, which is installed if it is not yet.
+ *
+ * @param gpio The GPIO pin to configure.
+ * @param isr Handler executed on each falling edge.
+ * @param arg Argument passed to the handler.
+ * @return ESP_OK on success, ESP_FAIL on error.
+ */
+esp_err_t gpio_init_interrupt(gpio_t gpio, gpio_isr_t isr, void *arg);
+
 #endif /* GPIO_H */
@@ -4,6 +4,10 @@
 
 
 #define DEFAULT_SLAVE_ADDRESS (0x29)
+/* Largest register block written in a single transaction */
+#define MAX_WRITE_BYTES (32)
+/* Different slave addresses used on the bus (one per sensor) */
+#define MAX_DEVICES (4)
 
 static const char *TAG = "VL53L0X_I2C";
 
@@ -21,479 +25,213 @@ typedef enum
     REG_SIZE_32BIT
 } reg_size_t;
 
-/* Read a register of size reg_size at address addr.
- * NOTE: The bytes are read from MSB to LSB. */
-static bool read_reg(uint8_t slave_addr, uint16_t addr, reg_size_t reg_size, uint8_t *data) {
-
-
-    bool success = false;
-
-    if(!i2c_get_bus()){
-        ESP_LOGE(TAG,"Error getting I2C Bus");
-        LOG_MESSAGE_E(TAG, "Error getting I2C Bus");
-        return false;
-    }
-    
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Crear un comando I2C"));
-    
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (cmd == NULL) {
-        ESP_LOGE(TAG, "Error al crear comando I2C");
-        LOG_MESSAGE_E(TAG, "Error al crear comando I2C");
-        i2c_give_bus();
-        return false;
-    }
+typedef struct
+{
+    uint8_t slave_addr;
+    i2c_master_dev_handle_t handle;
+} i2c_device_t;
 
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Iniciar la transferencia I2C"));
-    i2c_master_start(cmd);
+/* Device handles, created the first time an address is used and kept
+ * for the whole run so register accesses never allocate. i2c_delete_bus
+ * clears them, they are added again on the next use. */
+static i2c_device_t devices[MAX_DEVICES];
+static uint8_t device_count = 0;
 
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Escribir la dirección del dispositivo en el bus (modo escritura)"));
-    if (i2c_master_write_byte(cmd, (slave_addr << 1) | I2C_MASTER_WRITE, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al escribir la dirección del dispositivo");
-        LOG_MESSAGE_E(TAG, "Error al escribir la dirección del dispositivo");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
-    }
-
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Escribir el registro que queremos leer"));
-    if (i2c_master_write_byte(cmd, addr, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al escribir el registro");
-        LOG_MESSAGE_E(TAG, "Error al escribir el registro");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
-    }
+/* Address used by the wrapper functions, selects the sensor */
+static uint8_t slave_address = DEFAULT_SLAVE_ADDRESS;
 
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Enviar el comando de repetición para leer (modo lectura)"));
-    i2c_master_start(cmd);
-    if (i2c_master_write_byte(cmd, (slave_addr << 1) | I2C_MASTER_READ, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al escribir la dirección del dispositivo en modo lectura");
-        LOG_MESSAGE_E(TAG, "Error al escribir la dirección del dispositivo en modo lectura");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
-    }
-
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Leer los datos del registro"));
-    switch (reg_size) {
-        case REG_SIZE_8BIT:
-            if (i2c_master_read_byte(cmd, data, I2C_MASTER_LAST_NACK) != ESP_OK) {
-                ESP_LOGE(TAG, "Error en la lectura de 8 bits");
-                LOG_MESSAGE_E(TAG, "Error en la lectura de 8 bits");
-            } else {
-                success = true;
-            }
-            break;
-        case REG_SIZE_16BIT:
-            if (i2c_master_read_byte(cmd, data + 1, I2C_MASTER_ACK) == ESP_OK &&
-                i2c_master_read_byte(cmd, data, I2C_MASTER_LAST_NACK) == ESP_OK) {
-                success = true;
-            } else {
-                ESP_LOGE(TAG, "Error en la lectura de 16 bits");
-                LOG_MESSAGE_E(TAG, "Error en la lectura de 16 bits");
-            }
-            break;
-        case REG_SIZE_32BIT:
-            if (i2c_master_read_byte(cmd, data + 3, I2C_MASTER_ACK) == ESP_OK &&
-                i2c_master_read_byte(cmd, data + 2, I2C_MASTER_ACK) == ESP_OK &&
-                i2c_master_read_byte(cmd, data + 1, I2C_MASTER_ACK) == ESP_OK &&
-                i2c_master_read_byte(cmd, data, I2C_MASTER_LAST_NACK) == ESP_OK) {
-                success = true;
-            } else {
-                ESP_LOGE(TAG, "Error en la lectura de 32 bits");
-                LOG_MESSAGE_E(TAG, "Error en la lectura de 32 bits");
-            }
+static i2c_master_dev_handle_t get_device(uint8_t slave_addr)
+{
+    i2c_device_t *device = NULL;
+    for (uint8_t i = 0; i < device_count; i++) {
+        if (devices[i].slave_addr == slave_addr) {
+            device = &devices[i];
             break;
+        }
     }
-
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Terminar la transferencia I2C"));
-    if (i2c_master_stop(cmd) != ESP_OK){
-        ESP_LOGE(TAG, "Error en el cierre de la transferencia con el Master");
-        LOG_MESSAGE_E(TAG, "Error en el cierre de la transferencia con el Master");
-        i2c_give_bus();
-        return false;
+    if (device == NULL) {
+        if (device_count >= MAX_DEVICES) {
+            ESP_LOGE(TAG, "Demasiados dispositivos I2C");
+            LOG_MESSAGE_E(TAG, "Demasiados dispositivos I2C");
+            return NULL;
+        }
+        device = &devices[device_count++];
+        device->slave_addr = slave_addr;
+        device->handle = NULL;
     }
-
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Enviar el comando I2C y verificar el éxito"));
-    esp_err_t ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS(1000));
-    if (ret == ESP_OK) {
-        success = true;
-    } else {
-        ESP_LOGE(TAG, "Error en la transferencia I2C en read_reg: %s", esp_err_to_name(ret));
-        LOG_MESSAGE_E(TAG, "Error en la transferencia I2C en read_reg");
-        success = false;
-    } 
-
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Liberar el comando I2C"));
-    i2c_cmd_link_delete(cmd);
-
-    if(!i2c_give_bus()){
-        return false;
+    /* i2c_add_device keeps a pointer to the handle to clear it when the bus is deleted */
+    if (device->handle == NULL && i2c_add_device(slave_addr, &device->handle) != ESP_OK) {
+        return NULL;
     }
-    return success;
+    return device->handle;
 }
 
-static bool read_reg_bytes(uint8_t slave_addr, addr_size_t addr_size, uint16_t addr, uint8_t *bytes, uint16_t byte_count) {
-    bool success = false;
-
-    if(!i2c_get_bus()){
-        ESP_LOGE(TAG,"Error getting I2C Bus");
-        LOG_MESSAGE_E(TAG, "Error getting I2C Bus");
-        return false;
-    }
-
-    // Crear un comando I2C
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (cmd == NULL) {
-        ESP_LOGE(TAG, "Error al crear comando I2C");
-        LOG_MESSAGE_E(TAG, "Error al crear comando I2C");
-        i2c_give_bus();
-        return false;
-    }
-
-    // Iniciar la transferencia I2C en modo escritura para enviar la dirección del registro
-    i2c_master_start(cmd);
-    if (i2c_master_write_byte(cmd, (slave_addr << 1) | I2C_MASTER_WRITE, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al escribir la dirección del dispositivo en modo escritura");
-        LOG_MESSAGE_E(TAG, "Error al escribir la dirección del dispositivo en modo escritura");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
-    }
-
-    // Enviar la dirección del registro (1 o 2 bytes según addr_size)
+/* Puts the register address in the tx buffer, returns its length */
+static uint8_t put_addr(uint8_t *tx_buffer, addr_size_t addr_size, uint16_t addr)
+{
     if (addr_size == ADDR_SIZE_16BIT) {
-        if (i2c_master_write_byte(cmd, (addr >> 8) & 0xFF, true) != ESP_OK) {
-            ESP_LOGE(TAG, "Error al enviar el byte alto de la dirección");
-        LOG_MESSAGE_E(TAG, "Error al enviar el byte alto de la dirección");
-            i2c_cmd_link_delete(cmd);
-            i2c_give_bus();
-            return false;
-        }
-    }
-    if (i2c_master_write_byte(cmd, addr & 0xFF, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al enviar el byte bajo de la dirección");
-        LOG_MESSAGE_E(TAG, "Error al enviar el byte bajo de la dirección");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
-    }
-
-    // Repetir la condición de inicio para cambiar a modo lectura
-    i2c_master_start(cmd);
-    if (i2c_master_write_byte(cmd, (slave_addr << 1) | I2C_MASTER_READ, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al cambiar a modo lectura");
-        LOG_MESSAGE_E(TAG, "Error al cambiar a modo lectura");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
+        tx_buffer[0] = (addr >> 8) & 0xFF;
+        tx_buffer[1] = addr & 0xFF;
+        return 2;
     }
+    tx_buffer[0] = addr & 0xFF;
+    return 1;
+}
 
-    // Leer los bytes en el buffer
-    for (int i = 0; i < byte_count; i++) {
-        if (i == byte_count - 1) {
-            // Último byte debe terminar con NACK
-            if (i2c_master_read_byte(cmd, &bytes[i], I2C_MASTER_NACK) != ESP_OK) {
-                ESP_LOGE(TAG, "Error al leer el último byte");
-                LOG_MESSAGE_E(TAG, "Error al leer el último byte");
-                i2c_cmd_link_delete(cmd);
-                i2c_give_bus();
-                return false;
-            }
-        } else {
-            // Leer el byte con ACK
-            if (i2c_master_read_byte(cmd, &bytes[i], I2C_MASTER_ACK) != ESP_OK) {
-                ESP_LOGE(TAG, "Error al leer un byte con ACK");
-                LOG_MESSAGE_E(TAG, "Error al leer un byte con ACK");
-                i2c_cmd_link_delete(cmd);
-                i2c_give_bus();
-                return false;
-            }
-        }
-    }
+/* Read byte_count bytes starting at register addr into bytes.
+ * Write of the register address and read are done with a repeated start. */
+static bool read_reg_bytes(uint8_t slave_addr, addr_size_t addr_size, uint16_t addr, uint8_t *bytes, uint16_t byte_count) {
+    uint8_t tx_buffer[2];
 
-    // Finalizar la transferencia I2C
-    if (i2c_master_stop(cmd) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al finalizar la transferencia");
-        LOG_MESSAGE_E(TAG, "Error al finalizar la transferencia");
-        i2c_give_bus();
+    i2c_master_dev_handle_t dev = get_device(slave_addr);
+    if (dev == NULL) {
         return false;
     }
 
-    // Ejecutar el comando y verificar si fue exitoso
-    esp_err_t ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
-    if (ret == ESP_OK) {
-        success = true;
-    } else {
+    uint8_t addr_len = put_addr(tx_buffer, addr_size, addr);
+    esp_err_t ret = i2c_transfer(I2C_CLIENT_LIDAR, dev, tx_buffer, addr_len, bytes, byte_count);
+    if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Error en la transferencia I2C en read_reg_bytes: %s", esp_err_to_name(ret));
         LOG_MESSAGE_E(TAG, "Error en la transferencia I2C en read_reg_bytes");
-    }
-
-    // Liberar el comando I2C
-    i2c_cmd_link_delete(cmd);
-
-    if(!i2c_give_bus()){
         return false;
     }
-    return success;
+    return true;
 }
 
-/* Write data to a register of size reg_size at address addr.
- * NOTE: Writes the most significant byte (MSB) first. */
-static bool write_reg(uint8_t slave_addr, addr_size_t addr_size, uint16_t addr, reg_size_t reg_size, uint16_t data) {
-    bool success = false;
-
-    if(!i2c_get_bus()){
-        ESP_LOGE(TAG,"Error getting I2C Bus");
-        LOG_MESSAGE_E(TAG, "Error getting I2C Bus");
-        return false;
-    }
-
-    // Crear un comando I2C
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (cmd == NULL) {
-        ESP_LOGE(TAG, "Error al crear comando I2C");
-        LOG_MESSAGE_E(TAG, "Error al crear comando I2C");
-        i2c_give_bus();
-        return false;
-    }
-
-    // Iniciar la transferencia I2C
-    i2c_master_start(cmd);
+/* Read a register of size reg_size at address addr.
+ * NOTE: The bytes are read from MSB to LSB. */
+static bool read_reg(uint8_t slave_addr, addr_size_t addr_size, uint16_t addr, reg_size_t reg_size, uint8_t *data) {
+    uint8_t bytes[4];
+    uint8_t size = (reg_size == REG_SIZE_8BIT) ? 1 : (reg_size == REG_SIZE_16BIT) ? 2 : 4;
 
-    // Escribir la dirección del dispositivo en el bus (modo escritura)
-    if (i2c_master_write_byte(cmd, (slave_addr << 1) | I2C_MASTER_WRITE, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al escribir la dirección del dispositivo en modo escritura");
-        LOG_MESSAGE_E(TAG, "Error al escribir la dirección del dispositivo en modo escritura");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
+    if (!read_reg_bytes(slave_addr, addr_size, addr, bytes, size)) {
         return false;
     }
-
-    // Escribir la dirección del registro según el tamaño de la dirección
-    if (addr_size == ADDR_SIZE_16BIT) {
-        if (i2c_master_write_byte(cmd, (addr >> 8) & 0xFF, true) != ESP_OK) {
-            ESP_LOGE(TAG, "Error al escribir el byte alto de la dirección");
-            LOG_MESSAGE_E(TAG, "Error al escribir el byte alto de la dirección");
-            i2c_cmd_link_delete(cmd);
-            i2c_give_bus();
-            return false;
-        }
+    /* Registers are big endian, the host is little endian */
+    for (uint8_t i = 0; i < size; i++) {
+        data[i] = bytes[size - 1 - i];
     }
-    if (i2c_master_write_byte(cmd, addr & 0xFF, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al escribir el byte bajo de la dirección");
-        LOG_MESSAGE_E(TAG, "Error al escribir el byte bajo de la dirección");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
-    }
-
-    // Escribir los datos según el tamaño del registro
-    switch (reg_size) {
-        case REG_SIZE_8BIT:
-            if (i2c_master_write_byte(cmd, data & 0xFF, true) != ESP_OK) {
-                ESP_LOGE(TAG, "Error al escribir el dato de 8 bits");
-                LOG_MESSAGE_E(TAG,"Error al escribir el dato de 8 bits");
-                i2c_cmd_link_delete(cmd);
-                i2c_give_bus();
-                return false;
-            }
-            success = true;
-            break;
-        case REG_SIZE_16BIT:
-            if (i2c_master_write_byte(cmd, (data >> 8) & 0xFF, true) != ESP_OK ||
-                i2c_master_write_byte(cmd, data & 0xFF, true) != ESP_OK) {
-                ESP_LOGE(TAG, "Error al escribir el dato de 16 bits");
-                LOG_MESSAGE_E(TAG,"Error al escribir el dato de 16 bits");
-                i2c_cmd_link_delete(cmd);
-                i2c_give_bus();
-                return false;
-            }
-            success = true;
-            break;
-        case REG_SIZE_32BIT:
-            // Enviar los cuatro bytes de datos, del más significativo al menos significativo
-            if (i2c_master_write_byte(cmd, (data >> 24) & 0xFF, true) != ESP_OK ||
-                i2c_master_write_byte(cmd, (data >> 16) & 0xFF, true) != ESP_OK ||
-                i2c_master_write_byte(cmd, (data >> 8) & 0xFF, true) != ESP_OK ||
-                i2c_master_write_byte(cmd, data & 0xFF, true) != ESP_OK) {
-                ESP_LOGE(TAG, "Error al escribir el dato de 32 bits");
-                LOG_MESSAGE_E(TAG,"Error al escribir el dato de 32 bits");
-                i2c_cmd_link_delete(cmd);
-                i2c_give_bus();
-                return false;
-            }
-            success = true;
-            break;
-    }
-
-    // Terminar la transferencia I2C
-    if (i2c_master_stop(cmd) != ESP_OK) {
-        ESP_LOGE(TAG, "Error en el cierre de la transferencia con el Master");
-        LOG_MESSAGE_E(TAG,"Error en el cierre de la transferencia con el Master");
-        success = false;
-    }
-
-    // Enviar el comando I2C y verificar el éxito
-    esp_err_t ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
-    if (ret == ESP_OK) {
-        success = true;
-    } else {
-        ESP_LOGE(TAG, "Error en la transferencia I2C en write_reg: %s", esp_err_to_name(ret));
-        LOG_MESSAGE_E(TAG,"Error en la transferencia I2C en write_reg");
-        success = false;
-    }
-
-    // Liberar el comando I2C
-    i2c_cmd_link_delete(cmd);
-
-    if(!i2c_give_bus()){
-        return false;
-    }
-
-    return success;
+    return true;
 }
 
-static bool write_reg_bytes(uint8_t slave_addr, uint16_t addr, uint8_t *bytes, uint16_t byte_count) {
-    bool success = false;
+static bool write_reg_bytes(uint8_t slave_addr, addr_size_t addr_size, uint16_t addr, const uint8_t *bytes, uint16_t byte_count) {
+    uint8_t tx_buffer[2 + MAX_WRITE_BYTES];
 
-    if(!i2c_get_bus()){
-        ESP_LOGE(TAG,"Error getting I2C Bus");
-        LOG_MESSAGE_E(TAG,"Error getting I2C Bus");
+    if (byte_count > MAX_WRITE_BYTES) {
+        ESP_LOGE(TAG, "Escritura de %d bytes excede el buffer", byte_count);
+        LOG_MESSAGE_E(TAG,"Escritura excede el buffer");
         return false;
     }
 
-    // Crear un comando I2C para la transferencia
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (cmd == NULL) {
-        ESP_LOGE(TAG, "Error al crear comando I2C");
-        LOG_MESSAGE_E(TAG,"Error al crear comando I2C");
-        i2c_give_bus();
+    i2c_master_dev_handle_t dev = get_device(slave_addr);
+    if (dev == NULL) {
         return false;
     }
 
-    // Iniciar la transferencia I2C
-    i2c_master_start(cmd);
-
-    // Escribir la dirección del dispositivo en el bus (modo escritura)
-    if (i2c_master_write_byte(cmd, (slave_addr << 1) | I2C_MASTER_WRITE, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al escribir la dirección del dispositivo en modo escritura");
-        LOG_MESSAGE_E(TAG,"Error al escribir la dirección del dispositivo en modo escritura");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
-    }
-
-    // Escribir la dirección del registro
-    if (i2c_master_write_byte(cmd, (addr >> 8) & 0xFF, true) != ESP_OK || 
-        i2c_master_write_byte(cmd, addr & 0xFF, true) != ESP_OK) {
-        ESP_LOGE(TAG, "Error al escribir la dirección del registro");
-        LOG_MESSAGE_E(TAG,"Error al escribir la dirección del registro");
-        i2c_cmd_link_delete(cmd);
-        i2c_give_bus();
-        return false;
-    }
-
-    // Escribir los bytes al registro del dispositivo
+    uint8_t addr_len = put_addr(tx_buffer, addr_size, addr);
     for (uint16_t i = 0; i < byte_count; i++) {
-        if (i2c_master_write_byte(cmd, bytes[i], true) != ESP_OK) {
-            ESP_LOGE(TAG, "Error al escribir el byte %d en el dispositivo", i);
-            LOG_MESSAGE_E(TAG,"Error al escribir un byte en el dispositivo");
-            i2c_cmd_link_delete(cmd);
-            i2c_give_bus();
-            return false;
-        }
+        tx_buffer[addr_len + i] = bytes[i];
     }
 
-    // Terminar la transferencia I2C
-    if (i2c_master_stop(cmd) != ESP_OK) {
-        ESP_LOGE(TAG, "Error en el cierre de la transferencia con el Master");
-        LOG_MESSAGE_E(TAG,"Error en el cierre de la transferencia con el Master");
-        success = false;
-    } else {
-        success = true;
-    }
-
-    // Enviar el comando I2C y verificar el éxito
-    esp_err_t ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS));
+    esp_err_t ret = i2c_transfer(I2C_CLIENT_LIDAR, dev, tx_buffer, addr_len + byte_count, NULL, 0);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Error en la transferencia I2C en write_reg_bytes: %s", esp_err_to_name(ret));
         LOG_MESSAGE_E(TAG,"Error en la transferencia I2C en write_reg_bytes");
-        success = false;
+        return false;
     }
+    return true;
+}
 
-    // Liberar el comando I2C
-    i2c_cmd_link_delete(cmd);
+/* Write data to a register of size reg_size at address addr.
+ * NOTE: Writes the most significant byte (MSB) first. */
+static bool write_reg(uint8_t slave_addr, addr_size_t addr_size, uint16_t addr, reg_size_t reg_size, uint32_t data) {
+    uint8_t bytes[4];
+    uint8_t size = (reg_size == REG_SIZE_8BIT) ? 1 : (reg_size == REG_SIZE_16BIT) ? 2 : 4;
 
-    if(!i2c_give_bus()){
-        return false;
+    for (uint8_t i = 0; i < size; i++) {
+        bytes[i] = (data >> (8 * (size - 1 - i))) & 0xFF;
     }
-
-    return success;
+    return write_reg_bytes(slave_addr, addr_size, addr, bytes, size);
 }
 
 
+void i2c_set_slave_address(uint8_t addr)
+{
+    slave_address = addr;
+}
+
 bool i2c_read_addr8_data8(uint8_t addr, uint8_t *data)
 {
-    return read_reg(0x29, addr, REG_SIZE_8BIT, data);
+    return read_reg(slave_address, ADDR_SIZE_8BIT, addr, REG_SIZE_8BIT, data);
 }
 
 bool i2c_read_addr8_data16(uint8_t addr, uint16_t *data)
 {
-    return read_reg(0x29, addr, REG_SIZE_16BIT, (uint8_t *)data);
+    return read_reg(slave_address, ADDR_SIZE_8BIT, addr, REG_SIZE_16BIT, (uint8_t *)data);
 }
 
 bool i2c_read_addr16_data8(uint16_t addr, uint8_t *data)
 {
-    return read_reg(0x29, addr, REG_SIZE_8BIT, data);
+    return read_reg(slave_address, ADDR_SIZE_16BIT, addr, REG_SIZE_8BIT, data);
 }
 
 bool i2c_read_addr16_data16(uint16_t addr, uint16_t *data)
 {
-    return read_reg(0x29, addr, REG_SIZE_16BIT, (uint8_t *)data);
+    return read_reg(slave_address, ADDR_SIZE_16BIT, addr, REG_SIZE_16BIT, (uint8_t *)data);
 }
 
 bool i2c_read_addr8_data32(uint16_t addr, uint32_t *data)
-{   
-    DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ALERTA: El registro de dirección 8bits 32bits no es soportado"));
-    LOG_MESSAGE_E(TAG,"ALERTA: El registro de dirección 8bits 32bits no es soportado");
-    return read_reg(0x29, addr, REG_SIZE_32BIT, (uint8_t *)data);
+{
+    return read_reg(slave_address, ADDR_SIZE_8BIT, addr, REG_SIZE_32BIT, (uint8_t *)data);
 }
 
 bool i2c_read_addr16_data32(uint16_t addr, uint32_t *data)
 {
-    DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ALERTA: El registro de dirección 16bits 32bits no es soportado"));
-    LOG_MESSAGE_E(TAG,"ALERTA: El registro de dirección 16bits 32bits no es soportado");
-    return read_reg(0x29, addr, REG_SIZE_32BIT, (uint8_t *)data);
+    return read_reg(slave_address, ADDR_SIZE_16BIT, addr, REG_SIZE_32BIT, (uint8_t *)data);
 }
 
 bool i2c_read_addr8_bytes(uint8_t start_addr, uint8_t *bytes, uint16_t byte_count)
 {
-    return read_reg_bytes(0x29, ADDR_SIZE_8BIT, start_addr, bytes, byte_count);
+    return read_reg_bytes(slave_address, ADDR_SIZE_8BIT, start_addr, bytes, byte_count);
 }
 
 bool i2c_write_addr8_data8(uint8_t addr, uint8_t value)
 {
-    return write_reg(0x29, ADDR_SIZE_8BIT, addr, REG_SIZE_8BIT, value);
+    return write_reg(slave_address, ADDR_SIZE_8BIT, addr, REG_SIZE_8BIT, value);
 }
 
 bool i2c_write_addr8_data16(uint8_t addr, uint16_t value)
 {
-    return write_reg(0x29, ADDR_SIZE_8BIT, addr, REG_SIZE_16BIT, value);
+    return write_reg(slave_address, ADDR_SIZE_8BIT, addr, REG_SIZE_16BIT, value);
 }
 
 bool i2c_write_addr16_data8(uint16_t addr, uint8_t value)
 {
-    return write_reg(0x29, ADDR_SIZE_16BIT, addr, REG_SIZE_8BIT, value);
+    return write_reg(slave_address, ADDR_SIZE_16BIT, addr, REG_SIZE_8BIT, value);
 }
 
 bool i2c_write_addr16_data16(uint16_t addr, uint16_t value)
 {
-    return write_reg(0x29, ADDR_SIZE_16BIT, addr, REG_SIZE_16BIT, value);
+    return write_reg(slave_address, ADDR_SIZE_16BIT, addr, REG_SIZE_16BIT, value);
 }
 
 bool i2c_write_addr8_bytes(uint8_t start_addr, uint8_t *bytes, uint16_t byte_count)
 {
-    return write_reg_bytes(0x29, start_addr, bytes, byte_count);
+    return write_reg_bytes(slave_address, ADDR_SIZE_8BIT, start_addr, bytes, byte_count);
+}
+
+bool i2c_write_addr8_table(const i2c_reg_write_t *table, uint16_t count)
+{
+    i2c_master_dev_handle_t dev = get_device(slave_address);
+    if (dev == NULL) {
+        return false;
+    }
+
+    esp_err_t ret = i2c_write_table(I2C_CLIENT_LIDAR, dev, table, count);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error en la transferencia I2C en write_table: %s", esp_err_to_name(ret));
+        LOG_MESSAGE_E(TAG,"Error en la transferencia I2C en write_table");
+        return false;
+    }
+    return true;
 }
@@ -6,6 +6,12 @@
 #include "i2c.h"
 
 
+/**
+ * Selects the slave address used by the wrapper functions below.
+ * The default is the VL53L0X boot address (0x29).
+ */
+void i2c_set_slave_address(uint8_t addr);
+
 /**
  * Wrapper functions for reading from registers with different address
  * and data sizes.
@@ -44,4 +50,11 @@ bool i2c_write_addr16_data16(uint16_t , uint16_t);
  */
 bool i2c_write_addr8_bytes(uint8_t, uint8_t *, uint16_t);
 
+/**
+ * Write a table of (register, value) pairs in order, with a single
+ * request to the bus manager.
+ * @return True if every register was written, False if error
+ */
+bool i2c_write_addr8_table(const i2c_reg_write_t *, uint16_t);
+
 #endif
\ No newline at end of file
@@ -92,9 +92,9 @@ esp_err_t interrupt_init()
         return err;
     }
 
-    // Install ISR service
+    // Install ISR service (it may already be installed by the LiDAR data-ready interrupt)
     err = gpio_install_isr_service(0);
-    if (err != ESP_OK)
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
     {
         ESP_LOGE(TAG, "Failed to install the GPIO driver's ISR handler service.");
         LOG_MESSAGE_E(TAG,"Failed to install the GPIO driver's ISR handler service.");
@@ -3,11 +3,149 @@
 #include "vl53l0x.h"
 #include "esp_log.h"
 #include "debug_helper.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include <stdatomic.h>
+#include <stdlib.h>
 
-#define MIN_DISTANCE 100
+#define RANGE_OFFSET_MM 38 // Calibración del valor obtenido
+
+/* Delay before each recovery tier, doubled on every escalation and on every
+ * fault that could not be recovered */
+#define RECOVERY_BACKOFF_MIN_MS 5
+#define RECOVERY_BACKOFF_MAX_MS 200
+
+/* Mounting angle of each sensor relative to the first one, in degrees */
+#define SECOND_SENSOR_ANGLE_OFFSET 180
+#define THIRD_SENSOR_ANGLE_OFFSET 90
+
+/* Finest spacing between two triggered measurements, in millidegrees */
+#define SAMPLING_MIN_SPACING_MDEG 1000
+/* Time kept after each measurement to read every sensor and start the next ones */
+#define SAMPLING_READ_MARGIN_US 2000
+/* Trigger period while the servo is not moving */
+#define SAMPLING_IDLE_US 50000
+/* Longest wait for a trigger, so a pending profile change is never held back */
+#define SAMPLING_WAIT_MS 200
+/* Densest scan that can be asked for, in tenths of a point per degree */
+#define DENSITY_MAX_X10 100
+/* Sweep period change below which the density target does not touch the servo */
+#define DENSITY_DEADBAND_PERCENT 5
+/* EWMA weight of a new round time, 1/2^shift */
+#define ROUND_EWMA_SHIFT 3
 
 static const char *TAG = "MAPPING";
-static esp_err_t getValue(uint16_t *);
+static esp_err_t getValue(vl53l0x_idx_t, uint16_t *);
+static esp_err_t applyPendingProfile(void);
+static esp_err_t startRanging(void);
+static esp_err_t stopRanging(void);
+static esp_err_t startSensor(vl53l0x_idx_t);
+#ifndef MAPPING_FREE_RUNNING
+static esp_err_t triggerRanging(void);
+static void scheduleTrigger(const servo_motion_t *, int64_t);
+static void recordSpacing(const servo_motion_t *, int64_t);
+static esp_err_t applyDensity(void);
+#endif
+static esp_err_t recoverValue(vl53l0x_idx_t, uint16_t *, int64_t *);
+static esp_err_t runRecoveryTier(mapping_recovery_tier_t, vl53l0x_idx_t);
+static void addToFrame(const mapping_value_t *);
+static void resetFrame(scan_frame_t *, uint32_t, bool);
+
+/** @brief Angular offset of each sensor, added to the servo angle */
+static const int16_t sensor_angle_offset[VL53L0X_IDX_COUNT] = {
+    [VL53L0X_IDX_FIRST] = 0,
+#ifdef VL53L0X_SECOND
+    [VL53L0X_IDX_SECOND] = SECOND_SENSOR_ANGLE_OFFSET,
+#endif
+#ifdef VL53L0X_THIRD
+    [VL53L0X_IDX_THIRD] = THIRD_SENSOR_ANGLE_OFFSET,
+#endif
+};
+
+/** @brief Sensor read on the next call, sensors are read round-robin */
+static vl53l0x_idx_t next_sensor = VL53L0X_IDX_FIRST;
+
+/** @brief Recovery counters, written only by the mapping task */
+static mapping_recovery_stats_t recovery_stats;
+
+/** @brief Backoff before the first recovery tier, grows while faults are not recovered */
+static uint32_t recovery_backoff_ms = RECOVERY_BACKOFF_MIN_MS;
+
+static const char *recovery_tier_names[MAPPING_RECOVERY_COUNT] = {
+    [MAPPING_RECOVERY_RETRY] = "retry",
+    [MAPPING_RECOVERY_RESTART] = "restart",
+    [MAPPING_RECOVERY_REINIT] = "reinit",
+    [MAPPING_RECOVERY_RESET] = "reset",
+};
+
+/** @brief State of each scan frame buffer */
+typedef enum
+{
+    FRAME_FREE,       // Can be filled
+    FRAME_FILLING,    // Being filled by the mapping task
+    FRAME_READY,      // Completed, waiting for the publisher
+    FRAME_PUBLISHING  // Taken by the publisher
+} frame_state_t;
+
+/** @brief Double buffer of scan frames: one is filled while the other is published */
+static scan_frame_t scan_frames[2];
+static atomic_int frame_state[2] = {FRAME_FILLING, FRAME_FREE};
+
+/** @brief Frame being filled, only used by the mapping task */
+static uint8_t fill_frame = 0;
+
+/** @brief Frames handed to the publisher and frames dropped because it was still busy */
+static uint32_t frames_completed = 0;
+static uint32_t frames_dropped = 0;
+
+/** @brief Ranging profile to apply before the next sample */
+static volatile vl53l0x_profile_t next_profile = VL53L0X_PROFILE_DEFAULT;
+
+/** @brief Flag indicating a change of ranging profile */
+static volatile bool change_profile_flag = false;
+
+/** @brief Semaphore protecting the pending profile change */
+static SemaphoreHandle_t profile_semaphore;
+
+#ifndef MAPPING_FREE_RUNNING
+/** @brief One-shot timer firing at the next angular boundary */
+static esp_timer_handle_t sampling_timer = NULL;
+
+/** @brief Given by the timer, taken by the mapping task to start the measurements */
+static SemaphoreHandle_t sampling_trigger = NULL;
+
+/** @brief Time the measurements being read were started */
+static int64_t trigger_us = 0;
+
+/** @brief Spacing aimed for by the last scheduled trigger, in millidegrees */
+static uint32_t target_mdeg = 0;
+
+/** @brief Finest spacing the scheduler aims for, set by the density target */
+static volatile uint32_t min_spacing_mdeg = SAMPLING_MIN_SPACING_MDEG;
+
+/** @brief Density target in tenths of a point per degree, 0 if none */
+static volatile uint16_t density_x10 = 0;
+
+/** @brief Average time from a trigger to the read of the last sensor */
+static volatile uint32_t round_us = 0;
+
+/** @brief Spacing of the sweep in progress */
+static mapping_sampling_stats_t sweep_spacing;
+static uint64_t sweep_spacing_total_mdeg = 0;
+static uint32_t spacing_sweep = 0;
+static int64_t last_trigger_us = 0;
+#endif
+
+/** @brief Spacing of the last completed sweep, written only by the mapping task */
+static mapping_sampling_stats_t sampling_stats;
+
+#ifndef MAPPING_FREE_RUNNING
+static void samplingTimerCallback(void *arg)
+{
+    xSemaphoreGive(sampling_trigger);
+}
+#endif
 
 esp_err_t mapping_init()
 {
@@ -15,6 +153,15 @@ esp_err_t mapping_init()
     esp_err_t err = ESP_OK;
     DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Initializing Mapping"));
 
+    profile_semaphore = xSemaphoreCreateBinary();
+    if (profile_semaphore == NULL)
+    {
+        ESP_LOGE(TAG, "ERROR: profile_semaphore is NULL");
+        LOG_MESSAGE_E(TAG, "ERROR: profile_semaphore is NULL");
+        return ESP_FAIL;
+    }
+    xSemaphoreGive(profile_semaphore);
+
     DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Initializing GPIO..."));
     err = gpio_init();
     if (err != ESP_OK)
@@ -41,6 +188,31 @@ esp_err_t mapping_init()
         return ESP_FAIL;
     }
 
+    resetFrame(&scan_frames[fill_frame], 0, false);
+
+#ifndef MAPPING_FREE_RUNNING
+    sampling_trigger = xSemaphoreCreateBinary();
+    const esp_timer_create_args_t timer_args = {
+        .callback = samplingTimerCallback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "mapping_trigger",
+    };
+    if (sampling_trigger == NULL || esp_timer_create(&timer_args, &sampling_timer) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error creating the sampling timer");
+        LOG_MESSAGE_E(TAG, "Error creating the sampling timer");
+        return ESP_FAIL;
+    }
+#endif
+
+    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Starting continuous ranging..."));
+    if (startRanging() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error starting LiDAR continuous ranging");
+        LOG_MESSAGE_E(TAG, "Error starting LiDAR continuous ranging");
+        return ESP_FAIL;
+    }
+
     DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Initializing ServoMotor..."));
     err = servo_initialize();
     if (err != ESP_OK)
@@ -60,44 +232,539 @@ esp_err_t mapping_init()
     return err;
 }
 
-esp_err_t getMappingValue(int16_t *angle, uint16_t *distance)
+/**
+ * Reads the next sensor in round-robin order. All sensors range at the same
+ * time, so while one is read the others keep measuring. The value is tagged
+ * with the sensor index and its angle already includes the sensor offset.
+ *
+ * Unless MAPPING_FREE_RUNNING is defined, a round starts by waiting for the
+ * sampling timer, so the measurements start at evenly spaced angles and the
+ * angle of the sample is the one at the middle of the measurement.
+ */
+esp_err_t getMappingValue(mapping_value_t *value)
 {
 
-    if (angle == NULL || distance == NULL)
+    if (value == NULL)
     {
         ESP_LOGE(TAG, "NULL pointer passed to getMappingValue.");
         LOG_MESSAGE_E(TAG, "NULL pointer passed to getMappingValue.");
         return ESP_ERR_INVALID_ARG;
     }
 
-    *angle = readAngle();
-    if (*angle == -1)
+    if (change_profile_flag)
+    {
+        esp_err_t err_profile = applyPendingProfile();
+        if (err_profile != ESP_OK)
+            return err_profile;
+    }
+
+    vl53l0x_idx_t sensor = next_sensor;
+#ifdef MAPPING_FREE_RUNNING
+    int16_t angle = readAngle();
+#else
+    if (sensor == VL53L0X_IDX_FIRST)
+    {
+        esp_err_t err_trigger = triggerRanging();
+        if (err_trigger != ESP_OK)
+            return err_trigger;
+    }
+    int16_t angle = servo_angle_at(trigger_us + vl53l0x_get_timing_budget_us() / 2);
+#endif
+    next_sensor = (next_sensor + 1) % VL53L0X_IDX_COUNT;
+    value->sensor = sensor;
+
+    if (angle == -1)
         return ESP_ERR_INVALID_RESPONSE;
-    esp_err_t err = getValue(distance);
-    // esp_err_t err = ESP_OK;
-    //*distance = 500;
+    value->angle = (angle + sensor_angle_offset[sensor]) % 360;
+
+    esp_err_t err = getValue(sensor, &value->distance);
     if (err == ESP_FAIL)
     {
-        ESP_LOGW(TAG, "ERROR MAPPING: %s", esp_err_to_name(err));
+        TIER_LOG_EVERY_MS(LOG_WARNING, TAG, 1000, "ERROR MAPPING: %s", esp_err_to_name(err));
         LOG_MESSAGE_W(TAG, "ERROR MAPPING");
+        int64_t measured_us = 0;
+        err = recoverValue(sensor, &value->distance, &measured_us);
+        if (err == ESP_OK)
+        {
+            /* The recovered distance comes from a later measurement, tag it
+             * with the angle of that one or drop it */
+            angle = servo_angle_at(measured_us);
+            if (angle == -1)
+                return ESP_ERR_INVALID_RESPONSE;
+            value->angle = (angle + sensor_angle_offset[sensor]) % 360;
+        }
+    }
+#ifndef MAPPING_FREE_RUNNING
+    else if (sensor == VL53L0X_IDX_COUNT - 1)
+    {
+        /* The round ends with the last sensor, its length is the ranging rate */
+        int32_t round = (int32_t)(esp_timer_get_time() - trigger_us);
+        round_us = (round_us == 0) ? (uint32_t)round : (uint32_t)((int32_t)round_us + ((round - (int32_t)round_us) >> ROUND_EWMA_SHIFT));
+    }
+#endif
+    value->timestamp_us = esp_timer_get_time();
+    if (err == ESP_OK)
+        addToFrame(value);
+    return err;
+}
+
+/**
+ * Recovery ladder for a failed read. Each tier is cheaper than the next:
+ * retry the read, restart ranging (clears the interrupt), re-run the sensor
+ * init without power cycling it, and only then the hard XSHUT reset.
+ * The first tier that gives a good read ends the ladder.
+ * measured_us is set to the time the recovered distance was measured at.
+ */
+static esp_err_t recoverValue(vl53l0x_idx_t sensor, uint16_t *distance, int64_t *measured_us)
+{
+    int64_t start_us = esp_timer_get_time();
+    uint32_t backoff_ms = recovery_backoff_ms;
+    esp_err_t err = ESP_FAIL;
+
+    recovery_stats.faults++;
+    for (mapping_recovery_tier_t tier = MAPPING_RECOVERY_RETRY; tier < MAPPING_RECOVERY_COUNT; tier++)
+    {
+        if (tier != MAPPING_RECOVERY_RETRY)
+        {
+            vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+            backoff_ms = (backoff_ms * 2 > RECOVERY_BACKOFF_MAX_MS) ? RECOVERY_BACKOFF_MAX_MS : backoff_ms * 2;
+        }
+
+        recovery_stats.tier_count[tier]++;
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "LiDAR %d recovery: %s", sensor, recovery_tier_names[tier]));
+        if (runRecoveryTier(tier, sensor) != ESP_OK)
+            continue;
+
+#ifndef MAPPING_FREE_RUNNING
+        /* The tier ends by starting a new single shot */
+        int64_t started_us = esp_timer_get_time();
+#endif
+        err = getValue(sensor, distance);
+        if (err != ESP_FAIL)
+        {
+#ifdef MAPPING_FREE_RUNNING
+            *measured_us = esp_timer_get_time();
+#else
+            *measured_us = started_us + vl53l0x_get_timing_budget_us() / 2;
+#endif
+            break;
+        }
+    }
 
+    recovery_stats.lost_us += esp_timer_get_time() - start_us;
+    if (err == ESP_FAIL)
+    {
+        recovery_stats.unrecovered++;
+        recovery_backoff_ms = (recovery_backoff_ms * 2 > RECOVERY_BACKOFF_MAX_MS) ? RECOVERY_BACKOFF_MAX_MS : recovery_backoff_ms * 2;
+        ESP_LOGE(TAG, "LiDAR %d not recovered", sensor);
+        LOG_MESSAGE_E(TAG, "LiDAR not recovered");
+    }
+    else
+    {
+        recovery_backoff_ms = RECOVERY_BACKOFF_MIN_MS;
+    }
+    return err;
+}
+
+/**
+ * Runs the action of one recovery tier, the read is done by the caller.
+ */
+static esp_err_t runRecoveryTier(mapping_recovery_tier_t tier, vl53l0x_idx_t sensor)
+{
+    esp_err_t err = ESP_OK;
+    switch (tier)
+    {
+    case MAPPING_RECOVERY_RETRY:
+#ifndef MAPPING_FREE_RUNNING
+        /* A single shot gives one sample, measure again */
+        err = startSensor(sensor);
+#endif
+        break;
+    case MAPPING_RECOVERY_RESTART:
+        vl53l0x_stop_continuous(sensor);
+        err = startSensor(sensor);
+        break;
+    case MAPPING_RECOVERY_REINIT:
+        vl53l0x_stop_continuous(sensor);
+        err = vl53l0x_reinit(sensor);
+        if (err == ESP_OK)
+            err = startSensor(sensor);
+        break;
+    case MAPPING_RECOVERY_RESET:
         // //LLAMAR RUTINA DE REINICIO LIDAR
         ESP_LOGW(TAG, "Reiniciando LiDAR...");
         LOG_MESSAGE_E(TAG, "Reiniciando LiDAR...");
-        esp_err_t err2 = vl53l0x_reset();
-        if (err2 != ESP_OK)
+        err = vl53l0x_reset();
+        if (err != ESP_OK)
         {
-            ESP_LOGE(TAG, "Error restarting the LiDAR: %s", esp_err_to_name(err2));
+            ESP_LOGE(TAG, "Error restarting the LiDAR: %s", esp_err_to_name(err));
             LOG_MESSAGE_E(TAG,"Error restarting the LiDAR");
-            return ESP_FAIL;
+            break;
         }
-        vTaskDelay(20 / portTICK_PERIOD_MS);
+        /* The reset re-inits every sensor, so all of them are restarted */
+        err = startRanging();
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Error restarting LiDAR continuous ranging: %s", esp_err_to_name(err));
+            LOG_MESSAGE_E(TAG,"Error restarting LiDAR continuous ranging");
+        }
+#ifndef MAPPING_FREE_RUNNING
+        else
+        {
+            err = startSensor(sensor);
+        }
+#endif
+        break;
+    default:
+        err = ESP_ERR_INVALID_ARG;
+        break;
+    }
+    return err;
+}
 
-        return err;
+/**
+ * Adds a sample to the frame being filled. When the servo starts a new sweep
+ * the frame is handed to the publisher and the other buffer is filled. If the
+ * publisher still holds the other buffer the completed frame is dropped.
+ */
+static void addToFrame(const mapping_value_t *value)
+{
+    bool clockwise = false;
+    uint32_t sweep = servo_get_sweep(&clockwise);
+    scan_frame_t *frame = &scan_frames[fill_frame];
+
+    if (sweep != frame->sweep_id)
+    {
+        if (frame->samples > 0)
+        {
+            uint8_t other = fill_frame ^ 1;
+            int expected = FRAME_FREE;
+            if (atomic_compare_exchange_strong(&frame_state[other], &expected, FRAME_FILLING))
+            {
+                atomic_store(&frame_state[fill_frame], FRAME_READY);
+                frames_completed++;
+                fill_frame = other;
+                frame = &scan_frames[fill_frame];
+            }
+            else
+            {
+                frames_dropped++;
+            }
+        }
+        resetFrame(frame, sweep, clockwise);
+    }
+
+    uint16_t bin = (uint16_t)(value->angle * SCAN_FRAME_BINS / 360) % SCAN_FRAME_BINS;
+    scan_bin_t *scan_bin = &frame->bins[bin];
+    if (value->distance < scan_bin->distance)
+        scan_bin->distance = value->distance;
+    if (scan_bin->count < UINT8_MAX)
+        scan_bin->count++;
+
+    if (frame->samples == 0)
+        frame->start_us = value->timestamp_us;
+    frame->end_us = value->timestamp_us;
+    frame->samples++;
+}
+
+static void resetFrame(scan_frame_t *frame, uint32_t sweep, bool clockwise)
+{
+    frame->sweep_id = sweep;
+    frame->clockwise = clockwise;
+    frame->start_us = 0;
+    frame->end_us = 0;
+    frame->samples = 0;
+    for (int i = 0; i < SCAN_FRAME_BINS; i++)
+    {
+        frame->bins[i].distance = SCAN_BIN_EMPTY;
+        frame->bins[i].count = 0;
+    }
+}
+
+scan_frame_t *mapping_take_frame(void)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        int expected = FRAME_READY;
+        if (atomic_compare_exchange_strong(&frame_state[i], &expected, FRAME_PUBLISHING))
+            return &scan_frames[i];
+    }
+    return NULL;
+}
+
+uint32_t mapping_frames_completed(void)
+{
+    return frames_completed;
+}
+
+void mapping_release_frame(scan_frame_t *frame)
+{
+    if (frame == &scan_frames[0] || frame == &scan_frames[1])
+        atomic_store(&frame_state[frame - scan_frames], FRAME_FREE);
+}
+
+void mapping_log_frame_stats(void)
+{
+    ESP_LOGI(TAG, "Scan frames: %lu completed, %lu dropped",
+             (unsigned long)frames_completed, (unsigned long)frames_dropped);
+}
+
+void mapping_get_recovery_stats(mapping_recovery_stats_t *stats)
+{
+    if (stats != NULL)
+        *stats = recovery_stats;
+}
+
+void mapping_log_recovery_stats(void)
+{
+    mapping_recovery_stats_t stats = recovery_stats;
+    ESP_LOGI(TAG, "LiDAR faults: %lu, unrecovered %lu, lost %lu ms", (unsigned long)stats.faults,
+             (unsigned long)stats.unrecovered, (unsigned long)(stats.lost_us / 1000));
+    for (int i = 0; i < MAPPING_RECOVERY_COUNT; i++)
+    {
+        ESP_LOGI(TAG, "  %s: %lu", recovery_tier_names[i], (unsigned long)stats.tier_count[i]);
+    }
+}
+
+void mapping_get_sampling_stats(mapping_sampling_stats_t *stats)
+{
+    if (stats != NULL)
+        *stats = sampling_stats;
+}
+
+void mapping_log_sampling_stats(void)
+{
+    mapping_sampling_stats_t stats = sampling_stats;
+    ESP_LOGI(TAG, "Sampling: target %lu mdeg, achieved avg %lu min %lu max %lu mdeg, %lu points, %lu sweeps, %lu skipped, round %lu us",
+             (unsigned long)stats.target_mdeg, (unsigned long)stats.avg_mdeg, (unsigned long)stats.min_mdeg,
+             (unsigned long)stats.max_mdeg, (unsigned long)stats.points, (unsigned long)stats.sweeps,
+             (unsigned long)stats.skipped, (unsigned long)stats.round_us);
+}
+
+esp_err_t mapping_set_density(uint16_t points_per_deg_x10)
+{
+#ifdef MAPPING_FREE_RUNNING
+    return ESP_ERR_NOT_SUPPORTED;
+#else
+    if (points_per_deg_x10 > DENSITY_MAX_X10)
+        return ESP_ERR_INVALID_ARG;
+
+    density_x10 = points_per_deg_x10;
+    if (points_per_deg_x10 == 0)
+    {
+        min_spacing_mdeg = SAMPLING_MIN_SPACING_MDEG;
+        return servo_set_sweep_period(0);
+    }
+    min_spacing_mdeg = 10000 / points_per_deg_x10;
+    return applyDensity();
+#endif
+}
+
+/**
+ * Starts a measurement on one sensor: back-to-back ranging when free
+ * running, otherwise a single shot.
+ */
+static esp_err_t startSensor(vl53l0x_idx_t idx)
+{
+#ifdef MAPPING_FREE_RUNNING
+    return vl53l0x_start_continuous(idx);
+#else
+    return vl53l0x_start_single(idx);
+#endif
+}
+
+/**
+ * Starts back-to-back ranging on every sensor. When triggered it only arms
+ * the sampling timer, the measurements are started on each trigger.
+ */
+static esp_err_t startRanging(void)
+{
+#ifdef MAPPING_FREE_RUNNING
+    for (vl53l0x_idx_t idx = VL53L0X_IDX_FIRST; idx < VL53L0X_IDX_COUNT; idx++)
+    {
+        esp_err_t err = vl53l0x_start_continuous(idx);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Error starting ranging on sensor %d", idx);
+            return err;
+        }
+    }
+#else
+    servo_motion_t motion;
+    servo_get_motion(&motion);
+    scheduleTrigger(&motion, esp_timer_get_time());
+#endif
+    return ESP_OK;
+}
+
+/**
+ * Stops ranging on every sensor
+ */
+static esp_err_t stopRanging(void)
+{
+#ifndef MAPPING_FREE_RUNNING
+    /* Single shots stop by themselves: cancel the next trigger and let the
+     * measurements in flight end before the sensors are touched */
+    esp_timer_stop(sampling_timer);
+    vTaskDelay(pdMS_TO_TICKS(vl53l0x_get_timing_budget_us() / 1000) + 1);
+    return ESP_OK;
+#else
+    esp_err_t err = ESP_OK;
+    for (vl53l0x_idx_t idx = VL53L0X_IDX_FIRST; idx < VL53L0X_IDX_COUNT; idx++)
+    {
+        if (vl53l0x_stop_continuous(idx) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Error stopping ranging on sensor %d", idx);
+            err = ESP_FAIL;
+        }
     }
     return err;
+#endif
+}
+
+#ifndef MAPPING_FREE_RUNNING
+/* Angle travelled in `us` at `rate_q32` (degrees per µs in Q32), in millidegrees */
+static uint32_t travelMdeg(uint32_t rate_q32, int64_t us)
+{
+    return (us > 0) ? (uint32_t)(((uint64_t)rate_q32 * (uint64_t)us * 1000) >> 32) : 0;
 }
 
+/**
+ * Waits for the sampling timer, schedules the next trigger and starts a
+ * single measurement on every sensor.
+ */
+static esp_err_t triggerRanging(void)
+{
+    bool triggered = xSemaphoreTake(sampling_trigger, pdMS_TO_TICKS(SAMPLING_WAIT_MS)) == pdTRUE;
+    int64_t now = esp_timer_get_time();
+    servo_motion_t motion;
+
+    servo_get_motion(&motion);
+    /* Re-armed even without a trigger, so a lost one never stalls mapping */
+    scheduleTrigger(&motion, now);
+    if (!triggered || motion.time_base == 0)
+        return ESP_ERR_INVALID_RESPONSE;
+
+    recordSpacing(&motion, now);
+    trigger_us = now;
+    for (vl53l0x_idx_t idx = VL53L0X_IDX_FIRST; idx < VL53L0X_IDX_COUNT; idx++)
+    {
+        /* A sensor that does not start fails its read and goes to recovery */
+        if (vl53l0x_start_single(idx) != ESP_OK)
+            TIER_LOG_EVERY_MS(LOG_WARNING, TAG, 1000, "Error starting measurement on sensor %d", idx);
+    }
+    return ESP_OK;
+}
+
+/**
+ * Arms the timer at the next angular boundary after `now`. Boundaries are a
+ * time grid starting at the base of the servo segment, one step of the grid
+ * is the time the servo takes to travel the target spacing. The spacing is
+ * as fine as the timing budget allows, but never under
+ * SAMPLING_MIN_SPACING_MDEG.
+ */
+static void scheduleTrigger(const servo_motion_t *motion, int64_t now)
+{
+    uint32_t rate = (uint32_t)abs(motion->rate_q32);
+    uint64_t delay_us = SAMPLING_IDLE_US;
+
+    if (motion->time_base != 0 && rate != 0)
+    {
+        uint32_t needed_mdeg = travelMdeg(rate, vl53l0x_get_timing_budget_us() + SAMPLING_READ_MARGIN_US);
+        uint32_t floor_mdeg = min_spacing_mdeg;
+        target_mdeg = (needed_mdeg > floor_mdeg) ? needed_mdeg : floor_mdeg;
+        uint64_t period_us = ((uint64_t)target_mdeg << 32) / ((uint64_t)rate * 1000);
+        if (period_us == 0)
+            period_us = 1;
+        int64_t elapsed = now - motion->time_base;
+        uint64_t boundary = (elapsed > 0) ? (uint64_t)elapsed / period_us + 1 : 0;
+        int64_t next = motion->time_base + (int64_t)(boundary * period_us);
+        delay_us = (next > now) ? (uint64_t)(next - now) : 0;
+    }
+
+    esp_timer_stop(sampling_timer);
+    /* Drop a trigger the timer gave after the wait timed out */
+    xSemaphoreTake(sampling_trigger, 0);
+    esp_timer_start_once(sampling_timer, delay_us);
+}
+
+/**
+ * Asks the servo for the sweep period that gives the density target at the
+ * measured ranging rate: the servo has to travel one spacing per round.
+ */
+static esp_err_t applyDensity(void)
+{
+    uint16_t density = density_x10;
+    if (density == 0)
+        return ESP_OK;
+
+    uint64_t round = round_us;
+    if (round == 0)
+        round = vl53l0x_get_timing_budget_us() + SAMPLING_READ_MARGIN_US;
+    uint64_t period_ms = (uint64_t)servo_get_sweep_span() * round * density / 10000;
+    if (period_ms < SERVO_SWEEP_PERIOD_MIN_MS)
+        period_ms = SERVO_SWEEP_PERIOD_MIN_MS;
+    else if (period_ms > SERVO_SWEEP_PERIOD_MAX_MS)
+        period_ms = SERVO_SWEEP_PERIOD_MAX_MS;
+
+    /* Small drifts are left to the scheduler, every change costs a timed sweep */
+    uint32_t current = servo_get_sweep_period();
+    uint32_t deadband = current * DENSITY_DEADBAND_PERCENT / 100;
+    if (current != 0 && period_ms + deadband >= current && period_ms <= current + deadband)
+        return ESP_OK;
+
+    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Density %u/10 per degree: sweep period %lu ms", density, (unsigned long)period_ms));
+    return servo_set_sweep_period((uint32_t)period_ms);
+}
+
+/**
+ * Measures the angle travelled since the previous trigger and closes the
+ * spacing of a sweep when the servo starts a new one.
+ */
+static void recordSpacing(const servo_motion_t *motion, int64_t now)
+{
+    if (motion->sweep_id != spacing_sweep || last_trigger_us == 0)
+    {
+        if (sweep_spacing.points > 1)
+        {
+            sampling_stats.target_mdeg = sweep_spacing.target_mdeg;
+            sampling_stats.avg_mdeg = sweep_spacing_total_mdeg / (sweep_spacing.points - 1);
+            sampling_stats.min_mdeg = sweep_spacing.min_mdeg;
+            sampling_stats.max_mdeg = sweep_spacing.max_mdeg;
+            sampling_stats.points = sweep_spacing.points;
+            sampling_stats.round_us = round_us;
+            sampling_stats.sweeps++;
+            TIER_LOGD(TAG, "Sweep %lu: %lu points, target %lu mdeg, achieved avg %lu min %lu max %lu mdeg",
+                      (unsigned long)spacing_sweep, (unsigned long)sampling_stats.points,
+                      (unsigned long)sampling_stats.target_mdeg, (unsigned long)sampling_stats.avg_mdeg,
+                      (unsigned long)sampling_stats.min_mdeg, (unsigned long)sampling_stats.max_mdeg);
+        }
+        sweep_spacing.min_mdeg = UINT32_MAX;
+        sweep_spacing.max_mdeg = 0;
+        sweep_spacing.points = 1;
+        sweep_spacing_total_mdeg = 0;
+        spacing_sweep = motion->sweep_id;
+        last_trigger_us = now;
+        /* Follows the ranging rate, e.g. after a profile change */
+        if (density_x10 != 0)
+            applyDensity();
+        return;
+    }
+
+    uint32_t gap = travelMdeg((uint32_t)abs(motion->rate_q32), now - last_trigger_us);
+    last_trigger_us = now;
+    sweep_spacing.target_mdeg = target_mdeg;
+    sweep_spacing.points++;
+    sweep_spacing_total_mdeg += gap;
+    if (gap < sweep_spacing.min_mdeg)
+        sweep_spacing.min_mdeg = gap;
+    if (gap > sweep_spacing.max_mdeg)
+        sweep_spacing.max_mdeg = gap;
+    if (target_mdeg != 0 && gap > target_mdeg + target_mdeg / 2)
+        sampling_stats.skipped += (gap + target_mdeg / 2) / target_mdeg - 1;
+}
+#endif
+
 // static esp_err_t getValue(uint16_t *distance)
 // {
 //     esp_err_t success;
@@ -154,41 +821,106 @@ esp_err_t getMappingValue(int16_t *angle, uint16_t *distance)
 //     return ESP_OK; // Índice 5 es la mediana en un arreglo de 10 elementos
 // }
 
-static esp_err_t getValue(uint16_t *distance)
+/**
+ * Reads the last LiDAR sample. Validity comes from the sensor's own
+ * range status and signal rate, not from fixed distance thresholds.
+ */
+static esp_err_t getValue(vl53l0x_idx_t sensor, uint16_t *distance)
 {
     esp_err_t success;
-    uint16_t val = 0;
+    vl53l0x_sample_t sample;
 
 #ifndef VL53L0X
-    success = vl53l0x_read_range_single(VL53L0X_IDX_FIRST, &val);
+    success = vl53l0x_read_sample(sensor, &sample);
     if (success != ESP_OK)
     {
-        // Si la lectura no es exitosa o el valor está fuera de rango
         ESP_LOGE(TAG, "Error reading: %s", esp_err_to_name(success));
         LOG_MESSAGE_W(TAG,"Error reading");
         return ESP_FAIL;
     }
-    else
+    if (!sample.valid)
     {
-        val -= 38; // Calibración del valor obtenido
-        if (val < VL53L0X_OUT_OF_RANGE && val >= MIN_DISTANCE)
-        {
-            *distance = val;
-        }
-        else
-        {
-            ESP_LOGE(TAG, "Invalid value: %d", val);
-            //LOG_MESSAGE_E(TAG,"Invalid value");
-            return ESP_ERR_INVALID_RESPONSE;
-        }
+        TIER_LOG_EVERY_MS(LOG_INFO, TAG, 1000, "Invalid sample: range %d status %d signal %d",
+                          sample.range_mm, sample.range_status, sample.signal_rate_mcps_q7);
+        return ESP_ERR_INVALID_RESPONSE;
     }
+    *distance = (sample.range_mm > RANGE_OFFSET_MM) ? (sample.range_mm - RANGE_OFFSET_MM) : 0;
 #else
     ESP_LOGE(TAG, "ERROR VL53L0X NOT DEFINED");
     LOG_MESSAGE_E(TAG,"ERROR VL53L0X NOT DEFINED");
     return ESP_FAIL; // Si VL53L0X no está definido, retornar error
 #endif
 
-    return ESP_OK; // Índice 5 es la mediana en un arreglo de 10 elementos
+    return ESP_OK;
+}
+
+/**
+ * Stops ranging, programs the pending profile and restarts ranging.
+ * Runs in the mapping task so it never races an in-flight measurement.
+ * If a sensor fails, the sensors already changed (and the failed one) get
+ * their previous profile back, so all of them keep ranging with the same one.
+ * @return ESP_OK, or the error of the stop or of the failed sensor
+ */
+static esp_err_t applyPendingProfile(void)
+{
+    vl53l0x_profile_t profile;
+
+    if (xSemaphoreTake(profile_semaphore, portMAX_DELAY) != pdTRUE)
+        return ESP_FAIL;
+    profile = next_profile;
+    change_profile_flag = false;
+    xSemaphoreGive(profile_semaphore);
+
+    vl53l0x_profile_t previous[VL53L0X_IDX_COUNT];
+    for (vl53l0x_idx_t idx = VL53L0X_IDX_FIRST; idx < VL53L0X_IDX_COUNT; idx++)
+        previous[idx] = vl53l0x_get_profile(idx);
+
+    esp_err_t err = stopRanging();
+    for (vl53l0x_idx_t idx = VL53L0X_IDX_FIRST; err == ESP_OK && idx < VL53L0X_IDX_COUNT; idx++)
+    {
+        err = vl53l0x_set_profile(idx, profile);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Error setting LiDAR profile %d: %s", profile, esp_err_to_name(err));
+            LOG_MESSAGE_E(TAG, "Error setting LiDAR profile");
+            for (vl53l0x_idx_t back = VL53L0X_IDX_FIRST; back <= idx; back++)
+            {
+                if (vl53l0x_set_profile(back, previous[back]) != ESP_OK)
+                {
+                    ESP_LOGE(TAG, "Error restoring LiDAR %d profile %d", back, previous[back]);
+                    LOG_MESSAGE_E(TAG, "Error restoring LiDAR profile");
+                }
+            }
+        }
+    }
+    /* Ranging is restarted even on failure so mapping keeps going */
+    esp_err_t err_start = startRanging();
+    if (err_start != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error restarting LiDAR continuous ranging");
+        LOG_MESSAGE_E(TAG, "Error restarting LiDAR continuous ranging");
+        return ESP_FAIL;
+    }
+    next_sensor = VL53L0X_IDX_FIRST;
+    if (err != ESP_OK)
+        return err;
+    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "LiDAR profile %d applied", profile));
+    return ESP_OK;
+}
+
+esp_err_t mapping_set_profile(vl53l0x_profile_t profile)
+{
+    if (profile >= VL53L0X_PROFILE_COUNT)
+        return ESP_ERR_INVALID_ARG;
+    if (profile_semaphore == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    if (xSemaphoreTake(profile_semaphore, portMAX_DELAY) != pdTRUE)
+        return ESP_FAIL;
+    next_profile = profile;
+    change_profile_flag = true;
+    xSemaphoreGive(profile_semaphore);
+    return ESP_OK;
 }
 
 esp_err_t mapping_pause()
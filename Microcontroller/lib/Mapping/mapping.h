@@ -2,11 +2,130 @@
 #define _MAPPING_H_
 
 #include "esp_err.h"
+#include "vl53l0x.h"
+
+/* Uncomment to range back-to-back and tag each sample with the angle it is
+ * read at, instead of starting the measurements at evenly spaced angles.
+ * Back-to-back gives one sample per timing budget (about 30/s per sensor
+ * with the default 33 ms); triggered rounds take at least the budget plus
+ * SAMPLING_READ_MARGIN_US (about 28/s), and a round that misses its
+ * boundary waits for the next one */
+// #define MAPPING_FREE_RUNNING
+
+/**
+ * One mapping point, tagged with the sensor that measured it.
+ */
+typedef struct
+{
+    int16_t angle;     // Servo angle plus the mounting offset of the sensor (0 to 359)
+    uint16_t distance; // Distance in mm
+    uint8_t sensor;    // vl53l0x_idx_t of the sensor
+    int64_t timestamp_us; // esp_timer time at which the sample was read
+} mapping_value_t;
+
+#define SCAN_FRAME_BINS 360      // One bin per degree
+#define SCAN_BIN_EMPTY 0xFFFF    // Distance of a bin without samples
+
+/**
+ * One angular bin of a scan frame.
+ */
+typedef struct
+{
+    uint16_t distance; // Nearest distance seen in the bin (mm), SCAN_BIN_EMPTY if none
+    uint8_t count;     // Samples that fell in the bin, saturates at 255
+} scan_bin_t;
+
+/**
+ * All the samples of one servo sweep, binned by angle.
+ */
+typedef struct
+{
+    uint32_t sweep_id;  // Sweep counter from the servo
+    bool clockwise;     // Direction of the sweep
+    int64_t start_us;   // Timestamp of the first sample
+    int64_t end_us;     // Timestamp of the last sample
+    uint16_t samples;   // Samples in the frame
+    scan_bin_t bins[SCAN_FRAME_BINS];
+} scan_frame_t;
+
+/**
+ * Tiers of the LiDAR recovery ladder, from the cheapest to the most expensive.
+ */
+typedef enum
+{
+    MAPPING_RECOVERY_RETRY,   // Read the sample again
+    MAPPING_RECOVERY_RESTART, // Stop and start ranging, clears the interrupt
+    MAPPING_RECOVERY_REINIT,  // Re-run the sensor init without power cycling it
+    MAPPING_RECOVERY_RESET,   // Hard reset through XSHUT and full init
+    MAPPING_RECOVERY_COUNT
+} mapping_recovery_tier_t;
+
+/**
+ * LiDAR fault recovery counters.
+ */
+typedef struct
+{
+    uint32_t faults;                             // Read errors that started the ladder
+    uint32_t tier_count[MAPPING_RECOVERY_COUNT]; // Times each tier was run
+    uint32_t unrecovered;                        // Faults that not even the hard reset fixed
+    uint64_t lost_us;                            // Sample time spent recovering
+} mapping_recovery_stats_t;
+
+/**
+ * Angular spacing of the triggered samples, target vs achieved.
+ */
+typedef struct
+{
+    uint32_t target_mdeg; // Spacing aimed for in the last sweep (millidegrees)
+    uint32_t avg_mdeg;    // Achieved average spacing in the last sweep
+    uint32_t min_mdeg;    // Narrowest gap in the last sweep
+    uint32_t max_mdeg;    // Widest gap in the last sweep
+    uint32_t points;      // Triggers in the last sweep
+    uint32_t sweeps;      // Sweeps completed
+    uint32_t skipped;     // Boundaries missed because a trigger came late
+    uint32_t round_us;    // Average time from a trigger to the read of the last sensor
+} mapping_sampling_stats_t;
 
 esp_err_t mapping_init(void);
-esp_err_t getMappingValue(int16_t *, uint16_t *);
+esp_err_t getMappingValue(mapping_value_t *);
 esp_err_t mapping_pause(void);
 esp_err_t mapping_stop(void);
 esp_err_t mapping_restart(void);
+/**
+ * Requests a LiDAR ranging profile. The change is applied by the mapping
+ * task before its next sample.
+ */
+esp_err_t mapping_set_profile(vl53l0x_profile_t);
+/**
+ * Takes the last completed scan frame, without copying it. The frame stays
+ * owned by the caller until it is given back with mapping_release_frame.
+ * @return The frame or NULL if none is ready.
+ */
+scan_frame_t *mapping_take_frame(void);
+void mapping_release_frame(scan_frame_t *);
+/**
+ * Number of frames handed to the publisher so far, it changes when a new
+ * frame can be taken with mapping_take_frame.
+ */
+uint32_t mapping_frames_completed(void);
+void mapping_log_frame_stats(void);
+/**
+ * Copies the LiDAR recovery counters.
+ */
+void mapping_get_recovery_stats(mapping_recovery_stats_t *);
+void mapping_log_recovery_stats(void);
+/**
+ * Copies the spacing of the last completed sweep, all zero when free running.
+ */
+void mapping_get_sampling_stats(mapping_sampling_stats_t *);
+void mapping_log_sampling_stats(void);
+/**
+ * Sets a target scan density. The finest spacing of the scheduler becomes
+ * 1 / density and the servo sweep period is set so the servo travels one
+ * spacing per ranging round, at the measured ranging rate.
+ * @param points_per_deg_x10 Tenths of a point per degree (1 to 100), 0 to
+ *                           go back to the default spacing and servo speed.
+ */
+esp_err_t mapping_set_density(uint16_t points_per_deg_x10);
 
 #endif
\ No newline at end of file
@@ -6,6 +6,31 @@
  * Este archivo implementa la inicialización y control de un servomotor de giro continuo mediante
  * la API de MCPWM del ESP32. Se incluyen funciones para inicializar el servo, ajustar su velocidad,
  * invertir su dirección y leer el ángulo estimado de rotación.
+ *
+ * El ángulo se estima con la velocidad angular de cada nivel de duty, aprendida
+ * midiendo cuánto tarda cada barrido completo entre dos activaciones del final
+ * de carrera. Las velocidades se guardan en punto fijo (grados/µs en Q32), se
+ * filtran con una EWMA y se persisten en NVS, así `readAngle` es una sola
+ * multiplicación entera y no depende de una calibración manual.
+ *
+ * Con el controlador de período activo el duty deja de ser uno de los niveles
+ * fijos: se calcula interpolando las velocidades aprendidas para obtener la
+ * velocidad que da el período de barrido pedido, y al final de cada barrido el
+ * período medido corrige un factor integral. El duty nuevo se aplica al instante.
+ *
+ * En modo sector la inversión no espera al final de carrera: un esp_timer se
+ * programa para el instante en que el modelo de ángulo llega al borde del
+ * sector y la tarea del servo invierte ahí. El final de carrera queda como
+ * respaldo, y cada SECTOR_RESYNC_SWEEPS barridos se deja llegar a él para
+ * corregir la deriva del ángulo estimado. Ese barrido, del punto de inversión
+ * al límite, es el que mide la velocidad y alimenta al controlador mientras
+ * hay un sector activo.
+ *
+ * El estado compartido del servo (duty, velocidad, referencia de tiempo y
+ * offset del barrido) es un único registro publicado con un seqlock: quien lo
+ * modifica lo hace dentro de una sección crítica corta, y los lectores nunca
+ * se bloquean, por lo que `readAngle` y `servo_angle_at` pueden usarse desde
+ * cualquier tarea o desde una ISR.
  * 
  * @date 2025-02-09
  * @version 1.0
@@ -17,6 +42,9 @@
 #include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "nvs.h"
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 #include <driver/gpio.h>
 #include "debug_helper.h"
@@ -31,10 +59,67 @@
 #define SERVO_TIMEBASE_RESOLUTION_HZ 1000000 // 1MHz, 1us per tick
 #define SERVO_TIMEBASE_PERIOD 20000          // 20000 ticks, 20ms
 
+/* Modelo nominal, solo se usa como valor inicial de las velocidades */
 #define CONVERSION_FACTOR 1000000
 #define BASE_SPEED 545.45
 #define DIFFERENTIAL 600
-#define W_5V 0.00055  // grados/µs
+
+/* Degrees covered by a sweep: a full turn minus the arc between the limits */
+#define SWEEP_SPAN_DEG 300
+/* EWMA weight of a new sweep, 1/2^shift */
+#define RATE_EWMA_SHIFT 3
+/* A sweep is discarded if its rate is off the nominal by more than this factor */
+#define RATE_TOLERANCE 4
+/* New sweeps between two writes of the rates to NVS */
+#define RATE_SAVE_SWEEPS 20
+
+/* Sweep period controller */
+#define CONTROL_MIN_OFFSET_US 100     // Smallest distance of the duty to stop, the servo stalls below it
+#define CONTROL_TRIM_ONE (1 << 16)    // Trim of 1.0, Q16
+#define CONTROL_KI_SHIFT 2            // Integral gain of the period error, 1/2^shift
+#define CONTROL_STEP_PERCENT 25       // Period change of servo_set_speed while the controller runs
+
+/* Sector scanning */
+#define SECTOR_TOLERANCE_DEG 1        // A reversal point counts as reached this close to it
+#define SECTOR_RESYNC_SWEEPS 10       // Software reversals before a sweep is let run to the limit switch
+
+/* Learned rates cached in NVS */
+#define RATE_NVS_NAMESPACE "servo"
+#define RATE_NVS_KEY "rates"
+/* Bump when servo_rate_blob_t or the duty levels change */
+#define RATE_VERSION (1)
+
+/** @brief Duty levels with their own learned rate */
+static const uint32_t rate_duty[] = {
+    SERVO_MAX_SPEED_CW,
+    SERVO_MEDIUM_SPEED_CW,
+    SERVO_LOW_SPEED_CW,
+    SERVO_LOW_SPEED_CCW,
+    SERVO_MEDIUM_SPEED_CCW,
+    SERVO_MAX_SPEED_CCW,
+};
+#define RATE_LEVELS (sizeof(rate_duty) / sizeof(rate_duty[0]))
+/* Rate points of one direction: its levels plus the stop */
+#define DIRECTION_POINTS (RATE_LEVELS / 2 + 1)
+
+/** @brief Rates as stored in NVS */
+typedef struct
+{
+    uint8_t version;
+    uint32_t rate_q32[RATE_LEVELS];  /**< Degrees per µs, Q32 */
+    uint16_t sweeps[RATE_LEVELS];    /**< Sweeps measured */
+} servo_rate_blob_t;
+
+/** @brief State shared with the readers of the angle */
+typedef struct
+{
+    int64_t time_base;      /**< Start of the current segment (µs), 0 before the first inversion */
+    int32_t rate_q32;       /**< Signed rate of the current duty, degrees per µs in Q32 */
+    uint32_t duty;          /**< Current duty cycle (µs) */
+    int16_t angle_offset;   /**< Angle at time_base */
+    bool clockwise;         /**< Direction of the current sweep */
+    uint32_t sweep_id;      /**< Incremented on every inversion */
+} servo_state_t;
 
 /** @brief Logging tag for debugging */
 static const char *TAG = "SERVOMOTOR";
@@ -45,23 +130,20 @@ static mcpwm_cmpr_handle_t comparator = NULL;
 /** @brief MCPWM timer handle */
 static mcpwm_timer_handle_t timer = NULL;
 
-/** @brief Current servo duty cycle (in microseconds) */
-static uint32_t current_duty = SERVO_STOP_PULSEWIDTH_US;
-
 /** @brief Clockwise (CW) angle of rotation speed*/
-static const int16_t cw_limit = 30;
+static const int16_t cw_limit = SERVO_CW_LIMIT_DEG;
 
 /** @brief Counterclockwise (CCW) angle of rotation speed*/
-static const int16_t ccw_limit = -30;
+static const int16_t ccw_limit = SERVO_CCW_LIMIT_DEG - 360;
 
-/** @brief Time base variable for tracking operation time */
-static volatile uint64_t time_base = 0;
+/** @brief Shared state, only accessed through state_read and state_publish */
+static servo_state_t state = {.duty = SERVO_STOP_PULSEWIDTH_US};
 
-/** @brief Last recorded angle offset */
-static volatile uint16_t last_angle_offset = 0;
+/** @brief Seqlock counter of `state`, odd while it is being written */
+static atomic_uint state_seq = 0;
 
-/** @brief Current servo angle */
-static volatile uint16_t angle = 0;
+/** @brief Serializes the writers of `state` */
+static portMUX_TYPE state_lock = portMUX_INITIALIZER_UNLOCKED;
 
 /** @brief Speed value for the next update */
 static volatile uint32_t next_speed = 0;
@@ -69,20 +151,63 @@ static volatile uint32_t next_speed = 0;
 /** @brief Flag indicating a change in speed */
 static volatile bool change_speed_flag = false;
 
-/** @brief Partial time base for intermediate calculations */
-static volatile uint64_t partialTimeBase = 0;
+/** @brief Semaphore for managing speed change synchronization */
+static SemaphoreHandle_t speed_change_semaphore;
 
-/** @brief Pause time base for tracking idle durations */
-static volatile uint64_t pauseTimeBase = 0;
+/** @brief Learned rate of each duty level */
+static servo_rate_blob_t rates;
 
-/** @brief Semaphore for limiting concurrent access to servo parameters */
-static SemaphoreHandle_t limit_semaphore;
+/** @brief Nominal rate of each duty level, bounds the learned ones */
+static uint32_t nominal_rate_q32[RATE_LEVELS];
 
-/** @brief Semaphore for protecting current duty cycle modifications */
-static SemaphoreHandle_t current_duty_semaphore;
+/** @brief Duty of the sweep in progress */
+static volatile uint32_t sweep_duty = SERVO_STOP_PULSEWIDTH_US;
 
-/** @brief Semaphore for managing speed change synchronization */
-static SemaphoreHandle_t speed_change_semaphore;
+/** @brief The sweep in progress was paused or changed speed, its timing is not valid */
+static volatile bool sweep_untimed = false;
+
+/** @brief Start of the sweep in progress (µs), speed changes do not move it */
+static int64_t sweep_start_us = 0;
+
+/** @brief Sweeps measured since the rates were saved */
+static uint16_t rates_unsaved = 0;
+
+/** @brief Sweeps discarded for being off the nominal rate */
+static uint32_t rates_rejected = 0;
+
+/** @brief Guards the rates table */
+static portMUX_TYPE rates_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/** @brief Sweep period asked for (µs), 0 while the fixed duty levels are used */
+static uint32_t control_period_us = 0;
+
+/** @brief Integral correction of the requested rate, Q16 */
+static uint32_t control_trim_q16 = CONTROL_TRIM_ONE;
+
+/** @brief Controller counters */
+static servo_control_stats_t control_stats;
+
+/** @brief Guards the controller and the sector */
+static portMUX_TYPE control_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/** @brief Reversal points of the sector, both 0 to sweep the full range */
+static int16_t sector_start = 0;
+static int16_t sector_end = 0;
+
+/** @brief Software reversals since the last limit switch activation */
+static uint32_t sector_reversals = 0;
+
+/** @brief The sweep in progress started at a limit switch */
+static volatile bool sweep_from_limit = false;
+
+/** @brief Angle the sweep in progress started at, 0 to 359 */
+static int16_t sweep_start_angle = 0;
+
+/** @brief Fires when the angle model reaches the next reversal point */
+static esp_timer_handle_t reversal_timer = NULL;
+
+/** @brief Given by reversal_timer, taken by servo_check_reversal */
+static SemaphoreHandle_t reversal_semaphore = NULL;
 
 /**
  * @brief Sets the servo speed in an ISR-safe manner.
@@ -92,11 +217,390 @@ static SemaphoreHandle_t speed_change_semaphore;
  */
 static esp_err_t servo_set_speed_ISR(uint32_t);
 
+static void invert_sweep(bool, int16_t);
+
+/* Index of a duty level in the rates table, -1 if it has none */
+static int rate_index(uint32_t duty)
+{
+    for (int i = 0; i < RATE_LEVELS; i++)
+    {
+        if (rate_duty[i] == duty)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Learned rate points of one direction sorted by distance to stop, the
+ * first one is the stop itself. Returns how many there are */
+static int direction_points(bool ccw, uint32_t offset[DIRECTION_POINTS], uint32_t rate[DIRECTION_POINTS])
+{
+    int count = 1;
+    offset[0] = 0;
+    rate[0] = 0;
+    taskENTER_CRITICAL(&rates_lock);
+    for (int i = 0; i < RATE_LEVELS; i++)
+    {
+        if ((rate_duty[i] > SERVO_STOP_PULSEWIDTH_US) != ccw)
+        {
+            continue;
+        }
+        uint32_t off = abs((int32_t)rate_duty[i] - SERVO_STOP_PULSEWIDTH_US);
+        int j = count++;
+        while (j > 1 && offset[j - 1] > off)
+        {
+            offset[j] = offset[j - 1];
+            rate[j] = rate[j - 1];
+            j--;
+        }
+        offset[j] = off;
+        rate[j] = rates.rate_q32[i];
+    }
+    taskEXIT_CRITICAL(&rates_lock);
+    return count;
+}
+
+/* Signed rate of a duty: positive towards CCW, 0 when stopped. Duties between
+ * two levels are interpolated */
+static int32_t rate_of(uint32_t duty)
+{
+    if (duty == SERVO_STOP_PULSEWIDTH_US)
+    {
+        return 0;
+    }
+    bool ccw = duty > SERVO_STOP_PULSEWIDTH_US;
+    int64_t rate;
+    int idx = rate_index(duty);
+    if (idx >= 0)
+    {
+        taskENTER_CRITICAL(&rates_lock);
+        rate = rates.rate_q32[idx];
+        taskEXIT_CRITICAL(&rates_lock);
+    }
+    else
+    {
+        uint32_t offset[DIRECTION_POINTS], points[DIRECTION_POINTS];
+        int count = direction_points(ccw, offset, points);
+        uint32_t off = abs((int32_t)duty - SERVO_STOP_PULSEWIDTH_US);
+        rate = points[count - 1];
+        for (int i = 1; i < count; i++)
+        {
+            if (off <= offset[i])
+            {
+                rate = points[i - 1] + ((int64_t)points[i] - points[i - 1]) * (off - offset[i - 1]) /
+                                           (int64_t)(offset[i] - offset[i - 1]);
+                break;
+            }
+        }
+    }
+    return ccw ? (int32_t)rate : -(int32_t)rate;
+}
+
+/* Duty that gives a signed rate, the inverse of rate_of. Sets `saturated`
+ * when the rate is out of reach and the fastest duty is used */
+static uint32_t duty_for_rate(int32_t rate, bool *saturated)
+{
+    *saturated = false;
+    if (rate == 0)
+    {
+        return SERVO_STOP_PULSEWIDTH_US;
+    }
+    bool ccw = rate > 0;
+    uint32_t target = (uint32_t)abs(rate);
+    uint32_t offset[DIRECTION_POINTS], points[DIRECTION_POINTS];
+    int count = direction_points(ccw, offset, points);
+    uint32_t off = offset[count - 1];
+    int i;
+    for (i = 1; i < count; i++)
+    {
+        uint32_t lo = points[i - 1], hi = points[i];
+        if (hi != lo && target >= (lo < hi ? lo : hi) && target <= (lo < hi ? hi : lo))
+        {
+            off = offset[i - 1] + (uint32_t)(((int64_t)target - lo) * (int64_t)(offset[i] - offset[i - 1]) /
+                                             ((int64_t)hi - lo));
+            break;
+        }
+    }
+    if (i == count)
+    {
+        *saturated = true;
+    }
+    if (off < CONTROL_MIN_OFFSET_US)
+    {
+        off = CONTROL_MIN_OFFSET_US;
+    }
+    return ccw ? SERVO_STOP_PULSEWIDTH_US + off : SERVO_STOP_PULSEWIDTH_US - off;
+}
+
+/* Level of the same direction closest to a duty */
+static int nearest_level(uint32_t duty)
+{
+    int nearest = -1;
+    uint32_t best = UINT32_MAX;
+    for (int i = 0; i < RATE_LEVELS; i++)
+    {
+        uint32_t distance = abs((int32_t)rate_duty[i] - (int32_t)duty);
+        if ((rate_duty[i] > SERVO_STOP_PULSEWIDTH_US) == (duty > SERVO_STOP_PULSEWIDTH_US) && distance < best)
+        {
+            best = distance;
+            nearest = i;
+        }
+    }
+    return nearest;
+}
+
+/* Copies the shared state, never blocks. Retries if a writer was active */
+static void state_read(servo_state_t *out)
+{
+    unsigned seq;
+    do
+    {
+        seq = atomic_load_explicit(&state_seq, memory_order_acquire);
+        *out = state;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&state_seq, memory_order_relaxed));
+}
+
+/* Starts a change of the shared state, readers retry until state_end */
+static servo_state_t *state_begin(void)
+{
+    taskENTER_CRITICAL(&state_lock);
+    atomic_fetch_add_explicit(&state_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return &state;
+}
+
+/* Publishes the change started by state_begin */
+static void state_end(void)
+{
+    atomic_fetch_add_explicit(&state_seq, 1, memory_order_release);
+    taskEXIT_CRITICAL(&state_lock);
+}
+
+/* Angle of a state at a given time, 0 to 359 */
+static int16_t state_angle(const servo_state_t *st, int64_t time_us)
+{
+    int32_t angle = st->angle_offset + (int32_t)(((int64_t)st->rate_q32 * (time_us - st->time_base)) >> 32);
+    angle %= 360;
+    if (angle < 0)
+    {
+        angle += 360;
+    }
+    return (int16_t)angle;
+}
+
+/* Duty of the same speed level in the opposite direction, 0 if unknown */
+static uint32_t opposite_duty(uint32_t duty)
+{
+    switch (duty)
+    {
+    case SERVO_LOW_SPEED_CCW:
+        return SERVO_LOW_SPEED_CW;
+    case SERVO_MEDIUM_SPEED_CCW:
+        return SERVO_MEDIUM_SPEED_CW;
+    case SERVO_MAX_SPEED_CCW:
+        return SERVO_MAX_SPEED_CW;
+    case SERVO_LOW_SPEED_CW:
+        return SERVO_LOW_SPEED_CCW;
+    case SERVO_MEDIUM_SPEED_CW:
+        return SERVO_MEDIUM_SPEED_CCW;
+    case SERVO_MAX_SPEED_CW:
+        return SERVO_MAX_SPEED_CCW;
+    default:
+        return 0;
+    }
+}
+
+/* Seeds the rates with the nominal model and replaces them with the ones
+ * learned on previous boots, if any */
+static void load_rates(void)
+{
+    for (int i = 0; i < RATE_LEVELS; i++)
+    {
+        double deg_per_us = BASE_SPEED * abs((int32_t)rate_duty[i] - SERVO_STOP_PULSEWIDTH_US) /
+                            ((double)DIFFERENTIAL * CONVERSION_FACTOR);
+        nominal_rate_q32[i] = (uint32_t)(deg_per_us * 4294967296.0);
+        rates.rate_q32[i] = nominal_rate_q32[i];
+        rates.sweeps[i] = 0;
+    }
+    rates.version = RATE_VERSION;
+
+    nvs_handle_t handle;
+    if (nvs_open(RATE_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        /* Namespace not created yet: first boot */
+        return;
+    }
+    servo_rate_blob_t stored;
+    size_t size = sizeof(stored);
+    esp_err_t err = nvs_get_blob(handle, RATE_NVS_KEY, &stored, &size);
+    nvs_close(handle);
+
+    if (err != ESP_OK || size != sizeof(stored) || stored.version != RATE_VERSION)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "No learned rates cached"));
+        return;
+    }
+    rates = stored;
+}
+
+/* Folds the timing of a completed sweep of `span_deg` into the rate of its
+ * duty. A duty between levels corrects the closest level, in proportion */
+static void learn_rate(uint32_t duty, int64_t sweep_us, uint16_t span_deg)
+{
+    int idx = rate_index(duty);
+    if (duty == SERVO_STOP_PULSEWIDTH_US || sweep_us <= 0)
+    {
+        return;
+    }
+    uint64_t measured = ((uint64_t)span_deg << 32) / (uint64_t)sweep_us;
+    if (idx < 0)
+    {
+        uint32_t expected = (uint32_t)abs(rate_of(duty));
+        idx = nearest_level(duty);
+        if (idx < 0 || expected == 0)
+        {
+            return;
+        }
+        taskENTER_CRITICAL(&rates_lock);
+        uint32_t level = rates.rate_q32[idx];
+        taskEXIT_CRITICAL(&rates_lock);
+        measured = measured * level / expected;
+    }
+    if (measured < nominal_rate_q32[idx] / RATE_TOLERANCE ||
+        measured > (uint64_t)nominal_rate_q32[idx] * RATE_TOLERANCE)
+    {
+        rates_rejected++;
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Sweep of %lld us discarded", (long long)sweep_us));
+        return;
+    }
+
+    taskENTER_CRITICAL(&rates_lock);
+    if (rates.sweeps[idx] == 0)
+    {
+        rates.rate_q32[idx] = (uint32_t)measured;
+    }
+    else
+    {
+        int64_t error = (int64_t)measured - rates.rate_q32[idx];
+        rates.rate_q32[idx] = (uint32_t)(rates.rate_q32[idx] + (error >> RATE_EWMA_SHIFT));
+    }
+    if (rates.sweeps[idx] < UINT16_MAX)
+    {
+        rates.sweeps[idx]++;
+    }
+    rates_unsaved++;
+    taskEXIT_CRITICAL(&rates_lock);
+}
+
+/* esp_timer callback, the inversion itself runs in servo_check_reversal */
+static void reversal_timer_cb(void *arg)
+{
+    xSemaphoreGive(reversal_semaphore);
+}
+
+/* Reversal point ahead of a state, false if the sweep must reach the limit switch */
+static bool reversal_point(const servo_state_t *st, int16_t *point)
+{
+    taskENTER_CRITICAL(&control_lock);
+    bool active = sector_end != 0 && sector_reversals < SECTOR_RESYNC_SWEEPS;
+    *point = (st->rate_q32 > 0) ? sector_end : sector_start;
+    taskEXIT_CRITICAL(&control_lock);
+    return active && st->time_base != 0 && st->rate_q32 != 0;
+}
+
+/* Arms reversal_timer at the time the state reaches its reversal point.
+ * Called on every change of the state, so the timer follows the segment */
+static void schedule_reversal(const servo_state_t *st)
+{
+    int16_t point;
+    if (reversal_timer == NULL)
+    {
+        return;
+    }
+    esp_timer_stop(reversal_timer);
+    if (!reversal_point(st, &point))
+    {
+        return;
+    }
+
+    // The range between the limits does not cross 0, angles are linear in it
+    int32_t travel = point - state_angle(st, st->time_base);
+    uint64_t delay_us = 0;
+    if ((travel > 0) == (st->rate_q32 > 0) && travel != 0)
+    {
+        delay_us = ((uint64_t)abs(travel) << 32) / (uint32_t)abs(st->rate_q32);
+        int64_t elapsed = esp_timer_get_time() - st->time_base;
+        if (elapsed > 0)
+        {
+            delay_us = ((uint64_t)elapsed < delay_us) ? delay_us - elapsed : 0;
+        }
+    }
+    esp_timer_start_once(reversal_timer, delay_us);
+}
+
+/* Duty the controller asks for in one direction, 0 while it is off */
+static uint32_t control_duty(bool ccw)
+{
+    taskENTER_CRITICAL(&control_lock);
+    uint32_t period = control_period_us;
+    uint32_t trim = control_trim_q16;
+    taskEXIT_CRITICAL(&control_lock);
+    if (period == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rate = ((((uint64_t)servo_get_sweep_span() << 32) / period) * trim) >> 16;
+    if (rate > INT32_MAX)
+    {
+        rate = INT32_MAX;
+    }
+    bool saturated;
+    uint32_t duty = duty_for_rate(ccw ? (int32_t)rate : -(int32_t)rate, &saturated);
+
+    taskENTER_CRITICAL(&control_lock);
+    control_stats.duty = duty;
+    if (saturated)
+    {
+        control_stats.saturated++;
+    }
+    taskEXIT_CRITICAL(&control_lock);
+    return duty;
+}
+
+/* Integrates the period error of a completed sweep of `span_deg` into the
+ * trim. The sweep time is scaled to the active span first */
+static void control_update(int64_t sweep_us, uint16_t span_deg)
+{
+    sweep_us = sweep_us * servo_get_sweep_span() / span_deg;
+    taskENTER_CRITICAL(&control_lock);
+    if (control_period_us != 0 && sweep_us > 0)
+    {
+        // A sweep slower than asked (positive error) raises the rate
+        int64_t error = sweep_us - (int64_t)control_period_us;
+        int64_t trim = control_trim_q16 + ((((int64_t)control_trim_q16 * error) / control_period_us) >> CONTROL_KI_SHIFT);
+        if (trim < CONTROL_TRIM_ONE / 2)
+        {
+            trim = CONTROL_TRIM_ONE / 2;
+        }
+        else if (trim > CONTROL_TRIM_ONE * 2)
+        {
+            trim = CONTROL_TRIM_ONE * 2;
+        }
+        control_trim_q16 = (uint32_t)trim;
+        control_stats.last_period_ms = (uint32_t)(sweep_us / 1000);
+        control_stats.sweeps++;
+    }
+    taskEXIT_CRITICAL(&control_lock);
+}
+
 /**
  * @brief Initializes the servo motor.
  *
  * This function configures the necessary MCPWM components (timer, operator, comparator, generator)
- * and initializes semaphores for thread-safe operations. It also sets up the servo for proper
+ * and initializes the semaphore for the pending speed change. It also sets up the servo for proper
  * operation using ESP32 hardware PWM.
  *
  * @return esp_err_t ESP_OK on success, ESP_FAIL on failure.
@@ -104,23 +608,9 @@ static esp_err_t servo_set_speed_ISR(uint32_t);
 esp_err_t servo_initialize(void)
 {
 
+    load_rates();
+
     // Initialize semaphores
-    limit_semaphore = xSemaphoreCreateBinary();
-    xSemaphoreGive(limit_semaphore);
-    if(limit_semaphore == NULL)
-    {
-        ESP_LOGE(TAG,"ERROR: limit_semaphore is NULL");
-        LOG_MESSAGE_E(TAG,"ERROR: limit_semaphore is NULL");
-        return ESP_FAIL;
-    }
-    current_duty_semaphore = xSemaphoreCreateBinary();
-    xSemaphoreGive(current_duty_semaphore);
-    if(current_duty_semaphore == NULL)
-    {
-        ESP_LOGE(TAG,"ERROR: current_duty_semaphore is NULL");
-        LOG_MESSAGE_E(TAG,"ERROR: current_duty_semaphore is NULL");
-        return ESP_FAIL;
-    }
     speed_change_semaphore = xSemaphoreCreateBinary();
     xSemaphoreGive(speed_change_semaphore);
     if(speed_change_semaphore == NULL)
@@ -130,6 +620,19 @@ esp_err_t servo_initialize(void)
         return ESP_FAIL;
     }
     
+    reversal_semaphore = xSemaphoreCreateBinary();
+    const esp_timer_create_args_t reversal_args = {
+        .callback = reversal_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "servo_reversal",
+    };
+    if (reversal_semaphore == NULL || esp_timer_create(&reversal_args, &reversal_timer) != ESP_OK)
+    {
+        ESP_LOGE(TAG,"ERROR Creating the reversal timer");
+        LOG_MESSAGE_E(TAG,"ERROR Creating the reversal timer");
+        return ESP_FAIL;
+    }
+    
     // MCPWM Timer Configuration
     DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Creating timer and operator..."));
     mcpwm_timer_config_t timer_config = {
@@ -247,7 +750,14 @@ esp_err_t servo_initialize(void)
  */
 esp_err_t servo_start(void)
 {
-
+    servo_state_t st;
+    state_read(&st);
+    // Con el controlador activo sigue en el sentido del barrido en curso
+    uint32_t duty = control_duty(!st.clockwise);
+    if (duty != 0)
+    {
+        return servo_set_speed_ISR(duty);
+    }
     return servo_set_speed_ISR(SERVO_MEDIUM_SPEED_CCW); // Inicia con el duty en 900us
 }
 
@@ -268,7 +778,8 @@ esp_err_t servo_stop(void)
  *
  * This function sets the PWM duty cycle to control the servo speed. 
  * It verifies that the duty cycle is within the allowed range, then updates the PWM comparator.
- * Additionally, it updates the `current_duty` variable in a thread-safe manner using a semaphore.
+ * Additionally, it publishes the new duty and its rate in the shared state. The angle
+ * reached so far becomes the offset of the new segment, so the estimate stays continuous.
  *
  * @param duty The desired duty cycle in microseconds. Must be within `SERVO_MIN_PULSEWIDTH_US` and `SERVO_MAX_PULSEWIDTH_US`.
  * @return
@@ -292,12 +803,23 @@ static esp_err_t servo_set_speed_ISR(uint32_t duty)
         LOG_MESSAGE_E(TAG,"Error al ajustar la velocidad");
         return ESP_FAIL;
     }
-    // SE PUEDE QUITAR AL MODIFICAR LA RUTINA DE INICIO.
-    if (xSemaphoreTakeFromISR(current_duty_semaphore, NULL) == pdTRUE)
+    int32_t rate = rate_of(duty);
+    int64_t now = esp_timer_get_time();
+    servo_state_t *st = state_begin();
+    if (st->time_base != 0)
     {
-        current_duty = duty;
-        xSemaphoreGive(current_duty_semaphore);
+        st->angle_offset = state_angle(st, now);
+        st->time_base = now;
+        if (st->duty != duty)
+        {
+            sweep_untimed = true;
+        }
     }
+    st->duty = duty;
+    st->rate_q32 = rate;
+    servo_state_t snapshot = *st;
+    state_end();
+    schedule_reversal(&snapshot);
     return ESP_OK;
 }
 
@@ -306,7 +828,6 @@ static esp_err_t servo_set_speed_ISR(uint32_t duty)
  *
  * This function changes the rotation direction of the servo motor by adjusting the PWM duty cycle.
  * It checks if the servo is currently stopped and prevents inversion if so.
- * The function safely updates the duty cycle using semaphores and adjusts timing parameters accordingly.
  * 
  * Behavior:
  * - If the servo is moving clockwise (CW), it switches to the corresponding counterclockwise (CCW) speed.
@@ -316,83 +837,101 @@ static esp_err_t servo_set_speed_ISR(uint32_t duty)
  * It also make a time reference when its called, which is used to calculate the position angle.
  * And if the flag indicates it, it also change the speed.
  *
- * @note Uses `xSemaphoreTake` and `xSemaphoreGive` to ensure safe access to shared variables.
+ * Called by the limit switch, the angle of the new sweep starts at the limit reached.
+ *
+ * @note The new sweep is published as a single state record, the readers of the
+ * angle never wait for the MCPWM to be reprogrammed.
  */
 void servo_invert()
+{
+    invert_sweep(true, 0);
+}
+
+/**
+ * @brief Inverts the direction at a limit switch or at a software reversal point.
+ *
+ * @param at_limit The limit switch was reached, its angle is known exactly.
+ * @param angle Angle of the software reversal point, unused at a limit.
+ */
+static void invert_sweep(bool at_limit, int16_t angle)
 {
     esp_err_t err = ESP_OK;
+    int64_t now = esp_timer_get_time();
+    servo_state_t st;
+    state_read(&st);
 
-    if (xSemaphoreTake(current_duty_semaphore, portMAX_DELAY) == pdTRUE)
+    // Barrido que termina en un final de carrera: medir su velocidad. Si empezó
+    // en un punto de inversión del sector (barrido de resincronización) el
+    // recorrido va de ese punto al límite
+    if (st.time_base != 0 && !sweep_untimed && at_limit)
     {
-        if (xSemaphoreTake(speed_change_semaphore, portMAX_DELAY) == pdTRUE)
+        int16_t limit_angle = (st.duty > SERVO_STOP) ? 360 + ccw_limit : cw_limit;
+        uint16_t span = sweep_from_limit ? SWEEP_SPAN_DEG : (uint16_t)abs(limit_angle - sweep_start_angle);
+        if (span >= SERVO_SECTOR_MIN_WIDTH_DEG)
         {
-            if (change_speed_flag)
-            {
-                change_speed_flag = false;
-                current_duty = next_speed;
-            }
-            xSemaphoreGive(speed_change_semaphore);
+            learn_rate(sweep_duty, now - sweep_start_us, span);
+            control_update(now - sweep_start_us, span);
         }
-        if (current_duty == SERVO_STOP)
+    }
+    sweep_untimed = false;
+    sweep_from_limit = at_limit;
+    sweep_start_angle = angle;
+    sweep_start_us = now;
+
+    taskENTER_CRITICAL(&control_lock);
+    sector_reversals = at_limit ? 0 : sector_reversals + 1;
+    taskEXIT_CRITICAL(&control_lock);
+
+    uint32_t duty = st.duty;
+    if (xSemaphoreTake(speed_change_semaphore, portMAX_DELAY) == pdTRUE)
+    {
+        if (change_speed_flag && next_speed != 0)
         {
-            ESP_LOGW(TAG, "Error: Trying to invert orientation while servo is stopped");
-            LOG_MESSAGE_W(TAG,"Error: Trying to invert orientation while servo is stopped");
+            duty = next_speed;
         }
-        else if (current_duty > SERVO_STOP)
+        change_speed_flag = false;
+        xSemaphoreGive(speed_change_semaphore);
+    }
+
+    if (duty == SERVO_STOP)
+    {
+        ESP_LOGW(TAG, "Error: Trying to invert orientation while servo is stopped");
+        LOG_MESSAGE_W(TAG,"Error: Trying to invert orientation while servo is stopped");
+    }
+    else
+    {
+        bool clockwise = duty > SERVO_STOP;
+        uint32_t next = control_duty(!clockwise);
+        if (next == 0)
         {
-            if (xSemaphoreTake(limit_semaphore, portMAX_DELAY) == pdTRUE)
-            {
-                last_angle_offset = ccw_limit;
-                time_base = esp_timer_get_time();
-                xSemaphoreGive(limit_semaphore);
-            }
-            switch (current_duty)
-            {
-            case SERVO_LOW_SPEED_CCW:
-                xSemaphoreGive(current_duty_semaphore);
-                err = servo_set_speed_ISR(SERVO_LOW_SPEED_CW);
-                break;
-            case SERVO_MEDIUM_SPEED_CCW:
-                xSemaphoreGive(current_duty_semaphore);
-                err = servo_set_speed_ISR(SERVO_MEDIUM_SPEED_CW);
-                break;
-            case SERVO_MAX_SPEED_CCW:
-                xSemaphoreGive(current_duty_semaphore);
-                err = servo_set_speed_ISR(SERVO_MAX_SPEED_CW);
-                break;
-            default:
-                xSemaphoreGive(current_duty_semaphore);
-                break;
-            }
+            next = opposite_duty(duty);
         }
-        else if (current_duty < SERVO_STOP)
+        if (next != 0 && mcpwm_comparator_set_compare_value(comparator, next) != ESP_OK)
         {
-            if (xSemaphoreTake(limit_semaphore, portMAX_DELAY) == pdTRUE)
-            {
-                last_angle_offset = cw_limit;
-                time_base = esp_timer_get_time();
-                xSemaphoreGive(limit_semaphore);
-            }
-            switch (current_duty)
-            {
-            case SERVO_LOW_SPEED_CW:
-                xSemaphoreGive(current_duty_semaphore);
-                err = servo_set_speed_ISR(SERVO_LOW_SPEED_CCW);
-                break;
-            case SERVO_MEDIUM_SPEED_CW:
-                xSemaphoreGive(current_duty_semaphore);
-                err = servo_set_speed_ISR(SERVO_MEDIUM_SPEED_CCW);
-                break;
-            case SERVO_MAX_SPEED_CW:
-                xSemaphoreGive(current_duty_semaphore);
-                err = servo_set_speed_ISR(SERVO_MAX_SPEED_CCW);
-                break;
-            default:
-                xSemaphoreGive(current_duty_semaphore);
-                break;
-            }
+            err = ESP_FAIL;
+            next = 0;
         }
+        duty = (next != 0) ? next : duty;
+        int32_t rate = rate_of(duty);
+        servo_state_t *live = state_begin();
+        live->duty = duty;
+        live->rate_q32 = rate;
+        if (at_limit)
+        {
+            live->angle_offset = clockwise ? ccw_limit : cw_limit;
+        }
+        else
+        {
+            live->angle_offset = angle;
+        }
+        live->clockwise = clockwise;
+        live->time_base = now;
+        live->sweep_id++;
+        servo_state_t snapshot = *live;
+        state_end();
+        schedule_reversal(&snapshot);
     }
+    sweep_duty = duty;
     if (err != ESP_OK)
     {
         ESP_LOGE(TAG, "Error: Trying to invert servo orientation, rebooting servo....");
@@ -401,16 +940,39 @@ void servo_invert()
     DEBUGING_ESP_LOG(ESP_LOGW(TAG, "INVERT END"));
 }
 
+/**
+ * @brief Estimates the angle of the servo motor at a given time.
+ *
+ * Never blocks, so it can be called from an ISR to timestamp a sample.
+ *
+ * @param time_us Time of the estimate, from `esp_timer_get_time`.
+ * @return 
+ *      - The angle in degrees (0 to 359).
+ *      - `-1` if there is no valid time reference.
+ */
+int16_t servo_angle_at(int64_t time_us)
+{
+    servo_state_t st;
+    state_read(&st);
+    if (st.time_base == 0)
+    {
+        return -1;
+    }
+    return state_angle(&st, time_us);
+}
+
 /**
  * @brief Reads the current angle of the servo motor.
  *
  * This function calculates the current angle of the servo motor based on the elapsed time
- * and the stored duty cycle. It ensures thread-safe access to shared variables using semaphores.
+ * and the learned rate of the current duty cycle. It reads a snapshot of the shared state
+ * and never blocks.
  *
  * The calculation considers:
  * - The last known angle offset.
  * - The time since the last reference point.
- * - The current duty cycle of the servo motor.
+ * - The rate of the current duty cycle, in Q32 degrees per µs, so the angle is a
+ *   single integer multiply-add.
  *
  * @return 
  *      - The current angle in degrees (0 to 359).
@@ -418,37 +980,55 @@ void servo_invert()
  */
 int16_t readAngle()
 {
-    uint16_t duty = 0;
-    uint64_t time_now = esp_timer_get_time();
-    int16_t angle_offset = 0;
-    uint64_t time_reference = 0;
+    int64_t time_now = esp_timer_get_time();
+    servo_state_t st;
+    state_read(&st);
 
-    // Obtener variables necesarias con semáforo
-    if (xSemaphoreTake(limit_semaphore, portMAX_DELAY) == pdTRUE)
-    {
-        angle_offset = last_angle_offset;
-        time_reference = time_base;
-        xSemaphoreGive(limit_semaphore);
-    }
-
-    if(time_reference == 0){
+    if(st.time_base == 0){
         return -1;
     }
 
-    if (xSemaphoreTake(current_duty_semaphore, portMAX_DELAY) == pdTRUE)
-    {
-        duty = current_duty;
-        xSemaphoreGive(current_duty_semaphore);
-    }
+    int16_t angle = state_angle(&st, time_now);
 
-    // Calcular velocidad escalada y ángulo
-    int64_t temp = ((int64_t)BASE_SPEED * (duty - SERVO_STOP)) * (time_now - time_reference);
-    int16_t angle = (int16_t)(((temp / (DIFFERENTIAL * CONVERSION_FACTOR)) + angle_offset) % 360);
-    //ESP_LOGE(TAG, "Angle = %" PRIi16, angle);
+    TIER_LOG_RECORD(LOG_DEBUG, TAG, LOG_RECORD_ANGLE, 100, "Angle = %" PRIi32 " - Rate: %" PRIi32 " - Offset: %" PRIi32,
+                    angle, st.rate_q32, st.angle_offset);
 
-    DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Angle = %" PRIi16, angle));
+    return angle;
+}
 
-    return (angle);
+/**
+ * @brief Reads the current sweep.
+ *
+ * A sweep is the movement between two inversions of the servo, so the
+ * sweep counter changes every time the limit switch inverts the direction.
+ *
+ * @param[out] clockwise Direction of the current sweep, may be NULL.
+ * @return The sweep counter, 0 before the first inversion.
+ */
+uint32_t servo_get_sweep(bool *clockwise)
+{
+    servo_state_t st;
+    state_read(&st);
+    if (clockwise != NULL)
+    {
+        *clockwise = st.clockwise;
+    }
+    return st.sweep_id;
+}
+
+/**
+ * @brief Reads the motion model of the current segment.
+ *
+ * @param[out] motion Snapshot of the current segment.
+ */
+void servo_get_motion(servo_motion_t *motion)
+{
+    servo_state_t st;
+    state_read(&st);
+    motion->time_base = st.time_base;
+    motion->rate_q32 = st.rate_q32;
+    motion->angle_offset = st.angle_offset;
+    motion->sweep_id = st.sweep_id;
 }
 
 /**
@@ -462,84 +1042,102 @@ int16_t readAngle()
  * - If `dir == DOWN`, the speed decreases to the previous level (Max → Medium → Low).
  * - If the servo is stopped, it remains stopped.
  *
- * Thread safety is ensured using semaphores when modifying the duty cycle.
+ * The current duty is read from the shared state, the next one is kept under a semaphore.
  * The speed is not changed instanly, but set to change when servo_invert() is called.
  *
+ * While the sweep period controller runs, the target period is shortened (`UP`) or
+ * stretched (`DOWN`) by CONTROL_STEP_PERCENT instead, and applied at once.
+ *
  * @param dir The desired direction (`UP` to increase speed, `DOWN` to decrease speed).
  */
 void servo_set_speed(SERVO_DIRECTION dir)
 {
     static volatile uint32_t duty = 0;
-    if (xSemaphoreTake(current_duty_semaphore, portMAX_DELAY) == pdTRUE)
+    uint32_t period_ms = servo_get_sweep_period();
+    if (period_ms != 0)
     {
-        if (current_duty != SERVO_STOP)
+        period_ms = (dir == UP) ? period_ms * (100 - CONTROL_STEP_PERCENT) / 100
+                                : period_ms * (100 + CONTROL_STEP_PERCENT) / 100;
+        if (period_ms < SERVO_SWEEP_PERIOD_MIN_MS)
+        {
+            period_ms = SERVO_SWEEP_PERIOD_MIN_MS;
+        }
+        else if (period_ms > SERVO_SWEEP_PERIOD_MAX_MS)
+        {
+            period_ms = SERVO_SWEEP_PERIOD_MAX_MS;
+        }
+        servo_set_sweep_period(period_ms);
+        return;
+    }
+    servo_state_t st;
+    state_read(&st);
+    uint32_t current_duty = st.duty;
+    if (current_duty != SERVO_STOP)
+    {
+        switch (dir)
         {
-            switch (dir)
-            {
 
-            case UP:
-                if (current_duty == SERVO_LOW_SPEED_CCW || current_duty == SERVO_LOW_SPEED_CW)
+        case UP:
+            if (current_duty == SERVO_LOW_SPEED_CCW || current_duty == SERVO_LOW_SPEED_CW)
+            {
+                if (current_duty == SERVO_LOW_SPEED_CCW)
                 {
-                    if (current_duty == SERVO_LOW_SPEED_CCW)
-                    {
-                        duty = SERVO_MEDIUM_SPEED_CCW;
-                    }
-                    else
-                    {
-                        duty = SERVO_MEDIUM_SPEED_CW;
-                    }
+                    duty = SERVO_MEDIUM_SPEED_CCW;
                 }
                 else
                 {
-                    if (current_duty == SERVO_MEDIUM_SPEED_CCW || current_duty == SERVO_MEDIUM_SPEED_CW)
-                    {
-                        if (current_duty == SERVO_MEDIUM_SPEED_CCW)
-                        {
-                            duty = SERVO_MAX_SPEED_CCW;
-                        }
-                        else
-                        {
-                            duty = SERVO_MAX_SPEED_CW;
-                        }
-                    }
+                    duty = SERVO_MEDIUM_SPEED_CW;
                 }
-                break;
-            case DOWN:
-                if (current_duty == SERVO_MAX_SPEED_CCW || current_duty == SERVO_MAX_SPEED_CW)
+            }
+            else
+            {
+                if (current_duty == SERVO_MEDIUM_SPEED_CCW || current_duty == SERVO_MEDIUM_SPEED_CW)
                 {
-                    if (current_duty == SERVO_MAX_SPEED_CCW)
+                    if (current_duty == SERVO_MEDIUM_SPEED_CCW)
                     {
-                        duty = SERVO_MEDIUM_SPEED_CCW;
+                        duty = SERVO_MAX_SPEED_CCW;
                     }
                     else
                     {
-                        duty = SERVO_MEDIUM_SPEED_CW;
+                        duty = SERVO_MAX_SPEED_CW;
                     }
                 }
+            }
+            break;
+        case DOWN:
+            if (current_duty == SERVO_MAX_SPEED_CCW || current_duty == SERVO_MAX_SPEED_CW)
+            {
+                if (current_duty == SERVO_MAX_SPEED_CCW)
+                {
+                    duty = SERVO_MEDIUM_SPEED_CCW;
+                }
                 else
                 {
-                    if (current_duty == SERVO_MEDIUM_SPEED_CCW || current_duty == SERVO_MEDIUM_SPEED_CW)
+                    duty = SERVO_MEDIUM_SPEED_CW;
+                }
+            }
+            else
+            {
+                if (current_duty == SERVO_MEDIUM_SPEED_CCW || current_duty == SERVO_MEDIUM_SPEED_CW)
+                {
+                    if (current_duty == SERVO_MEDIUM_SPEED_CCW)
                     {
-                        if (current_duty == SERVO_MEDIUM_SPEED_CCW)
-                        {
-                            duty = SERVO_LOW_SPEED_CCW;
-                        }
-                        else
-                        {
-                            duty = SERVO_LOW_SPEED_CW;
-                        }
+                        duty = SERVO_LOW_SPEED_CCW;
+                    }
+                    else
+                    {
+                        duty = SERVO_LOW_SPEED_CW;
                     }
                 }
-
-                break;
-            default:
-                current_duty = SERVO_STOP;
-                break;
             }
+
+            break;
+        default:
+            duty = SERVO_STOP;
+            break;
         }
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG,"VELOCIDAD ACTUAL: %lu",current_duty));
-        xSemaphoreGive(current_duty_semaphore);
     }
+    DEBUGING_ESP_LOG(ESP_LOGE(TAG,"VELOCIDAD ACTUAL: %lu",current_duty));
     if (xSemaphoreTake(speed_change_semaphore, portMAX_DELAY) == pdTRUE)
     {
         next_speed = duty;
@@ -548,65 +1146,318 @@ void servo_set_speed(SERVO_DIRECTION dir)
     }
 }
 
+/**
+ * @brief Sets the sweep period held by the controller.
+ *
+ * The duty of the current sweep is recomputed and applied right away, from
+ * then on every sweep gets the duty whose learned rate covers the sweep in
+ * the target period, corrected by the integral of the period error.
+ *
+ * @param period_ms Target period of one sweep, 0 to go back to the fixed duty levels.
+ * @return
+ *      - `ESP_OK` on success.
+ *      - `ESP_ERR_INVALID_ARG` if the period is out of SERVO_SWEEP_PERIOD_MIN_MS..SERVO_SWEEP_PERIOD_MAX_MS.
+ *      - `ESP_FAIL` if the PWM comparator update fails.
+ */
+esp_err_t servo_set_sweep_period(uint32_t period_ms)
+{
+    if (period_ms != 0 && (period_ms < SERVO_SWEEP_PERIOD_MIN_MS || period_ms > SERVO_SWEEP_PERIOD_MAX_MS))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    taskENTER_CRITICAL(&control_lock);
+    control_period_us = period_ms * 1000;
+    control_stats.target_ms = period_ms;
+    if (period_ms == 0)
+    {
+        control_trim_q16 = CONTROL_TRIM_ONE;
+    }
+    taskEXIT_CRITICAL(&control_lock);
+
+    servo_state_t st;
+    state_read(&st);
+    if (st.duty == SERVO_STOP)
+    {
+        // Detenido o en pausa: se aplica al arrancar
+        return ESP_OK;
+    }
+    bool ccw = st.duty > SERVO_STOP;
+    uint32_t duty = control_duty(ccw);
+    if (duty == 0)
+    {
+        duty = ccw ? SERVO_MEDIUM_SPEED_CCW : SERVO_MEDIUM_SPEED_CW;
+    }
+    return servo_set_speed_ISR(duty);
+}
+
+/**
+ * @brief Reads the sweep period held by the controller.
+ *
+ * @return The target period in ms, 0 while the fixed duty levels are used.
+ */
+uint32_t servo_get_sweep_period(void)
+{
+    taskENTER_CRITICAL(&control_lock);
+    uint32_t period_us = control_period_us;
+    taskEXIT_CRITICAL(&control_lock);
+    return period_us / 1000;
+}
+
+/**
+ * @brief Degrees covered by a sweep: the sector width, or the full range.
+ */
+uint16_t servo_get_sweep_span(void)
+{
+    taskENTER_CRITICAL(&control_lock);
+    uint16_t span = (sector_end != 0) ? (uint16_t)(sector_end - sector_start) : SWEEP_SPAN_DEG;
+    taskEXIT_CRITICAL(&control_lock);
+    return span;
+}
+
+/**
+ * @brief Copies the controller counters.
+ *
+ * @param[out] stats Current counters.
+ */
+void servo_get_control_stats(servo_control_stats_t *stats)
+{
+    taskENTER_CRITICAL(&control_lock);
+    *stats = control_stats;
+    stats->trim_permille = (uint32_t)(((uint64_t)control_trim_q16 * 1000) >> 16);
+    taskEXIT_CRITICAL(&control_lock);
+}
+
+/**
+ * @brief Logs the controller counters and the sector.
+ */
+void servo_log_control(void)
+{
+    servo_control_stats_t stats;
+    servo_get_control_stats(&stats);
+    if (sector_end != 0)
+    {
+        ESP_LOGI(TAG, "Sector %d..%d, %lu software reversals since the last limit",
+                 sector_start, sector_end, (unsigned long)sector_reversals);
+    }
+    if (stats.target_ms == 0)
+    {
+        ESP_LOGI(TAG, "Sweep period controller off");
+        return;
+    }
+    ESP_LOGI(TAG, "Sweep period: target %lu ms, last %lu ms, duty %lu, trim %lu/1000, %lu sweeps, %lu saturated",
+             (unsigned long)stats.target_ms, (unsigned long)stats.last_period_ms, (unsigned long)stats.duty,
+             (unsigned long)stats.trim_permille, (unsigned long)stats.sweeps, (unsigned long)stats.saturated);
+}
+
+/**
+ * @brief Waits for the software reversal point and inverts the servo there.
+ *
+ * Returns after `wait_ms` if the point is not reached, so it can pace the
+ * loop polling the limit switch. The point is checked against the angle
+ * model before inverting, a trigger left by an older segment is ignored.
+ *
+ * @param wait_ms Longest wait for the reversal point.
+ */
+void servo_check_reversal(uint32_t wait_ms)
+{
+    if (reversal_semaphore == NULL || xSemaphoreTake(reversal_semaphore, pdMS_TO_TICKS(wait_ms)) != pdTRUE)
+    {
+        if (reversal_semaphore == NULL)
+        {
+            vTaskDelay(pdMS_TO_TICKS(wait_ms));
+        }
+        return;
+    }
+
+    servo_state_t st;
+    int16_t point;
+    state_read(&st);
+    if (!reversal_point(&st, &point))
+    {
+        return;
+    }
+    int16_t angle = state_angle(&st, esp_timer_get_time());
+    bool reached = (st.rate_q32 > 0) ? angle >= point - SECTOR_TOLERANCE_DEG : angle <= point + SECTOR_TOLERANCE_DEG;
+    if (!reached)
+    {
+        schedule_reversal(&st);
+        return;
+    }
+    DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Sector reversal at %d", angle));
+    invert_sweep(false, angle);
+}
+
+/**
+ * @brief Limits the sweeps to a sector.
+ *
+ * The servo reverses when the angle model reaches `start_deg` or `end_deg`,
+ * the limit switches only act as a backstop. The angular rate is kept, so a
+ * narrower sector is swept proportionally more often: a target sweep period
+ * is scaled with the sector width.
+ *
+ * @param start_deg Reversal point of the clockwise sweeps, in servo degrees.
+ * @param end_deg Reversal point of the counterclockwise sweeps, both 0 for the full range.
+ * @return
+ *      - `ESP_OK` on success.
+ *      - `ESP_ERR_INVALID_ARG` if the sector is out of the range between the
+ *        limits or narrower than SERVO_SECTOR_MIN_WIDTH_DEG.
+ */
+esp_err_t servo_set_sector(int16_t start_deg, int16_t end_deg)
+{
+    if (!servo_sector_valid(start_deg, end_deg))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    bool full = start_deg == 0 && end_deg == 0;
+
+    uint16_t old_span = servo_get_sweep_span();
+    taskENTER_CRITICAL(&control_lock);
+    sector_start = full ? 0 : start_deg;
+    sector_end = full ? 0 : end_deg;
+    sector_reversals = 0;
+    uint16_t new_span = (sector_end != 0) ? (uint16_t)(sector_end - sector_start) : SWEEP_SPAN_DEG;
+    if (control_period_us != 0)
+    {
+        // Misma velocidad angular: el período escala con el ancho del sector
+        uint64_t period = (uint64_t)control_period_us * new_span / old_span;
+        if (period < SERVO_SWEEP_PERIOD_MIN_MS * 1000)
+        {
+            period = SERVO_SWEEP_PERIOD_MIN_MS * 1000;
+        }
+        else if (period > SERVO_SWEEP_PERIOD_MAX_MS * 1000)
+        {
+            period = SERVO_SWEEP_PERIOD_MAX_MS * 1000;
+        }
+        control_period_us = (uint32_t)period;
+        control_stats.target_ms = control_period_us / 1000;
+    }
+    taskEXIT_CRITICAL(&control_lock);
+
+    servo_state_t st;
+    state_read(&st);
+    schedule_reversal(&st);
+    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Sector %d..%d, span %u", sector_start, sector_end, new_span));
+    return ESP_OK;
+}
+
+bool servo_sector_valid(int32_t start_deg, int32_t end_deg)
+{
+    if (start_deg == 0 && end_deg == 0)
+    {
+        return true;
+    }
+    return start_deg >= cw_limit && end_deg <= 360 + ccw_limit && end_deg - start_deg >= SERVO_SECTOR_MIN_WIDTH_DEG;
+}
+
 /**
  * @brief Pauses the servo motor operation.
  *
- * This function stops the servo motor and records the current time as a reference
- * for resuming operation later. It ensures safe access to shared variables using semaphores.
+ * This function stops the servo motor. The angle reached is kept as the offset of
+ * the shared state with a zero rate, so the estimate holds still while paused.
  *
  * @return 
  *      - `ESP_OK` if the servo was successfully paused.
  *      - `ESP_FAIL` if stopping the servo failed.
- *      - `ESP_ERR_TIMEOUT` if semaphore acquisition failed.
  */
 esp_err_t servo_pause(){
 
-    if(xSemaphoreTake(limit_semaphore,portMAX_DELAY) == pdTRUE){
-        if(servo_stop() != ESP_OK){
-            ESP_LOGE(TAG,"FAIL TO PAUSE SERVO");
-            LOG_MESSAGE_E(TAG,"FAIL TO PAUSE SERVO");
-            xSemaphoreGive(limit_semaphore);
-            return ESP_FAIL;
-        }
-        partialTimeBase = time_base;
-        pauseTimeBase = esp_timer_get_time();
-        xSemaphoreGive(limit_semaphore);
-        return ESP_OK;
+    sweep_untimed = true;
+    if(servo_stop() != ESP_OK){
+        ESP_LOGE(TAG,"FAIL TO PAUSE SERVO");
+        LOG_MESSAGE_E(TAG,"FAIL TO PAUSE SERVO");
+        return ESP_FAIL;
     }
-    return ESP_ERR_TIMEOUT;
+    return ESP_OK;
 }
 
 /**
  * @brief Resumes the servo motor operation after being paused.
  *
- * This function restarts the servo motor and adjusts the reference time to maintain
- * proper timing after resumption. It ensures safe access to shared variables using semaphores.
+ * This function restarts the servo motor, the estimate continues from the angle
+ * where it was paused.
  *
  * @return 
  *      - `ESP_OK` if the servo was successfully restarted.
  *      - `ESP_FAIL` if restarting the servo failed.
- *      - `ESP_ERR_TIMEOUT` if semaphore acquisition failed.
  */
 esp_err_t servo_restart(){
-    uint64_t auxTime=0;
-    if(xSemaphoreTake(limit_semaphore,portMAX_DELAY) == pdTRUE){
-        auxTime = esp_timer_get_time() - pauseTimeBase;
-        if(servo_start() != ESP_OK){
-            ESP_LOGE(TAG,"FAIL TO RESTART SERVO");
-            LOG_MESSAGE_E(TAG,"FAIL TO RESTART SERVO");
-            xSemaphoreGive(limit_semaphore);
-            return ESP_FAIL;
+    if(servo_start() != ESP_OK){
+        ESP_LOGE(TAG,"FAIL TO RESTART SERVO");
+        LOG_MESSAGE_E(TAG,"FAIL TO RESTART SERVO");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Persists the learned rates to NVS.
+ *
+ * Writes only once RATE_SAVE_SWEEPS new sweeps were measured, to spare the
+ * flash. Call it from a low priority task, never from the limit switch path.
+ *
+ * @return
+ *      - `ESP_OK` if the rates were saved or there was nothing new to save.
+ *      - An NVS error code if writing failed, the rates are kept in RAM.
+ */
+esp_err_t servo_save_rates(void)
+{
+    servo_rate_blob_t copy;
+    taskENTER_CRITICAL(&rates_lock);
+    bool pending = rates_unsaved >= RATE_SAVE_SWEEPS;
+    copy = rates;
+    taskEXIT_CRITICAL(&rates_lock);
+    if (!pending)
+    {
+        return ESP_OK;
+    }
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(RATE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(handle, RATE_NVS_KEY, &copy, sizeof(copy));
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(handle);
         }
-        partialTimeBase -= auxTime;
-        xSemaphoreGive(limit_semaphore);
+        nvs_close(handle);
     }
-    else 
+    if (err != ESP_OK)
     {
-        return ESP_ERR_TIMEOUT;
+        ESP_LOGW(TAG, "Error guardando las velocidades en NVS: %s", esp_err_to_name(err));
+        LOG_MESSAGE_W(TAG,"Error guardando las velocidades en NVS");
+        return err;
     }
+
+    taskENTER_CRITICAL(&rates_lock);
+    rates_unsaved = 0;
+    taskEXIT_CRITICAL(&rates_lock);
     return ESP_OK;
 }
 
+/**
+ * @brief Logs the learned rate of each duty level.
+ */
+void servo_log_rates(void)
+{
+    servo_rate_blob_t copy;
+    taskENTER_CRITICAL(&rates_lock);
+    copy = rates;
+    taskEXIT_CRITICAL(&rates_lock);
+
+    for (int i = 0; i < RATE_LEVELS; i++)
+    {
+        // Q32 grados/µs a milésimas de grado/s
+        uint32_t mdeg_per_s = (uint32_t)(((uint64_t)copy.rate_q32[i] * 1000000000ULL) >> 32);
+        uint32_t nominal = (uint32_t)(((uint64_t)nominal_rate_q32[i] * 1000000000ULL) >> 32);
+        ESP_LOGI(TAG, "Duty %lu: %lu.%03lu deg/s (nominal %lu.%03lu), %u sweeps",
+                 (unsigned long)rate_duty[i], (unsigned long)(mdeg_per_s / 1000), (unsigned long)(mdeg_per_s % 1000),
+                 (unsigned long)(nominal / 1000), (unsigned long)(nominal % 1000), copy.sweeps[i]);
+    }
+    ESP_LOGI(TAG, "Sweeps discarded: %lu", (unsigned long)rates_rejected);
+}
+
 /**
  * @brief Deletes all semaphores related to the servo motor.
  *
@@ -619,20 +1470,6 @@ esp_err_t servo_restart(){
  */
 esp_err_t delete_servo_semaphores()
 {
-    if (limit_semaphore != NULL) {
-        vSemaphoreDelete(limit_semaphore);
-    }
-    else {
-        return ESP_FAIL;
-    }
-
-    if (current_duty_semaphore != NULL) {
-        vSemaphoreDelete(current_duty_semaphore);
-    }
-    else {
-        return ESP_FAIL;
-    }
-
     if (speed_change_semaphore != NULL) {
         vSemaphoreDelete(speed_change_semaphore);
     }
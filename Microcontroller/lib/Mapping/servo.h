@@ -16,6 +16,8 @@
 #define _SERVO_H_
 
 #include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 /** @defgroup Servo Speed Definitions
  *  Predefined PWM values for different servo speeds.
@@ -28,6 +30,13 @@
 #define SERVO_MEDIUM_SPEED_CCW  1650    /**< Medium speed for counterclockwise rotation (previously 1950). */
 #define SERVO_MAX_SPEED_CCW     2100    /**< Maximum speed for counterclockwise rotation. */
 
+#define SERVO_SWEEP_PERIOD_MIN_MS   300     /**< Fastest sweep the period controller can be asked for. */
+#define SERVO_SWEEP_PERIOD_MAX_MS   20000   /**< Slowest sweep the period controller can be asked for. */
+
+#define SERVO_CW_LIMIT_DEG          30      /**< Angle of the clockwise limit switch, lowest sector start. */
+#define SERVO_CCW_LIMIT_DEG         330     /**< Angle of the counterclockwise limit switch, highest sector end. */
+#define SERVO_SECTOR_MIN_WIDTH_DEG  20      /**< Narrowest sector that can be asked for. */
+
 
 /**
  * @enum SERVO_DIRECTION
@@ -38,6 +47,29 @@ typedef enum {
     DOWN
 } SERVO_DIRECTION;
 
+/**
+ * @brief Motion of the current segment, the angle at time t is
+ * angle_offset + rate_q32 * (t - time_base) / 2^32.
+ */
+typedef struct {
+    int64_t time_base;      /**< Start of the current segment (µs), 0 before the first inversion */
+    int32_t rate_q32;       /**< Signed rate, degrees per µs in Q32, 0 while stopped */
+    int16_t angle_offset;   /**< Angle at time_base */
+    uint32_t sweep_id;      /**< Incremented on every inversion */
+} servo_motion_t;
+
+/**
+ * @brief Counters of the sweep period controller.
+ */
+typedef struct {
+    uint32_t target_ms;         /**< Period asked for, 0 while the controller is off */
+    uint32_t last_period_ms;    /**< Period of the last timed sweep */
+    uint32_t duty;              /**< Last duty computed (µs) */
+    uint32_t trim_permille;     /**< Integral correction of the rate, 1000 is none */
+    uint32_t sweeps;            /**< Sweeps that updated the controller */
+    uint32_t saturated;         /**< Times the rate asked for was beyond the fastest duty */
+} servo_control_stats_t;
+
 
 
 /**
@@ -88,10 +120,31 @@ esp_err_t servo_restart(void);
 /**
  * @brief Reads the current angle of the servo.
  *
- * @return The current servo angle in degrees.
+ * @return The current servo angle in degrees (0 to 359), -1 before the first inversion.
  */
 int16_t readAngle(void);
 
+/**
+ * @brief Estimates the angle of the servo at a given time, without blocking.
+ *
+ * Safe to call from an ISR, e.g. to get the angle of a sample when it is taken.
+ *
+ * @param time_us Time of the estimate, from esp_timer_get_time().
+ * @return The angle in degrees (0 to 359), -1 before the first inversion.
+ */
+int16_t servo_angle_at(int64_t time_us);
+
+uint32_t servo_get_sweep(bool *);
+
+/**
+ * @brief Reads the motion model of the current segment, without blocking.
+ *
+ * Lets a caller predict when the servo will reach a given angle.
+ *
+ * @param[out] motion Snapshot of the current segment.
+ */
+void servo_get_motion(servo_motion_t *motion);
+
 /**
  * @brief Sets the servo rotation speed based on the given direction.
  *
@@ -106,6 +159,94 @@ void servo_set_speed(SERVO_DIRECTION);
  */
 void servo_invert(void);
 
+/**
+ * @brief Holds a sweep period by adjusting the duty continuously.
+ *
+ * The duty is interpolated between the learned rates of the fixed levels and
+ * corrected every sweep with the measured period. The change is immediate.
+ *
+ * @param period_ms Target period of one sweep (SERVO_SWEEP_PERIOD_MIN_MS to SERVO_SWEEP_PERIOD_MAX_MS),
+ *                  0 to go back to the fixed levels.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if out of range, ESP_FAIL on PWM error.
+ */
+esp_err_t servo_set_sweep_period(uint32_t period_ms);
+
+/**
+ * @brief Reads the target sweep period.
+ *
+ * @return The period in ms, 0 while the controller is off.
+ */
+uint32_t servo_get_sweep_period(void);
+
+/**
+ * @brief Degrees covered by a sweep.
+ */
+uint16_t servo_get_sweep_span(void);
+
+/**
+ * @brief Limits the sweeps to a sector with software reversal points.
+ *
+ * The servo reverses when the angle model reaches either end, the limit
+ * switches stay as a backstop and are reached every few sweeps to correct
+ * the drift of the estimate. A narrower sector keeps the angular rate, so it
+ * refreshes proportionally faster.
+ *
+ * @param start_deg Start of the sector, in servo degrees (30 to 330).
+ * @param end_deg End of the sector, both 0 to sweep the full range.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the sector is not valid.
+ */
+esp_err_t servo_set_sector(int16_t start_deg, int16_t end_deg);
+
+/**
+ * @brief Checks a sector with the rule of servo_set_sector.
+ *
+ * Valid sectors lie between SERVO_CW_LIMIT_DEG and SERVO_CCW_LIMIT_DEG,
+ * start below end and at least SERVO_SECTOR_MIN_WIDTH_DEG wide. 0..0 is the
+ * full range.
+ *
+ * @param start_deg Start of the sector, in servo degrees.
+ * @param end_deg End of the sector, in servo degrees.
+ * @return true if servo_set_sector accepts it.
+ */
+bool servo_sector_valid(int32_t start_deg, int32_t end_deg);
+
+/**
+ * @brief Waits up to `wait_ms` for the sector reversal point and inverts there.
+ *
+ * Meant for the task polling the limit switch, so both inversions are
+ * serialized.
+ *
+ * @param wait_ms Longest wait.
+ */
+void servo_check_reversal(uint32_t wait_ms);
+
+/**
+ * @brief Copies the counters of the sweep period controller.
+ *
+ * @param[out] stats Current counters.
+ */
+void servo_get_control_stats(servo_control_stats_t *stats);
+
+/**
+ * @brief Logs the counters of the sweep period controller.
+ */
+void servo_log_control(void);
+
+/**
+ * @brief Persists the learned angular rates to NVS.
+ *
+ * The rate of each duty level is learned from the time between two limit
+ * switch activations. This only writes after enough new sweeps.
+ *
+ * @return ESP_OK if saved or nothing new, an NVS error code otherwise.
+ */
+esp_err_t servo_save_rates(void);
+
+/**
+ * @brief Logs the learned angular rate of each duty level.
+ */
+void servo_log_rates(void);
+
 /**
  * @brief Deletes any semaphores used for servo control.
  *
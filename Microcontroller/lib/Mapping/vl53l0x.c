@@ -22,6 +22,9 @@
 #include "vl53l0x.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include "esp_timer.h"
 #include "debug_helper.h"
 
 
@@ -41,6 +44,18 @@
 #define REG_GLOBAL_CONFIG_SPAD_ENABLES_REF_0 (0xB0)
 #define REG_RESULT_RANGE_STATUS (0x14)
 #define REG_SLAVE_DEVICE_ADDRESS (0x8A)
+#define REG_MSRC_CONFIG_TIMEOUT_MACROP (0x46)
+#define REG_PRE_RANGE_CONFIG_VCSEL_PERIOD (0x50)
+#define REG_PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI (0x51)
+#define REG_PRE_RANGE_CONFIG_VALID_PHASE_LOW (0x56)
+#define REG_PRE_RANGE_CONFIG_VALID_PHASE_HIGH (0x57)
+#define REG_FINAL_RANGE_CONFIG_VCSEL_PERIOD (0x70)
+#define REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI (0x71)
+#define REG_FINAL_RANGE_CONFIG_VALID_PHASE_LOW (0x47)
+#define REG_FINAL_RANGE_CONFIG_VALID_PHASE_HIGH (0x48)
+#define REG_GLOBAL_CONFIG_VCSEL_WIDTH (0x32)
+#define REG_ALGO_PHASECAL_CONFIG_TIMEOUT (0x30)
+#define REG_ALGO_PHASECAL_LIM (0x30) /* On page 0x01 */
 
 #define RANGE_SEQUENCE_STEP_TCC (0x10) /* Target CentreCheck */
 #define RANGE_SEQUENCE_STEP_MSRC (0x04) /* Minimum Signal Rate Check */
@@ -48,6 +63,28 @@
 #define RANGE_SEQUENCE_STEP_PRE_RANGE (0x40)
 #define RANGE_SEQUENCE_STEP_FINAL_RANGE (0x80)
 
+/* Margin added on top of the timing budget while waiting for a measurement
+ * to become ready, so only a stuck sensor hits the timeout. */
+#define VL53L0X_DATA_READY_TIMEOUT_MS (100)
+
+/* Overheads of each sequence step (in us) as used by the ST api code to
+ * split the measurement timing budget. */
+#define TIMING_BUDGET_START_OVERHEAD (1910)
+#define TIMING_BUDGET_END_OVERHEAD (960)
+#define TIMING_BUDGET_MSRC_OVERHEAD (660)
+#define TIMING_BUDGET_TCC_OVERHEAD (590)
+#define TIMING_BUDGET_DSS_OVERHEAD (690)
+#define TIMING_BUDGET_PRE_RANGE_OVERHEAD (660)
+#define TIMING_BUDGET_FINAL_RANGE_OVERHEAD (550)
+#define TIMING_BUDGET_MIN_US (20000)
+/* Budget right after static_init with the default tuning settings */
+#define TIMING_BUDGET_DEFAULT_US (33000)
+
+/* The result block starting at REG_RESULT_RANGE_STATUS, read in one go */
+#define RESULT_BLOCK_SIZE (12)
+/* Device range status reported when the final range measurement is valid */
+#define RANGE_STATUS_VALID (11)
+
 #define VL53L0X_EXPECTED_DEVICE_ID (0xEE)
 #define VL53L0X_DEFAULT_ADDRESS (0x29)
 
@@ -71,12 +108,21 @@
  * offset to the aperture quadrant is (256 - 64 - 180) = 12 */
 #define SPAD_APERTURE_START_INDEX (12)
 
+/* Calibration results cached in NVS, one blob per sensor ("cal0", "cal1"...) */
+#define CALIBRATION_NVS_NAMESPACE "vl53l0x"
+/* Bump when the layout of vl53l0x_calibration_t or the way it is computed
+ * changes, so old blobs are discarded and the sensors are calibrated again */
+#define CALIBRATION_VERSION (2)
+
+#define TABLE_SIZE(table) (sizeof(table) / sizeof((table)[0]))
+
 static const char *TAG = "VL53L0X";
 
 typedef struct vl53l0x_info
 {
     uint8_t addr;
     gpio_t xshut_gpio;
+    gpio_t int_gpio;
 } vl53l0x_info_t;
 
 typedef enum
@@ -85,18 +131,277 @@ typedef enum
     CALIBRATION_TYPE_PHASE
 } calibration_type_t;
 
+/**
+ * Results of the SPAD selection and the VHV/phase reference calibration.
+ * Restoring them is a handful of register writes, instead of the SPAD
+ * selection and the two calibration measurements needed to compute them.
+ * The SPAD count and type read from the NVM identify the sensor the blob
+ * was computed for.
+ */
+typedef struct
+{
+    uint8_t version;
+    uint8_t spad_count;                     /* NVM reference SPAD count */
+    uint8_t spad_type;                      /* NVM reference SPAD type */
+    uint8_t spad_map[SPAD_MAP_ROW_COUNT];   /* Reference SPADs enabled */
+    uint8_t vhv_settings;
+    uint8_t phase_cal;
+} vl53l0x_calibration_t;
+
 static const vl53l0x_info_t vl53l0x_infos[] =
 {
-    [VL53L0X_IDX_FIRST] = { .addr = 0x29, .xshut_gpio = GPIO_XSHUT_FIRST },
+    [VL53L0X_IDX_FIRST] = { .addr = 0x29, .xshut_gpio = GPIO_XSHUT_FIRST, .int_gpio = GPIO_INT_FIRST },
 #ifdef VL53L0X_SECOND
-    [VL53L0X_IDX_SECOND] = { .addr = 0x31, .xshut_gpio = GPIO_XSHUT_SECOND },
+    [VL53L0X_IDX_SECOND] = { .addr = 0x31, .xshut_gpio = GPIO_XSHUT_SECOND, .int_gpio = GPIO_INT_SECOND },
 #endif
 #ifdef VL53L0X_THIRD
-    [VL53L0X_IDX_THIRD] = { .addr = 0x32, .xshut_gpio = GPIO_XSHUT_THIRD },
+    [VL53L0X_IDX_THIRD] = { .addr = 0x32, .xshut_gpio = GPIO_XSHUT_THIRD, .int_gpio = GPIO_INT_THIRD },
 #endif
 };
 
-static uint8_t stop_variable = 0;
+typedef enum
+{
+    VCSEL_PERIOD_PRE_RANGE,
+    VCSEL_PERIOD_FINAL_RANGE
+} vcsel_period_type_t;
+
+typedef struct
+{
+    bool tcc;
+    bool msrc;
+    bool dss;
+    bool pre_range;
+    bool final_range;
+} sequence_step_enables_t;
+
+typedef struct
+{
+    uint16_t pre_range_vcsel_period_pclks;
+    uint16_t final_range_vcsel_period_pclks;
+    uint16_t msrc_dss_tcc_mclks;
+    uint16_t pre_range_mclks;
+    uint16_t final_range_mclks;
+    uint32_t msrc_dss_tcc_us;
+    uint32_t pre_range_us;
+    uint32_t final_range_us;
+} sequence_step_timeouts_t;
+
+typedef struct
+{
+    uint32_t timing_budget_us;
+    uint8_t pre_range_vcsel_period_pclks;
+    uint8_t final_range_vcsel_period_pclks;
+    uint16_t signal_rate_limit_mcps_q7; /* Fixed point 9.7, MCPS * 128 */
+} vl53l0x_profile_info_t;
+
+/* Values taken from the ST api code ranging profiles */
+static const vl53l0x_profile_info_t vl53l0x_profiles[] =
+{
+    [VL53L0X_PROFILE_DEFAULT] = { .timing_budget_us = 33000, .pre_range_vcsel_period_pclks = 14,
+                                  .final_range_vcsel_period_pclks = 10, .signal_rate_limit_mcps_q7 = 32 },
+    [VL53L0X_PROFILE_HIGH_SPEED] = { .timing_budget_us = 20000, .pre_range_vcsel_period_pclks = 14,
+                                     .final_range_vcsel_period_pclks = 10, .signal_rate_limit_mcps_q7 = 32 },
+    [VL53L0X_PROFILE_HIGH_ACCURACY] = { .timing_budget_us = 200000, .pre_range_vcsel_period_pclks = 14,
+                                        .final_range_vcsel_period_pclks = 10, .signal_rate_limit_mcps_q7 = 32 },
+    [VL53L0X_PROFILE_LONG_RANGE] = { .timing_budget_us = 33000, .pre_range_vcsel_period_pclks = 18,
+                                     .final_range_vcsel_period_pclks = 14, .signal_rate_limit_mcps_q7 = 13 },
+};
+
+/* Default tuning settings from the ST api code, written in this order.
+ * 0xFF selects the register page. */
+static const i2c_reg_write_t default_tuning_settings[] =
+{
+    { 0xFF, 0x01 }, { 0x00, 0x00 }, { 0xFF, 0x00 }, { 0x09, 0x00 },
+    { 0x10, 0x00 }, { 0x11, 0x00 }, { 0x24, 0x01 }, { 0x25, 0xFF },
+    { 0x75, 0x00 }, { 0xFF, 0x01 }, { 0x4E, 0x2C }, { 0x48, 0x00 },
+    { 0x30, 0x20 }, { 0xFF, 0x00 }, { 0x30, 0x09 }, { 0x54, 0x00 },
+    { 0x31, 0x04 }, { 0x32, 0x03 }, { 0x40, 0x83 }, { 0x46, 0x25 },
+    { 0x60, 0x00 }, { 0x27, 0x00 }, { 0x50, 0x06 }, { 0x51, 0x00 },
+    { 0x52, 0x96 }, { 0x56, 0x08 }, { 0x57, 0x30 }, { 0x61, 0x00 },
+    { 0x62, 0x00 }, { 0x64, 0x00 }, { 0x65, 0x00 }, { 0x66, 0xA0 },
+    { 0xFF, 0x01 }, { 0x22, 0x32 }, { 0x47, 0x14 }, { 0x49, 0xFF },
+    { 0x4A, 0x00 }, { 0xFF, 0x00 }, { 0x7A, 0x0A }, { 0x7B, 0x00 },
+    { 0x78, 0x21 }, { 0xFF, 0x01 }, { 0x23, 0x34 }, { 0x42, 0x00 },
+    { 0x44, 0xFF }, { 0x45, 0x26 }, { 0x46, 0x05 }, { 0x40, 0x40 },
+    { 0x0E, 0x06 }, { 0x20, 0x1A }, { 0x43, 0x40 }, { 0xFF, 0x00 },
+    { 0x34, 0x03 }, { 0x35, 0x44 }, { 0xFF, 0x01 }, { 0x31, 0x04 },
+    { 0x4B, 0x09 }, { 0x4C, 0x05 }, { 0x4D, 0x04 }, { 0xFF, 0x00 },
+    { 0x44, 0x00 }, { 0x45, 0x20 }, { 0x47, 0x08 }, { 0x48, 0x28 },
+    { 0x67, 0x00 }, { 0x70, 0x04 }, { 0x71, 0x01 }, { 0x72, 0xFE },
+    { 0x76, 0x00 }, { 0x77, 0x00 }, { 0xFF, 0x01 }, { 0x0D, 0x01 },
+    { 0xFF, 0x00 }, { 0x80, 0x01 }, { 0x01, 0xF8 }, { 0xFF, 0x01 },
+    { 0x8E, 0x01 }, { 0x00, 0x01 }, { 0xFF, 0x00 }, { 0x80, 0x00 },
+};
+
+/* Set I2C standard mode and open page 1 to read the stop variable */
+static const i2c_reg_write_t data_init_open_seq[] =
+{
+    { 0x88, 0x00 }, { 0x80, 0x01 }, { 0xFF, 0x01 }, { 0x00, 0x00 },
+};
+
+/* Back to page 0 once the stop variable is read */
+static const i2c_reg_write_t data_init_close_seq[] =
+{
+    { 0x00, 0x01 }, { 0xFF, 0x00 }, { 0x80, 0x00 },
+};
+
+/* Access to the NVM, until the strobe handshake */
+static const i2c_reg_write_t nvm_open_seq[] =
+{
+    { 0x80, 0x01 }, { 0xFF, 0x01 }, { 0x00, 0x00 }, { 0xFF, 0x06 },
+};
+
+static const i2c_reg_write_t nvm_select_seq[] =
+{
+    { 0xFF, 0x07 }, { 0x81, 0x01 }, { 0x80, 0x01 },
+};
+
+static const i2c_reg_write_t nvm_close_seq[] =
+{
+    { 0x81, 0x00 }, { 0xFF, 0x06 },
+};
+
+static const i2c_reg_write_t nvm_restore_seq[] =
+{
+    { 0xFF, 0x01 }, { 0x00, 0x01 }, { 0xFF, 0x00 }, { 0x80, 0x00 },
+};
+
+/* Reference SPAD selection setup, before writing the SPAD map */
+static const i2c_reg_write_t spad_select_seq[] =
+{
+    { 0xFF, 0x01 }, { REG_DYNAMIC_SPAD_REF_EN_START_OFFSET, 0x00 },
+    { REG_DYNAMIC_SPAD_NUM_REQUESTED_REF_SPAD, 0x2C }, { 0xFF, 0x00 },
+    { REG_GLOBAL_CONFIG_REF_EN_START_SELECT, SPAD_START_SELECT },
+};
+
+/* Access to the VHV and phase calibration registers */
+static const i2c_reg_write_t ref_calibration_open_seq[] =
+{
+    { 0xFF, 0x01 }, { 0x00, 0x00 }, { 0xFF, 0x00 },
+};
+
+static const i2c_reg_write_t ref_calibration_close_seq[] =
+{
+    { 0xFF, 0x01 }, { 0x00, 0x01 }, { 0xFF, 0x00 },
+};
+
+/* Writing single-shot mode stops the back-to-back sequence, then the stop variable is cleared */
+static const i2c_reg_write_t stop_continuous_seq[] =
+{
+    { REG_SYSRANGE_START, 0x01 }, { 0xFF, 0x01 }, { 0x00, 0x00 },
+    { 0x91, 0x00 }, { 0x00, 0x01 }, { 0xFF, 0x00 },
+};
+
+/* Read from each sensor in data_init, the value is not shared between sensors */
+static uint8_t stop_variables[VL53L0X_IDX_COUNT];
+static uint32_t measurement_timing_budgets_us[VL53L0X_IDX_COUNT];
+/* Profile programmed in each sensor, VL53L0X_PROFILE_DEFAULT (0) until changed */
+static vl53l0x_profile_t active_profiles[VL53L0X_IDX_COUNT];
+
+/* Calibration of each sensor, loaded from NVS once and kept for resets */
+static vl53l0x_calibration_t calibrations[VL53L0X_IDX_COUNT];
+static bool calibration_valid[VL53L0X_IDX_COUNT];
+static bool calibration_loaded[VL53L0X_IDX_COUNT];
+
+/* Given from the GPIO1 ISR of each sensor when it has a new sample ready */
+static SemaphoreHandle_t data_ready_semaphores[VL53L0X_IDX_COUNT];
+
+/**
+ * GPIO1 falling edge: the sensor has a new sample ready. Only the waiting
+ * task is woken, the I2C read is done outside the ISR.
+ */
+static void data_ready_isr_handler(void *arg)
+{
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    xSemaphoreGiveFromISR((SemaphoreHandle_t)arg, &higher_priority_task_woken);
+    if (higher_priority_task_woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+/**
+ * Longest wait for a measurement of the sensor: its timing budget plus
+ * VL53L0X_DATA_READY_TIMEOUT_MS.
+ */
+static uint32_t data_ready_timeout_ms(vl53l0x_idx_t idx)
+{
+    return (measurement_timing_budgets_us[idx] / 1000) + VL53L0X_DATA_READY_TIMEOUT_MS;
+}
+
+/**
+ * Blocks until the sensor signals a new sample through GPIO1. If the
+ * interrupt is not configured it falls back to polling the status register
+ * until the same deadline. On timeout the status register is checked once,
+ * in case the edge was missed.
+ * @return ESP_OK, ESP_FAIL if the I2C access fails or ESP_ERR_TIMEOUT
+ */
+static esp_err_t wait_data_ready(vl53l0x_idx_t idx)
+{
+    uint8_t interrupt_status = 0;
+    SemaphoreHandle_t data_ready_semaphore = data_ready_semaphores[idx];
+    uint32_t timeout_ms = data_ready_timeout_ms(idx);
+
+    if (data_ready_semaphore == NULL) {
+        int64_t deadline_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+        do {
+            if (!i2c_read_addr8_data8(REG_RESULT_INTERRUPT_STATUS, &interrupt_status)) {
+                return ESP_FAIL;
+            }
+            if ((interrupt_status & 0x07) != 0) {
+                return ESP_OK;
+            }
+        } while (esp_timer_get_time() < deadline_us);
+        ESP_LOGE(TAG, "Timeout polling data ready");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if (xSemaphoreTake(data_ready_semaphore, pdMS_TO_TICKS(timeout_ms)) == pdTRUE) {
+        return ESP_OK;
+    }
+
+    if (!i2c_read_addr8_data8(REG_RESULT_INTERRUPT_STATUS, &interrupt_status)) {
+        return ESP_FAIL;
+    }
+    if ((interrupt_status & 0x07) == 0) {
+        ESP_LOGE(TAG, "Timeout waiting for data ready");
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Attaches the GPIO1 new-sample-ready line of a sensor to the ISR. Done
+ * only once, a later reset reuses the same handler.
+ */
+static bool init_data_ready_interrupt(vl53l0x_idx_t idx)
+{
+    if (data_ready_semaphores[idx] != NULL) {
+        return true;
+    }
+
+    SemaphoreHandle_t semaphore = xSemaphoreCreateBinary();
+    if (semaphore == NULL) {
+        ESP_LOGE(TAG, "Error creating data ready semaphore");
+        return false;
+    }
+
+    if (gpio_init_interrupt(vl53l0x_infos[idx].int_gpio, data_ready_isr_handler, semaphore) != ESP_OK) {
+        vSemaphoreDelete(semaphore);
+        return false;
+    }
+    data_ready_semaphores[idx] = semaphore;
+    return true;
+}
+
+/**
+ * Discards edges left over from calibration or a previous run
+ */
+static void clear_data_ready(vl53l0x_idx_t idx)
+{
+    if (data_ready_semaphores[idx] != NULL) {
+        xSemaphoreTake(data_ready_semaphores[idx], 0);
+    }
+}
 
 /**
  * We can read the model id to confirm that the device is booted.
@@ -117,7 +422,7 @@ static bool device_is_booted()
 /**
  * One time device initialization
  */
-static bool data_init()
+static bool data_init(vl53l0x_idx_t idx)
 {
     bool success = false;
 
@@ -132,16 +437,9 @@ static bool data_init()
     }
 
     /* Set I2C standard mode */
-    success = i2c_write_addr8_data8(0x88, 0x00);
-
-    success &= i2c_write_addr8_data8(0x80, 0x01);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x00, 0x00);
-    /* It may be unnecessary to retrieve the stop variable for each sensor */
-    success &= i2c_read_addr8_data8(0x91, &stop_variable);
-    success &= i2c_write_addr8_data8(0x00, 0x01);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x80, 0x00);
+    success = i2c_write_addr8_table(data_init_open_seq, TABLE_SIZE(data_init_open_seq));
+    success &= i2c_read_addr8_data8(0x91, &stop_variables[idx]);
+    success &= i2c_write_addr8_table(data_init_close_seq, TABLE_SIZE(data_init_close_seq));
 
     return success;
 }
@@ -189,15 +487,10 @@ static bool get_spad_info_from_nvm(uint8_t *spad_count, uint8_t *spad_type, uint
     uint32_t tmp_data32 = 0;
 
     /* Setup to read from NVM */
-    success  = i2c_write_addr8_data8(0x80, 0x01);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x00, 0x00);
-    success &= i2c_write_addr8_data8(0xFF, 0x06);
+    success  = i2c_write_addr8_table(nvm_open_seq, TABLE_SIZE(nvm_open_seq));
     success &= i2c_read_addr8_data8(0x83, &tmp_data8);
     success &= i2c_write_addr8_data8(0x83, tmp_data8 | 0x04);
-    success &= i2c_write_addr8_data8(0xFF, 0x07);
-    success &= i2c_write_addr8_data8(0x81, 0x01);
-    success &= i2c_write_addr8_data8(0x80, 0x01);
+    success &= i2c_write_addr8_table(nvm_select_seq, TABLE_SIZE(nvm_select_seq));
     if (!success) {
       return false;
     }
@@ -251,14 +544,10 @@ static bool get_spad_info_from_nvm(uint8_t *spad_count, uint8_t *spad_type, uint
 #endif
 
     /* Restore after reading from NVM */
-    success &=i2c_write_addr8_data8(0x81, 0x00);
-    success &=i2c_write_addr8_data8(0xFF, 0x06);
+    success &=i2c_write_addr8_table(nvm_close_seq, TABLE_SIZE(nvm_close_seq));
     success &=i2c_read_addr8_data8(0x83, &tmp_data8);
     success &=i2c_write_addr8_data8(0x83, tmp_data8 & 0xfb);
-    success &=i2c_write_addr8_data8(0xFF, 0x01);
-    success &=i2c_write_addr8_data8(0x00, 0x01);
-    success &=i2c_write_addr8_data8(0xFF, 0x00);
-    success &=i2c_write_addr8_data8(0x80, 0x00);
+    success &=i2c_write_addr8_table(nvm_restore_seq, TABLE_SIZE(nvm_restore_seq));
 
     /* When we haven't configured the SPAD map yet, the SPAD map register actually
      * contains the good SPAD map, so we can retrieve it straight from this register
@@ -269,35 +558,39 @@ static bool get_spad_info_from_nvm(uint8_t *spad_count, uint8_t *spad_type, uint
     return success;
 }
 
+/**
+ * Writes the reference SPAD selection.
+ */
+static bool write_spad_map(const uint8_t spad_map[SPAD_MAP_ROW_COUNT])
+{
+    if (!i2c_write_addr8_table(spad_select_seq, TABLE_SIZE(spad_select_seq))) {
+        return false;
+    }
+
+    /* Write the new SPAD configuration */
+    return i2c_write_addr8_bytes(REG_GLOBAL_CONFIG_SPAD_ENABLES_REF_0, (uint8_t *)spad_map, SPAD_MAP_ROW_COUNT);
+}
+
 /**
  * Sets the SPADs according to the value saved to NVM by ST during production. Assuming
  * similar conditions (e.g. no cover glass), this should give reasonable readings and we
  * can avoid running ref spad management (tedious code).
+ * The NVM values come from get_spad_info_from_nvm. The selected SPADs are
+ * returned in spad_map so they can be cached.
  */
-static bool set_spads_from_nvm()
+static bool set_spads_from_nvm(uint8_t spads_to_enable_count, uint8_t spad_type,
+                               const uint8_t good_spad_map[SPAD_MAP_ROW_COUNT],
+                               uint8_t spad_map[SPAD_MAP_ROW_COUNT])
 {
-    uint8_t spad_map[SPAD_MAP_ROW_COUNT] = { 0 };
-    uint8_t good_spad_map[SPAD_MAP_ROW_COUNT] = { 0 };
     uint8_t spads_enabled_count = 0;
-    uint8_t spads_to_enable_count = 0;
-    uint8_t spad_type = 0;
     volatile uint32_t total_val = 0;
 
-    if (!get_spad_info_from_nvm(&spads_to_enable_count, &spad_type, good_spad_map)) {
-        return false;
-    }
-
     for (int i = 0; i < 6; i++) {
         total_val += good_spad_map[i];
     }
 
-    bool success = i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(REG_DYNAMIC_SPAD_REF_EN_START_OFFSET, 0x00);
-    success &= i2c_write_addr8_data8(REG_DYNAMIC_SPAD_NUM_REQUESTED_REF_SPAD, 0x2C);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(REG_GLOBAL_CONFIG_REF_EN_START_SELECT, SPAD_START_SELECT);
-    if (!success) {
-        return false;
+    for (int i = 0; i < SPAD_MAP_ROW_COUNT; i++) {
+        spad_map[i] = 0;
     }
 
     uint8_t offset = (spad_type == SPAD_TYPE_APERTURE) ? SPAD_APERTURE_START_INDEX : 0;
@@ -333,12 +626,7 @@ static bool set_spads_from_nvm()
         return false;
     }
 
-    /* Write the new SPAD configuration */
-    if (!i2c_write_addr8_bytes(REG_GLOBAL_CONFIG_SPAD_ENABLES_REF_0, spad_map, SPAD_MAP_ROW_COUNT)) {
-        return false;
-    }
-
-    return true;
+    return write_spad_map(spad_map);
 }
 
 /**
@@ -346,87 +634,7 @@ static bool set_spads_from_nvm()
  */
 static bool load_default_tuning_settings()
 {
-    bool success = i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x00, 0x00);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x09, 0x00);
-    success &= i2c_write_addr8_data8(0x10, 0x00);
-    success &= i2c_write_addr8_data8(0x11, 0x00);
-    success &= i2c_write_addr8_data8(0x24, 0x01);
-    success &= i2c_write_addr8_data8(0x25, 0xFF);
-    success &= i2c_write_addr8_data8(0x75, 0x00);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x4E, 0x2C);
-    success &= i2c_write_addr8_data8(0x48, 0x00);
-    success &= i2c_write_addr8_data8(0x30, 0x20);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x30, 0x09);
-    success &= i2c_write_addr8_data8(0x54, 0x00);
-    success &= i2c_write_addr8_data8(0x31, 0x04);
-    success &= i2c_write_addr8_data8(0x32, 0x03);
-    success &= i2c_write_addr8_data8(0x40, 0x83);
-    success &= i2c_write_addr8_data8(0x46, 0x25);
-    success &= i2c_write_addr8_data8(0x60, 0x00);
-    success &= i2c_write_addr8_data8(0x27, 0x00);
-    success &= i2c_write_addr8_data8(0x50, 0x06);
-    success &= i2c_write_addr8_data8(0x51, 0x00);
-    success &= i2c_write_addr8_data8(0x52, 0x96);
-    success &= i2c_write_addr8_data8(0x56, 0x08);
-    success &= i2c_write_addr8_data8(0x57, 0x30);
-    success &= i2c_write_addr8_data8(0x61, 0x00);
-    success &= i2c_write_addr8_data8(0x62, 0x00);
-    success &= i2c_write_addr8_data8(0x64, 0x00);
-    success &= i2c_write_addr8_data8(0x65, 0x00);
-    success &= i2c_write_addr8_data8(0x66, 0xA0);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x22, 0x32);
-    success &= i2c_write_addr8_data8(0x47, 0x14);
-    success &= i2c_write_addr8_data8(0x49, 0xFF);
-    success &= i2c_write_addr8_data8(0x4A, 0x00);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x7A, 0x0A);
-    success &= i2c_write_addr8_data8(0x7B, 0x00);
-    success &= i2c_write_addr8_data8(0x78, 0x21);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x23, 0x34);
-    success &= i2c_write_addr8_data8(0x42, 0x00);
-    success &= i2c_write_addr8_data8(0x44, 0xFF);
-    success &= i2c_write_addr8_data8(0x45, 0x26);
-    success &= i2c_write_addr8_data8(0x46, 0x05);
-    success &= i2c_write_addr8_data8(0x40, 0x40);
-    success &= i2c_write_addr8_data8(0x0E, 0x06);
-    success &= i2c_write_addr8_data8(0x20, 0x1A);
-    success &= i2c_write_addr8_data8(0x43, 0x40);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x34, 0x03);
-    success &= i2c_write_addr8_data8(0x35, 0x44);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x31, 0x04);
-    success &= i2c_write_addr8_data8(0x4B, 0x09);
-    success &= i2c_write_addr8_data8(0x4C, 0x05);
-    success &= i2c_write_addr8_data8(0x4D, 0x04);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x44, 0x00);
-    success &= i2c_write_addr8_data8(0x45, 0x20);
-    success &= i2c_write_addr8_data8(0x47, 0x08);
-    success &= i2c_write_addr8_data8(0x48, 0x28);
-    success &= i2c_write_addr8_data8(0x67, 0x00);
-    success &= i2c_write_addr8_data8(0x70, 0x04);
-    success &= i2c_write_addr8_data8(0x71, 0x01);
-    success &= i2c_write_addr8_data8(0x72, 0xFE);
-    success &= i2c_write_addr8_data8(0x76, 0x00);
-    success &= i2c_write_addr8_data8(0x77, 0x00);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x0D, 0x01);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x80, 0x01);
-    success &= i2c_write_addr8_data8(0x01, 0xF8);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x8E, 0x01);
-    success &= i2c_write_addr8_data8(0x00, 0x01);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x80, 0x00);
-    return success;
+    return i2c_write_addr8_table(default_tuning_settings, TABLE_SIZE(default_tuning_settings));
 }
 
 static bool configure_interrupt()
@@ -462,11 +670,17 @@ static bool set_sequence_steps_enabled(uint8_t sequence_step)
 }
 
 /**
- * Basic device initialization
+ * Basic device initialization. With a cached calibration the SPAD map is
+ * written straight away, otherwise it is computed from the NVM SPAD count,
+ * type and good SPAD map into cal->spad_map.
  */
-static bool static_init()
+static bool static_init(vl53l0x_calibration_t *cal, const uint8_t good_spad_map[SPAD_MAP_ROW_COUNT], bool cached)
 {
-    if (!set_spads_from_nvm()) {
+    if (cached) {
+        if (!write_spad_map(cal->spad_map)) {
+            return false;
+        }
+    } else if (!set_spads_from_nvm(cal->spad_count, cal->spad_type, good_spad_map, cal->spad_map)) {
         return false;
     }
 
@@ -548,6 +762,411 @@ static bool perform_ref_calibration()
     return true;
 }
 
+/**
+ * Reads the VHV and phase values left by perform_ref_calibration
+ * (same access sequence as VL53L0X_ref_calibration_io in the ST api code).
+ */
+static bool get_ref_calibration(uint8_t *vhv_settings, uint8_t *phase_cal)
+{
+    bool success = i2c_write_addr8_table(ref_calibration_open_seq, TABLE_SIZE(ref_calibration_open_seq));
+    success &= i2c_read_addr8_data8(0xCB, vhv_settings);
+    success &= i2c_read_addr8_data8(0xEE, phase_cal);
+    success &= i2c_write_addr8_table(ref_calibration_close_seq, TABLE_SIZE(ref_calibration_close_seq));
+    *vhv_settings &= 0xFE;
+    *phase_cal &= 0xEF;
+    return success;
+}
+
+/**
+ * Writes previously measured VHV and phase values instead of running
+ * the reference calibration again.
+ */
+static bool set_ref_calibration(uint8_t vhv_settings, uint8_t phase_cal)
+{
+    uint8_t phase_reg = 0;
+    bool success = i2c_write_addr8_table(ref_calibration_open_seq, TABLE_SIZE(ref_calibration_open_seq));
+    success &= i2c_write_addr8_data8(0xCB, vhv_settings);
+    success &= i2c_read_addr8_data8(0xEE, &phase_reg);
+    success &= i2c_write_addr8_data8(0xEE, (phase_reg & 0x80) | phase_cal);
+    success &= i2c_write_addr8_table(ref_calibration_close_seq, TABLE_SIZE(ref_calibration_close_seq));
+    return success;
+}
+
+static void calibration_key(vl53l0x_idx_t idx, char key[8])
+{
+    key[0] = 'c';
+    key[1] = 'a';
+    key[2] = 'l';
+    key[3] = '0' + idx;
+    key[4] = '\0';
+}
+
+/**
+ * Loads the calibration of a sensor from NVS the first time it is needed.
+ * Later calls (after a reset) use the copy kept in RAM.
+ * @return true if a valid calibration is available
+ */
+static bool load_calibration(vl53l0x_idx_t idx)
+{
+    if (calibration_loaded[idx]) {
+        return calibration_valid[idx];
+    }
+    calibration_loaded[idx] = true;
+
+    nvs_handle_t handle;
+    if (nvs_open(CALIBRATION_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        /* Namespace not created yet: first boot */
+        return false;
+    }
+    char key[8];
+    calibration_key(idx, key);
+    vl53l0x_calibration_t cal;
+    size_t size = sizeof(cal);
+    esp_err_t err = nvs_get_blob(handle, key, &cal, &size);
+    nvs_close(handle);
+
+    if (err != ESP_OK || size != sizeof(cal) || cal.version != CALIBRATION_VERSION) {
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "No valid calibration cached for sensor %d", idx));
+        return false;
+    }
+    calibrations[idx] = cal;
+    calibration_valid[idx] = true;
+    return true;
+}
+
+/**
+ * Keeps the calibration of a sensor in RAM and persists it to NVS.
+ * Failing to persist is not fatal, the sensor is just calibrated again
+ * on the next boot.
+ */
+static void store_calibration(vl53l0x_idx_t idx)
+{
+    calibrations[idx].version = CALIBRATION_VERSION;
+    calibration_valid[idx] = true;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(CALIBRATION_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        char key[8];
+        calibration_key(idx, key);
+        err = nvs_set_blob(handle, key, &calibrations[idx], sizeof(calibrations[idx]));
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Error guardando la calibracion en NVS: %s", esp_err_to_name(err));
+        LOG_MESSAGE_W(TAG,"Error guardando la calibracion en NVS");
+    }
+}
+
+/**
+ * Drops the cached calibration of a sensor, in RAM and in NVS.
+ */
+static void invalidate_calibration(vl53l0x_idx_t idx)
+{
+    calibration_valid[idx] = false;
+
+    nvs_handle_t handle;
+    if (nvs_open(CALIBRATION_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+        char key[8];
+        calibration_key(idx, key);
+        nvs_erase_key(handle, key);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
+/**
+ * The VCSEL (laser) periods are stored as (period_pclks / 2) - 1
+ */
+static uint8_t decode_vcsel_period(uint8_t reg_value)
+{
+    return (reg_value + 1) << 1;
+}
+
+static uint8_t encode_vcsel_period(uint8_t period_pclks)
+{
+    return (period_pclks >> 1) - 1;
+}
+
+/**
+ * Macro period in ns for a given VCSEL period (in PCLKs)
+ */
+static uint32_t calc_macro_period_ns(uint16_t vcsel_period_pclks)
+{
+    return ((2304UL * vcsel_period_pclks * 1655UL) + 500) / 1000;
+}
+
+static uint32_t timeout_mclks_to_us(uint16_t timeout_mclks, uint16_t vcsel_period_pclks)
+{
+    uint32_t macro_period_ns = calc_macro_period_ns(vcsel_period_pclks);
+    return ((timeout_mclks * macro_period_ns) + 500) / 1000;
+}
+
+static uint32_t timeout_us_to_mclks(uint32_t timeout_us, uint16_t vcsel_period_pclks)
+{
+    uint32_t macro_period_ns = calc_macro_period_ns(vcsel_period_pclks);
+    return ((timeout_us * 1000) + (macro_period_ns / 2)) / macro_period_ns;
+}
+
+/**
+ * Timeout registers are stored as (LSByte * 2^MSByte) + 1
+ */
+static uint16_t decode_timeout(uint16_t reg_value)
+{
+    return (uint16_t)((reg_value & 0x00FF) << (uint16_t)((reg_value & 0xFF00) >> 8)) + 1;
+}
+
+static uint16_t encode_timeout(uint32_t timeout_mclks)
+{
+    uint32_t ls_byte = 0;
+    uint16_t ms_byte = 0;
+
+    if (timeout_mclks == 0) {
+        return 0;
+    }
+    ls_byte = timeout_mclks - 1;
+    while ((ls_byte & 0xFFFFFF00) > 0) {
+        ls_byte >>= 1;
+        ms_byte++;
+    }
+    return (ms_byte << 8) | (ls_byte & 0xFF);
+}
+
+static bool get_vcsel_period(vcsel_period_type_t type, uint16_t *period_pclks)
+{
+    uint8_t reg_value = 0;
+    uint8_t reg = (type == VCSEL_PERIOD_PRE_RANGE) ? REG_PRE_RANGE_CONFIG_VCSEL_PERIOD
+                                                   : REG_FINAL_RANGE_CONFIG_VCSEL_PERIOD;
+    if (!i2c_read_addr8_data8(reg, &reg_value)) {
+        return false;
+    }
+    *period_pclks = decode_vcsel_period(reg_value);
+    return true;
+}
+
+static bool get_sequence_step_enables(sequence_step_enables_t *enables)
+{
+    uint8_t sequence_config = 0;
+    if (!i2c_read_addr8_data8(REG_SYSTEM_SEQUENCE_CONFIG, &sequence_config)) {
+        return false;
+    }
+    enables->tcc = (sequence_config >> 4) & 0x1;
+    enables->dss = (sequence_config >> 3) & 0x1;
+    enables->msrc = (sequence_config >> 2) & 0x1;
+    enables->pre_range = (sequence_config >> 6) & 0x1;
+    enables->final_range = (sequence_config >> 7) & 0x1;
+    return true;
+}
+
+/**
+ * Reads the timeouts of each sequence step. The final range timeout register
+ * includes the pre range timeout, so it is subtracted when pre range is enabled.
+ */
+static bool get_sequence_step_timeouts(const sequence_step_enables_t *enables, sequence_step_timeouts_t *timeouts)
+{
+    uint8_t msrc_reg = 0;
+    uint16_t timeout_reg = 0;
+
+    if (!get_vcsel_period(VCSEL_PERIOD_PRE_RANGE, &timeouts->pre_range_vcsel_period_pclks)) {
+        return false;
+    }
+    if (!i2c_read_addr8_data8(REG_MSRC_CONFIG_TIMEOUT_MACROP, &msrc_reg)) {
+        return false;
+    }
+    timeouts->msrc_dss_tcc_mclks = msrc_reg + 1;
+    timeouts->msrc_dss_tcc_us = timeout_mclks_to_us(timeouts->msrc_dss_tcc_mclks,
+                                                    timeouts->pre_range_vcsel_period_pclks);
+
+    if (!i2c_read_addr8_data16(REG_PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI, &timeout_reg)) {
+        return false;
+    }
+    timeouts->pre_range_mclks = decode_timeout(timeout_reg);
+    timeouts->pre_range_us = timeout_mclks_to_us(timeouts->pre_range_mclks,
+                                                 timeouts->pre_range_vcsel_period_pclks);
+
+    if (!get_vcsel_period(VCSEL_PERIOD_FINAL_RANGE, &timeouts->final_range_vcsel_period_pclks)) {
+        return false;
+    }
+    if (!i2c_read_addr8_data16(REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI, &timeout_reg)) {
+        return false;
+    }
+    timeouts->final_range_mclks = decode_timeout(timeout_reg);
+    if (enables->pre_range) {
+        timeouts->final_range_mclks -= timeouts->pre_range_mclks;
+    }
+    timeouts->final_range_us = timeout_mclks_to_us(timeouts->final_range_mclks,
+                                                   timeouts->final_range_vcsel_period_pclks);
+    return true;
+}
+
+/**
+ * The measurement timing budget is the time allowed for one measurement. The
+ * final range timeout is what is left after the other enabled steps.
+ * A longer budget gives more accurate measurements.
+ */
+static bool set_measurement_timing_budget(vl53l0x_idx_t idx, uint32_t budget_us)
+{
+    sequence_step_enables_t enables;
+    sequence_step_timeouts_t timeouts;
+    uint32_t used_budget_us = TIMING_BUDGET_START_OVERHEAD + TIMING_BUDGET_END_OVERHEAD;
+
+    if (budget_us < TIMING_BUDGET_MIN_US) {
+        return false;
+    }
+    if (!get_sequence_step_enables(&enables) || !get_sequence_step_timeouts(&enables, &timeouts)) {
+        return false;
+    }
+
+    if (enables.tcc) {
+        used_budget_us += timeouts.msrc_dss_tcc_us + TIMING_BUDGET_TCC_OVERHEAD;
+    }
+    if (enables.dss) {
+        used_budget_us += 2 * (timeouts.msrc_dss_tcc_us + TIMING_BUDGET_DSS_OVERHEAD);
+    } else if (enables.msrc) {
+        used_budget_us += timeouts.msrc_dss_tcc_us + TIMING_BUDGET_MSRC_OVERHEAD;
+    }
+    if (enables.pre_range) {
+        used_budget_us += timeouts.pre_range_us + TIMING_BUDGET_PRE_RANGE_OVERHEAD;
+    }
+    if (enables.final_range) {
+        used_budget_us += TIMING_BUDGET_FINAL_RANGE_OVERHEAD;
+        if (used_budget_us > budget_us) {
+            /* Requested timeout too short */
+            return false;
+        }
+        uint32_t final_range_timeout_mclks = timeout_us_to_mclks(budget_us - used_budget_us,
+                                                                 timeouts.final_range_vcsel_period_pclks);
+        if (enables.pre_range) {
+            final_range_timeout_mclks += timeouts.pre_range_mclks;
+        }
+        if (!i2c_write_addr8_data16(REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+                                    encode_timeout(final_range_timeout_mclks))) {
+            return false;
+        }
+    }
+    measurement_timing_budgets_us[idx] = budget_us;
+    return true;
+}
+
+/**
+ * Sets the VCSEL (laser) pulse period of the pre or final range step. Longer
+ * periods increase the potential range. The step timeouts are recalculated
+ * for the new period and the phase calibration is rerun, as required by the
+ * ST api code.
+ * Valid values are 12 to 18 (even) for pre range and 8 to 14 (even) for final range.
+ */
+static bool set_vcsel_pulse_period(vl53l0x_idx_t idx, vcsel_period_type_t type, uint8_t period_pclks)
+{
+    sequence_step_enables_t enables;
+    sequence_step_timeouts_t timeouts;
+    uint8_t vcsel_period_reg = encode_vcsel_period(period_pclks);
+    bool success = false;
+
+    if (!get_sequence_step_enables(&enables) || !get_sequence_step_timeouts(&enables, &timeouts)) {
+        return false;
+    }
+
+    if (type == VCSEL_PERIOD_PRE_RANGE) {
+        uint8_t valid_phase_high = 0;
+        switch (period_pclks) {
+        case 12: valid_phase_high = 0x18; break;
+        case 14: valid_phase_high = 0x30; break;
+        case 16: valid_phase_high = 0x40; break;
+        case 18: valid_phase_high = 0x50; break;
+        default: return false;
+        }
+        success = i2c_write_addr8_data8(REG_PRE_RANGE_CONFIG_VALID_PHASE_HIGH, valid_phase_high);
+        success &= i2c_write_addr8_data8(REG_PRE_RANGE_CONFIG_VALID_PHASE_LOW, 0x08);
+        success &= i2c_write_addr8_data8(REG_PRE_RANGE_CONFIG_VCSEL_PERIOD, vcsel_period_reg);
+
+        uint32_t pre_range_mclks = timeout_us_to_mclks(timeouts.pre_range_us, period_pclks);
+        success &= i2c_write_addr8_data16(REG_PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI, encode_timeout(pre_range_mclks));
+
+        uint32_t msrc_mclks = timeout_us_to_mclks(timeouts.msrc_dss_tcc_us, period_pclks);
+        success &= i2c_write_addr8_data8(REG_MSRC_CONFIG_TIMEOUT_MACROP,
+                                         (msrc_mclks > 256) ? 255 : (msrc_mclks - 1));
+    } else {
+        uint8_t valid_phase_high = 0;
+        uint8_t vcsel_width = 0;
+        uint8_t phasecal_timeout = 0;
+        uint8_t phasecal_lim = 0;
+        switch (period_pclks) {
+        case 8:  valid_phase_high = 0x10; vcsel_width = 0x02; phasecal_timeout = 0x0C; phasecal_lim = 0x30; break;
+        case 10: valid_phase_high = 0x28; vcsel_width = 0x03; phasecal_timeout = 0x09; phasecal_lim = 0x20; break;
+        case 12: valid_phase_high = 0x38; vcsel_width = 0x03; phasecal_timeout = 0x08; phasecal_lim = 0x20; break;
+        case 14: valid_phase_high = 0x48; vcsel_width = 0x03; phasecal_timeout = 0x07; phasecal_lim = 0x20; break;
+        default: return false;
+        }
+        success = i2c_write_addr8_data8(REG_FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, valid_phase_high);
+        success &= i2c_write_addr8_data8(REG_FINAL_RANGE_CONFIG_VALID_PHASE_LOW, 0x08);
+        success &= i2c_write_addr8_data8(REG_GLOBAL_CONFIG_VCSEL_WIDTH, vcsel_width);
+        success &= i2c_write_addr8_data8(REG_ALGO_PHASECAL_CONFIG_TIMEOUT, phasecal_timeout);
+        success &= i2c_write_addr8_data8(0xFF, 0x01);
+        success &= i2c_write_addr8_data8(REG_ALGO_PHASECAL_LIM, phasecal_lim);
+        success &= i2c_write_addr8_data8(0xFF, 0x00);
+        success &= i2c_write_addr8_data8(REG_FINAL_RANGE_CONFIG_VCSEL_PERIOD, vcsel_period_reg);
+
+        uint32_t final_range_mclks = timeout_us_to_mclks(timeouts.final_range_us, period_pclks);
+        if (enables.pre_range) {
+            final_range_mclks += timeouts.pre_range_mclks;
+        }
+        success &= i2c_write_addr8_data16(REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI, encode_timeout(final_range_mclks));
+    }
+    if (!success) {
+        return false;
+    }
+
+    /* Timeouts changed, so the budget has to be redistributed */
+    if (!set_measurement_timing_budget(idx, measurement_timing_budgets_us[idx])) {
+        return false;
+    }
+
+    /* Rerun the phase calibration for the new period */
+    uint8_t sequence_config = 0;
+    if (!i2c_read_addr8_data8(REG_SYSTEM_SEQUENCE_CONFIG, &sequence_config)) {
+        return false;
+    }
+    if (!perform_single_ref_calibration(CALIBRATION_TYPE_PHASE)) {
+        return false;
+    }
+    return i2c_write_addr8_data8(REG_SYSTEM_SEQUENCE_CONFIG, sequence_config);
+}
+
+/**
+ * Minimum return signal rate for a measurement to be reported as valid.
+ * Lower values increase the range but also the chance of inaccurate readings.
+ */
+static bool set_signal_rate_limit(uint16_t limit_mcps_q7)
+{
+    return i2c_write_addr8_data16(REG_FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT, limit_mcps_q7);
+}
+
+/**
+ * Programs the VCSEL periods, signal rate limit and timing budget of a profile.
+ * The timing budget goes last since it depends on the VCSEL periods.
+ */
+static bool apply_profile(vl53l0x_idx_t idx, vl53l0x_profile_t profile)
+{
+    const vl53l0x_profile_info_t *info = &vl53l0x_profiles[profile];
+
+    if (!set_signal_rate_limit(info->signal_rate_limit_mcps_q7)) {
+        return false;
+    }
+    if (!set_vcsel_pulse_period(idx, VCSEL_PERIOD_PRE_RANGE, info->pre_range_vcsel_period_pclks)) {
+        return false;
+    }
+    if (!set_vcsel_pulse_period(idx, VCSEL_PERIOD_FINAL_RANGE, info->final_range_vcsel_period_pclks)) {
+        return false;
+    }
+    if (!set_measurement_timing_budget(idx, info->timing_budget_us)) {
+        return false;
+    }
+    return true;
+}
+
 static bool configure_address(uint8_t addr)
 {
     /* 7-bit address */
@@ -587,15 +1206,20 @@ static void configure_gpio()
         LOG_MESSAGE_E(TAG,"Fallo en gpio_set_output()");
     }
 
-    // err = gpio_set_output(GPIO_XSHUT_SECOND, false);
-    // if (err != ESP_OK){
-    //     ESP_LOGI(TAG, "Fallo en configure_gpio(): %s", esp_err_to_name(err));
-    // }
-
-    // err = gpio_set_output(GPIO_XSHUT_THIRD, false);
-    // if (err != ESP_OK){
-    //     ESP_LOGI(TAG, "Fallo en configure_gpio(): %s", esp_err_to_name(err));
-    // }
+#ifdef VL53L0X_SECOND
+    err = gpio_init_output(GPIO_XSHUT_SECOND);
+    if (err != ESP_OK){
+        ESP_LOGE(TAG, "Fallo en configure_gpio(): %s", esp_err_to_name(err));
+        LOG_MESSAGE_E(TAG,"Fallo en configure_gpio()");
+    }
+#endif
+#ifdef VL53L0X_THIRD
+    err = gpio_init_output(GPIO_XSHUT_THIRD);
+    if (err != ESP_OK){
+        ESP_LOGE(TAG, "Fallo en configure_gpio(): %s", esp_err_to_name(err));
+        LOG_MESSAGE_E(TAG,"Fallo en configure_gpio()");
+    }
+#endif
 }
 
 /* Sets the address of a single VL53L0X sensor.
@@ -604,7 +1228,7 @@ static void configure_gpio()
 static bool init_address(vl53l0x_idx_t idx)
 {
     set_hardware_standby(idx, false);
-    //i2c_set_slave_address(VL53L0X_DEFAULT_ADDRESS);
+    i2c_set_slave_address(VL53L0X_DEFAULT_ADDRESS);
 
     /* The datasheet doesn't say how long we must wait to leave hw standby,
      * but using the same delay as vl6180x seems to work fine. */
@@ -656,20 +1280,63 @@ static bool init_addresses()
 
 static bool init_config(vl53l0x_idx_t idx)
 {
-    //i2c_set_slave_address(vl53l0x_infos[idx].addr);
-    if (!data_init()) {
+    i2c_set_slave_address(vl53l0x_infos[idx].addr);
+    if (!data_init(idx)) {
         ESP_LOGE(TAG, "Fallo en data_init");
         LOG_MESSAGE_E(TAG,"Fallo en data_init");
         return false;
     }
-    if (!static_init()) {
-        ESP_LOGE(TAG, "Fallo en static_init");
-        LOG_MESSAGE_E(TAG,"Fallo en static_init");
+    /* Read before anything is written, afterwards the SPAD map register no
+     * longer holds the good SPAD map */
+    uint8_t spad_count = 0;
+    uint8_t spad_type = 0;
+    uint8_t good_spad_map[SPAD_MAP_ROW_COUNT] = { 0 };
+    if (!get_spad_info_from_nvm(&spad_count, &spad_type, good_spad_map)) {
+        ESP_LOGE(TAG, "Fallo en get_spad_info_from_nvm");
+        LOG_MESSAGE_E(TAG,"Fallo en get_spad_info_from_nvm");
         return false;
     }
-    if (!perform_ref_calibration()) {
-        ESP_LOGE(TAG, "Fallo en perform_ref_calibration");
-        LOG_MESSAGE_E(TAG,"Fallo en perform_ref_calibration");
+    vl53l0x_calibration_t *cal = &calibrations[idx];
+    bool restored = false;
+    if (load_calibration(idx)) {
+        /* Warm start: restore the SPAD map and the VHV/phase values */
+        if (cal->spad_count != spad_count || cal->spad_type != spad_type) {
+            ESP_LOGW(TAG, "La calibracion guardada no corresponde al sensor %d", idx);
+            LOG_MESSAGE_W(TAG,"La calibracion guardada no corresponde al sensor");
+        } else if (static_init(cal, good_spad_map, true) && set_ref_calibration(cal->vhv_settings, cal->phase_cal)) {
+            DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Calibracion restaurada para el sensor %d", idx));
+            restored = true;
+        } else {
+            ESP_LOGE(TAG, "Fallo restaurando la calibracion del sensor %d", idx);
+            LOG_MESSAGE_E(TAG,"Fallo restaurando la calibracion");
+        }
+        if (!restored) {
+            /* Fall back to a fresh calibration, which replaces the cached one */
+            invalidate_calibration(idx);
+        }
+    }
+    if (!restored) {
+        cal->spad_count = spad_count;
+        cal->spad_type = spad_type;
+        if (!static_init(cal, good_spad_map, false)) {
+            ESP_LOGE(TAG, "Fallo en static_init");
+            LOG_MESSAGE_E(TAG,"Fallo en static_init");
+            return false;
+        }
+        if (!perform_ref_calibration()) {
+            ESP_LOGE(TAG, "Fallo en perform_ref_calibration");
+            LOG_MESSAGE_E(TAG,"Fallo en perform_ref_calibration");
+            return false;
+        }
+        if (get_ref_calibration(&cal->vhv_settings, &cal->phase_cal)) {
+            store_calibration(idx);
+        }
+    }
+    /* A reset brings the sensor back to the default tuning, restore the selected profile */
+    measurement_timing_budgets_us[idx] = TIMING_BUDGET_DEFAULT_US;
+    if (active_profiles[idx] != VL53L0X_PROFILE_DEFAULT && !apply_profile(idx, active_profiles[idx])) {
+        ESP_LOGE(TAG, "Fallo en apply_profile");
+        LOG_MESSAGE_E(TAG,"Fallo en apply_profile");
         return false;
     }
     return true;
@@ -677,82 +1344,260 @@ static bool init_config(vl53l0x_idx_t idx)
 
 bool vl53l0x_init()
 {
+    /* Boot phase timer: the address phase is dominated by the XSHUT wake up
+     * delay, the config phase by the register upload and calibration */
+    int64_t start_us = esp_timer_get_time();
     if (!init_addresses()) {
         ESP_LOGE(TAG, "Fallo en init_addresses");
         LOG_MESSAGE_E(TAG,"Fallo en init_addresses");
         return false;
     }
-    if (!init_config(VL53L0X_IDX_FIRST)) {
-        ESP_LOGE(TAG, "Fallo en init_config");
-        LOG_MESSAGE_E(TAG,"Fallo en init_config");
-        return false;
+    int64_t addresses_us = esp_timer_get_time();
+    for (vl53l0x_idx_t idx = VL53L0X_IDX_FIRST; idx < VL53L0X_IDX_COUNT; idx++) {
+        int64_t config_start_us = esp_timer_get_time();
+        if (!init_config(idx)) {
+            ESP_LOGE(TAG, "Fallo en init_config del sensor %d", idx);
+            LOG_MESSAGE_E(TAG,"Fallo en init_config");
+            return false;
+        }
+        ESP_LOGI(TAG, "Sensor %d configurado en %lld us", idx, (long long)(esp_timer_get_time() - config_start_us));
+        if (!init_data_ready_interrupt(idx)) {
+            /* Not fatal, measurements fall back to polling the status register */
+            ESP_LOGW(TAG, "Fallo en init_data_ready_interrupt del sensor %d, usando polling", idx);
+            LOG_MESSAGE_W(TAG,"Fallo en init_data_ready_interrupt, usando polling");
+        }
     }
-#ifdef VL53L0X_SECOND
-    if (!init_config(VL53L0X_IDX_SECOND)) {
+    int64_t end_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "Init LiDAR: %lld us (direcciones %lld us, configuracion %lld us)",
+             (long long)(end_us - start_us), (long long)(addresses_us - start_us),
+             (long long)(end_us - addresses_us));
+    return true;
+}
+
+/**
+ * Writes the stop variable read in data_init for this sensor, needed before starting a measurement
+ */
+static bool write_stop_variable(vl53l0x_idx_t idx)
+{
+    const i2c_reg_write_t seq[] =
+    {
+        { 0x80, 0x01 }, { 0xFF, 0x01 }, { 0x00, 0x00 }, { 0x91, stop_variables[idx] },
+        { 0x00, 0x01 }, { 0xFF, 0x00 }, { 0x80, 0x00 },
+    };
+    return i2c_write_addr8_table(seq, TABLE_SIZE(seq));
+}
+
+/**
+ * Reads the whole result block in a single transaction and clears the interrupt.
+ * Layout (big endian words):
+ *   [0]     device range status in bits 6:3
+ *   [2..3]  effective SPAD return count (8.8)
+ *   [6..7]  return signal rate (9.7 MCPS)
+ *   [8..9]  ambient rate (9.7 MCPS)
+ *   [10..11] range in mm
+ */
+static bool read_result_sample(vl53l0x_sample_t *sample)
+{
+    uint8_t result[RESULT_BLOCK_SIZE] = { 0 };
+
+    if (!i2c_read_addr8_bytes(REG_RESULT_RANGE_STATUS, result, RESULT_BLOCK_SIZE)) {
         return false;
     }
-#endif
-#ifdef VL53L0X_THIRD
-    if (!init_config(VL53L0X_IDX_THIRD)) {
+    if (!i2c_write_addr8_data8(REG_SYSTEM_INTERRUPT_CLEAR, 0x01)) {
         return false;
     }
-#endif
+
+    sample->range_status = (result[0] & 0x78) >> 3;
+    sample->effective_spad_count_q8 = ((uint16_t)result[2] << 8) | result[3];
+    sample->signal_rate_mcps_q7 = ((uint16_t)result[6] << 8) | result[7];
+    sample->ambient_rate_mcps_q7 = ((uint16_t)result[8] << 8) | result[9];
+    sample->range_mm = ((uint16_t)result[10] << 8) | result[11];
+
+    /* 8190 or 8191 may be returned when obstacle is out of range. */
+    sample->valid = (sample->range_status == RANGE_STATUS_VALID) &&
+                    (sample->range_mm < 8190) &&
+                    (sample->signal_rate_mcps_q7 > 0);
     return true;
 }
 
+/**
+ * Legacy range value: out of range readings are reported as VL53L0X_OUT_OF_RANGE
+ */
+static uint16_t sample_to_range(const vl53l0x_sample_t *sample)
+{
+    if (sample->range_mm == 8190 || sample->range_mm == 8191) {
+        return VL53L0X_OUT_OF_RANGE;
+    }
+    return sample->range_mm;
+}
+
 esp_err_t vl53l0x_read_range_single(vl53l0x_idx_t idx, uint16_t *range)
 {
-    //i2c_set_slave_address(vl53l0x_infos[idx].addr);
-    bool success = i2c_write_addr8_data8(0x80, 0x01);
-    success &= i2c_write_addr8_data8(0xFF, 0x01);
-    success &= i2c_write_addr8_data8(0x00, 0x00);
-    success &= i2c_write_addr8_data8(0x91, stop_variable);
-    success &= i2c_write_addr8_data8(0x00, 0x01);
-    success &= i2c_write_addr8_data8(0xFF, 0x00);
-    success &= i2c_write_addr8_data8(0x80, 0x00);
+    i2c_set_slave_address(vl53l0x_infos[idx].addr);
+    bool success = write_stop_variable(idx);
     
     if (!success) {
         return ESP_FAIL;
     }
 
+    clear_data_ready(idx);
+
     if (!i2c_write_addr8_data8(REG_SYSRANGE_START, 0x01)) {
         return ESP_FAIL;
     }
 
+    /* Bit 0 clears once the measurement has started */
     uint8_t sysrange_start = 0;
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)data_ready_timeout_ms(idx) * 1000;
     do {
-        success = i2c_read_addr8_data8(REG_SYSRANGE_START, &sysrange_start);
-    } while (success && (sysrange_start & 0x01));
-    
-    if (!success) {
+        if (!i2c_read_addr8_data8(REG_SYSRANGE_START, &sysrange_start)) {
+            return ESP_FAIL;
+        }
+        if ((sysrange_start & 0x01) == 0) {
+            break;
+        }
+    } while (esp_timer_get_time() < deadline_us);
+    if (sysrange_start & 0x01) {
+        ESP_LOGE(TAG, "Timeout waiting for the measurement to start");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    esp_err_t err = wait_data_ready(idx);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    vl53l0x_sample_t sample;
+    if (!read_result_sample(&sample)) {
         return ESP_FAIL;
     }
+    *range = sample_to_range(&sample);
+
+    return ESP_OK;
+}
+
+esp_err_t vl53l0x_start_single(vl53l0x_idx_t idx)
+{
+    i2c_set_slave_address(vl53l0x_infos[idx].addr);
+    bool success = write_stop_variable(idx);
 
-    uint8_t interrupt_status = 0;
-    do {
-        success = i2c_read_addr8_data8(REG_RESULT_INTERRUPT_STATUS, &interrupt_status);
-    } while (success && ((interrupt_status & 0x07) == 0));
-    
     if (!success) {
         return ESP_FAIL;
     }
 
-    if (!i2c_read_addr8_data16(REG_RESULT_RANGE_STATUS + 10, range)) {
+    clear_data_ready(idx);
+    /* Same as in continuous mode, a pending interrupt would hide the new edge */
+    if (!i2c_write_addr8_data8(REG_SYSTEM_INTERRUPT_CLEAR, 0x01)) {
+        return ESP_FAIL;
+    }
+
+    /* Single shot, the result is fetched later with vl53l0x_read_sample */
+    if (!i2c_write_addr8_data8(REG_SYSRANGE_START, 0x01)) {
         return ESP_FAIL;
     }
+    return ESP_OK;
+}
 
+esp_err_t vl53l0x_start_continuous(vl53l0x_idx_t idx)
+{
+    i2c_set_slave_address(vl53l0x_infos[idx].addr);
+    bool success = write_stop_variable(idx);
+
+    if (!success) {
+        return ESP_FAIL;
+    }
+
+    clear_data_ready(idx);
+    /* A pending interrupt left by a failed read would keep GPIO1 low and no new edge would come */
     if (!i2c_write_addr8_data8(REG_SYSTEM_INTERRUPT_CLEAR, 0x01)) {
         return ESP_FAIL;
     }
-    
-    /* 8190 or 8191 may be returned when obstacle is out of range. */
-    if (*range == 8190 || *range == 8191) {
-        *range = VL53L0X_OUT_OF_RANGE;
+
+    /* Back-to-back mode: a new measurement starts as soon as the previous one ends */
+    if (!i2c_write_addr8_data8(REG_SYSRANGE_START, 0x02)) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t vl53l0x_read_sample(vl53l0x_idx_t idx, vl53l0x_sample_t *sample)
+{
+    i2c_set_slave_address(vl53l0x_infos[idx].addr);
+    esp_err_t err = wait_data_ready(idx);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (!read_result_sample(sample)) {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t vl53l0x_read_range_continuous(vl53l0x_idx_t idx, uint16_t *range)
+{
+    vl53l0x_sample_t sample;
+    esp_err_t err = vl53l0x_read_sample(idx, &sample);
+    if (err != ESP_OK) {
+        return err;
     }
+    *range = sample_to_range(&sample);
+
+    return ESP_OK;
+}
+
+esp_err_t vl53l0x_stop_continuous(vl53l0x_idx_t idx)
+{
+    i2c_set_slave_address(vl53l0x_infos[idx].addr);
+    bool success = i2c_write_addr8_table(stop_continuous_seq, TABLE_SIZE(stop_continuous_seq));
+
+    return success ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t vl53l0x_reinit(vl53l0x_idx_t idx)
+{
+    /* Same path as vl53l0x_init for a single sensor, without the XSHUT
+     * cycle: the sensor keeps its address and the cached calibration is used */
+    if (!init_config(idx)) {
+        ESP_LOGE(TAG, "Fallo en la reinicializacion del sensor %d", idx);
+        LOG_MESSAGE_E(TAG,"Fallo en la reinicializacion del sensor");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
 
+esp_err_t vl53l0x_set_profile(vl53l0x_idx_t idx, vl53l0x_profile_t profile)
+{
+    if (profile >= VL53L0X_PROFILE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    i2c_set_slave_address(vl53l0x_infos[idx].addr);
+    if (!apply_profile(idx, profile)) {
+        ESP_LOGE(TAG, "Error applying ranging profile %d", profile);
+        LOG_MESSAGE_E(TAG,"Error applying ranging profile");
+        return ESP_FAIL;
+    }
+    active_profiles[idx] = profile;
     return ESP_OK;
 }
 
+vl53l0x_profile_t vl53l0x_get_profile(vl53l0x_idx_t idx)
+{
+    return active_profiles[idx];
+}
+
+uint32_t vl53l0x_get_timing_budget_us(void)
+{
+    uint32_t budget_us = 0;
+    for (vl53l0x_idx_t idx = VL53L0X_IDX_FIRST; idx < VL53L0X_IDX_COUNT; idx++) {
+        if (measurement_timing_budgets_us[idx] > budget_us) {
+            budget_us = measurement_timing_budgets_us[idx];
+        }
+    }
+    return budget_us ? budget_us : TIMING_BUDGET_DEFAULT_US;
+}
+
 esp_err_t vl53l0x_reset() {
 
     esp_err_t err;
@@ -777,6 +1622,9 @@ esp_err_t vl53l0x_reset() {
 
     vTaskDelay(pdMS_TO_TICKS(30)); // Esperar a que el sensor esté listo
 
+    /* After the reset the first sensor is back on the default address. The
+     * others are put in standby and readdressed by vl53l0x_init. */
+    i2c_set_slave_address(VL53L0X_DEFAULT_ADDRESS);
     if (device_is_booted()) {
         if( vl53l0x_init() ){
             return ESP_OK;
@@ -42,8 +42,34 @@ typedef enum
 #ifdef VL53L0X_THIRD
     VL53L0X_IDX_THIRD,
 #endif
+    VL53L0X_IDX_COUNT
 } vl53l0x_idx_t;
 
+/**
+ * One measurement together with the quality data reported by the sensor.
+ */
+typedef struct
+{
+    uint16_t range_mm;                 /* Measured range */
+    uint8_t range_status;              /* Device range status, 11 means valid */
+    uint16_t signal_rate_mcps_q7;      /* Return signal rate, fixed point 9.7 MCPS */
+    uint16_t ambient_rate_mcps_q7;     /* Ambient rate, fixed point 9.7 MCPS */
+    uint16_t effective_spad_count_q8;  /* Effective SPAD return count, fixed point 8.8 */
+    bool valid;                        /* The sensor reported the range as valid */
+} vl53l0x_sample_t;
+
+/**
+ * Ranging profiles, trading measurement time for accuracy or range.
+ */
+typedef enum
+{
+    VL53L0X_PROFILE_DEFAULT,        /* ~33 ms timing budget */
+    VL53L0X_PROFILE_HIGH_SPEED,     /* ~20 ms timing budget, less accurate */
+    VL53L0X_PROFILE_HIGH_ACCURACY,  /* ~200 ms timing budget */
+    VL53L0X_PROFILE_LONG_RANGE,     /* Longer VCSEL periods and lower signal rate limit */
+    VL53L0X_PROFILE_COUNT
+} vl53l0x_profile_t;
+
 /**
  * Initializes the sensors in the vl53l0x_idx_t enum.
  * @note Each sensor must have its XSHUT pin connected.
@@ -58,10 +84,116 @@ bool vl53l0x_init(void);
  * @return
  * - `ESP_OK`: If the distance was successfully read.
  * - `ESP_FAIL`: If the reading fails.
- * @note   Polling-based
+ * - `ESP_ERR_TIMEOUT`: If the measurement did not complete within the
+ *   timing budget plus a margin.
+ * @note   Blocks on the GPIO1 data-ready interrupt
  */
 esp_err_t vl53l0x_read_range_single(vl53l0x_idx_t idx, uint16_t *range);
 
+/**
+ * Starts a single measurement and returns without waiting for it. The
+ * sample is fetched with 'vl53l0x_read_sample', which blocks
+ * on the GPIO1 data-ready interrupt, so the caller decides exactly when
+ * each measurement starts.
+ * @param idx selects specific sensor
+ * @return
+ * - `ESP_OK`: If the measurement was started.
+ * - `ESP_FAIL`: If the start sequence fails.
+ */
+esp_err_t vl53l0x_start_single(vl53l0x_idx_t idx);
+
+/**
+ * Starts back-to-back (continuous) ranging. The stop variable sequence
+ * is written only once here, after that the sensor keeps measuring on
+ * its own and each sample only has to be fetched.
+ * @param idx selects specific sensor
+ * @return
+ * - `ESP_OK`: If continuous ranging was started.
+ * - `ESP_FAIL`: If the start sequence fails.
+ */
+esp_err_t vl53l0x_start_continuous(vl53l0x_idx_t idx);
+
+/**
+ * Reads the last range measured in continuous mode and clears the
+ * interrupt so the sensor can publish the next sample.
+ * @param idx selects specific sensor
+ * @param range contains the measured range or VL53L0X_OUT_OF_RANGE
+ *        if out of range.
+ * @return
+ * - `ESP_OK`: If the distance was successfully read.
+ * - `ESP_FAIL`: If the reading fails.
+ * - `ESP_ERR_TIMEOUT`: If no sample is ready within the timing budget plus
+ *   a margin.
+ * @note   Call 'vl53l0x_start_continuous' first. Blocks on the GPIO1
+ *         data-ready interrupt instead of polling the bus.
+ */
+esp_err_t vl53l0x_read_range_continuous(vl53l0x_idx_t idx, uint16_t *range);
+
+/**
+ * Reads the last sample measured, with its range status, signal rate,
+ * ambient rate and effective SPAD count, in a single burst read. Then
+ * clears the interrupt. Works in single-shot and in continuous mode.
+ * @param idx selects specific sensor
+ * @param sample filled with the measurement and its quality data
+ * @return
+ * - `ESP_OK`: If the sample was successfully read. Check 'sample->valid'.
+ * - `ESP_FAIL`: If the reading fails.
+ * - `ESP_ERR_TIMEOUT`: If no sample is ready within the timing budget plus
+ *   a margin.
+ * @note   Call 'vl53l0x_start_single' or 'vl53l0x_start_continuous' first.
+ */
+esp_err_t vl53l0x_read_sample(vl53l0x_idx_t idx, vl53l0x_sample_t *sample);
+
+/**
+ * Stops continuous ranging, leaving the sensor ready for single
+ * measurements again.
+ * @param idx selects specific sensor
+ * @return
+ * - `ESP_OK`: If ranging was stopped.
+ * - `ESP_FAIL`: If the stop sequence fails.
+ */
+esp_err_t vl53l0x_stop_continuous(vl53l0x_idx_t idx);
+
+/**
+ * Re-runs the init sequence of a single sensor without power cycling it.
+ * Cheaper than vl53l0x_reset, used to recover a sensor that stopped answering
+ * properly while it still holds its I2C address.
+ * @param idx selects specific sensor
+ * @return
+ * - `ESP_OK`: If the sensor was initialized again.
+ * - `ESP_FAIL`: If the init sequence fails.
+ * @note   Stop ranging before and call 'vl53l0x_start_continuous' after it.
+ */
+esp_err_t vl53l0x_reinit(vl53l0x_idx_t idx);
+
+/**
+ * Selects a ranging profile: programs the measurement timing budget, the
+ * pre/final range VCSEL periods and the final range signal rate limit.
+ * The profile is tracked per sensor and kept across 'vl53l0x_reset'. On
+ * failure the sensor may be partly programmed, apply its previous profile
+ * again to restore it.
+ * @param idx selects specific sensor
+ * @param profile profile to apply
+ * @return
+ * - `ESP_OK`: If the profile was applied.
+ * - `ESP_ERR_INVALID_ARG`: If the profile is not valid.
+ * - `ESP_FAIL`: If programming the sensor fails.
+ * @note   Ranging must be stopped while the profile is changed.
+ */
+esp_err_t vl53l0x_set_profile(vl53l0x_idx_t idx, vl53l0x_profile_t profile);
+
+/**
+ * Returns the ranging profile last applied to a sensor.
+ * @param idx selects specific sensor
+ */
+vl53l0x_profile_t vl53l0x_get_profile(vl53l0x_idx_t idx);
+
+/**
+ * Measurement timing budget of the active profile, in microseconds. If the
+ * sensors differ (a profile change failed on one of them) the longest one.
+ */
+uint32_t vl53l0x_get_timing_budget_us(void);
+
 /**
  * Restarts the VL53L0X sensor
  * @return
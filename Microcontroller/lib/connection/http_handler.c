@@ -8,25 +8,21 @@
  * instructions in JSON format, and execute corresponding actions based on the 
  * received data.
  * 
- * @note: This library is a patch for an error in the MQTT implementation  
- * that makes it impossible for us to receive instructions through it.  
- * It must be deprecated once it is fixed.  
+ * @note: Instructions are normally pushed via MQTT. This library is the  
+ * fallback used while the MQTT client is not connected to the broker.  
  * 
  * @date 2025-02-09
  */
 
 #include "http_handler.h"
-#include "frozen_json_helper.h"
 #include "esp_log.h"
 #include "esp_http_client.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include "instruction_buffer.h"
+#include "mqtt_handler.h"
 #include "debug_helper.h"
 
-#define INST_MAX_SIZE 20    // Maximum size of the instruction
-
 static const char *TAG = "HTTP_HANDLER";
 static const char *URL = "http://192.168.4.2:8080/instruction/last"; // Backend URL
 
@@ -110,44 +106,12 @@ esp_err_t getHTTPInstruction(void)
 /**
  * @brief Decodes the received instruction in JSON format and executes the corresponding action.
  *
- * This function extracts the instruction from the JSON-formatted string and converts it 
- * into a readable command. If the command is "REBOOT", it triggers a microcontroller reset.
- * If the command is "ABORT", it logs the action without executing it. Otherwise, the 
- * instruction is stored in a buffer for further processing.
+ * Same handling as the instructions received via MQTT, see `handleInstructionMessage`.
  *
  * @param length Length of the received instruction string.
- * @param str Instruction string in JSON format.
+ * @param str Instruction string in JSON format, not null-terminated.
  */
 static void decodeInstruction(int length, char *str)
 {
-    char msg[INST_MAX_SIZE] = "";
-    esp_err_t err = deserialize_json_data(str, msg, INST_MAX_SIZE);
-    if (err != ESP_OK)
-    {
-        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERORR DECODING JSON"));
-        LOG_MESSAGE_E(TAG, "ERORR DECODING JSON");
-
-    }
-    else
-    {
-        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "INST: %s", msg));
-        // Compare the received instruction with expected commands
-        if (strncmp(msg, "REBOOT", strlen("REBOOT")) == 0)
-        {
-            DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Reiniciando el MCU..."));
-            LOG_MESSAGE_W(TAG, "Reiniciando el MCU...");
-            esp_restart(); // Restart the microcontroller
-        }
-        else if (strncmp(msg, "ABORT", strlen("ABORT")) == 0)
-        {
-            DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Abortando..."));
-            LOG_MESSAGE_W(TAG, "Abortando...");
-            //ABORT IS STILL IN DEVELOPMENT
-        }
-        else
-        {
-            // Save the instruction in a buffer for further processing
-            saveInstruction(msg);
-        }
-    }
-}
\ No newline at end of file
+    handleInstructionMessage(str, length);
+}
@@ -0,0 +1,131 @@
+/**
+ * @file mapping_wire.c
+ * @brief Implementation of the packed binary encoding of the mapping data.
+ *
+ * The encoder writes straight into the caller's buffer, it does not allocate
+ * and never formats numbers as text. See mapping_wire.h for the layout.
+ *
+ * @version 1.0
+ * @date 2025-03-18
+ */
+
+#include "mapping_wire.h"
+#include <stdbool.h>
+
+/* Output cursor, overflow is sticky so the callers only check at the end */
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} wire_writer_t;
+
+static void put_byte(wire_writer_t *w, uint8_t value)
+{
+    if (w->len >= w->size)
+    {
+        w->overflow = true;
+        return;
+    }
+    w->buf[w->len++] = value;
+}
+
+/* Unsigned LEB128: 7 bits per byte, bit 7 set while more bytes follow */
+static void put_varint(wire_writer_t *w, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        put_byte(w, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    put_byte(w, (uint8_t)value);
+}
+
+/* Zigzag maps small negative deltas to small unsigned values (-1 -> 1, 1 -> 2) */
+static void put_svarint(wire_writer_t *w, int32_t value)
+{
+    put_varint(w, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+static void put_header(wire_writer_t *w, mapping_wire_type_t type, uint8_t flags, uint32_t seq)
+{
+    put_byte(w, MAPPING_WIRE_MAGIC);
+    put_byte(w, MAPPING_WIRE_VERSION);
+    put_byte(w, (uint8_t)type);
+    put_byte(w, flags);
+    for (int i = 0; i < 4; i++)
+    {
+        put_byte(w, (uint8_t)(seq >> (8 * i)));
+    }
+}
+
+static uint64_t to_ms(int64_t time_us)
+{
+    return time_us > 0 ? (uint64_t)(time_us / 1000) : 0;
+}
+
+size_t mapping_wire_encode_samples(uint8_t *buf, size_t size, uint32_t seq,
+                                   const mapping_value_t *samples, uint16_t count)
+{
+    wire_writer_t w = {.buf = buf, .size = size};
+    put_header(&w, MAPPING_WIRE_SAMPLES, 0, seq);
+    put_varint(&w, count);
+
+    uint64_t prev_ms = count > 0 ? to_ms(samples[0].timestamp_us) : 0;
+    int32_t prev_angle = 0;
+    int32_t prev_distance = 0;
+    put_varint(&w, prev_ms);
+
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint64_t ms = to_ms(samples[i].timestamp_us);
+        put_svarint(&w, samples[i].angle - prev_angle);
+        put_svarint(&w, samples[i].distance - prev_distance);
+        put_varint(&w, ms >= prev_ms ? ms - prev_ms : 0);
+        prev_angle = samples[i].angle;
+        prev_distance = samples[i].distance;
+        prev_ms = ms;
+    }
+    return w.overflow ? 0 : w.len;
+}
+
+size_t mapping_wire_encode_frame(uint8_t *buf, size_t size, uint32_t seq, const scan_frame_t *frame)
+{
+    wire_writer_t w = {.buf = buf, .size = size};
+    uint16_t bins = 0;
+    for (int i = 0; i < SCAN_FRAME_BINS; i++)
+    {
+        if (frame->bins[i].count > 0)
+        {
+            bins++;
+        }
+    }
+
+    uint64_t start_ms = to_ms(frame->start_us);
+    uint64_t end_ms = to_ms(frame->end_us);
+    put_header(&w, MAPPING_WIRE_FRAME, frame->clockwise ? MAPPING_WIRE_FLAG_CLOCKWISE : 0, seq);
+    put_varint(&w, frame->sweep_id);
+    put_varint(&w, start_ms);
+    put_varint(&w, end_ms >= start_ms ? end_ms - start_ms : 0);
+    put_varint(&w, frame->samples);
+    put_varint(&w, bins);
+
+    int32_t prev_angle = 0;
+    int32_t prev_distance = 0;
+    for (int i = 0; i < SCAN_FRAME_BINS; i++)
+    {
+        const scan_bin_t *bin = &frame->bins[i];
+        if (bin->count == 0)
+        {
+            continue;
+        }
+        int32_t angle = i * 360 / SCAN_FRAME_BINS;
+        put_varint(&w, (uint32_t)(angle - prev_angle));
+        put_svarint(&w, bin->distance - prev_distance);
+        put_varint(&w, bin->count);
+        prev_angle = angle;
+        prev_distance = bin->distance;
+    }
+    return w.overflow ? 0 : w.len;
+}
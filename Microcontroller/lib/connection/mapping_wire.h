@@ -0,0 +1,82 @@
+/**
+ * @file mapping_wire.h
+ * @brief Packed binary encoding of the mapping data published via MQTT.
+ *
+ * Replaces the per-sample JSON messages on the "MappingBin" topic. Every
+ * message starts with a fixed header followed by a body that depends on its
+ * type. Multi-byte header fields are little endian, the body uses LEB128
+ * varints and zigzag coded deltas, so a typical sample takes 3-4 bytes.
+ *
+ * Header (MAPPING_WIRE_HEADER_SIZE bytes):
+ * | offset | size | field                                      |
+ * |--------|------|--------------------------------------------|
+ * | 0      | 1    | magic, MAPPING_WIRE_MAGIC                  |
+ * | 1      | 1    | version, MAPPING_WIRE_VERSION              |
+ * | 2      | 1    | type, mapping_wire_type_t                  |
+ * | 3      | 1    | flags (frame: bit 0 clockwise)             |
+ * | 4      | 4    | sequence number, +1 per message            |
+ *
+ * Samples body: count, time of the first sample in ms since boot, then per
+ * sample zigzag(angle - previous angle), zigzag(distance - previous distance)
+ * and the ms elapsed since the previous sample. The first sample is
+ * delta coded against 0.
+ *
+ * Frame body: sweep id, start in ms since boot, duration in ms, samples in the
+ * sweep, count of non-empty bins, then per bin the angle step from the
+ * previous bin (the first one from 0), zigzag(distance - previous distance)
+ * and the samples averaged in the bin.
+ *
+ * @version 1.0
+ * @date 2025-03-18
+ *
+ * @note
+ * - Any change of the layout must bump MAPPING_WIRE_VERSION, the backend
+ *   drops messages with a version it does not know.
+ */
+
+#ifndef _MAPPING_WIRE_H_
+#define _MAPPING_WIRE_H_
+
+#include "mapping.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAPPING_WIRE_MAGIC 0xC7         // First byte of every message
+#define MAPPING_WIRE_VERSION 1          // Layout version
+#define MAPPING_WIRE_HEADER_SIZE 8      // Fixed header length
+#define MAPPING_WIRE_FLAG_CLOCKWISE 0x01
+
+/**
+ * @brief Message types.
+ */
+typedef enum
+{
+    MAPPING_WIRE_SAMPLES = 1,   ///< Batch of individual samples
+    MAPPING_WIRE_FRAME = 2      ///< Scan frame of one servo sweep
+} mapping_wire_type_t;
+
+/**
+ * @brief Encodes a batch of samples.
+ *
+ * @param[out] buf Output buffer.
+ * @param[in] size Size of the output buffer.
+ * @param[in] seq Sequence number of the message.
+ * @param[in] samples Samples in acquisition order.
+ * @param[in] count Number of samples.
+ * @return Length of the message, 0 if it does not fit in the buffer.
+ */
+size_t mapping_wire_encode_samples(uint8_t *buf, size_t size, uint32_t seq,
+                                   const mapping_value_t *samples, uint16_t count);
+
+/**
+ * @brief Encodes a scan frame, only the bins with samples are included.
+ *
+ * @param[out] buf Output buffer.
+ * @param[in] size Size of the output buffer.
+ * @param[in] seq Sequence number of the message.
+ * @param[in] frame Completed frame.
+ * @return Length of the message, 0 if it does not fit in the buffer.
+ */
+size_t mapping_wire_encode_frame(uint8_t *buf, size_t size, uint32_t seq, const scan_frame_t *frame);
+
+#endif // _MAPPING_WIRE_H_
@@ -9,7 +9,9 @@
  * mapping data (distance and angle), and any other MQTT-related operations.
  *
  * The functions implemented here are designed for:
- * - Sending JSON-encoded messages via MQTT.
+ * - Sending JSON-encoded messages via MQTT. The JSON is written with the
+ *   streaming encoder of json_writer.h into fixed buffers, nothing is
+ *   allocated per message.
  * - Handling control messages and mapping data.
  * - Interfacing with other modules through structured JSON payloads.
  *
@@ -23,35 +25,155 @@
 #include "esp_log.h"
 #include "instruction_buffer.h"
 #include "frozen_json_helper.h"
+#include "json_writer.h"
+#include "mapping_wire.h"
+#include "esp_system.h"
 #include "debug_helper.h"
+#include "servo.h"
 
 // Definitions
-#define INSTRUCTIONS_BUFFER_SIZE 10       // Maximum number of instructions to store in buffer
 #define INSTRUCTION_MESSAGE "Instruction" // Instruction Topic
 #define CONTROL_MESSAGE "Messages"        // Message Topic
 #define MAPPING_VALUE "Mapping"           // Mapping Value Topic
 #define BATTERY_VALUE "Battery"           // Battery Level Topic
+#define SCAN_FRAME "Scan"                 // Scan Frame Topic
+#define MAPPING_WIRE "MappingBin"         // Packed mapping data Topic
+#define CONTROL_MESSAGE_SIZE 192         // Tag, type and message text
+#define MAPPING_VALUE_SIZE 40             // {"distance":65535,"angle":-32768}
+#define BATTERY_VALUE_SIZE 16             // {"level":255}
+#define SCAN_FRAME_BUFFER_SIZE 6144       // Worst case: every bin as [359,65534,255]
+#define WIRE_FRAME_BUFFER_SIZE 2560       // Worst case: 7 bytes per bin plus header
+#define WIRE_SAMPLES_BUFFER_SIZE 576      // Worst case: 16 bytes per sample plus header
+
+/* Uncomment to publish the mapping data as JSON on the "Mapping" and "Scan"
+ * topics instead of the packed format, easier to read with a plain MQTT client */
+// #define MAPPING_JSON_DEBUG
 
 // Const
 static const char *TAG = "MQTT_HANDLER"; // Library Tag
 
+// Sequence number of the packed messages, lets the backend detect losses
+static uint32_t wire_sequence = 0;
+
 // Function Prototypes
 static esp_err_t sendControlMessage(const char *, char *, const char *);
+#ifdef MAPPING_JSON_DEBUG
+static esp_err_t sendScanFrameJson(const scan_frame_t *);
+#else
+static esp_err_t publishWire(const uint8_t *, size_t);
+#endif
 
 /**
  * @brief Get the Instruction Message
  *
  * This function get instruction from instruction buffer in instruction_buffer library.
  *
- * @param[out] msg Instruction
+ * @param[out] inst Next instruction to execute
+ * @param[in] timeout_ms Maximum time to wait
  * @return
  *      - ESP_OK on success
- *      - ESP_FAIL on fail
+ *      - ESP_ERR_NOT_FOUND if no instruction arrived in time
+ *      - ESP_ERR_INVALID_STATE if the buffer was not initialized
  */
-esp_err_t getInstructionMessage(char *msg)
+esp_err_t getInstructionMessage(instruction_t *inst, uint32_t timeout_ms)
 {
 
-    return getInstruction(msg);
+    return getInstruction(inst, timeout_ms);
+}
+
+/**
+ * @brief Decodes an instruction message and queues it for execution.
+ *
+ * The instruction name is located in place inside the message and mapped
+ * straight to its opcode, nothing is copied or allocated. If the command is
+ * "REBOOT", it triggers a microcontroller reset. If the command is "ABORT", it
+ * logs the action without executing it. Otherwise, the opcode is stored in the
+ * instruction buffer for further processing, with the optional "argument"
+ * integer of the message (0 if absent).
+ *
+ * @param[in] data Instruction in JSON format, not null-terminated
+ * @param[in] length Length of the message
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_SUPPORTED if the instruction is unknown
+ *      - ESP_FAIL if the message can not be decoded or the buffer is full
+ */
+esp_err_t handleInstructionMessage(const char *data, size_t length)
+{
+    const char *name = NULL;
+    size_t name_len = 0;
+    esp_err_t err = json_find_string(data, length, ".instruction", &name, &name_len);
+    if (err != ESP_OK)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERORR DECODING JSON"));
+        LOG_MESSAGE_E(TAG, "ERORR DECODING JSON");
+        return ESP_FAIL;
+    }
+
+    instruction_opcode_t opcode = instruction_lookup(name, name_len);
+    DEBUGING_ESP_LOG(ESP_LOGW(TAG, "INST: %.*s", (int)name_len, name));
+
+    int32_t argument = 0;
+    if (json_find_int(data, length, ".argument", &argument) == ESP_ERR_INVALID_ARG)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "INVALID ARGUMENT"));
+        LOG_MESSAGE_E(TAG, "INVALID ARGUMENT");
+        return ESP_FAIL;
+    }
+    if (opcode == INST_SCAN_SECTOR)
+    {
+        // {"instruction":"ScanSector","start":90,"end":270}, sin ángulos barre todo el rango
+        int32_t start = 0, end = 0;
+        if (json_find_int(data, length, ".start", &start) == ESP_ERR_INVALID_ARG ||
+            json_find_int(data, length, ".end", &end) == ESP_ERR_INVALID_ARG ||
+            !servo_sector_valid(start, end))
+        {
+            DEBUGING_ESP_LOG(ESP_LOGE(TAG, "INVALID SECTOR"));
+            LOG_MESSAGE_E(TAG, "INVALID SECTOR");
+            return ESP_FAIL;
+        }
+        argument = INSTRUCTION_SECTOR_ARG(start, end);
+    }
+    switch (opcode)
+    {
+    case INST_UNKNOWN:
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Unknown instruction: %.*s", (int)name_len, name));
+        LOG_MESSAGE_W(TAG, "Unknown instruction");
+        return ESP_ERR_NOT_SUPPORTED;
+    case INST_REBOOT:
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Reiniciando el MCU..."));
+        LOG_MESSAGE_W(TAG, "Reiniciando el MCU...");
+        esp_restart(); // Restart the microcontroller
+        return ESP_OK;
+    case INST_ABORT:
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Abortando..."));
+        LOG_MESSAGE_W(TAG, "Abortando...");
+        //ABORT IS STILL IN DEVELOPMENT
+        return ESP_OK;
+    default:
+        // Save the instruction in a buffer for further processing
+        return saveInstruction(opcode, argument);
+    }
+}
+
+/**
+ * @brief Waits for an instruction pushed by the backend via MQTT and handles it.
+ *
+ * @param[in] timeout_ms Maximum time to wait
+ * @return
+ *      - ESP_OK if an instruction was handled
+ *      - ESP_ERR_TIMEOUT if none arrived in time
+ *      - Any error of `handleInstructionMessage`
+ */
+esp_err_t receiveInstructionMessage(uint32_t timeout_ms)
+{
+    static mqtt_instruction_msg_t msg;
+    esp_err_t err = mqtt_receive_instruction(&msg, timeout_ms);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    return handleInstructionMessage(msg.data, msg.len);
 }
 
 /**
@@ -77,54 +199,42 @@ esp_err_t getInstructionMessage(char *msg)
  * @param[in] msg Message to send
  * @return
  *      - ESP_OK: If the message was successfully created and sent.
- *      - ESP_FAIL: If there was an error creating the JSON or sending the message.
+ *      - ESP_ERR_INVALID_SIZE: If the JSON does not fit in the buffer.
+ *      - ESP_FAIL: If there was an error sending the message.
  *
  * @note This function relies on the following functions:
- *      - `create_json_data`: Creates the JSON structure.
+ *      - `json_writer_*`: Writes the JSON into a stack buffer.
  *      - `print_json_data`: Logs the JSON for debugging.
  *      - `mqtt_publish`: Publishes the message via MQTT.
  *
- * @warning Ensure that `ESP_TAG`, `msg_type`, and `msg` are valid non-null
- *          strings to avoid undefined behavior.
+ * @warning Messages longer than CONTROL_MESSAGE_SIZE allows are not sent,
+ *          ESP_ERR_INVALID_SIZE is returned.
  *
  */
 static esp_err_t sendControlMessage(const char *ESP_TAG, char *msg_type, const char *msg)
 {
-    const char *values[3];
-    char TAG_buffer[20], type_buffer[8], msg_buffer[50];
-    snprintf(TAG_buffer, sizeof(TAG_buffer), "%s", ESP_TAG);
-    snprintf(type_buffer, sizeof(type_buffer), "%s", msg_type);
-    snprintf(msg_buffer, sizeof(msg_buffer), "%s", msg);
-    values[0] = TAG_buffer;
-    values[1] = type_buffer;
-    values[2] = msg_buffer;
-    const char *key[3] = {"tag", "type", "message"};
-    char *json = NULL;
-
-    esp_err_t err = create_json_data(&json, key, values, 3);
-
+    char json[CONTROL_MESSAGE_SIZE];
+    json_writer_t writer;
+    json_writer_init(&writer, json, sizeof(json));
+    json_writer_string(&writer, "tag", ESP_TAG);
+    json_writer_string(&writer, "type", msg_type);
+    json_writer_string(&writer, "message", msg);
+
+    esp_err_t err = json_writer_finish(&writer);
     if (err != ESP_OK)
     {
-        if(json) free(json);
-        
         DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error creating json data: %s", esp_err_to_name(err)));
         return err;
     }
-    else
-    {
-        print_json_data(json);
-    }
+    print_json_data(json);
 
     err = mqtt_publish(CONTROL_MESSAGE, json);
     if (err != ESP_OK)
     {
         DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error publishing Control Message: %s", esp_err_to_name(err)));
-        free(json);
         return err;
     }
 
-    free(json);
-
     return ESP_OK;
 }
 
@@ -201,8 +311,8 @@ esp_err_t sendErrorMessage( const char *TAG, const char *msg)
  *
  * The JSON structure is as follows:
  * {
- *   "distance": "<distance>",
- *   "angle": "<angle>"
+ *   "distance": <distance>,
+ *   "angle": <angle>
  * }
  *
  * @param[in] distance The distance value to include in the mapping data.
@@ -213,84 +323,198 @@ esp_err_t sendErrorMessage( const char *TAG, const char *msg)
  *      - ESP_FAIL: If there was an error creating or sending the JSON payload.
  *
  * @note This function relies on the following:
- *      - `create_json_data`: Creates the JSON structure.
+ *      - `json_writer_*`: Writes the JSON into a stack buffer.
  *      - `print_json_data`: Logs the JSON for debugging.
  *      - `mqtt_publish`: Publishes the JSON payload via MQTT.
- *
- * @warning Ensure the `distance` and `angle` parameters are valid values.
- *          The function converts them to strings with a maximum buffer size
- *          of 6 characters.
  */
 
 esp_err_t sendMappingValue(uint16_t distance, int16_t angle)
 {
-    const char *values[2];
-    char buffer1[6], buffer2[7];
-    snprintf(buffer1, sizeof(buffer1), "%d", distance);
-    snprintf(buffer2, sizeof(buffer2), "%i", angle);
-    values[0] = buffer1;
-    values[1] = buffer2;
-    const char *keys[2] = {"distance", "angle"};
-    char *json = NULL;
-
-    esp_err_t err = create_json_data(&json, keys, values, 2);
+    char json[MAPPING_VALUE_SIZE];
+    json_writer_t writer;
+    json_writer_init(&writer, json, sizeof(json));
+    json_writer_uint(&writer, "distance", distance);
+    json_writer_int(&writer, "angle", angle);
 
+    esp_err_t err = json_writer_finish(&writer);
     if (err != ESP_OK)
     {
         DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error creating json data: %s", esp_err_to_name(err)));
         return err;
     }
-    else 
-    {
-        print_json_data(json);
-    }
+    print_json_data(json);
 
     err = mqtt_publish(MAPPING_VALUE, json);
     if (err != ESP_OK)
     {
         DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error publishing Control Message: %s", esp_err_to_name(err)));
-        free(json);
         return err;
     }
 
-    free(json);
-
     return ESP_OK;
 }
 
-esp_err_t sendBatteryLevel(uint8_t batteryLevel)
+/**
+ * @brief Sends a batch of mapping samples.
+ *
+ * Encodes the samples as one packed message on the "MappingBin" topic, or,
+ * with MAPPING_JSON_DEBUG, sends each one with `sendMappingValue`.
+ *
+ * @param[in] samples Samples in acquisition order
+ * @param[in] count Number of samples, at most MAPPING_SAMPLES_PER_MESSAGE
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if the batch does not fit in the buffer
+ *      - ESP_FAIL on failure
+ */
+esp_err_t sendMappingSamples(const mapping_value_t *samples, uint16_t count)
 {
-    const char *values[1];                                
-    char buffer[6];                                       
-    snprintf(buffer, sizeof(buffer), "%d", batteryLevel); 
-    values[0] = buffer;                                   
+#ifdef MAPPING_JSON_DEBUG
+    esp_err_t ret = ESP_OK;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        esp_err_t err = sendMappingValue(samples[i].distance, samples[i].angle);
+        if (err != ESP_OK)
+        {
+            ret = err;
+        }
+    }
+    return ret;
+#else
+    static uint8_t buffer[WIRE_SAMPLES_BUFFER_SIZE];
+    if (count > MAPPING_SAMPLES_PER_MESSAGE)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t len = mapping_wire_encode_samples(buffer, sizeof(buffer), wire_sequence, samples, count);
+    if (len == 0)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return publishWire(buffer, len);
+#endif
+}
+
+/**
+ * @brief Sends a scan frame.
+ *
+ * Encodes the frame as one packed message on the "MappingBin" topic, or,
+ * with MAPPING_JSON_DEBUG, as JSON on the "Scan" topic. The message is
+ * written into a static buffer, so no memory is allocated per frame.
+ * Only the publisher task sends frames.
+ *
+ * @param[in] frame Completed frame
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if the message does not fit in the buffer
+ *      - ESP_FAIL on failure
+ */
+esp_err_t sendScanFrame(const scan_frame_t *frame)
+{
+#ifdef MAPPING_JSON_DEBUG
+    return sendScanFrameJson(frame);
+#else
+    static uint8_t buffer[WIRE_FRAME_BUFFER_SIZE];
+    size_t len = mapping_wire_encode_frame(buffer, sizeof(buffer), wire_sequence, frame);
+    if (len == 0)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return publishWire(buffer, len);
+#endif
+}
+
+#ifndef MAPPING_JSON_DEBUG
+/**
+ * @brief Publishes a packed message and advances the sequence number.
+ *
+ * The number advances even if publishing fails, so the backend sees the gap.
+ */
+static esp_err_t publishWire(const uint8_t *data, size_t len)
+{
+    wire_sequence++;
+    esp_err_t err = mqtt_publish_binary(MAPPING_WIRE, data, len);
+    if (err != ESP_OK)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error publishing mapping data: %s", esp_err_to_name(err)));
+        return err;
+    }
+    return ESP_OK;
+}
+#else
+/**
+ * @brief Sends a scan frame as a JSON payload (debug mode).
+ *
+ * @param[in] frame Completed frame
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if the message does not fit in the buffer
+ *      - ESP_FAIL on failure
+ */
+static esp_err_t sendScanFrameJson(const scan_frame_t *frame)
+{
+    static char json[SCAN_FRAME_BUFFER_SIZE];
+    json_writer_t writer;
+    json_writer_init(&writer, json, sizeof(json));
+    json_writer_uint(&writer, "sweep", frame->sweep_id);
+    json_writer_bool(&writer, "clockwise", frame->clockwise);
+    json_writer_int(&writer, "start", frame->start_us);
+    json_writer_int(&writer, "end", frame->end_us);
+    json_writer_uint(&writer, "samples", frame->samples);
+    json_writer_begin_array(&writer, "bins");
+    for (int i = 0; i < SCAN_FRAME_BINS; i++)
+    {
+        const scan_bin_t *bin = &frame->bins[i];
+        if (bin->count == 0)
+        {
+            continue;
+        }
+        json_writer_begin_array(&writer, NULL);
+        json_writer_int(&writer, NULL, i * 360 / SCAN_FRAME_BINS);
+        json_writer_uint(&writer, NULL, bin->distance);
+        json_writer_uint(&writer, NULL, bin->count);
+        json_writer_end_array(&writer);
+    }
+    json_writer_end_array(&writer);
+    if (json_writer_finish(&writer) != ESP_OK)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
 
-    const char *keys[1] = {"level"};
-    char *json = NULL;
+    esp_err_t err = mqtt_publish(SCAN_FRAME, json);
+    if (err != ESP_OK)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error publishing scan frame: %s", esp_err_to_name(err)));
+        return err;
+    }
+    return ESP_OK;
+}
+#endif
 
-    
-    esp_err_t err = create_json_data(&json, keys, values, 1);
-    print_json_data(json); 
+esp_err_t sendBatteryLevel(uint8_t batteryLevel)
+{
+    char json[BATTERY_VALUE_SIZE];
+    json_writer_t writer;
+    json_writer_init(&writer, json, sizeof(json));
+    json_writer_uint(&writer, "level", batteryLevel);
 
+    esp_err_t err = json_writer_finish(&writer);
     if (err != ESP_OK)
     {
         DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error creating json data: %s", esp_err_to_name(err)));
-        free(json);
         return err;
     }
+    print_json_data(json);
 
     err = mqtt_publish(BATTERY_VALUE, json);
     if (err != ESP_OK)
     {
         DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error publishing control message: %s", esp_err_to_name(err)));
-        free(json);
         return err;
     }
 
     DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Battery level published"));
 
-    free(json);
-
     return ESP_OK;
 }
 
@@ -17,6 +17,10 @@
  #define _MQTT_HANDLER_H_
  
  #include "esp_err.h"
+ #include "mapping.h"
+ #include "instruction_buffer.h"
+ 
+ #define MAPPING_SAMPLES_PER_MESSAGE 32 // Largest batch accepted by sendMappingSamples
  
  /**
   * @brief Retrieve an instruction message via MQTT
@@ -24,12 +28,43 @@
   * This function retrieves an instruction to execute and stores it in the 
   * provided `inst` parameter by reference.
   * 
-  * @param[out] inst Pointer to a buffer where the instruction will be stored
+  * @param[out] inst Next instruction to execute
+  * @param[in] timeout_ms Maximum time to wait, INSTRUCTION_WAIT_FOREVER to wait without limit
+  * @return
+  *      - ESP_OK on success
+  *      - ESP_ERR_NOT_FOUND if no instruction arrived in time
+  *      - ESP_ERR_INVALID_STATE if the buffer was not initialized
+  */
+ esp_err_t getInstructionMessage(instruction_t *inst, uint32_t timeout_ms);
+ 
+ /**
+  * @brief Decode an instruction message and queue it for execution
+  * 
+  * Shared by the MQTT and HTTP receive paths. REBOOT and ABORT are handled 
+  * right away, every other instruction goes to the instruction buffer.
+  * 
+  * @param[in] data Instruction in JSON format, not null-terminated
+  * @param[in] length Length of the message
   * @return
   *      - ESP_OK on success
+  *      - ESP_ERR_NOT_SUPPORTED if the instruction is unknown
   *      - ESP_FAIL on failure
   */
- esp_err_t getInstructionMessage(char *inst);
+ esp_err_t handleInstructionMessage(const char *data, size_t length);
+ 
+ /**
+  * @brief Wait for an instruction pushed via MQTT and handle it
+  * 
+  * Blocks until the backend publishes on the "Instruction" topic or the 
+  * timeout expires.
+  * 
+  * @param[in] timeout_ms Maximum time to wait in milliseconds
+  * @return
+  *      - ESP_OK if an instruction was handled
+  *      - ESP_ERR_TIMEOUT if none arrived in time
+  *      - ESP_FAIL on failure
+  */
+ esp_err_t receiveInstructionMessage(uint32_t timeout_ms);
  
  /**
   * @brief Send a mapping value (distance and angle) via MQTT
@@ -45,6 +80,38 @@
   */
  esp_err_t sendMappingValue(uint16_t distance, int16_t angle);
  
+ /**
+  * @brief Send a batch of mapping samples via MQTT
+  * 
+  * Publishes the samples as a single packed message on the "MappingBin" 
+  * topic (see mapping_wire.h). With MAPPING_JSON_DEBUG each sample is sent 
+  * on its own as JSON on the "Mapping" topic.
+  * 
+  * @param[in] samples Samples in acquisition order
+  * @param[in] count Number of samples, at most MAPPING_SAMPLES_PER_MESSAGE
+  * @return 
+  *      - ESP_OK on success
+  *      - ESP_ERR_INVALID_SIZE if the batch is too large
+  *      - ESP_FAIL on failure
+  */
+ esp_err_t sendMappingSamples(const mapping_value_t *samples, uint16_t count);
+ 
+ /**
+  * @brief Send a completed scan frame via MQTT
+  * 
+  * Publishes the frame of one servo sweep as a single packed message on the
+  * "MappingBin" topic (see mapping_wire.h). With MAPPING_JSON_DEBUG it is
+  * sent as JSON on the "Scan" topic instead. Only the bins with samples are
+  * sent, each one as angle, distance and count.
+  * 
+  * @param[in] frame Completed frame, not modified
+  * @return 
+  *      - ESP_OK on success
+  *      - ESP_ERR_INVALID_SIZE if the frame does not fit in the message buffer
+  *      - ESP_FAIL on failure
+  */
+ esp_err_t sendScanFrame(const scan_frame_t *frame);
+ 
  /**
   * @brief Send the battery charge percentage via MQTT
   * 
@@ -7,10 +7,10 @@
  * including connecting to an MQTT broker, publishing messages, subscribing to topics,
  * handling MQTT events, and managing received instructions.
  *
- * WARNING: The receive instructions function is not currently working, 
- * due to a conflict in the way we implemented it with FreeRTOS.
- * It should be checked and correct to MQTT be fully implemented. 
- * Meanwhile the http_handler library manages the receive instruction.
+ * Received instructions are only copied into a FreeRTOS queue by the event
+ * handler, which runs in the MQTT client task. Decoding and executing them is
+ * left to the instruction task (see `mqtt_receive_instruction`), so the client
+ * task never blocks, allocates or parses.
  *
  * @note Ensure the MQTT broker is reachable and configured properly in `URL`.
  *
@@ -23,24 +23,30 @@
 #include "mqtt_client.h"
 #include "instruction_buffer.h"
 #include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "debug_helper.h"
+#include <string.h>
 
 // Constants and Global Variables
-#define NUM_TOPICS 5 ///< Number of topics to subscribe to
+#define NUM_TOPICS 1                ///< Number of topics to subscribe to
+#define INSTRUCTION_TOPIC "Instruction"
+#define INSTRUCTION_QUEUE_LENGTH 8  ///< Received instructions waiting to be processed
 
 static const char *TAG = "MQTT_SERVER";                                          ///< Log tag for MQTT Server
 static const char *URL = "mqtt://192.168.4.2:1883";                              ///< MQTT broker URL
 static esp_mqtt_client_handle_t mqtt_client = NULL;                              ///< Handle for MQTT client
-static const char *TOPICS[] = {"Instruction", "Messages", "Mapping", "Battery", "Barrier"}; ///< Topics to subscribe to
-static char inst[40] = {0};                                                      ///< Buffer for instructions
-static uint32_t MQTT_CONNEECTED = 0;                                             ///< MQTT connection status
+static const char *TOPICS[] = {INSTRUCTION_TOPIC};                               ///< Topics to subscribe to, only the ones sent by the backend
+static QueueHandle_t instruction_queue = NULL;                                   ///< Instructions received, consumed by the instruction task
+static uint32_t dropped_instructions = 0;                                        ///< Instructions discarded (queue full or too long)
+static volatile uint32_t MQTT_CONNEECTED = 0;                                    ///< MQTT connection status
 
 // Function Prototypes
 static esp_err_t mqtt_connect(void);
 static esp_err_t mqtt_subscribe(const char *);
 static void mqtt_event_handler(void *, esp_event_base_t, int32_t, void *);
 static void mqtt_subscribing(void);
-static void instruction_handler(char *, size_t length);
+static void instruction_handler(esp_mqtt_event_handle_t);
 
 /**
  * @brief Initializes and starts the MQTT client
@@ -62,6 +68,16 @@ esp_err_t mqtt_start()
         return ESP_FAIL;
     }
 
+    if (instruction_queue == NULL)
+    {
+        instruction_queue = xQueueCreate(INSTRUCTION_QUEUE_LENGTH, sizeof(mqtt_instruction_msg_t));
+        if (instruction_queue == NULL)
+        {
+            DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error creating instruction queue"));
+            return ESP_FAIL;
+        }
+    }
+
     err = mqtt_connect();
     uint8_t retry_count = 0;
     const uint8_t max_retries = 5;
@@ -138,7 +154,8 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     case MQTT_EVENT_CONNECTED:
         DEBUGING_ESP_LOG(ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED"));
         MQTT_CONNEECTED = 1;
-        //mqtt_subscribing();
+        // Clean session: the subscription has to be renewed on every connection
+        mqtt_subscribing();
         break;
     case MQTT_EVENT_DISCONNECTED:
         DEBUGING_ESP_LOG(ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED"));
@@ -155,18 +172,16 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         DEBUGING_ESP_LOG(ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id));
         break;
     case MQTT_EVENT_DATA:
-        DEBUGING_ESP_LOG(ESP_LOGI(TAG, "MQTT_EVENT_DATA - %s",event->topic));
-        //Here should go the code to amnage the receive instruction
-        /*if (strncmp(event->topic, "Instruction", event->topic_len) == 0)
+        DEBUGING_ESP_LOG(ESP_LOGI(TAG, "MQTT_EVENT_DATA - %.*s", event->topic_len, event->topic));
+        if (event->topic_len == strlen(INSTRUCTION_TOPIC) &&
+            strncmp(event->topic, INSTRUCTION_TOPIC, event->topic_len) == 0)
         {
-            ESP_LOGI(TAG, "Instruction received");
-
-            instruction_handler(event->data, event->data_len);
+            instruction_handler(event);
         }
         else
         {
-            ESP_LOGW(TAG, "ERROR: Message received from an unexpected Topic(%s)", event->topic);
-        }*/
+            DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Message received from an unexpected Topic(%.*s)", event->topic_len, event->topic));
+        }
         break;
     case MQTT_EVENT_ERROR:
         DEBUGING_ESP_LOG(ESP_LOGI(TAG, "MQTT_EVENT_ERROR %s", event->data));
@@ -231,6 +246,39 @@ esp_err_t mqtt_publish(const char *topic, const char *payload)
     return ESP_OK;
 }
 
+/**
+ * @brief Publishes a binary message to an MQTT topic.
+ *
+ * Uses the same QoS and retain settings as `mqtt_publish`. The client copies
+ * the payload into its outbox, so the buffer can be reused on return.
+ *
+ * @param[in] topic The topic to which the message should be published.
+ * @param[in] data The message to publish.
+ * @param[in] len Length of the message in bytes.
+ *
+ * @return
+ *      - ESP_OK: If the message was published successfully.
+ *      - ESP_FAIL: If the MQTT client is not initialized or an error occurs during publishing.
+ */
+esp_err_t mqtt_publish_binary(const char *topic, const uint8_t *data, size_t len)
+{
+    if (mqtt_client == NULL)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "MQTT client not initialized"));
+        return ESP_FAIL;
+    }
+
+    int msg_id = esp_mqtt_client_publish(mqtt_client, topic, (const char *)data, (int)len, 1, 0);
+    if (msg_id == -1)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Failed to publish message to topic %s", topic));
+        return ESP_FAIL;
+    }
+
+    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Published %u bytes to topic %s", (unsigned)len, topic));
+    return ESP_OK;
+}
+
 /**
  * @brief Subscribes to a specific MQTT topic.
  *
@@ -287,6 +335,7 @@ esp_err_t mqtt_disconnect()
     }
 
     mqtt_client = NULL; // Limpiar el puntero del cliente
+    MQTT_CONNEECTED = 0;
     DEBUGING_ESP_LOG(ESP_LOGI(TAG, "MQTT client disconnected"));
     return ESP_OK;
 }
@@ -294,51 +343,72 @@ esp_err_t mqtt_disconnect()
 /**
  * @brief Handles received instruction messages
  *
- * Processes messages received on the "Instruction" topic, deserializing JSON data and
- * executing actions based on the instruction content (e.g., restarting the MCU).
+ * Runs in the MQTT client task, so it only copies the message into the
+ * instruction queue without waiting. Messages split across several events
+ * (larger than the client buffer) or larger than MQTT_INSTRUCTION_MAX_SIZE
+ * are discarded, instructions are far smaller.
  *
- * WARNING: This function is currently useless. Its causes a conflict with FreeRTOS, 
- * making the program reboot itself. It should be replaced with another one, to avoid conflict with FreeRTOS.
- * 
- * @param[in] data Pointer to the received message
- * @param[in] length Length of the message
+ * @param[in] event Data event of the "Instruction" topic
  */
-/*static void instruction_handler(char *str, size_t length)
+static void instruction_handler(esp_mqtt_event_handle_t event)
 {
-    ESP_LOGW(TAG, "DATA RECEIVE %s", str);
-    memset(inst, 0, sizeof(inst));
-    char *message = (char *)malloc(length + 1);
-    if (message == NULL)
+    mqtt_instruction_msg_t msg;
+
+    if (event->current_data_offset != 0 || event->data_len != event->total_data_len ||
+        event->data_len > MQTT_INSTRUCTION_MAX_SIZE || instruction_queue == NULL)
     {
-        ESP_LOGE(TAG, "Failed to allocate memory for MQTT message");
+        dropped_instructions++;
+        return;
     }
 
-    // Copiar los datos y agregar el terminador nulo manualmente
-    memcpy(message, str, length);
-    message[length] = '\0'; // Termina la cadena con '\0'
-    esp_err_t err = deserealize_json_data(message, inst, length);
-    free(message);
-    ESP_LOGW(TAG, "Des Receive: %s", inst);
-    if (err != ESP_OK)
+    msg.len = event->data_len;
+    memcpy(msg.data, event->data, event->data_len);
+    if (xQueueSend(instruction_queue, &msg, 0) != pdTRUE)
     {
-        ESP_LOGE(TAG, "Error deserializing Instruction");
+        dropped_instructions++;
     }
-    else
-    {
+}
 
-        if (strncmp(inst, "REBOOT", strlen("REBOOT")) == 0)
-        {
-            ESP_LOGW("RESTART", "Reiniciando el MCU...");
-            esp_restart(); // Llamada para reiniciar el MCU
-        }
-        else
-        {
-            ESP_LOGW(TAG, "Saving...");
-            if (saveInstruction(inst) != ESP_OK)
-            {
-                ESP_LOGE(TAG, "Error saving Instruction");
-            }
-            ESP_LOGW(TAG, "SAVED");
-        }
+/**
+ * @brief Waits for an instruction received via MQTT.
+ *
+ * @param[out] msg Received message, not null-terminated
+ * @param[in] timeout_ms Maximum time to wait
+ *
+ * @return
+ * - ESP_OK if a message was received
+ * - ESP_ERR_TIMEOUT if no message arrived in time
+ * - ESP_ERR_INVALID_STATE if the client was never started
+ */
+esp_err_t mqtt_receive_instruction(mqtt_instruction_msg_t *msg, uint32_t timeout_ms)
+{
+    if (instruction_queue == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
     }
-}*/
\ No newline at end of file
+    if (xQueueReceive(instruction_queue, msg, pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+    {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Reports whether the client is connected to the broker.
+ *
+ * @return true while connected
+ */
+bool mqtt_is_connected(void)
+{
+    return MQTT_CONNEECTED != 0;
+}
+
+/**
+ * @brief Instructions discarded by the receive path.
+ *
+ * @return Messages dropped because the queue was full or they were too long
+ */
+uint32_t mqtt_dropped_instructions(void)
+{
+    return dropped_instructions;
+}
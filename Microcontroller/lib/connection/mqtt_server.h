@@ -17,6 +17,20 @@
 #define _MQTT_SERVER_H_
 
 #include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MQTT_INSTRUCTION_MAX_SIZE 192 ///< Largest instruction message accepted
+
+/**
+ * @brief Instruction message as received on the "Instruction" topic.
+ */
+typedef struct
+{
+    uint16_t len;                           ///< Length of the message
+    char data[MQTT_INSTRUCTION_MAX_SIZE];   ///< JSON message, not null-terminated
+} mqtt_instruction_msg_t;
 
 /**
  * @brief Initialize the MQTT client and connect to the broker
@@ -45,6 +59,21 @@ esp_err_t mqtt_start();
  */
 esp_err_t mqtt_publish(const char *topic, const char *payload);
 
+/**
+ * @brief Publish a binary message to a specific MQTT topic
+ * 
+ * Same as `mqtt_publish`, but the payload length is given explicitly so it 
+ * may contain zero bytes.
+ * 
+ * @param[in] topic The MQTT topic to which the message will be published
+ * @param[in] data The message content to publish
+ * @param[in] len Length of the message in bytes
+ * @return 
+ *      - ESP_OK on successful message publication
+ *      - ESP_FAIL on failure to publish the message
+ */
+esp_err_t mqtt_publish_binary(const char *topic, const uint8_t *data, size_t len);
+
 /**
  * @brief Disconnect the MQTT client from the broker
  * 
@@ -58,4 +87,36 @@ esp_err_t mqtt_publish(const char *topic, const char *payload);
  */
 esp_err_t mqtt_disconnect();
 
+/**
+ * @brief Wait for an instruction received via MQTT
+ * 
+ * The client subscribes to the "Instruction" topic on every connection. The 
+ * messages are queued as they arrive and handed out here, in arrival order.
+ * 
+ * @param[out] msg Received message
+ * @param[in] timeout_ms Maximum time to wait in milliseconds
+ * @return 
+ *      - ESP_OK if a message was received
+ *      - ESP_ERR_TIMEOUT if no message arrived in time
+ *      - ESP_ERR_INVALID_STATE if the client was never started
+ */
+esp_err_t mqtt_receive_instruction(mqtt_instruction_msg_t *msg, uint32_t timeout_ms);
+
+/**
+ * @brief Check the connection with the broker
+ * 
+ * @return true while the client is connected
+ */
+bool mqtt_is_connected(void);
+
+/**
+ * @brief Number of received instructions that were discarded
+ * 
+ * Counts the messages dropped because the queue was full or they were 
+ * longer than MQTT_INSTRUCTION_MAX_SIZE.
+ * 
+ * @return Discarded messages since boot
+ */
+uint32_t mqtt_dropped_instructions(void);
+
 #endif // _MQTT_SERVER_H_
@@ -107,11 +107,11 @@ esp_err_t delete_semaphores()
         return err;
     }
 
-    err = delete_buffer_semaphore(); // instruction_buffer
+    err = deleteBuffer(); // instruction_buffer
     if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to delete the semaphore to access the buffer.");
-        LOG_MESSAGE_E(TAG, "Failed to delete the semaphore to access the buffer.");
+        ESP_LOGE(TAG, "Failed to delete the instruction buffer queue.");
+        LOG_MESSAGE_E(TAG, "Failed to delete the instruction buffer queue.");
         return err;
     }
 
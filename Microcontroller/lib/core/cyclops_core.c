@@ -29,22 +29,39 @@
 #include "lights.h"
 #include "mqtt_server.h"
 #include "mapping.h"
+#include "i2c.h"
+#include "sample_buffer.h"
 #include "heap_trace_helper.h"
 #include "debug_helper.h"
 
+/* Uncomment to also publish the individual samples, besides the scan
+ * frames (one per sweep) */
+// #define MAPPING_PUBLISH_POINTS
+
+/* Longest wait for an MQTT instruction before checking the connection again */
+#define INSTRUCTION_WAIT_MS 1000
+
+/* Idle time after which the suppressed repeats of a log message are reported */
+#define LOG_DRAIN_WAIT_MS 1000
+
 static const char *TAG = "CYCLOPS_CORE";
 TaskHandle_t servoInterruptionTaskHandler = NULL;
 TaskHandle_t instructionHandlerTaskHandler = NULL;
 TaskHandle_t receiveInstructionTaskHandler = NULL;
 TaskHandle_t batteryTaskHandler = NULL;
 TaskHandle_t mappingTaskHandler = NULL;
+TaskHandle_t publisherTaskHandler = NULL;
+TaskHandle_t logMessageTaskHandler = NULL;
 TaskHandle_t checkRAMHandler = NULL;
 
 static void servoInterruptionTask(void *);
 static void receiveInstruction(void *);
 static void instructionHandler(void *);
-static void executeInstruction(char *);
+static void executeInstruction(const instruction_t *);
+static void setLidarProfile(vl53l0x_profile_t);
 static void mappingTask(void *);
+static void publisherTask(void *);
+static void logMessageTask(void *);
 static void batteryTask(void *parameter);
 static void checkRAM(void *);
 
@@ -66,6 +83,12 @@ esp_err_t system_init()
 {
     esp_err_t err = ESP_OK;
 
+    err = initLogMessages();
+    if (err != ESP_OK)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR SETTING UP LOG MESSAGES"));
+        return ESP_FAIL;
+    }
 
     // err = start_heap_trace();
     // if (err != ESP_OK)
@@ -153,6 +176,8 @@ esp_err_t system_init()
  * - Instruction handling
  * - Receiving instructions
  * - Mapping service
+ * - Mapping samples publisher
+ * - Log messages publisher
  * - Battery monitoring
  * - RAM checking
  * 
@@ -180,12 +205,13 @@ esp_err_t createTasks()
 
     // // MAIN TASKs
     
+    // Above the other tasks so a queued Brake runs right away
     task_created = xTaskCreatePinnedToCore(
         instructionHandler,
         "InstructionsHandlerTask",
         4096,
         NULL,
-        2,
+        3,
         &instructionHandlerTaskHandler,
         tskNO_AFFINITY);
 
@@ -225,6 +251,36 @@ esp_err_t createTasks()
         return ESP_FAIL;
     }
 
+    task_created = xTaskCreatePinnedToCore(
+        publisherTask,
+        "PublisherTask",
+        4096,
+        NULL,
+        1,
+        &publisherTaskHandler,
+        tskNO_AFFINITY);
+
+    if (task_created != pdPASS)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error Creating Publisher Task"));
+        return ESP_FAIL;
+    }
+
+    task_created = xTaskCreatePinnedToCore(
+        logMessageTask,
+        "LogMessageTask",
+        4096,
+        NULL,
+        1,
+        &logMessageTaskHandler,
+        tskNO_AFFINITY);
+
+    if (task_created != pdPASS)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Error Creating Log Message Task"));
+        return ESP_FAIL;
+    }
+
     task_created = xTaskCreatePinnedToCore(
         batteryTask,
         "BateryTask",
@@ -289,6 +345,16 @@ void abort_tasks()
         vTaskDelete(mappingTaskHandler);
         mappingTaskHandler = NULL;
     }
+    if (publisherTaskHandler != NULL)
+    {
+        vTaskDelete(publisherTaskHandler);
+        publisherTaskHandler = NULL;
+    }
+    if (logMessageTaskHandler != NULL)
+    {
+        vTaskDelete(logMessageTaskHandler);
+        logMessageTaskHandler = NULL;
+    }
 
 }
 
@@ -304,14 +370,17 @@ static void servoInterruptionTask(void *parameter)
     while (1)
     {
         check_limit_switch();
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        // Espera el punto de inversión del sector, o 10 ms
+        servo_check_reversal(10);
     }
 }
 
 /**
- * @brief Task function for receiving instructions via HTTP.
+ * @brief Task function for receiving instructions.
  * 
- * This task continuously retrieves incoming instructions from the HTTP interface.
+ * While the MQTT client is connected the task blocks on the instructions
+ * pushed by the backend and handles each one as soon as it arrives. Otherwise
+ * it falls back to polling the HTTP interface.
  * 
  * @param parameter Unused parameter.
  */
@@ -320,6 +389,16 @@ static void receiveInstruction(void *parameter)
     esp_err_t err = ESP_OK;
     while (1)
     {
+        if (mqtt_is_connected())
+        {
+            err = receiveInstructionMessage(INSTRUCTION_WAIT_MS);
+            if (err != ESP_OK && err != ESP_ERR_TIMEOUT)
+            {
+                DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR HANDLING MQTT INSTRUCTION"));
+            }
+            continue;
+        }
+
         err = getHTTPInstruction();
         if (err != ESP_OK)
         {
@@ -333,110 +412,281 @@ static void receiveInstruction(void *parameter)
 /**
  * @brief Task function for handling instructions.
  * 
- * This task processes received instructions and executes them.
+ * This task blocks on the instruction buffer and executes each instruction
+ * as soon as it is queued, recording how long it waited.
  * 
  * @param parameter Unused parameter.
  */
 static void instructionHandler(void *parameter)
 {
-    char inst[20];
+    instruction_t inst;
     esp_err_t err = ESP_OK;
     while (1)
     {
-        err = getInstructionMessage(inst);
+        err = getInstructionMessage(&inst, INSTRUCTION_WAIT_FOREVER);
         if (err == ESP_OK)
         {
-            executeInstruction(inst);
-            DEBUGING_ESP_LOG(ESP_LOGW(TAG, "INST Handled - %s", inst));
+            recordInstructionLatency(&inst);
+            executeInstruction(&inst);
+            DEBUGING_ESP_LOG(ESP_LOGW(TAG, "INST Handled - %s", instruction_name(inst.opcode)));
         }
-        else if (err == ESP_ERR_TIMEOUT)
+        else
         {
             DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR GETTING INSTRUCTION"));
             LOG_MESSAGE_E(TAG, "ERROR GETTING INSTRUCTION");
-
+            vTaskDelay(50 / portTICK_PERIOD_MS);
         }
-        memset(inst, 0, 20);
-        vTaskDelay(50 / portTICK_PERIOD_MS);
     }
 }
 
-/**
- * @brief Executes the received instruction.
- * 
- * This function interprets and executes a given instruction related to motor control 
- * and mapping operations.
- * 
- * @param inst Pointer to the instruction string.
- */
-static void executeInstruction(char *inst)
+static void brakeInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Brake");
+    motors_command(STOP);
+}
+
+static void backwardInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Backward");
+    motors_command(BACKWARD);
+}
+
+static void forwardInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Forward");
+    motors_command(FORWARD);
+}
+
+static void rightInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Rotate Right");
+    motors_command(ROTATE_RIGHT);
+}
+
+static void leftInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Rotate Left");
+    motors_command(ROTATE_LEFT);
+}
+
+static void speedUpInstruction(const instruction_t *inst)
+{
+    servo_set_speed(UP);
+}
+
+static void speedDownInstruction(const instruction_t *inst)
+{
+    servo_set_speed(DOWN);
+}
+
+static void pauseInstruction(const instruction_t *inst)
 {
-    if (strncmp(inst, "Brake", 5) == 0)
+    LOG_MESSAGE_W(TAG, "Instruction: Pause");
+
+    if (mapping_pause() != ESP_OK)
     {
-        LOG_MESSAGE_W(TAG, "Instruction: Brake");
-        motors_command(STOP);
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR TRYING TO STOP SERVO"));
+        LOG_MESSAGE_E(TAG, "ERROR TRYING TO STOP SERVO");
+
     }
-    else if (strncmp(inst, "Backward", 8) == 0)
+    else
     {
-        LOG_MESSAGE_W(TAG, "Instruction: Backward");
-        motors_command(BACKWARD);
+        vTaskSuspend(mappingTaskHandler);
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Mapping task suspended"));
+        LOG_MESSAGE_W(TAG, "Mapping task suspended");
     }
-    else if (strncmp(inst, "Forward", 7) == 0)
+}
+
+static void playInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Play");
+    if (mapping_restart() != ESP_OK)
     {
-        LOG_MESSAGE_W(TAG, "Instruction: Forward");
-        motors_command(FORWARD);
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR TRYING TO RESTART SERVO"));
+        LOG_MESSAGE_E(TAG, "ERROR TRYING TO RESTART SERVO");
     }
-    else if (strncmp(inst, "Right", 5) == 0)
+    else
     {
-        LOG_MESSAGE_W(TAG, "Instruction: Rotate Right");
-        motors_command(ROTATE_RIGHT);
+        vTaskResume(mappingTaskHandler);
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Mapping task resumed"));
+        LOG_MESSAGE_I(TAG, "Mapping task resumed");
     }
-    else if (strncmp(inst, "Left", 4) == 0)
+}
+
+static void profileFastInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: LiDAR Profile High Speed");
+    setLidarProfile(VL53L0X_PROFILE_HIGH_SPEED);
+}
+
+static void profileDefaultInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: LiDAR Profile Default");
+    setLidarProfile(VL53L0X_PROFILE_DEFAULT);
+}
+
+static void profileAccurateInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: LiDAR Profile High Accuracy");
+    setLidarProfile(VL53L0X_PROFILE_HIGH_ACCURACY);
+}
+
+static void profileLongInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: LiDAR Profile Long Range");
+    setLidarProfile(VL53L0X_PROFILE_LONG_RANGE);
+}
+
+static void sweepPeriodInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Sweep Period");
+    if (inst->argument < 0 || servo_set_sweep_period((uint32_t)inst->argument) != ESP_OK)
     {
-        LOG_MESSAGE_W(TAG, "Instruction: Rotate Left");
-        motors_command(ROTATE_LEFT);
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR SETTING SWEEP PERIOD: %ld", (long)inst->argument));
+        LOG_MESSAGE_E(TAG, "ERROR SETTING SWEEP PERIOD");
     }
-    else if (strncmp(inst, "SpeedUp", 7) == 0)
+}
+
+static void scanSectorInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Scan Sector");
+    int16_t start = INSTRUCTION_SECTOR_START(inst->argument);
+    int16_t end = INSTRUCTION_SECTOR_END(inst->argument);
+    if (servo_set_sector(start, end) != ESP_OK)
     {
-        servo_set_speed(UP);
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR SETTING SCAN SECTOR: %d..%d", start, end));
+        LOG_MESSAGE_E(TAG, "ERROR SETTING SCAN SECTOR");
     }
-    else if (strncmp(inst, "SpeedDown", 9) == 0)
+}
+
+static void scanDensityInstruction(const instruction_t *inst)
+{
+    LOG_MESSAGE_W(TAG, "Instruction: Scan Density");
+    if (inst->argument < 0 || inst->argument > UINT16_MAX ||
+        mapping_set_density((uint16_t)inst->argument) != ESP_OK)
     {
-        servo_set_speed(DOWN);
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR SETTING SCAN DENSITY: %ld", (long)inst->argument));
+        LOG_MESSAGE_E(TAG, "ERROR SETTING SCAN DENSITY");
     }
-    else if (strncmp(inst, "Pause", 5) == 0)
+}
+
+/* Handler of each opcode. REBOOT and ABORT are handled where they are
+ * received, so they have no entry here. */
+static void (*const instruction_handlers[INST_COUNT])(const instruction_t *) = {
+    [INST_BRAKE] = brakeInstruction,
+    [INST_BACKWARD] = backwardInstruction,
+    [INST_FORWARD] = forwardInstruction,
+    [INST_RIGHT] = rightInstruction,
+    [INST_LEFT] = leftInstruction,
+    [INST_SPEED_UP] = speedUpInstruction,
+    [INST_SPEED_DOWN] = speedDownInstruction,
+    [INST_PAUSE] = pauseInstruction,
+    [INST_PLAY] = playInstruction,
+    [INST_PROFILE_FAST] = profileFastInstruction,
+    [INST_PROFILE_DEFAULT] = profileDefaultInstruction,
+    [INST_PROFILE_ACCURATE] = profileAccurateInstruction,
+    [INST_PROFILE_LONG] = profileLongInstruction,
+    [INST_SWEEP_PERIOD] = sweepPeriodInstruction,
+    [INST_SCAN_DENSITY] = scanDensityInstruction,
+    [INST_SCAN_SECTOR] = scanSectorInstruction,
+};
+
+/**
+ * @brief Executes the received instruction.
+ * 
+ * This function runs the handler of the instruction opcode, related to motor 
+ * control and mapping operations.
+ * 
+ * @param inst Instruction to execute.
+ */
+static void executeInstruction(const instruction_t *inst)
+{
+    if (inst->opcode >= INST_COUNT || instruction_handlers[inst->opcode] == NULL)
     {
-        LOG_MESSAGE_W(TAG, "Instruction: Pause");
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "No handler for instruction %d", inst->opcode));
+        return;
+    }
+    instruction_handlers[inst->opcode](inst);
+}
 
-        if (mapping_pause() != ESP_OK)
-        {
-            DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR TRYING TO STOP SERVO"));
-            LOG_MESSAGE_E(TAG, "ERROR TRYING TO STOP SERVO");
+/**
+ * @brief Requests a new LiDAR ranging profile.
+ * 
+ * The mapping task applies it before its next sample.
+ * 
+ * @param profile Ranging profile to use.
+ */
+static void setLidarProfile(vl53l0x_profile_t profile)
+{
+    if (mapping_set_profile(profile) != ESP_OK)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR SETTING LIDAR PROFILE"));
+        LOG_MESSAGE_E(TAG, "ERROR SETTING LIDAR PROFILE");
+    }
+}
 
-        }
-        else
+/**
+ * @brief Task function for publishing the mapping data.
+ * 
+ * Sends the scan frames completed by the mapping service, one message per
+ * servo sweep. With MAPPING_PUBLISH_POINTS it also drains the sample ring
+ * buffer filled by mappingTask and sends the samples in batches of up to
+ * MAPPING_SAMPLES_PER_MESSAGE per message. Network latency never stalls
+ * the ranging.
+ * 
+ * @param parameter Unused parameter.
+ */
+static void publisherTask(void *parameter)
+{
+    static mapping_value_t batch[MAPPING_SAMPLES_PER_MESSAGE];
+    scan_frame_t *frame;
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while ((frame = mapping_take_frame()) != NULL)
         {
-            vTaskSuspend(mappingTaskHandler);
-            DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Mapping task suspended"));
-            LOG_MESSAGE_W(TAG, "Mapping task suspended");
+            if (sendScanFrame(frame) != ESP_OK)
+            {
+                DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR SENDING SCAN FRAME"));
+            }
+            mapping_release_frame(frame);
         }
-    }
-    else if (strncmp(inst, "Play", 4) == 0)
-    {
-        LOG_MESSAGE_W(TAG, "Instruction: Play");
-        if (mapping_restart() != ESP_OK)
+        uint16_t count = 0;
+        while (popSample(&batch[count]))
         {
-            DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR TRYING TO RESTART SERVO"));
-            LOG_MESSAGE_E(TAG, "ERROR TRYING TO RESTART SERVO");
+            count++;
+            if (count == MAPPING_SAMPLES_PER_MESSAGE)
+            {
+                if (sendMappingSamples(batch, count) != ESP_OK)
+                {
+                    DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR SENDING MAPPING VALUES"));
+                }
+                count = 0;
+            }
         }
-        else
+        if (count > 0 && sendMappingSamples(batch, count) != ESP_OK)
         {
-            vTaskResume(mappingTaskHandler);
-            DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Mapping task resumed"));
-            LOG_MESSAGE_I(TAG, "Mapping task resumed");
+            DEBUGING_ESP_LOG(ESP_LOGE(TAG, "ERROR SENDING MAPPING VALUES"));
         }
     }
 }
 
+/**
+ * @brief Task function publishing the log messages.
+ * 
+ * Runs at the lowest priority, so publishing a log message never delays
+ * sensing nor actuation.
+ * 
+ * @param parameter Unused parameter.
+ */
+static void logMessageTask(void *parameter)
+{
+    while (1)
+    {
+        drainLogMessages(LOG_DRAIN_WAIT_MS);
+    }
+}
+
 /**
  * @brief Task function for handling battery monitoring.
  * 
@@ -459,13 +709,29 @@ static void batteryTask(void *parameter)
         }
         else
         {
-            ESP_LOGW(TAG, "Battery Level: %u", level);
+            TIER_LOGI(TAG, "Battery Level: %u", level);
             if (sendBatteryLevel(level) != ESP_OK)
             {
                 ESP_LOGE(TAG, "ERROR SENDING BATTERY LEVEL");
                 LOG_MESSAGE_E(TAG, "ERROR SENDING BATTERY LEVEL");
             }
         }
+        if (servo_save_rates() != ESP_OK)
+        {
+            LOG_MESSAGE_W(TAG, "ERROR SAVING SERVO RATES");
+        }
+        DEBUGING_ESP_LOG(servo_log_rates());
+        DEBUGING_ESP_LOG(servo_log_control());
+        DEBUGING_ESP_LOG(i2c_log_client_stats());
+        DEBUGING_ESP_LOG(mapping_log_recovery_stats());
+        DEBUGING_ESP_LOG(logSampleBufferStats());
+        DEBUGING_ESP_LOG(mapping_log_frame_stats());
+        DEBUGING_ESP_LOG(mapping_log_sampling_stats());
+        DEBUGING_ESP_LOG(logInstructionLatency());
+        DEBUGING_ESP_LOG(logInstructionBufferStats());
+        DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Instrucciones MQTT descartadas: %lu", (unsigned long)mqtt_dropped_instructions()));
+        DEBUGING_ESP_LOG(logLogMessageStats());
+        DEBUGING_ESP_LOG(flushLogRecords());
         vTaskDelay(5000 / portTICK_PERIOD_MS);
     }
 }
@@ -473,18 +739,20 @@ static void batteryTask(void *parameter)
 /**
  * @brief Task function for mapping operations.
  * 
- * This task handles mapping-related processes.
+ * This task handles mapping-related processes. getMappingValue paces the
+ * loop: it waits for the sampling timer before each round of measurements.
  * 
  * @param parameter Unused parameter.
  */
 static void mappingTask(void *parameter)
 {
-    uint16_t distance = 0;
-    int16_t angle = 0;
+    mapping_value_t value = {0};
     esp_err_t err = ESP_OK;
+    uint32_t handed_frames = 0;
     while (1)
     {
-        err = getMappingValue(&angle, &distance);
+        bool notify = false;
+        err = getMappingValue(&value);
         // if (err != ESP_OK)
         // {
         //     ESP_LOGE(TAG, "FAIL TO GET MAPPING VALUE");
@@ -505,14 +773,31 @@ static void mappingTask(void *parameter)
             case ESP_ERR_INVALID_RESPONSE:
                 break;
             default:
-                ESP_LOGW(TAG, "Dist: %u - Ang: %i", distance, angle);
-                sendMappingValue(distance, angle);
+                TIER_LOG_RECORD(LOG_INFO, TAG, LOG_RECORD_SAMPLE, 100, "Dist: %" PRIi32 " - Ang: %" PRIi32 " - Sensor: %" PRIi32,
+                                value.distance, value.angle, value.sensor);
+                // Never blocks: publishing runs in publisherTask
+#ifdef MAPPING_PUBLISH_POINTS
+                pushSample(&value);
+                notify = true;
+#endif
                 break;
         }
+        // The publisher is only woken when it has something to send
+        if (mapping_frames_completed() != handed_frames)
+        {
+            handed_frames = mapping_frames_completed();
+            notify = true;
+        }
+        if (notify && publisherTaskHandler != NULL)
+        {
+            xTaskNotifyGive(publisherTaskHandler);
+        }
 
-        angle = 0;
-        distance = 0;
+        value.angle = 0;
+        value.distance = 0;
+#ifdef MAPPING_FREE_RUNNING
         vTaskDelay(4 / portTICK_PERIOD_MS);
+#endif
     }
 }
 
@@ -531,7 +816,7 @@ static void checkRAM(void *parameter)
     {
         percent = (esp_get_free_heap_size() * 100) / 327680;
         //ESP_LOGI(TAG, "Memoria libre en el heap: %lu bytes >>>>>>>>>", esp_get_free_heap_size());
-        ESP_LOGI(TAG, "Memoria libre en el heap: %d %% >>>>>>>>>", percent);
+        TIER_LOG_EVERY_MS(LOG_INFO, TAG, 5000, "Memoria libre en el heap: %d %% >>>>>>>>>", percent);
         if (percent <= 20 && !flag)
         {
             stop_heap_trace();
@@ -4,13 +4,13 @@
  * @brief I2C Master Interface Library for ESP32
  * 
  * This library provides initialization and bus management for the I2C master 
- * interface on ESP32 devices, including semaphore-based access control for 
- * safe usage in multi-tasking environments.
+ * interface on ESP32 devices. A single bus manager task owns the bus and runs
+ * the transactions requested by the other tasks, in priority order.
  * 
  * The library handles the following:
  * - I2C master initialization with predefined configurations.
- * - Semaphore management for ensuring exclusive bus access.
- * - Functions to acquire and release the bus for multi-task applications.
+ * - A bus manager task with one request queue per priority level.
+ * - Per-client latency statistics.
  * 
  * @version 1.0
  * @date 2024-12-05
@@ -24,132 +24,529 @@
 #include "i2c.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include <stdint.h>
 #include "debug_helper.h"
 
+#define I2C_BUS_TASK_STACK 4096
+#define I2C_BUS_TASK_PRIORITY 5 // Above every client so requests are served right away
+#define I2C_QUEUE_LENGTH I2C_CLIENT_COUNT // A client has at most one request in flight
+#define I2C_MAX_DEVICES 8 // Devices that can be added to the bus
+
+/**
+ * @brief Priority levels of the request queues.
+ */
+typedef enum
+{
+    I2C_PRIORITY_HIGH,
+    I2C_PRIORITY_LOW,
+    I2C_PRIORITY_COUNT
+} i2c_priority_t;
+
+/**
+ * @brief Transaction waiting to be run by the bus manager task.
+ */
+typedef struct
+{
+    i2c_client_t client;
+    i2c_master_dev_handle_t dev;
+    const uint8_t *tx;
+    size_t tx_len;
+    uint8_t *rx;
+    size_t rx_len;
+    const i2c_reg_write_t *table; // Register table, used instead of tx/rx when not NULL
+    size_t table_len;
+    int64_t enqueue_us;
+} i2c_request_t;
+
+/**
+ * @brief Priority of each client.
+ */
+static const i2c_priority_t client_priority[I2C_CLIENT_COUNT] = {
+    [I2C_CLIENT_LIDAR] = I2C_PRIORITY_HIGH,
+    [I2C_CLIENT_BATTERY] = I2C_PRIORITY_LOW,
+};
+
 /**
- * @brief Static semaphore handle for managing I2C bus access.
+ * @brief Client names used when logging statistics.
+ */
+static const char *client_names[I2C_CLIENT_COUNT] = {
+    [I2C_CLIENT_LIDAR] = "LIDAR",
+    [I2C_CLIENT_BATTERY] = "BATTERY",
+};
+
+/**
+ * @brief Handle of the I2C master bus, shared by every device.
  * 
  */
-static SemaphoreHandle_t bus_semaphore;
+static i2c_master_bus_handle_t bus_handle = NULL;
+
+/**
+ * @brief Set once the bus, queues and task are created, cleared by `i2c_delete_bus`.
+ */
+static bool is_initialized = false;
+
+/**
+ * @brief Handles given out by `i2c_add_device`, kept as the caller's pointer
+ * so `i2c_delete_bus` can remove the devices and clear the caller's copy.
+ */
+static i2c_master_dev_handle_t *device_handles[I2C_MAX_DEVICES];
+static uint8_t device_count = 0;
+
+/**
+ * @brief Request queues, one per priority level.
+ */
+static QueueHandle_t request_queues[I2C_PRIORITY_COUNT];
+
+/**
+ * @brief Counts the requests pending in every queue, wakes up the bus task.
+ */
+static SemaphoreHandle_t pending_semaphore;
+
+/**
+ * @brief Serializes the tasks of a same client, so each has one request in flight.
+ */
+static SemaphoreHandle_t client_mutex[I2C_CLIENT_COUNT];
+
+/**
+ * @brief Given by the bus task when the request of a client is done.
+ */
+static SemaphoreHandle_t client_done[I2C_CLIENT_COUNT];
+
+/**
+ * @brief Result of the last request of each client.
+ */
+static esp_err_t client_result[I2C_CLIENT_COUNT];
+
+/**
+ * @brief Latency statistics of each client, written only by the bus task.
+ */
+static i2c_client_stats_t client_stats[I2C_CLIENT_COUNT];
+
+static TaskHandle_t busTaskHandler = NULL;
 
 /**
  * @brief Tag used for ESP-IDF logging.
  */
 static const char *TAG = "I2C";
 
+static void busTask(void *);
+static esp_err_t runRequest(const i2c_request_t *);
+static void updateStats(const i2c_request_t *, esp_err_t, int64_t, int64_t);
+static esp_err_t submitRequest(i2c_request_t *);
+
 /**
  * @brief Initializes the I2C master interface.
  * 
- * This function configures the I2C hardware with predefined parameters such as 
- * GPIO pins, clock speed, and pull-up configuration. It creates a FreeRTOS 
- * binary semaphore to manage access to the I2C bus and ensures that the 
- * initialization is only performed once.
+ * This function creates the I2C master bus with predefined parameters such as 
+ * GPIO pins and pull-up configuration. The clock speed is set per device in
+ * `i2c_add_device`. It creates the request queues and starts the bus manager
+ * task, and ensures that the initialization is only performed once.
  * 
  * @note If initialization has already been performed, the function skips 
  * reinitialization and logs a message.
  * 
  * @return 
  * - `ESP_OK`: Initialization was successful or was already performed.
- * - `ESP_FAIL`: Semaphore creation failed.
- * - Other `esp_err_t`: Errors from `i2c_param_config` or `i2c_driver_install`.
+ * - `ESP_FAIL`: Queue, semaphore or task creation failed.
+ * - Other `esp_err_t`: Errors from `i2c_new_master_bus`.
  */
 esp_err_t i2c_init()
 {
-
-    static bool is_initialized = false; // Estado de inicialización
-
     if(is_initialized){
         ESP_LOGI(TAG, "I2C already initialized, skipping initialization.");
         return ESP_OK;
     }
 
-    bus_semaphore = xSemaphoreCreateBinary();
-
-    i2c_config_t conf = {
-        .mode = I2C_MODE_MASTER,
+    i2c_master_bus_config_t conf = {
+        .i2c_port = I2C_MASTER_NUM,
         .sda_io_num = I2C_MASTER_SDA_IO,
         .scl_io_num = I2C_MASTER_SCL_IO,
-        .master.clk_speed = I2C_MASTER_FREQ_HZ,
-        .sda_pullup_en = GPIO_PULLUP_ENABLE,
-        .scl_pullup_en = GPIO_PULLUP_ENABLE,
-        .clk_flags = 0,
+        .clk_source = I2C_CLK_SRC_DEFAULT,
+        .glitch_ignore_cnt = I2C_MASTER_GLITCH_IGNORE_CNT,
+        .trans_queue_depth = 0, // Transacciones sincronicas, sin cola
+        .flags.enable_internal_pullup = true,
     };
 
-    esp_err_t err = i2c_param_config(I2C_MASTER_NUM, &conf);
+    esp_err_t err = i2c_new_master_bus(&conf, &bus_handle);
     if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Error in i2c_param_config: %s", esp_err_to_name(err));
-        LOG_MESSAGE_E(TAG, "Error in i2c_param_config");
+        ESP_LOGE(TAG, "Error in i2c_new_master_bus: %s", esp_err_to_name(err));
+        LOG_MESSAGE_E(TAG, "Error in i2c_new_master_bus");
         // Seng Msg to User and Turn ON error led
-
         return err;
     }
 
-    err = i2c_driver_install(I2C_MASTER_NUM,
-                             conf.mode,
-                             I2C_MASTER_RX_BUF_DISABLE,
-                             I2C_MASTER_TX_BUF_DISABLE,
-                             0);
-    if (err != ESP_OK)
+    for (int i = 0; i < I2C_PRIORITY_COUNT; i++)
     {
-        ESP_LOGE(TAG, "Error in i2c_driver_install: %s", esp_err_to_name(err));
-        LOG_MESSAGE_E(TAG, "Error in i2c_driver_install");
-        // Seng Msg to User and Turn ON error led
-        return err;
+        request_queues[i] = xQueueCreate(I2C_QUEUE_LENGTH, sizeof(i2c_request_t));
+        if (request_queues[i] == NULL)
+        {
+            ESP_LOGE(TAG, "Error creating I2C request queue");
+            LOG_MESSAGE_E(TAG, "Error creating I2C request queue");
+            return ESP_FAIL;
+        }
     }
-    
-    if (xSemaphoreGive(bus_semaphore) != pdTRUE)
+
+    pending_semaphore = xSemaphoreCreateCounting(I2C_QUEUE_LENGTH * I2C_PRIORITY_COUNT, 0);
+    if (pending_semaphore == NULL)
     {
         ESP_LOGE(TAG, "Error Initializing I2C Bus Semaphore");
         LOG_MESSAGE_E(TAG, "Error Initializing I2C Bus Semaphore");
         return ESP_FAIL;
     }
 
+    for (int i = 0; i < I2C_CLIENT_COUNT; i++)
+    {
+        client_mutex[i] = xSemaphoreCreateMutex();
+        client_done[i] = xSemaphoreCreateBinary();
+        if (client_mutex[i] == NULL || client_done[i] == NULL)
+        {
+            ESP_LOGE(TAG, "Error Initializing I2C Client Semaphores");
+            LOG_MESSAGE_E(TAG, "Error Initializing I2C Client Semaphores");
+            return ESP_FAIL;
+        }
+    }
+
+    if (xTaskCreatePinnedToCore(busTask, "I2CBusTask", I2C_BUS_TASK_STACK, NULL,
+                                I2C_BUS_TASK_PRIORITY, &busTaskHandler, tskNO_AFFINITY) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Error Creating I2C Bus Task");
+        LOG_MESSAGE_E(TAG, "Error Creating I2C Bus Task");
+        return ESP_FAIL;
+    }
+
     is_initialized = true;
     return err;
 }
 
+/**
+ * @brief Bus manager task.
+ * 
+ * Owns the bus: waits for requests and always serves the high priority queue
+ * before the low priority one. Every transaction runs to completion, so a low
+ * priority request can delay a LiDAR request by at most one transaction.
+ * 
+ * @param parameter Unused parameter.
+ */
+static void busTask(void *parameter)
+{
+    i2c_request_t request;
+    while (1)
+    {
+        if (xSemaphoreTake(pending_semaphore, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+
+        bool found = false;
+        for (int i = 0; i < I2C_PRIORITY_COUNT && !found; i++)
+        {
+            found = xQueueReceive(request_queues[i], &request, 0) == pdTRUE;
+        }
+        if (!found)
+        {
+            continue;
+        }
+
+        int64_t start_us = esp_timer_get_time();
+        esp_err_t err = runRequest(&request);
+        updateStats(&request, err, start_us, esp_timer_get_time());
+
+        client_result[request.client] = err;
+        xSemaphoreGive(client_done[request.client]);
+    }
+}
+
+/**
+ * @brief Runs a request on the bus. A register table is written entry by
+ * entry without releasing the bus to other clients.
+ */
+static esp_err_t runRequest(const i2c_request_t *request)
+{
+    if (request->table != NULL)
+    {
+        uint8_t tx[2];
+        for (size_t i = 0; i < request->table_len; i++)
+        {
+            tx[0] = request->table[i].reg;
+            tx[1] = request->table[i].value;
+            esp_err_t err = i2c_master_transmit(request->dev, tx, sizeof(tx), I2C_MASTER_TIMEOUT_MS);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+        }
+        return ESP_OK;
+    }
+    if (request->rx_len > 0)
+    {
+        return i2c_master_transmit_receive(request->dev, request->tx, request->tx_len,
+                                           request->rx, request->rx_len, I2C_MASTER_TIMEOUT_MS);
+    }
+    return i2c_master_transmit(request->dev, request->tx, request->tx_len, I2C_MASTER_TIMEOUT_MS);
+}
 
 /**
- * @brief Acquires the I2C bus for exclusive access.
+ * @brief Updates the statistics of the client that issued a request.
+ */
+static void updateStats(const i2c_request_t *request, esp_err_t err, int64_t start_us, int64_t end_us)
+{
+    i2c_client_stats_t *stats = &client_stats[request->client];
+    uint32_t wait_us = (uint32_t)(start_us - request->enqueue_us);
+    uint32_t latency_us = (uint32_t)(end_us - request->enqueue_us);
+
+    stats->transactions++;
+    if (err != ESP_OK)
+    {
+        stats->errors++;
+    }
+    stats->last_latency_us = latency_us;
+    stats->total_latency_us += latency_us;
+    if (latency_us > stats->max_latency_us)
+    {
+        stats->max_latency_us = latency_us;
+    }
+    if (wait_us > stats->max_wait_us)
+    {
+        stats->max_wait_us = wait_us;
+    }
+}
+
+/**
+ * @brief Runs a transaction on the bus through the bus manager task.
  * 
- * This function blocks until the semaphore controlling the I2C bus is available, 
- * ensuring that only one task can use the bus at a time.
+ * The request is queued by the priority of the client and the caller blocks
+ * until the bus task has run it. The request lives in the caller stack, no
+ * memory is allocated.
  * 
  * @return 
- * - `true`: The bus was successfully acquired.
- * - `false`: Failed to acquire the bus.
+ * - `ESP_OK`: The transaction was successful.
+ * - `ESP_ERR_INVALID_ARG`: Invalid client or device.
+ * - `ESP_ERR_INVALID_STATE`: The bus manager is not running.
+ * - Other `esp_err_t`: Errors from the I2C driver.
  */
-bool i2c_get_bus(){
-    if(xSemaphoreTake(bus_semaphore,portMAX_DELAY) == pdTRUE){
-        return true;
+esp_err_t i2c_transfer(i2c_client_t client, i2c_master_dev_handle_t dev,
+                       const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len)
+{
+    if (client >= I2C_CLIENT_COUNT || dev == NULL || (rx_len > 0 && rx == NULL))
+    {
+        return ESP_ERR_INVALID_ARG;
     }
-    return false;
+    if (busTaskHandler == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    i2c_request_t request = {
+        .client = client,
+        .dev = dev,
+        .tx = tx,
+        .tx_len = tx_len,
+        .rx = rx,
+        .rx_len = rx_len,
+    };
+    return submitRequest(&request);
 }
 
 /**
- * @brief Releases the I2C bus after use.
+ * @brief Writes a table of registers with a single bus request.
  * 
- * This function releases the semaphore controlling the I2C bus, allowing other 
- * tasks to acquire it.
+ * The table is usually a const array in flash, it is not copied.
  * 
  * @return 
- * - `true`: The bus was successfully released.
- * - `false`: Failed to release the bus.
+ * - `ESP_OK`: Every register was written.
+ * - `ESP_ERR_INVALID_ARG`: Invalid client, device or table.
+ * - `ESP_ERR_INVALID_STATE`: The bus manager is not running.
+ * - Other `esp_err_t`: Errors from the I2C driver.
  */
-bool i2c_give_bus(){
-    return xSemaphoreGive(bus_semaphore);
+esp_err_t i2c_write_table(i2c_client_t client, i2c_master_dev_handle_t dev,
+                          const i2c_reg_write_t *table, size_t count)
+{
+    if (client >= I2C_CLIENT_COUNT || dev == NULL || table == NULL || count == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (busTaskHandler == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    i2c_request_t request = {
+        .client = client,
+        .dev = dev,
+        .table = table,
+        .table_len = count,
+    };
+    return submitRequest(&request);
 }
 
-esp_err_t i2c_delete_bus()
+/**
+ * @brief Queues a request by the priority of its client and blocks until
+ * the bus task has run it.
+ */
+static esp_err_t submitRequest(i2c_request_t *request)
+{
+    i2c_client_t client = request->client;
+
+    if (xSemaphoreTake(client_mutex[client], portMAX_DELAY) != pdTRUE)
+    {
+        return ESP_FAIL;
+    }
+
+    request->enqueue_us = esp_timer_get_time();
+
+    esp_err_t err = ESP_FAIL;
+    if (xQueueSend(request_queues[client_priority[client]], request, portMAX_DELAY) == pdTRUE)
+    {
+        xSemaphoreGive(pending_semaphore);
+        // The bus task always answers, each transaction is bounded by I2C_MASTER_TIMEOUT_MS
+        xSemaphoreTake(client_done[client], portMAX_DELAY);
+        err = client_result[client];
+    }
+
+    xSemaphoreGive(client_mutex[client]);
+    return err;
+}
+
+/**
+ * @brief Copies the latency statistics of a client.
+ * 
+ * @return 
+ * - `ESP_OK`: Statistics copied.
+ * - `ESP_ERR_INVALID_ARG`: Invalid client or NULL pointer.
+ */
+esp_err_t i2c_get_client_stats(i2c_client_t client, i2c_client_stats_t *stats)
+{
+    if (client >= I2C_CLIENT_COUNT || stats == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *stats = client_stats[client];
+    return ESP_OK;
+}
+
+/**
+ * @brief Logs the latency statistics of every client.
+ */
+void i2c_log_client_stats(void)
+{
+    i2c_client_stats_t stats;
+    for (int i = 0; i < I2C_CLIENT_COUNT; i++)
+    {
+        i2c_get_client_stats(i, &stats);
+        uint32_t avg_us = stats.transactions ? (uint32_t)(stats.total_latency_us / stats.transactions) : 0;
+        ESP_LOGI(TAG, "%s: %lu trans, %lu err, avg %lu us, max %lu us, max wait %lu us",
+                 client_names[i], (unsigned long)stats.transactions, (unsigned long)stats.errors,
+                 (unsigned long)avg_us, (unsigned long)stats.max_latency_us, (unsigned long)stats.max_wait_us);
+    }
+}
+
+/**
+ * @brief Registers a device on the I2C master bus.
+ * 
+ * Devices are added once at init and their handles reused afterwards, so
+ * transactions do not allocate memory.
+ * 
+ * @param addr 7-bit I2C address of the device.
+ * @param dev_handle Pointer to store the device handle.
+ * 
+ * @return 
+ * - `ESP_OK`: The device was added.
+ * - `ESP_ERR_INVALID_ARG`: NULL handle pointer.
+ * - `ESP_ERR_INVALID_STATE`: The bus is not initialized.
+ * - Other `esp_err_t`: Errors from `i2c_master_bus_add_device`.
+ */
+esp_err_t i2c_add_device(uint16_t addr, i2c_master_dev_handle_t *dev_handle)
 {
-    if (bus_semaphore != NULL) {
-        vSemaphoreDelete(bus_semaphore);
+    if (dev_handle == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (bus_handle == NULL)
+    {
+        ESP_LOGE(TAG, "I2C bus not initialized");
+        LOG_MESSAGE_E(TAG, "I2C bus not initialized");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (device_count >= I2C_MAX_DEVICES)
+    {
+        ESP_LOGE(TAG, "Too many I2C devices");
+        LOG_MESSAGE_E(TAG, "Too many I2C devices");
+        return ESP_ERR_NO_MEM;
     }
-    else {
+
+    i2c_device_config_t dev_conf = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = addr,
+        .scl_speed_hz = I2C_MASTER_FREQ_HZ,
+    };
+
+    esp_err_t err = i2c_master_bus_add_device(bus_handle, &dev_conf, dev_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error adding I2C device 0x%02X: %s", addr, esp_err_to_name(err));
+        LOG_MESSAGE_E(TAG, "Error adding I2C device");
+        return err;
+    }
+    device_handles[device_count++] = dev_handle;
+    return ESP_OK;
+}
+
+/**
+ * @brief Stops the bus manager task and deletes its queues and semaphores,
+ * the devices and the master bus.
+ * 
+ * The device handles kept by the callers are set to NULL, they have to be
+ * added again after the next `i2c_init`.
+ * 
+ * @return 
+ * - `ESP_OK`: Resources deleted.
+ * - `ESP_FAIL`: The bus manager was not running.
+ */
+esp_err_t i2c_delete_bus()
+{
+    if (busTaskHandler == NULL)
+    {
         return ESP_FAIL;
     }
+    vTaskDelete(busTaskHandler);
+    busTaskHandler = NULL;
+
+    for (int i = 0; i < I2C_PRIORITY_COUNT; i++)
+    {
+        vQueueDelete(request_queues[i]);
+        request_queues[i] = NULL;
+    }
+    vSemaphoreDelete(pending_semaphore);
+    pending_semaphore = NULL;
+    for (int i = 0; i < I2C_CLIENT_COUNT; i++)
+    {
+        vSemaphoreDelete(client_mutex[i]);
+        vSemaphoreDelete(client_done[i]);
+        client_mutex[i] = NULL;
+        client_done[i] = NULL;
+    }
+
+    for (int i = 0; i < device_count; i++)
+    {
+        if (*device_handles[i] != NULL)
+        {
+            i2c_master_bus_rm_device(*device_handles[i]);
+            *device_handles[i] = NULL;
+        }
+        device_handles[i] = NULL;
+    }
+    device_count = 0;
+    if (bus_handle != NULL)
+    {
+        i2c_del_master_bus(bus_handle);
+        bus_handle = NULL;
+    }
+
+    is_initialized = false;
     return ESP_OK;
-}
\ No newline at end of file
+}
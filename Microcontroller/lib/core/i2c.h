@@ -4,8 +4,8 @@
  * @brief I2C Master Interface Library for ESP32
  * 
  * This library provides functions for initializing and managing the I2C master interface
- * on the ESP32. It includes functionality to configure I2C pins, acquire exclusive bus
- * access, and manage communication timeouts.
+ * on the ESP32. It includes functionality to configure I2C pins, run prioritized
+ * transactions through a bus manager task, and manage communication timeouts.
  * 
  * @version 1.0
  * @date 2024-12-05
@@ -20,16 +20,16 @@
 #define _I2C_H_
 
 #include "esp_err.h"
-#include "driver/i2c.h"
+#include "driver/i2c_master.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 
 #define I2C_MASTER_SCL_IO GPIO_NUM_22               ///< gpio number for I2C master clock
 #define I2C_MASTER_SDA_IO GPIO_NUM_21               ///< gpio number for I2C master data 
 #define I2C_MASTER_NUM I2C_NUM_0                    ///< I2C port number for master dev
 #define I2C_MASTER_FREQ_HZ 400000                   ///< I2C master clock frequency
-#define I2C_MASTER_TX_BUF_DISABLE 0                 ///< I2C master doesn't need buffer
-#define I2C_MASTER_RX_BUF_DISABLE 0                 ///< I2C master doesn't need buffer
+#define I2C_MASTER_GLITCH_IGNORE_CNT 7             ///< Glitch filter period in APB cycles
 #define I2C_MASTER_TIMEOUT_MS 1000                  ///< I2C timeout in ms
 
 /**
@@ -46,28 +46,122 @@
 esp_err_t i2c_init(void);
 
 /**
- * @brief Acquires the I2C bus for exclusive access.
+ * @brief Clients of the I2C bus. Each one has a fixed priority.
+ */
+typedef enum
+{
+    I2C_CLIENT_LIDAR,   ///< VL53L0X sensors, high priority
+    I2C_CLIENT_BATTERY, ///< INA219 battery sensor, low priority
+    I2C_CLIENT_COUNT
+} i2c_client_t;
+
+/**
+ * @brief Per-client latency statistics, in microseconds.
+ *
+ * `wait` is the time a request spent queued before reaching the bus and
+ * `latency` the total time from submission to completion.
+ */
+typedef struct
+{
+    uint32_t transactions;     ///< Completed transactions
+    uint32_t errors;           ///< Transactions that returned an error
+    uint32_t last_latency_us;  ///< Latency of the last transaction
+    uint32_t max_latency_us;   ///< Worst latency seen
+    uint32_t max_wait_us;      ///< Worst queueing time seen
+    uint64_t total_latency_us; ///< Sum of latencies, for the average
+} i2c_client_stats_t;
+
+/**
+ * @brief Runs a transaction on the bus through the bus manager task.
+ *
+ * Requests are served by priority: LiDAR requests are always taken before
+ * pending battery requests, so low priority reads only use the bus while the
+ * LiDAR is idle (e.g. while the sensor is integrating). The caller blocks
+ * until its transaction is done.
  *
- * This function checks if the I2C bus is available and reserves it for use.
- * It prevents conflicts when multiple tasks attempt to use the I2C bus.
+ * If `rx_len` is 0 the transaction is a write of `tx`, otherwise `tx` is
+ * written and `rx_len` bytes are read with a repeated start.
+ *
+ * @param client Client issuing the request, selects its priority.
+ * @param dev Device handle from `i2c_add_device`.
+ * @param tx Bytes to write.
+ * @param tx_len Number of bytes to write.
+ * @param rx Buffer for the read bytes, may be NULL if `rx_len` is 0.
+ * @param rx_len Number of bytes to read.
  *
  * @return 
- *      - `true`: If the bus was successfully acquired.
- *      - `false`: If the bus is already in use.
+ *      - ESP_OK: The transaction was successful.
+ *      - ESP_ERR_INVALID_ARG: Invalid client or device.
+ *      - ESP_ERR_INVALID_STATE: The bus manager is not running.
+ *      - Other `esp_err_t`: Errors from the I2C driver.
+ */
+esp_err_t i2c_transfer(i2c_client_t client, i2c_master_dev_handle_t dev,
+                       const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len);
+
+/**
+ * @brief Single register write of a register table (8-bit register and value).
  */
-bool i2c_get_bus();
+typedef struct
+{
+    uint8_t reg;
+    uint8_t value;
+} i2c_reg_write_t;
 
 /**
- * @brief Releases the I2C bus after use.
+ * @brief Writes a table of registers with a single bus request.
+ *
+ * Each entry is still its own write on the wire, but the whole table is run
+ * by the bus manager task in one go, so the caller pays one queue round trip
+ * instead of one per register. Stops at the first failed write.
+ *
+ * @param client Client issuing the request, selects its priority.
+ * @param dev Device handle from `i2c_add_device`.
+ * @param table Registers and values, written in order.
+ * @param count Number of entries in `table`.
+ *
+ * @return 
+ *      - ESP_OK: Every register was written.
+ *      - ESP_ERR_INVALID_ARG: Invalid client, device or table.
+ *      - ESP_ERR_INVALID_STATE: The bus manager is not running.
+ *      - Other `esp_err_t`: Errors from the I2C driver.
+ */
+esp_err_t i2c_write_table(i2c_client_t client, i2c_master_dev_handle_t dev,
+                          const i2c_reg_write_t *table, size_t count);
+
+/**
+ * @brief Copies the latency statistics of a client.
+ *
+ * @param client Client to query.
+ * @param stats Pointer to store the statistics.
+ *
+ * @return 
+ *      - ESP_OK: Statistics copied.
+ *      - ESP_ERR_INVALID_ARG: Invalid client or NULL pointer.
+ */
+esp_err_t i2c_get_client_stats(i2c_client_t client, i2c_client_stats_t *stats);
+
+/**
+ * @brief Logs the latency statistics of every client.
+ */
+void i2c_log_client_stats(void);
+
+/**
+ * @brief Registers a device on the I2C master bus.
+ *
+ * The returned handle is kept by the caller and reused for every transaction,
+ * so the bus and device configuration is only done once. `dev_handle` must
+ * stay valid: `i2c_delete_bus` sets it to NULL when it removes the device.
  *
- * This function signals that the I2C bus is no longer in use, making it available
- * for other tasks to access.
+ * @param addr 7-bit I2C address of the device.
+ * @param dev_handle Pointer to store the device handle.
  *
  * @return 
- *      - `true`: If the bus was successfully released.
- *      - `false`: If the release operation failed.
+ *      - ESP_OK: The device was added.
+ *      - ESP_ERR_INVALID_STATE: The bus is not initialized.
+ *      - ESP_ERR_NO_MEM: I2C_MAX_DEVICES devices were already added.
+ *      - Other `esp_err_t`: Errors from `i2c_master_bus_add_device`.
  */
-bool i2c_give_bus();
+esp_err_t i2c_add_device(uint16_t addr, i2c_master_dev_handle_t *dev_handle);
 
 esp_err_t i2c_delete_bus();
 
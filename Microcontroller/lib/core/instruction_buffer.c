@@ -1,61 +1,108 @@
 /**
  * @file instruction_buffer.c
  * @author Guerrico Leonel (lguerrico@outlook.com)
- * @brief Implementation of a circular buffer for storing instructions.
+ * @brief Implementation of the queue of instructions waiting to be executed.
  *
- * This file contains the implementation of a circular buffer that allows storing
- * and retrieving instructions in a thread-safe manner. The buffer uses FreeRTOS
- * semaphores to prevent concurrent access issues.
+ * The instructions are kept in three lanes, served in this order:
+ * - Priority lane: Brake, Pause and Play, a FreeRTOS queue served before anything else.
+ *   Play shares the lane with Pause so the two keep their arrival order.
+ * - Motion slot: a single pending Forward/Backward/Left/Right. A newer motion
+ *   command replaces the pending one (latest wins), so a burst of gamepad
+ *   input never piles up stale moves. A Brake discards it.
+ * - Normal lane: every other instruction, a FreeRTOS queue in arrival order.
  *
- * @version 1.0
+ * A counting semaphore is given once per stored entry, the consumer blocks
+ * on it and is woken by the scheduler as soon as an instruction is saved,
+ * without polling. Entries removed by coalescing leave a spare count behind,
+ * the consumer just goes back to wait when it finds every lane empty.
+ *
+ * @version 2.0
  * @date 2024-12-05
  *
  * @note
- * - The buffer has a fixed size of 10 instructions, with a maximum instruction
- *   length of 40 characters.
+ * - The normal lane holds 10 instructions and the priority lane 4.
  * - Ensure `initBuffer` is called before `saveInstruction` or `getInstruction`.
+ * - The latency counters are written only by the consumer task.
  */
 #include "instruction_buffer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/semphr.h"
-#include <string.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "debug_helper.h"
+#include <stdatomic.h>
+#include <string.h>
 
 
-#define INSTRUCTIONS_BUFFER_SIZE 10 ///< Number of instructions the buffer can hold.
-#define INSTRUCTION_MAX_LENGTH 40   ///< Maximum length of each instruction.
+#define INSTRUCTIONS_BUFFER_SIZE 10 ///< Number of instructions the normal lane can hold.
+#define PRIORITY_BUFFER_SIZE 4      ///< Number of instructions the priority lane can hold.
 
 // Global Variables
-char instructions_buffer[INSTRUCTIONS_BUFFER_SIZE][INSTRUCTION_MAX_LENGTH]; ///< Circular buffer.
-static uint8_t push_index = 0;                                              ///< Index for the next instruction to be saved.
-static uint8_t get_index = 0;                                               ///< Index for the next instruction to be retrieved.
-static SemaphoreHandle_t buffer_access;                                     ///< Semaphore for thread-safe access.
-static const char *TAG = "INSTRUCTION_BUFFER";                              ///< Tag for logging.
+static QueueHandle_t instructions_queue = NULL;                   ///< Normal lane.
+static QueueHandle_t priority_queue = NULL;                       ///< Priority lane (Brake, Pause, Play).
+static SemaphoreHandle_t instruction_ready = NULL;                ///< Given once per stored entry.
+static instruction_t pending_motion;                              ///< Motion slot, latest wins.
+static bool motion_pending = false;                               ///< The motion slot holds an instruction.
+static portMUX_TYPE motion_lock = portMUX_INITIALIZER_UNLOCKED;   ///< Guards the motion slot and the counters.
+static instruction_buffer_stats_t buffer_stats;                   ///< Lane counters.
+static atomic_uint_fast32_t next_sequence = 0;                    ///< Sequence number of the next instruction.
+static instruction_latency_t latency_stats[INST_COUNT];           ///< Latency counters per opcode.
+static const char *TAG = "INSTRUCTION_BUFFER";                    ///< Tag for logging.
+
+/* Motion commands superseded by the next one */
+static bool isMotion(instruction_opcode_t opcode)
+{
+    return opcode == INST_FORWARD || opcode == INST_BACKWARD || opcode == INST_RIGHT || opcode == INST_LEFT;
+}
+
+/* Commands that go ahead of everything else. Play goes with Pause, otherwise a
+ * Pause could overtake an older Play and mapping would end up running */
+static bool isPriority(instruction_opcode_t opcode)
+{
+    return opcode == INST_BRAKE || opcode == INST_PAUSE || opcode == INST_PLAY;
+}
+
+/* Takes the pending motion command, if any */
+static bool takeMotion(instruction_t *inst)
+{
+    bool taken = false;
+    taskENTER_CRITICAL(&motion_lock);
+    if (motion_pending)
+    {
+        *inst = pending_motion;
+        motion_pending = false;
+        taken = true;
+    }
+    taskEXIT_CRITICAL(&motion_lock);
+    return taken;
+}
 
 /**
  * @brief Initializes the instruction buffer.
  *
- * Creates the semaphore required for synchronizing access to the buffer.
- * Logs an error if the semaphore creation fails.
+ * Creates the queues of both lanes and the semaphore counting the stored
+ * instructions. Logs an error if the creation fails.
  *
  * @return
  * - `ESP_OK`: If the buffer was successfully initialized.
- * - `ESP_FAIL`: If semaphore creation fails.
+ * - `ESP_FAIL`: If the creation fails.
  */
 esp_err_t initBuffer()
 {
-    if (buffer_access == NULL)
+    if (instructions_queue == NULL)
     {
-        buffer_access = xSemaphoreCreateBinary();
-        xSemaphoreGive(buffer_access);
-        if (buffer_access == NULL)
+        instructions_queue = xQueueCreate(INSTRUCTIONS_BUFFER_SIZE, sizeof(instruction_t));
+        priority_queue = xQueueCreate(PRIORITY_BUFFER_SIZE, sizeof(instruction_t));
+        instruction_ready = xSemaphoreCreateCounting(INSTRUCTIONS_BUFFER_SIZE + PRIORITY_BUFFER_SIZE + 1, 0);
+        if (instructions_queue == NULL || priority_queue == NULL || instruction_ready == NULL)
         {
-            ESP_LOGE(TAG, "Error creating Semaphore");
-            LOG_MESSAGE_E(TAG, "Error creating Semaphore");
+            ESP_LOGE(TAG, "Error creating Queue");
+            LOG_MESSAGE_E(TAG, "Error creating Queue");
+            deleteBuffer();
             return ESP_FAIL;
         }
-        ESP_LOGW(TAG, "Semaphore initialized");
+        ESP_LOGW(TAG, "Queue initialized");
     }
     return ESP_OK;
 }
@@ -63,128 +110,245 @@ esp_err_t initBuffer()
 /**
  * @brief Retrieves the next instruction from the buffer.
  *
- * Fetches the oldest instruction in the buffer and removes it. If the buffer is
- * empty, the function returns an error.
+ * Serves the priority lane first, then the motion slot, then the normal lane.
  *
- * @param[out] inst Pointer to a buffer where the instruction will be stored.
+ * @param[out] inst Retrieved instruction.
+ * @param[in] timeout_ms Maximum time to wait, INSTRUCTION_WAIT_FOREVER to wait without limit.
  *
  * @return
  * - `ESP_OK`: If the instruction was successfully retrieved.
- * - `ESP_FAIL`: If the buffer is empty or the semaphore cannot be acquired.
+ * - `ESP_ERR_NOT_FOUND`: If no instruction arrived in time.
+ * - `ESP_ERR_INVALID_STATE`: If the buffer was not initialized.
  */
-esp_err_t getInstruction(char *inst)
+esp_err_t getInstruction(instruction_t *inst, uint32_t timeout_ms)
 {
-    // Toma el semáforo antes de acceder al buffer
-    if (xSemaphoreTake(buffer_access, pdMS_TO_TICKS(50)) == pdTRUE)
+    if (instructions_queue == NULL)
     {
+        return ESP_ERR_INVALID_STATE;
+    }
 
-        // Comprobar si el buffer  está vacío
-        if (get_index == push_index)
+    TickType_t wait = (timeout_ms == INSTRUCTION_WAIT_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    TimeOut_t timeout;
+    vTaskSetTimeOutState(&timeout);
+    while (1)
+    {
+        if (xSemaphoreTake(instruction_ready, wait) != pdTRUE)
         {
-            xSemaphoreGive(buffer_access); // Liberar el semáforo
-            return ESP_ERR_NOT_FOUND;      // Buffer vacío
+            return ESP_ERR_NOT_FOUND;
+        }
+        if (xQueueReceive(priority_queue, inst, 0) == pdTRUE || takeMotion(inst) ||
+            xQueueReceive(instructions_queue, inst, 0) == pdTRUE)
+        {
+            return ESP_OK;
+        }
+        // Count left by a coalesced instruction, wait for the next one
+        if (xTaskCheckForTimeOut(&timeout, &wait) == pdTRUE)
+        {
+            return ESP_ERR_NOT_FOUND;
         }
-
-        // Copiar la instrucción en la posición de get_index
-        strncpy(inst, instructions_buffer[get_index], INSTRUCTION_MAX_LENGTH);
-
-        // Actualizar get_index de forma cíclica
-        get_index = (get_index + 1) % INSTRUCTIONS_BUFFER_SIZE;
-
-        // Liberar el semáforo después de acceder al buffer
-        xSemaphoreGive(buffer_access);
-
-        return ESP_OK;
     }
-
-    return ESP_ERR_TIMEOUT;
 }
 
 /**
  * @brief Saves a new instruction into the buffer.
  *
- * Stores a new instruction in the buffer. If the buffer is full, the function
- * returns an error.
+ * Brake, Pause and Play go to the priority lane, a Brake also discards the pending
+ * motion command. Motion commands replace the pending one. Everything else
+ * goes to the normal lane.
  *
- * @param[in] inst Pointer to the instruction to be saved.
+ * @param[in] opcode Opcode of the instruction to be saved.
+ * @param[in] argument Opcode specific argument.
  *
  * @return
  * - `ESP_OK`: If the instruction was successfully saved.
- * - `ESP_FAIL`: If the buffer is full or the semaphore cannot be acquired.
+ * - `ESP_FAIL`: If its lane is full or the buffer was not initialized.
  */
-esp_err_t saveInstruction(char *inst)
+esp_err_t saveInstruction(instruction_opcode_t opcode, int32_t argument)
 {
-
-    // Toma el semáforo antes de acceder al buffer
-    if (xSemaphoreTake(buffer_access, pdMS_TO_TICKS(50)) == pdTRUE)
+    if (instructions_queue == NULL)
     {
+        return ESP_FAIL;
+    }
 
-        // Verificar si el buffer está lleno
-        uint8_t next_push_index = (push_index + 1) % INSTRUCTIONS_BUFFER_SIZE;
-        if (next_push_index == get_index)
+    instruction_t inst = {
+        .opcode = opcode,
+        .argument = argument,
+        .sequence = atomic_fetch_add(&next_sequence, 1),
+        .enqueued_us = esp_timer_get_time(),
+    };
+
+    if (isMotion(opcode))
+    {
+        bool replaced;
+        taskENTER_CRITICAL(&motion_lock);
+        replaced = motion_pending;
+        pending_motion = inst;
+        motion_pending = true;
+        buffer_stats.queued++;
+        if (replaced)
         {
-            xSemaphoreGive(buffer_access); // Liberar el semáforo
-            return ESP_FAIL;               // Buffer lleno
+            buffer_stats.coalesced++;
+        }
+        taskEXIT_CRITICAL(&motion_lock);
+        if (!replaced)
+        {
+            xSemaphoreGive(instruction_ready);
         }
-
-        // Copiar la instrucción a la posición de push_index
-        strncpy(instructions_buffer[push_index], inst, INSTRUCTION_MAX_LENGTH);
-
-        // Actualizar push_index de forma cíclica
-        push_index = next_push_index;
-
-        // Liberar el semáforo después de acceder al buffer
-        xSemaphoreGive(buffer_access);
-
         return ESP_OK;
     }
 
-    return ESP_FAIL;
+    QueueHandle_t lane = instructions_queue;
+    if (isPriority(opcode))
+    {
+        lane = priority_queue;
+        if (opcode == INST_BRAKE)
+        {
+            // A move still waiting must not run after the Brake
+            taskENTER_CRITICAL(&motion_lock);
+            if (motion_pending)
+            {
+                motion_pending = false;
+                buffer_stats.coalesced++;
+            }
+            taskEXIT_CRITICAL(&motion_lock);
+        }
+    }
+
+    bool sent = xQueueSend(lane, &inst, 0) == pdTRUE;
+    taskENTER_CRITICAL(&motion_lock);
+    if (!sent)
+    {
+        buffer_stats.dropped++;
+    }
+    else
+    {
+        buffer_stats.queued++;
+        if (lane == priority_queue)
+        {
+            buffer_stats.prioritized++;
+        }
+    }
+    taskEXIT_CRITICAL(&motion_lock);
+    if (!sent)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGW(TAG, "Buffer full, %s discarded", instruction_name(opcode)));
+        return ESP_FAIL; // Buffer lleno
+    }
+    xSemaphoreGive(instruction_ready);
+    return ESP_OK;
 }
 
 /**
- * @brief Deletes the semaphore used for buffer access control.
- *
- * This function safely deletes the semaphore that controls access to the buffer.
- * It checks if the semaphore exists before attempting deletion.
+ * @brief Deletes the queues of the buffer.
  *
- * @return 
- *      - `ESP_OK` if the semaphore was successfully deleted.
- *      - `ESP_FAIL` if the semaphore was `NULL` before deletion.
+ * @return
+ *      - `ESP_OK` if the queues were successfully deleted.
+ *      - `ESP_FAIL` if the buffer was not created.
  */
-esp_err_t delete_buffer_semaphore()
+esp_err_t deleteBuffer()
 {
-    if (buffer_access != NULL) {
-        vSemaphoreDelete(buffer_access);
-    }
-    else {
+    if (instructions_queue == NULL && priority_queue == NULL && instruction_ready == NULL)
+    {
         return ESP_FAIL;
     }
+    if (instructions_queue != NULL)
+    {
+        vQueueDelete(instructions_queue);
+        instructions_queue = NULL;
+    }
+    if (priority_queue != NULL)
+    {
+        vQueueDelete(priority_queue);
+        priority_queue = NULL;
+    }
+    if (instruction_ready != NULL)
+    {
+        vSemaphoreDelete(instruction_ready);
+        instruction_ready = NULL;
+    }
     return ESP_OK;
 }
 
 /**
- * @brief Clears the instruction buffer and resets indexes.
+ * @brief Discards every queued instruction.
  *
- * This function sets all elements in the `instructions_buffer` array to 0 and 
- * resets the push and get indexes to their initial state. It ensures safe access 
- * using a semaphore with a timeout.
- *
- * @return 
+ * @return
  *      - `ESP_OK` if the buffer was successfully cleared.
- *      - `ESP_ERR_TIMEOUT` if acquiring the semaphore failed within 50ms.
+ *      - `ESP_FAIL` if the buffer was not initialized.
  */
-esp_err_t clearBuffer() 
+esp_err_t clearBuffer()
 {
+    if (instructions_queue == NULL)
+    {
+        return ESP_FAIL;
+    }
+    instruction_t discarded;
+    takeMotion(&discarded);
+    xQueueReset(priority_queue);
+    xQueueReset(instructions_queue);
+    xQueueReset((QueueHandle_t)instruction_ready);
+    return ESP_OK;
+}
 
-    if (xSemaphoreTake(buffer_access, pdMS_TO_TICKS(50)) == pdTRUE)
+void getInstructionBufferStats(instruction_buffer_stats_t *stats)
+{
+    taskENTER_CRITICAL(&motion_lock);
+    *stats = buffer_stats;
+    taskEXIT_CRITICAL(&motion_lock);
+}
+
+void logInstructionBufferStats(void)
+{
+    instruction_buffer_stats_t stats;
+    getInstructionBufferStats(&stats);
+    ESP_LOGI(TAG, "queued %lu, prioritized %lu, coalesced %lu, dropped %lu",
+             (unsigned long)stats.queued, (unsigned long)stats.prioritized,
+             (unsigned long)stats.coalesced, (unsigned long)stats.dropped);
+}
+
+void recordInstructionLatency(const instruction_t *inst)
+{
+    if (inst->opcode <= INST_UNKNOWN || inst->opcode >= INST_COUNT)
     {
-        memset(instructions_buffer, 0, sizeof(instructions_buffer)); // Poner todo en 0
-        push_index = 0;
-        get_index = 0;
-        xSemaphoreGive(buffer_access);
-        return ESP_OK;
+        return;
+    }
+
+    int64_t elapsed = esp_timer_get_time() - inst->enqueued_us;
+    uint32_t latency = elapsed > 0 ? (uint32_t)elapsed : 0;
+    instruction_latency_t *stats = &latency_stats[inst->opcode];
+    stats->count++;
+    stats->last_us = latency;
+    stats->total_us += latency;
+    if (latency > stats->max_us)
+    {
+        stats->max_us = latency;
+    }
+    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "#%lu %s waited %lu us", (unsigned long)inst->sequence,
+                              instruction_name(inst->opcode), (unsigned long)latency));
+}
+
+void getInstructionLatency(instruction_opcode_t opcode, instruction_latency_t *latency)
+{
+    if (opcode <= INST_UNKNOWN || opcode >= INST_COUNT)
+    {
+        memset(latency, 0, sizeof(*latency));
+        return;
     }
+    *latency = latency_stats[opcode];
+}
 
-    return ESP_ERR_TIMEOUT;
-}
\ No newline at end of file
+void logInstructionLatency(void)
+{
+    for (int i = INST_UNKNOWN + 1; i < INST_COUNT; i++)
+    {
+        instruction_latency_t stats = latency_stats[i];
+        if (stats.count == 0)
+        {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: %lu executed, latency avg %lu us, max %lu us, last %lu us",
+                 instruction_name((instruction_opcode_t)i), (unsigned long)stats.count,
+                 (unsigned long)(stats.total_us / stats.count), (unsigned long)stats.max_us,
+                 (unsigned long)stats.last_us);
+    }
+}
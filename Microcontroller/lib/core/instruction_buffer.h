@@ -1,19 +1,25 @@
 /**
  * @file instruction_buffer.h
  * @author Guerrico Leonel (lguerrico@outlook.com)
- * @brief Circular buffer for storing and retrieving instructions.
+ * @brief Queue of instructions waiting to be executed.
  *
- * This library provides an interface for managing a circular buffer that stores
- * textual instructions. It supports operations to initialize the buffer, save
- * instructions, and retrieve them in a thread-safe manner using FreeRTOS semaphores.
+ * This library provides an interface for managing the queue that carries
+ * decoded instructions from the receive paths (MQTT and HTTP) to the task
+ * executing them. Each entry is a typed command with its opcode, argument,
+ * sequence number and the time it was queued, so the consumer can measure
+ * how long every command waited.
  *
- * @version 1.0
+ * Brake, Pause and Play skip ahead of every other instruction, in their
+ * arrival order. Motion commands (Forward, Backward, Left, Right) are
+ * coalesced: only the latest one waits to be executed, a newer one
+ * replaces it.
+ *
+ * @version 2.0
  * @date 2024-12-05
  *
  * @note
  * - Ensure to call `initBuffer` before using any other functions in this library.
- * - The buffer has a fixed size of 10 instructions, with each instruction
- *   limited to 40 characters.
+ * - The queue holds up to 10 instructions, plus 4 Brake/Pause/Play and one motion command.
  *
  */
 
@@ -21,74 +27,140 @@
 #define _INSTRUCTION_BUFFER_H_
 
 #include "esp_err.h"
+#include "instruction_set.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define INSTRUCTION_WAIT_FOREVER UINT32_MAX ///< Timeout of `getInstruction` that never expires
+
+/**
+ * @brief Queued instruction.
+ */
+typedef struct
+{
+    instruction_opcode_t opcode;    ///< What to execute
+    int32_t argument;               ///< Opcode specific argument, 0 if unused
+    uint32_t sequence;              ///< Incremented on every queued instruction
+    int64_t enqueued_us;            ///< Time it was queued (esp_timer)
+} instruction_t;
+
+/**
+ * @brief Enqueue-to-execute latency of one opcode.
+ */
+typedef struct
+{
+    uint32_t count;     ///< Instructions executed
+    uint32_t last_us;   ///< Latency of the last one
+    uint32_t max_us;    ///< Highest latency seen
+    uint64_t total_us;  ///< Sum of all latencies, for the average
+} instruction_latency_t;
+
+/**
+ * @brief Instruction buffer counters.
+ */
+typedef struct
+{
+    uint32_t queued;        ///< Instructions accepted
+    uint32_t prioritized;   ///< Brake/Pause/Play sent through the priority lane
+    uint32_t coalesced;     ///< Motion commands replaced by a newer one or by a Brake
+    uint32_t dropped;       ///< Instructions rejected because their lane was full
+} instruction_buffer_stats_t;
 
 /**
  * @brief Initializes the instruction buffer.
  *
- * This function creates the semaphore required to manage access to the circular
- * buffer. It must be called before any other operations on the buffer.
+ * This function creates the queues. It must be called before any other
+ * operations on the buffer.
  *
  * @return
  * - `ESP_OK`: If the buffer was successfully initialized.
- * - `ESP_FAIL`: If semaphore creation fails.
+ * - `ESP_FAIL`: If the queue creation fails.
  */
 esp_err_t initBuffer(void);
 
 /**
  * @brief Retrieves the next instruction from the buffer.
  *
- * This function fetches the oldest instruction from the buffer and removes it.
- * If the buffer is empty, the operation fails.
+ * Blocks until an instruction is available or the timeout expires, the
+ * caller wakes up as soon as one is queued.
  *
- * @param[out] inst Pointer to a buffer where the retrieved instruction will be stored.
- *             The buffer must be large enough to hold 40 characters.
+ * @param[out] inst Retrieved instruction.
+ * @param[in] timeout_ms Maximum time to wait, INSTRUCTION_WAIT_FOREVER to wait without limit.
  *
  * @return
  * - `ESP_OK`: If the instruction was successfully retrieved.
- * - `ESP_ERR_TIMEOUT`: If the buffer is empty or the operation fails.
  * - `ESP_ERR_NOT_FOUND`: If there is not new instruction.
- * 
+ * - `ESP_ERR_INVALID_STATE`: If the buffer was not initialized.
  */
-esp_err_t getInstruction(char *);
+esp_err_t getInstruction(instruction_t *inst, uint32_t timeout_ms);
 
 /**
  * @brief Saves a new instruction into the buffer.
  *
- * This function stores a new instruction in the buffer. If the buffer is full,
- * the operation fails.
+ * Assigns the sequence number and the enqueue time. Brake, Pause and Play go ahead
+ * of the other instructions, and a Brake discards the pending motion command.
+ * A motion command replaces the pending one. If the lane is full, the
+ * operation fails.
  *
- * @param[in] inst Pointer to the instruction to be saved. The instruction must be
- *             null-terminated and no longer than 40 characters.
+ * @param[in] opcode Opcode of the instruction to be saved.
+ * @param[in] argument Opcode specific argument, 0 if unused.
  *
  * @return
  * - `ESP_OK`: If the instruction was successfully saved.
- * - `ESP_FAIL`: If the buffer is full or the operation fails.
+ * - `ESP_FAIL`: If its lane is full or the buffer was not initialized.
  */
-esp_err_t saveInstruction(char *);
+esp_err_t saveInstruction(instruction_opcode_t opcode, int32_t argument);
 
 /**
- * @brief Deletes the semaphore used for buffer access control.
+ * @brief Deletes the queues of the buffer.
  *
- * This function deletes the semaphore responsible for synchronizing access 
- * to the buffer. It ensures safe deletion by checking if the semaphore exists.
- *
- * @return 
- *      - ESP_OK if the semaphore was successfully deleted.
- *      - ESP_FAIL if the semaphore was NULL before deletion.
+ * @return
+ *      - ESP_OK if the queue was successfully deleted.
+ *      - ESP_FAIL if the queue did not exist.
  */
-esp_err_t delete_buffer_semaphore();
+esp_err_t deleteBuffer(void);
 
 /**
- * @brief Clears the instruction buffer and resets its indexes.
+ * @brief Discards every queued instruction.
  *
- * This function resets all elements in the `instructions_buffer` array to 0 
- * and reinitializes the push and get indexes. It ensures safe access 
- * using a semaphore with a timeout.
- *
- * @return 
+ * @return
  *      - ESP_OK if the buffer was successfully cleared.
- *      - ESP_ERR_TIMEOUT if acquiring the semaphore failed within 50ms.
+ *      - ESP_FAIL if the buffer was not initialized.
  */
 esp_err_t clearBuffer(void);
 
-#endif
\ No newline at end of file
+/**
+ * @brief Copies the buffer counters.
+ *
+ * @param[out] stats Current counters.
+ */
+void getInstructionBufferStats(instruction_buffer_stats_t *stats);
+
+/**
+ * @brief Logs the buffer counters.
+ */
+void logInstructionBufferStats(void);
+
+/**
+ * @brief Records the enqueue-to-execute latency of an instruction.
+ *
+ * Called by the consumer right before executing the instruction.
+ *
+ * @param[in] inst Instruction about to be executed.
+ */
+void recordInstructionLatency(const instruction_t *inst);
+
+/**
+ * @brief Copies the latency counters of an opcode.
+ *
+ * @param[in] opcode Instruction opcode.
+ * @param[out] latency Counters of that opcode.
+ */
+void getInstructionLatency(instruction_opcode_t opcode, instruction_latency_t *latency);
+
+/**
+ * @brief Logs the latency counters of every opcode executed so far.
+ */
+void logInstructionLatency(void);
+
+#endif
@@ -0,0 +1,67 @@
+/**
+ * @file instruction_set.c
+ * @brief Mapping between instruction names and opcodes.
+ *
+ * @version 1.0
+ * @date 2025-03-22
+ */
+
+#include "instruction_set.h"
+#include <string.h>
+
+typedef struct
+{
+    const char *name;
+    size_t len;
+} instruction_entry_t;
+
+#define ENTRY(str) {str, sizeof(str) - 1}
+
+// Indexed by opcode
+static const instruction_entry_t instructions[INST_COUNT] = {
+    [INST_UNKNOWN] = ENTRY("Unknown"),
+    [INST_BRAKE] = ENTRY("Brake"),
+    [INST_BACKWARD] = ENTRY("Backward"),
+    [INST_FORWARD] = ENTRY("Forward"),
+    [INST_RIGHT] = ENTRY("Right"),
+    [INST_LEFT] = ENTRY("Left"),
+    [INST_SPEED_UP] = ENTRY("SpeedUp"),
+    [INST_SPEED_DOWN] = ENTRY("SpeedDown"),
+    [INST_PAUSE] = ENTRY("Pause"),
+    [INST_PLAY] = ENTRY("Play"),
+    [INST_PROFILE_FAST] = ENTRY("ProfileFast"),
+    [INST_PROFILE_DEFAULT] = ENTRY("ProfileDefault"),
+    [INST_PROFILE_ACCURATE] = ENTRY("ProfileAccurate"),
+    [INST_PROFILE_LONG] = ENTRY("ProfileLong"),
+    [INST_SWEEP_PERIOD] = ENTRY("SweepPeriod"),
+    [INST_SCAN_DENSITY] = ENTRY("ScanDensity"),
+    [INST_SCAN_SECTOR] = ENTRY("ScanSector"),
+    [INST_REBOOT] = ENTRY("REBOOT"),
+    [INST_ABORT] = ENTRY("ABORT"),
+};
+
+instruction_opcode_t instruction_lookup(const char *name, size_t len)
+{
+    if (name == NULL)
+    {
+        return INST_UNKNOWN;
+    }
+    // Comparing the length first discards almost every entry without touching the text
+    for (int i = INST_UNKNOWN + 1; i < INST_COUNT; i++)
+    {
+        if (instructions[i].len == len && memcmp(instructions[i].name, name, len) == 0)
+        {
+            return (instruction_opcode_t)i;
+        }
+    }
+    return INST_UNKNOWN;
+}
+
+const char *instruction_name(instruction_opcode_t opcode)
+{
+    if (opcode <= INST_UNKNOWN || opcode >= INST_COUNT)
+    {
+        return instructions[INST_UNKNOWN].name;
+    }
+    return instructions[opcode].name;
+}
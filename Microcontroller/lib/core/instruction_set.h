@@ -0,0 +1,74 @@
+/**
+ * @file instruction_set.h
+ * @brief Instructions understood by the robot and their opcodes.
+ *
+ * Instructions arrive from the backend as text ("Forward", "Pause", ...).
+ * They are mapped to an opcode once, where they are received, and only the
+ * opcode travels through the instruction buffer to the task executing it.
+ * Some instructions take an integer "argument" field next to the name.
+ *
+ * @version 1.0
+ * @date 2025-03-22
+ */
+
+#ifndef _INSTRUCTION_SET_H_
+#define _INSTRUCTION_SET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Instruction opcodes.
+ */
+typedef enum
+{
+    INST_UNKNOWN = 0,       ///< Not an instruction
+    INST_BRAKE,             ///< "Brake"
+    INST_BACKWARD,          ///< "Backward"
+    INST_FORWARD,           ///< "Forward"
+    INST_RIGHT,             ///< "Right"
+    INST_LEFT,              ///< "Left"
+    INST_SPEED_UP,          ///< "SpeedUp"
+    INST_SPEED_DOWN,        ///< "SpeedDown"
+    INST_PAUSE,             ///< "Pause"
+    INST_PLAY,              ///< "Play"
+    INST_PROFILE_FAST,      ///< "ProfileFast"
+    INST_PROFILE_DEFAULT,   ///< "ProfileDefault"
+    INST_PROFILE_ACCURATE,  ///< "ProfileAccurate"
+    INST_PROFILE_LONG,      ///< "ProfileLong"
+    INST_SWEEP_PERIOD,      ///< "SweepPeriod", argument: period in ms, 0 for the fixed speeds
+    INST_SCAN_DENSITY,      ///< "ScanDensity", argument: tenths of a point per degree, 0 for the default
+    INST_SCAN_SECTOR,       ///< "ScanSector", "start" and "end" angles, packed with INSTRUCTION_SECTOR_ARG
+    INST_REBOOT,            ///< "REBOOT"
+    INST_ABORT,             ///< "ABORT"
+    INST_COUNT
+} instruction_opcode_t;
+
+/** @brief Packs the start and end angles of "ScanSector" in one argument */
+#define INSTRUCTION_SECTOR_ARG(start, end) ((int32_t)(((uint32_t)(uint16_t)(start) << 16) | (uint16_t)(end)))
+/** @brief Start angle of a "ScanSector" argument */
+#define INSTRUCTION_SECTOR_START(arg) ((int16_t)((uint32_t)(arg) >> 16))
+/** @brief End angle of a "ScanSector" argument */
+#define INSTRUCTION_SECTOR_END(arg) ((int16_t)((uint32_t)(arg) & 0xFFFF))
+
+/**
+ * @brief Maps an instruction name to its opcode.
+ *
+ * The name does not need to be null-terminated, so it can point straight
+ * into the received message. The match is exact and case sensitive.
+ *
+ * @param[in] name Instruction name.
+ * @param[in] len Length of the name.
+ * @return The opcode, INST_UNKNOWN if the name is not an instruction.
+ */
+instruction_opcode_t instruction_lookup(const char *name, size_t len);
+
+/**
+ * @brief Name of an opcode, for logging.
+ *
+ * @param[in] opcode Instruction opcode.
+ * @return The instruction name, "Unknown" for invalid opcodes.
+ */
+const char *instruction_name(instruction_opcode_t opcode);
+
+#endif // _INSTRUCTION_SET_H_
@@ -0,0 +1,97 @@
+/**
+ * @file sample_buffer.c
+ * @brief Implementation of the lock-free mapping sample ring buffer.
+ *
+ * The producer and the consumer each own one free running counter. The producer
+ * writes the slot of `head` and then publishes `head + 1`. The consumer copies
+ * the slot of `tail` and checks afterwards that the producer did not start
+ * rewriting it in the meantime, in which case the copy is discarded and the
+ * consumer jumps to the oldest sample still in the buffer.
+ *
+ * @version 1.0
+ * @date 2025-03-10
+ */
+#include "sample_buffer.h"
+#include "esp_log.h"
+#include <stdatomic.h>
+
+#define SAMPLE_BUFFER_SIZE 64 ///< Number of samples, must be a power of two.
+
+static const char *TAG = "SAMPLE_BUFFER";
+
+static mapping_value_t samples[SAMPLE_BUFFER_SIZE];
+static atomic_uint_fast32_t head = 0;     ///< Samples pushed, written only by the producer.
+static atomic_uint_fast32_t tail = 0;     ///< Samples consumed or skipped, written only by the consumer.
+static atomic_uint_fast32_t dropped = 0;  ///< Written only by the consumer.
+static atomic_uint_fast32_t popped = 0;   ///< Written only by the consumer.
+static atomic_uint_fast32_t max_used = 0; ///< Written only by the consumer.
+
+void pushSample(const mapping_value_t *sample)
+{
+    uint32_t index = atomic_load_explicit(&head, memory_order_relaxed);
+    samples[index & (SAMPLE_BUFFER_SIZE - 1)] = *sample;
+    // Publica la muestra recien escrita
+    atomic_store_explicit(&head, index + 1, memory_order_release);
+}
+
+bool popSample(mapping_value_t *sample)
+{
+    uint32_t index = atomic_load_explicit(&tail, memory_order_relaxed);
+
+    while (1)
+    {
+        uint32_t written = atomic_load_explicit(&head, memory_order_acquire);
+        uint32_t used = written - index;
+        if (used == 0)
+        {
+            return false; // Buffer vacio
+        }
+        uint32_t occupancy = (used > SAMPLE_BUFFER_SIZE) ? SAMPLE_BUFFER_SIZE : used;
+        if (occupancy > atomic_load_explicit(&max_used, memory_order_relaxed))
+        {
+            atomic_store_explicit(&max_used, occupancy, memory_order_relaxed);
+        }
+        if (used > SAMPLE_BUFFER_SIZE)
+        {
+            // El productor dio la vuelta: las muestras mas viejas se perdieron
+            uint32_t lost = used - SAMPLE_BUFFER_SIZE;
+            atomic_fetch_add_explicit(&dropped, lost, memory_order_relaxed);
+            index += lost;
+        }
+
+        *sample = samples[index & (SAMPLE_BUFFER_SIZE - 1)];
+
+        // The slot of `index` is rewritten when the producer writes index + SIZE,
+        // which it only starts once head reached that value.
+        atomic_thread_fence(memory_order_acquire);
+        written = atomic_load_explicit(&head, memory_order_relaxed);
+        if (written - index < SAMPLE_BUFFER_SIZE)
+        {
+            break;
+        }
+        // La copia puede estar corrupta, se descarta y se reintenta
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        index++;
+    }
+
+    atomic_store_explicit(&tail, index + 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&popped, 1, memory_order_relaxed);
+    return true;
+}
+
+void getSampleBufferStats(sample_buffer_stats_t *stats)
+{
+    stats->pushed = atomic_load_explicit(&head, memory_order_relaxed);
+    stats->popped = atomic_load_explicit(&popped, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+    stats->max_used = atomic_load_explicit(&max_used, memory_order_relaxed);
+}
+
+void logSampleBufferStats(void)
+{
+    sample_buffer_stats_t stats;
+    getSampleBufferStats(&stats);
+    ESP_LOGI(TAG, "pushed %lu, popped %lu, dropped %lu, max used %lu/%d",
+             (unsigned long)stats.pushed, (unsigned long)stats.popped, (unsigned long)stats.dropped,
+             (unsigned long)stats.max_used, SAMPLE_BUFFER_SIZE);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file sample_buffer.h
+ * @brief Ring buffer carrying mapping samples from the mapping task to the publisher task.
+ *
+ * Single producer (mapping task) and single consumer (publisher task), no locks.
+ * The producer never blocks: when the buffer is full the oldest sample is
+ * overwritten, and the consumer counts the samples it lost.
+ *
+ * @version 1.0
+ * @date 2025-03-10
+ *
+ * @note
+ * - Only one task may push and only one task may pop.
+ */
+
+#ifndef _SAMPLE_BUFFER_H_
+#define _SAMPLE_BUFFER_H_
+
+#include "esp_err.h"
+#include "mapping.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Ring buffer counters.
+ */
+typedef struct
+{
+    uint32_t pushed;     ///< Samples written by the producer
+    uint32_t popped;     ///< Samples read by the consumer
+    uint32_t dropped;    ///< Samples overwritten before being read
+    uint32_t max_used;   ///< Highest occupancy seen by the consumer
+} sample_buffer_stats_t;
+
+/**
+ * @brief Stores a sample, overwriting the oldest one if the buffer is full.
+ *
+ * Never blocks, safe to call from the acquisition loop.
+ *
+ * @param[in] sample Sample to store.
+ */
+void pushSample(const mapping_value_t *sample);
+
+/**
+ * @brief Takes the oldest sample in the buffer.
+ *
+ * If the producer overwrote samples since the last call they are skipped
+ * and counted as dropped.
+ *
+ * @param[out] sample Where the sample is copied.
+ *
+ * @return
+ * - `true`: A sample was copied.
+ * - `false`: The buffer is empty.
+ */
+bool popSample(mapping_value_t *sample);
+
+/**
+ * @brief Copies the ring buffer counters.
+ *
+ * @param[out] stats Where the counters are copied.
+ */
+void getSampleBufferStats(sample_buffer_stats_t *stats);
+
+/**
+ * @brief Logs the ring buffer counters.
+ */
+void logSampleBufferStats(void);
+
+#endif
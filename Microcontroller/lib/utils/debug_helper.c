@@ -4,48 +4,365 @@
  * 
  * @brief Implementation of logging helper for ESP32.
  * 
- * This file implements the logging function that sends messages to different 
- * handlers based on the log level. If an error occurs while sending, it logs 
- * the issue using ESP-IDF's logging system.
+ * `LOG_MESSAGE` only copies the message into a fixed ring and returns, it
+ * never formats JSON nor touches MQTT, so it is safe to call while holding
+ * the I2C bus or right before a motor command. A low priority task calls
+ * `drainLogMessages`, which publishes the queued messages through the
+ * MQTT handler. If sending fails, the issue is logged using ESP-IDF's
+ * logging system.
+ *
+ * Before being queued every message goes through:
+ * - Repeat suppression: the same message from the same tag is counted
+ *   instead of queued, and later reported as "last message repeated N times".
+ * - Rate limiting: a token bucket per tag, LOG_RATE_BURST messages at once
+ *   and LOG_RATE_PER_SEC after that.
  * 
  * @date 2025-02-09
  *  
  */
  
 #include "debug_helper.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "mqtt_handler.h"
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_RING_SIZE 16        ///< Messages waiting to be published.
+#define LOG_RATE_TAGS 20        ///< Tags with their own token bucket, the last one is shared.
+#define LOG_RATE_BURST 5        ///< Messages a tag can send at once.
+#define LOG_RATE_PER_SEC 1      ///< Messages per second a tag gets back.
+#define LOG_TOKEN 1000000       ///< One message, in token units (1 unit per us at 1 msg/s).
+#define LOG_RECORDS_SIZE 64     ///< Binary records kept until the next flush.
+
+/* Queued message, `repeats` != 0 marks a "last message repeated" report */
+typedef struct
+{
+    const char *tag;
+    uint8_t level;
+    uint16_t repeats;
+    char msg[LOG_MESSAGE_MAX_SIZE];
+} log_entry_t;
+
+/* Token bucket of one tag */
+typedef struct
+{
+    const char *tag;
+    uint32_t tokens;
+    int64_t last_us;
+} log_bucket_t;
+
+static const char *TAG = "DEBUG_HELPER";
+
+static log_entry_t ring[LOG_RING_SIZE];
+static uint8_t ring_head = 0;                               ///< Next entry to publish.
+static uint8_t ring_count = 0;
+static log_bucket_t buckets[LOG_RATE_TAGS];
+static log_message_stats_t stats;
+static portMUX_TYPE log_lock = portMUX_INITIALIZER_UNLOCKED; ///< Guards the ring, the buckets and the counters.
+static SemaphoreHandle_t log_ready = NULL;                   ///< Given when a message is queued.
+
+/* Last queued message, for the repeat suppression */
+static const char *last_tag = NULL;
+static uint8_t last_level = 0;
+static uint32_t last_hash = 0;
+static uint16_t last_repeats = 0;
+
+/* FNV-1a, cheap enough to run on every message */
+static uint32_t hashMessage(const char *msg)
+{
+    uint32_t hash = 2166136261u;
+    while (*msg)
+    {
+        hash = (hash ^ (uint8_t)*msg++) * 16777619u;
+    }
+    return hash;
+}
+
+/* Takes a token from the bucket of the tag, call with log_lock held */
+static bool takeToken(const char *tag, int64_t now)
+{
+    log_bucket_t *bucket = &buckets[LOG_RATE_TAGS - 1];
+    for (int i = 0; i < LOG_RATE_TAGS; i++)
+    {
+        if (buckets[i].tag == tag)
+        {
+            bucket = &buckets[i];
+            break;
+        }
+        if (buckets[i].tag == NULL)
+        {
+            buckets[i].tag = tag;
+            buckets[i].tokens = LOG_RATE_BURST * LOG_TOKEN;
+            buckets[i].last_us = now;
+            bucket = &buckets[i];
+            break;
+        }
+    }
+
+    uint64_t refill = (uint64_t)(now - bucket->last_us) * LOG_RATE_PER_SEC;
+    bucket->last_us = now;
+    bucket->tokens = (refill >= LOG_RATE_BURST * LOG_TOKEN - bucket->tokens)
+                         ? LOG_RATE_BURST * LOG_TOKEN
+                         : bucket->tokens + (uint32_t)refill;
+    if (bucket->tokens < LOG_TOKEN)
+    {
+        return false;
+    }
+    bucket->tokens -= LOG_TOKEN;
+    return true;
+}
+
+/* Reserves the next free entry of the ring, call with log_lock held */
+static log_entry_t *pushEntry(const char *tag, uint8_t level)
+{
+    if (ring_count == LOG_RING_SIZE)
+    {
+        stats.dropped++;
+        return NULL;
+    }
+    log_entry_t *entry = &ring[(ring_head + ring_count) % LOG_RING_SIZE];
+    ring_count++;
+    stats.queued++;
+    entry->tag = tag;
+    entry->level = level;
+    entry->repeats = 0;
+    entry->msg[0] = '\0';
+    return entry;
+}
+
+/* Queues the report of the suppressed repeats, call with log_lock held */
+static bool pushRepeats(void)
+{
+    if (last_repeats == 0)
+    {
+        return false;
+    }
+    log_entry_t *entry = pushEntry(last_tag, last_level);
+    if (entry == NULL)
+    {
+        return false;
+    }
+    entry->repeats = last_repeats;
+    last_repeats = 0;
+    return true;
+}
+
+esp_err_t initLogMessages(void)
+{
+    if (log_ready == NULL)
+    {
+        log_ready = xSemaphoreCreateBinary();
+        if (log_ready == NULL)
+        {
+            ESP_LOGE(TAG, "Error creating log semaphore");
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
 
 /**
- * @brief Sends a log message to the appropriate logging system.
+ * @brief Queues a log message to be published.
  * 
- * This function determines the type of message (error, warning, or info) 
- * and calls the corresponding handler. If sending fails, an error is logged 
- * using ESP-IDF's logging system.
+ * Never blocks: the message is copied (truncated to LOG_MESSAGE_MAX_SIZE)
+ * into the ring, or counted and discarded if it is a repeat, its tag ran
+ * out of tokens or the ring is full.
  * 
  * @param[in] level Log level (LOG_ERROR, LOG_WARNING, LOG_INFO).
- * @param[in] TAG   Identifier tag for the log message.
+ * @param[in] TAG   Identifier tag for the log message, must be a static string.
  * @param[in] fmt   Formatted log message string.
  */
 void LOG_MESSAGE(int level, const char *TAG, char *fmt) {
 
-    esp_err_t err = ESP_OK;
+    if (fmt == NULL)
+    {
+        return;
+    }
+    uint32_t hash = hashMessage(fmt);
+    int64_t now = esp_timer_get_time();
+    bool queued = false;
 
-    // Send message based on log level
-    switch(level){
-        case LOG_ERROR:
-            err = sendErrorMessage(TAG, fmt);
-            break;
-        case LOG_WARNING:
-            err = sendWarningMessage(TAG, fmt);
-            break;
-        case LOG_INFO:
-            err = sendInfoMessage(TAG, fmt);
-            break;
+    taskENTER_CRITICAL(&log_lock);
+    if (TAG == last_tag && level == last_level && hash == last_hash)
+    {
+        // Counted now, reported when another message arrives or the ring drains
+        if (last_repeats < UINT16_MAX)
+        {
+            last_repeats++;
+        }
+        stats.suppressed++;
     }
+    else
+    {
+        queued = pushRepeats();
+        if (!takeToken(TAG, now))
+        {
+            stats.rate_limited++;
+        }
+        else
+        {
+            log_entry_t *entry = pushEntry(TAG, (uint8_t)level);
+            if (entry != NULL)
+            {
+                strncpy(entry->msg, fmt, sizeof(entry->msg) - 1);
+                entry->msg[sizeof(entry->msg) - 1] = '\0';
+                queued = true;
+                // Only a queued message can be repeated, a discarded one is tried again next time
+                last_tag = TAG;
+                last_level = (uint8_t)level;
+                last_hash = hash;
+                last_repeats = 0;
+            }
+        }
+    }
+    taskEXIT_CRITICAL(&log_lock);
+
+    if (queued && log_ready != NULL)
+    {
+        xSemaphoreGive(log_ready);
+    }
+}
+
+/**
+ * @brief Publishes the queued log messages.
+ * 
+ * Waits up to `timeout_ms` for a message, then publishes everything in the
+ * ring. When nothing arrives in time, the pending repeat count is reported.
+ * 
+ * @param[in] timeout_ms Maximum time to wait for a message.
+ */
+void drainLogMessages(uint32_t timeout_ms)
+{
+    if (log_ready == NULL)
+    {
+        vTaskDelay(pdMS_TO_TICKS(timeout_ms));
+        return;
+    }
+    if (xSemaphoreTake(log_ready, pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+    {
+        taskENTER_CRITICAL(&log_lock);
+        pushRepeats();
+        taskEXIT_CRITICAL(&log_lock);
+    }
+
+    log_entry_t entry;
+    char repeated[40];
+    while (1)
+    {
+        taskENTER_CRITICAL(&log_lock);
+        bool available = ring_count > 0;
+        if (available)
+        {
+            entry = ring[ring_head];
+            ring_head = (ring_head + 1) % LOG_RING_SIZE;
+            ring_count--;
+        }
+        taskEXIT_CRITICAL(&log_lock);
+        if (!available)
+        {
+            return;
+        }
+
+        const char *msg = entry.msg;
+        if (entry.repeats != 0)
+        {
+            snprintf(repeated, sizeof(repeated), "last message repeated %u times", entry.repeats);
+            msg = repeated;
+        }
+
+        esp_err_t err = ESP_OK;
+
+        // Send message based on log level
+        switch(entry.level){
+            case LOG_ERROR:
+                err = sendErrorMessage(entry.tag, msg);
+                break;
+            case LOG_WARNING:
+                err = sendWarningMessage(entry.tag, msg);
+                break;
+            case LOG_INFO:
+                err = sendInfoMessage(entry.tag, msg);
+                break;
+        }
+
+        // Log error if message sending fails
+        if (err != ESP_OK) {
+            taskENTER_CRITICAL(&log_lock);
+            stats.failed++;
+            taskEXIT_CRITICAL(&log_lock);
+            ESP_LOGE(entry.tag, "Error enviando mensaje de log: %s", msg);
+        }
+    }
+}
+
+void getLogMessageStats(log_message_stats_t *out)
+{
+    taskENTER_CRITICAL(&log_lock);
+    *out = stats;
+    taskEXIT_CRITICAL(&log_lock);
+}
+
+void logLogMessageStats(void)
+{
+    log_message_stats_t current;
+    getLogMessageStats(&current);
+    ESP_LOGI(TAG, "log messages: queued %lu, suppressed %lu, rate limited %lu, dropped %lu, failed %lu",
+             (unsigned long)current.queued, (unsigned long)current.suppressed,
+             (unsigned long)current.rate_limited, (unsigned long)current.dropped,
+             (unsigned long)current.failed);
+}
+
+#ifdef LOG_BINARY_RECORDS
+static log_record_t records[LOG_RECORDS_SIZE];
+static uint16_t records_count = 0;
+static uint32_t records_dropped = 0;
+#endif
+
+void logRecord(uint8_t level, uint16_t id, int32_t a, int32_t b, int32_t c)
+{
+#ifdef LOG_BINARY_RECORDS
+    uint32_t time_ms = esp_log_timestamp();
+    taskENTER_CRITICAL(&log_lock);
+    if (records_count == LOG_RECORDS_SIZE)
+    {
+        records_dropped++;
+    }
+    else
+    {
+        records[records_count++] = (log_record_t){
+            .time_ms = time_ms,
+            .id = id,
+            .level = level,
+            .values = {a, b, c},
+        };
+    }
+    taskEXIT_CRITICAL(&log_lock);
+#endif
+}
+
+void flushLogRecords(void)
+{
+#ifdef LOG_BINARY_RECORDS
+    static log_record_t copy[LOG_RECORDS_SIZE];
+    uint16_t count;
+    uint32_t dropped;
+
+    taskENTER_CRITICAL(&log_lock);
+    count = records_count;
+    dropped = records_dropped;
+    memcpy(copy, records, count * sizeof(log_record_t));
+    records_count = 0;
+    records_dropped = 0;
+    taskEXIT_CRITICAL(&log_lock);
 
-    // Log error if message sending fails
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error enviando mensaje de log: %s", fmt);
+    if (count > 0)
+    {
+        ESP_LOGI(TAG, "records: %u, dropped %lu", count, (unsigned long)dropped);
+        ESP_LOG_BUFFER_HEX(TAG, copy, count * sizeof(log_record_t));
     }
+#endif
 }
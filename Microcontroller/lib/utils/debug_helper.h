@@ -32,23 +32,79 @@
     #define DEBUGING_ESP_LOG(...) do {} while (0)
 #endif
 
+/* Uncomment to keep TIER_LOG_RECORD values as binary records in RAM instead
+ * of printing them, see flushLogRecords */
+// #define LOG_BINARY_RECORDS
+
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOG_MESSAGE_MAX_SIZE 96  /**< Longer messages are truncated */
+
+/**
+ * @brief Counters of the queued log messages.
+ */
+typedef struct
+{
+    uint32_t queued;        /**< Messages (and repeat reports) put in the ring */
+    uint32_t suppressed;    /**< Repeats of the previous message */
+    uint32_t rate_limited;  /**< Discarded because their tag ran out of tokens */
+    uint32_t dropped;       /**< Discarded because the ring was full */
+    uint32_t failed;        /**< Taken from the ring but not published */
+} log_message_stats_t;
 
 /**
  * @brief Logs a message with a specified log level.
  * 
- * This function sends a formatted log message to the appropriate log handler 
- * based on the level of severity.
+ * This function queues the message and returns right away, a low priority
+ * task publishes it later (see `drainLogMessages`). Repeats of the previous
+ * message and tags sending too often are counted instead of queued.
  * 
  * @param[in] level Log level (e.g., LOG_ERROR, LOG_WARNING, LOG_INFO).
- * @param[in] TAG   Tag to identify the source of the log message.
+ * @param[in] TAG   Tag to identify the source of the log message, must be a static string.
  * @param[in] fmt   Log message format string.
  */
 void LOG_MESSAGE(int level, const char *TAG, char *fmt);
 
+/**
+ * @brief Creates the semaphore that wakes the drain task.
+ * 
+ * Messages logged before are kept in the ring and published once the drain
+ * task runs.
+ * 
+ * @return ESP_OK on success, ESP_FAIL if the semaphore cannot be created.
+ */
+esp_err_t initLogMessages(void);
+
+/**
+ * @brief Publishes the queued log messages, to be called in a loop by a low priority task.
+ * 
+ * @param[in] timeout_ms Maximum time to wait for a new message.
+ */
+void drainLogMessages(uint32_t timeout_ms);
+
+/**
+ * @brief Copies the log message counters.
+ * 
+ * @param[out] out Current counters.
+ */
+void getLogMessageStats(log_message_stats_t *out);
+
+/**
+ * @brief Logs the log message counters to the console.
+ */
+void logLogMessageStats(void);
+
 // Log level definitions
+#define LOG_NONE    0
 #define LOG_ERROR   1
 #define LOG_WARNING 2
 #define LOG_INFO    3
+#define LOG_DEBUG   4
 
 /**
  * @brief Logs an error message.
@@ -65,4 +121,131 @@ void LOG_MESSAGE(int level, const char *TAG, char *fmt);
  */
 #define LOG_MESSAGE_I(TAG, fmt) LOG_MESSAGE(LOG_INFO, TAG, fmt)
 
+/*
+ * Tiered console logging.
+ *
+ * Each module may define LOG_MODULE_LEVEL before including any header, the
+ * TIER_LOG* calls above that level are removed at compile time. By default
+ * the modules keep warnings and errors, and info too in DEBUG builds.
+ *
+ * The console runs at 115200 baud, so calls made on every sample must use
+ * TIER_LOG_SAMPLED, TIER_LOG_EVERY_MS or TIER_LOG_RECORD: their cost does
+ * not grow with the sample rate.
+ */
+#ifndef LOG_MODULE_LEVEL
+    #if DEBUG
+        #define LOG_MODULE_LEVEL LOG_INFO
+    #else
+        #define LOG_MODULE_LEVEL LOG_WARNING
+    #endif
+#endif
+
+/** @brief True if the module keeps the calls of that level */
+#define TIER_LOG_ENABLED(level) ((level) != LOG_NONE && (level) <= LOG_MODULE_LEVEL)
+
+/* LOG_DEBUG is printed as info, ESP-IDF already filters its own debug level */
+#define TIER_ESP_LEVEL(level) ((level) >= LOG_INFO ? ESP_LOG_INFO : (esp_log_level_t)(level))
+
+/**
+ * @brief Logs to the console if the module keeps that level.
+ */
+#define TIER_LOG(level, TAG, fmt, ...) do { \
+        if (TIER_LOG_ENABLED(level)) { \
+            ESP_LOG_LEVEL(TIER_ESP_LEVEL(level), TAG, fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define TIER_LOGE(TAG, fmt, ...) TIER_LOG(LOG_ERROR, TAG, fmt, ##__VA_ARGS__)
+#define TIER_LOGW(TAG, fmt, ...) TIER_LOG(LOG_WARNING, TAG, fmt, ##__VA_ARGS__)
+#define TIER_LOGI(TAG, fmt, ...) TIER_LOG(LOG_INFO, TAG, fmt, ##__VA_ARGS__)
+#define TIER_LOGD(TAG, fmt, ...) TIER_LOG(LOG_DEBUG, TAG, fmt, ##__VA_ARGS__)
+
+/**
+ * @brief Logs one of every `every` calls of this call site.
+ */
+#define TIER_LOG_SAMPLED(level, TAG, every, fmt, ...) do { \
+        if (TIER_LOG_ENABLED(level)) { \
+            static uint32_t tier_calls_; \
+            if (tier_calls_++ % (every) == 0) { \
+                ESP_LOG_LEVEL(TIER_ESP_LEVEL(level), TAG, fmt, ##__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+/**
+ * @brief Logs at most once every `period_ms` from this call site. The first
+ * call always logs.
+ */
+#define TIER_LOG_EVERY_MS(level, TAG, period_ms, fmt, ...) do { \
+        if (TIER_LOG_ENABLED(level)) { \
+            static bool tier_logged_ = false; \
+            static int64_t tier_last_us_; \
+            int64_t tier_now_us_ = esp_timer_get_time(); \
+            if (!tier_logged_ || tier_now_us_ - tier_last_us_ >= (int64_t)(period_ms) * 1000) { \
+                tier_logged_ = true; \
+                tier_last_us_ = tier_now_us_; \
+                ESP_LOG_LEVEL(TIER_ESP_LEVEL(level), TAG, fmt, ##__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+/**
+ * @brief Identifiers of the binary records.
+ */
+typedef enum
+{
+    LOG_RECORD_SAMPLE = 1,  /**< Mapping sample: distance, angle, sensor */
+    LOG_RECORD_ANGLE,       /**< Servo angle: angle, rate_q32, offset */
+} log_record_id_t;
+
+/**
+ * @brief Binary record, 20 bytes instead of a formatted line.
+ */
+typedef struct
+{
+    uint32_t time_ms;       /**< esp_log_timestamp() when recorded */
+    uint16_t id;            /**< log_record_id_t */
+    uint8_t level;          /**< LOG_ERROR ... LOG_DEBUG */
+    uint8_t reserved;
+    int32_t values[3];
+} log_record_t;
+
+/**
+ * @brief Logs three values, one of every `every` calls of this call site.
+ *
+ * With LOG_BINARY_RECORDS the values are stored as a `log_record_t` and
+ * printed later by `flushLogRecords`, otherwise they are formatted with `fmt`,
+ * which receives the three values as int32_t (use PRIi32).
+ */
+#ifdef LOG_BINARY_RECORDS
+    #define TIER_LOG_RECORD(level, TAG, id, every, fmt, a, b, c) do { \
+            if (TIER_LOG_ENABLED(level)) { \
+                static uint32_t tier_calls_; \
+                if (tier_calls_++ % (every) == 0) { \
+                    logRecord(level, id, (int32_t)(a), (int32_t)(b), (int32_t)(c)); \
+                } \
+            } \
+        } while (0)
+#else
+    #define TIER_LOG_RECORD(level, TAG, id, every, fmt, a, b, c) \
+        TIER_LOG_SAMPLED(level, TAG, every, fmt, (int32_t)(a), (int32_t)(b), (int32_t)(c))
+#endif
+
+/**
+ * @brief Stores a binary record, never blocks nor prints.
+ *
+ * @param[in] level Log level of the record.
+ * @param[in] id    log_record_id_t of the record.
+ * @param[in] a, b, c Values of the record.
+ */
+void logRecord(uint8_t level, uint16_t id, int32_t a, int32_t b, int32_t c);
+
+/**
+ * @brief Prints the stored binary records as hex and empties the buffer.
+ *
+ * Does nothing unless LOG_BINARY_RECORDS is defined. Call it from a low
+ * priority task.
+ */
+void flushLogRecords(void);
+
 #endif // DEBUG_HELPER_H_
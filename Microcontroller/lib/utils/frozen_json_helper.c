@@ -3,8 +3,8 @@
  * @author Guerrico Leonel (lguerrico@outlook.com)
  * @brief Implementation of JSON Helper Library for ESP32 using Frozen JSON
  *
- * This file contains the implementation of utility functions for creating,
- * parsing, and printing JSON objects using the `Frozen JSON` library. These functions
+ * This file contains the implementation of utility functions for
+ * parsing and printing JSON objects using the `Frozen JSON` library. These functions
  * simplify working with JSON in ESP32 applications.
  *
  * @version 1.0
@@ -20,6 +20,9 @@
 #include "frozen.h"
 #include "debug_helper.h"
 
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 /**
@@ -27,117 +30,116 @@
  */
 static const char *TAG = "JSON_HELPER";
 
+
+/* State of the json_walk search */
+typedef struct
+{
+    const char *path;
+    enum json_token_type type;
+    struct json_token token;
+    bool found;
+} string_search_t;
+
+/* json_walk callback, keeps the first value of the searched type found at the searched path */
+static void find_string_cb(void *callback_data, const char *name, size_t name_len,
+                           const char *path, const struct json_token *token)
+{
+    string_search_t *search = (string_search_t *)callback_data;
+    if (!search->found && token->type == search->type && strcmp(path, search->path) == 0)
+    {
+        search->token = *token;
+        search->found = true;
+    }
+}
+
 /**
- * @brief Creates a JSON string from key-value pairs using Frozen JSON.
+ * @brief Finds a string value in a JSON document without copying it.
+ *
+ * Walks the document with `json_walk`, nothing is allocated and the other
+ * fields are skipped without being converted.
  *
- * @param[out] msg Buffer to store the JSON string.
- * @param[in] msg_size Size of the buffer.
- * @param[in] keys Array of keys for the JSON object.
- * @param[in] values Array of values corresponding to the keys.
- * @param[in] length Number of key-value pairs.
+ * @param[in] data The JSON document, it does not need to be null-terminated.
+ * @param[in] length Length of the document.
+ * @param[in] path Path of the value, e.g. ".instruction".
+ * @param[out] value Points into `data` at the first character of the string.
+ * @param[out] value_len Length of the string, still JSON escaped.
  *
  * @return
- * - `ESP_OK`: If the JSON string was successfully created.
- * - `ESP_FAIL`: If there was an error creating the JSON string.
+ * - `ESP_OK`: If the value was found.
+ * - `ESP_ERR_NOT_FOUND`: If there is no string at that path.
+ * - `ESP_FAIL`: If the document is not valid JSON.
  */
-esp_err_t create_json_data(char **msg, const char **keys, const char **values, const size_t length) {
-    struct json_out out = JSON_OUT_BUF(NULL, 0); // Inicializa buffer vacío
-    size_t size = 0;
-
-    // Calcula el tamaño del JSON sin generar la cadena aún
-    int estimated_size = json_printf(&out, "{");
-    for (size_t i = 0; i < length; i++) {
-        estimated_size += json_printf(&out, "%Q:%Q%s", keys[i], values[i], (i < length - 1) ? "," : "");
-    }
-    estimated_size += json_printf(&out, "}");
+esp_err_t json_find_string(const char *data, size_t length, const char *path,
+                           const char **value, size_t *value_len)
+{
+    string_search_t search = {.path = path, .type = JSON_TYPE_STRING, .found = false};
 
-    // Asigna memoria dinámica
-    size = estimated_size + 1; // +1 para el null-terminator
-    *msg = (char *)malloc(size);
-    if (*msg == NULL) {
-        ESP_LOGE(TAG, "Error allocating memory for JSON string");
-        LOG_MESSAGE_E(TAG,"Error allocating memory for JSON string");
+    if (json_walk(data, (int)length, find_string_cb, &search) < 0)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Invalid JSON: %.*s", (int)length, data));
         return ESP_FAIL;
     }
-
-    // Genera el JSON en el buffer asignado
-    struct json_out out_real = JSON_OUT_BUF(*msg, size);
-    json_printf(&out_real, "{");
-    for (size_t i = 0; i < length; i++) {
-        json_printf(&out_real, "%Q:%Q%s", keys[i], values[i], (i < length - 1) ? "," : "");
+    if (!search.found)
+    {
+        return ESP_ERR_NOT_FOUND;
     }
-    json_printf(&out_real, "}");
-
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "JSON created: %s", *msg)); // Log para verificar salida
 
+    *value = search.token.ptr;
+    *value_len = (size_t)search.token.len;
     return ESP_OK;
 }
 
-
 /**
- * @brief Deserializes a JSON string and extracts specific data using Frozen JSON.
+ * @brief Finds an integer value in a JSON document.
+ *
+ * Same walk as `json_find_string`, the number is converted in place.
  *
- * @param[in] data The JSON string to parse.
- * @param[out] msg Buffer to store the extracted instruction.
- * @param[in] msg_size Length of the output buffer.
+ * @param[in] data The JSON document, it does not need to be null-terminated.
+ * @param[in] length Length of the document.
+ * @param[in] path Path of the value, e.g. ".argument".
+ * @param[out] value The integer found.
  *
  * @return
- * - `ESP_OK`: If the data was successfully deserialized.
- * - `ESP_ERR_INVALID_ARG`: If expected keys are missing.
- * - `ESP_ERR_INVALID_SIZE`: If the extracted instruction exceeds the buffer size.
- * - `ESP_FAIL`: If parsing fails.
+ * - `ESP_OK`: If the value was found.
+ * - `ESP_ERR_NOT_FOUND`: If there is no number at that path.
+ * - `ESP_ERR_INVALID_ARG`: If the number is not an integer or does not fit in 32 bits.
+ * - `ESP_FAIL`: If the document is not valid JSON.
  */
-#include "esp_log.h"
-#include "frozen.h"
-
-#define TAG "JSON_PARSER"
-
-esp_err_t deserialize_json_data(const char *data, char *msg, size_t msg_size) 
+esp_err_t json_find_int(const char *data, size_t length, const char *path, int32_t *value)
 {
-    char *instruction = NULL;
-    char *id = NULL;
-    char *time = NULL;
-    bool read = false;
-
-    DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Received JSON: %s", data));
-
-    json_scanf(data, strlen(data), 
-               "{id:%Q, instruction:%Q, time:%Q, read:%B}", 
-                &id, &instruction, &time, &read);
+    string_search_t search = {.path = path, .type = JSON_TYPE_NUMBER, .found = false};
 
+    if (json_walk(data, (int)length, find_string_cb, &search) < 0)
+    {
+        DEBUGING_ESP_LOG(ESP_LOGE(TAG, "Invalid JSON: %.*s", (int)length, data));
+        return ESP_FAIL;
+    }
+    if (!search.found)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
 
-    if (instruction == NULL) {
-        ESP_LOGE(TAG, "Instruction is missing in JSON");
-        LOG_MESSAGE_E(TAG,"Instruction is missing in JSON");
-        free(id);
-        free(time);
+    // The token is not null-terminated, strtol needs a bounded copy
+    char number[12];
+    if (search.token.len <= 0 || search.token.len >= (int)sizeof(number))
+    {
         return ESP_ERR_INVALID_ARG;
     }
-
-    if (strlen(instruction) >= msg_size) {
-        ESP_LOGE(TAG, "Message length exceeds buffer size");
-        LOG_MESSAGE_E(TAG,"Message length exceeds buffer size");
-        free(id);
-        free(instruction);
-        free(time);
-        return ESP_ERR_INVALID_SIZE;
+    memcpy(number, search.token.ptr, search.token.len);
+    number[search.token.len] = '\0';
+
+    // long is 32 bits on the ESP32, out of range values only show up in errno
+    char *end = NULL;
+    errno = 0;
+    long parsed = strtol(number, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed < INT32_MIN || parsed > INT32_MAX)
+    {
+        return ESP_ERR_INVALID_ARG;
     }
-
-    strncpy(msg, instruction, msg_size - 1);
-    msg[msg_size - 1] = '\0'; // Asegurar terminación nula
-
-    DEBUGING_ESP_LOG(ESP_LOGI(TAG, "Final parsed values -> Instruction: %s, Time: %s", instruction, time));
-
-    // Liberar memoria asignada dinámicamente
-    free(id);
-    free(instruction);
-    free(time);
-
+    *value = (int32_t)parsed;
     return ESP_OK;
 }
 
-
-
 /**
  * @brief Prints a JSON string to the log.
  *
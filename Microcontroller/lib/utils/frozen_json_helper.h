@@ -3,8 +3,9 @@
  * @author Guerrico Leonel (lguerrico@outlook.com)
  * @brief JSON Helper Library Header for ESP32 using Frozen JSON
  *
- * This file provides the function declarations for creating, parsing, and printing
- * JSON objects using the `Frozen JSON` library. These functions operate with fixed buffers
+ * This file provides the function declarations for parsing and printing
+ * JSON objects using the `Frozen JSON` library. JSON messages are built with
+ * the streaming encoder of json_writer.h. These functions operate with fixed buffers
  * to ensure memory efficiency in ESP32 applications.
  *
  * @version 1.0
@@ -20,37 +21,42 @@
 #define JSON_HELPER_H
 
 #include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
 
 
 /**
- * @brief Creates a JSON string from key-value pairs using Frozen JSON.
+ * @brief Finds a string value in a JSON document without copying it.
  *
- * @param[out] msg Buffer to store the JSON string.
- * @param[in] msg_size Size of the buffer.
- * @param[in] keys Array of keys for the JSON object.
- * @param[in] values Array of values corresponding to the keys.
- * @param[in] length Number of key-value pairs.
+ * @param[in] data The JSON document, it does not need to be null-terminated.
+ * @param[in] length Length of the document.
+ * @param[in] path Path of the value, e.g. ".instruction".
+ * @param[out] value Points into `data` at the first character of the string.
+ * @param[out] value_len Length of the string, still JSON escaped.
  *
  * @return
- * - `ESP_OK`: If the JSON string was successfully created.
- * - `ESP_FAIL`: If there was an error creating the JSON string.
+ * - `ESP_OK`: If the value was found.
+ * - `ESP_ERR_NOT_FOUND`: If there is no string at that path.
+ * - `ESP_FAIL`: If the document is not valid JSON.
  */
-esp_err_t create_json_data(char **msg, const char **keys, const char **values, size_t length);
+esp_err_t json_find_string(const char *data, size_t length, const char *path,
+                           const char **value, size_t *value_len);
 
 /**
- * @brief Deserializes a JSON string and extracts specific data using Frozen JSON.
+ * @brief Finds an integer value in a JSON document.
  *
- * @param[in] data The JSON string to parse.
- * @param[out] msg Buffer to store the extracted instruction.
- * @param[in] msg_size Length of the output buffer.
+ * @param[in] data The JSON document, it does not need to be null-terminated.
+ * @param[in] length Length of the document.
+ * @param[in] path Path of the value, e.g. ".argument".
+ * @param[out] value The integer found.
  *
  * @return
- * - `ESP_OK`: If the data was successfully deserialized.
- * - `ESP_ERR_INVALID_ARG`: If expected keys are missing.
- * - `ESP_ERR_INVALID_SIZE`: If the extracted instruction exceeds the buffer size.
- * - `ESP_FAIL`: If parsing fails.
+ * - `ESP_OK`: If the value was found.
+ * - `ESP_ERR_NOT_FOUND`: If there is no number at that path.
+ * - `ESP_ERR_INVALID_ARG`: If the number is not an integer or does not fit in 32 bits.
+ * - `ESP_FAIL`: If the document is not valid JSON.
  */
-esp_err_t deserialize_json_data(const char *data, char *msg, size_t msg_size);
+esp_err_t json_find_int(const char *data, size_t length, const char *path, int32_t *value);
 
 /**
  * @brief Prints a JSON string to the log.
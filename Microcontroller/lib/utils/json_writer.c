@@ -0,0 +1,189 @@
+/**
+ * @file json_writer.c
+ * @brief Implementation of the streaming JSON encoder.
+ *
+ * Numbers are converted by hand instead of with snprintf, every character
+ * goes through `put_char`, which is the only place that checks the bounds.
+ *
+ * @version 1.0
+ * @date 2025-03-20
+ */
+
+#include "json_writer.h"
+
+static void put_char(json_writer_t *w, char c)
+{
+    // One position is always kept for the terminating null
+    if (w->len + 1 >= w->size)
+    {
+        w->overflow = true;
+        return;
+    }
+    w->buf[w->len++] = c;
+}
+
+static void put_raw(json_writer_t *w, const char *str)
+{
+    while (*str)
+    {
+        put_char(w, *str++);
+    }
+}
+
+static void put_escaped(json_writer_t *w, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    put_char(w, '"');
+    for (; *str; str++)
+    {
+        unsigned char c = (unsigned char)*str;
+        switch (c)
+        {
+        case '"':
+            put_raw(w, "\\\"");
+            break;
+        case '\\':
+            put_raw(w, "\\\\");
+            break;
+        case '\n':
+            put_raw(w, "\\n");
+            break;
+        case '\r':
+            put_raw(w, "\\r");
+            break;
+        case '\t':
+            put_raw(w, "\\t");
+            break;
+        default:
+            if (c < 0x20)
+            {
+                put_raw(w, "\\u00");
+                put_char(w, hex[c >> 4]);
+                put_char(w, hex[c & 0x0F]);
+            }
+            else
+            {
+                put_char(w, (char)c);
+            }
+            break;
+        }
+    }
+    put_char(w, '"');
+}
+
+static void put_uint(json_writer_t *w, uint64_t value)
+{
+    char digits[20];
+    uint8_t n = 0;
+    do
+    {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (n > 0)
+    {
+        put_char(w, digits[--n]);
+    }
+}
+
+/* Separator and key of the next item of the open container */
+static void begin_item(json_writer_t *w, const char *key)
+{
+    uint8_t level = 1 << (w->depth - 1);
+    if (w->has_items & level)
+    {
+        put_char(w, ',');
+    }
+    w->has_items |= level;
+    if (key != NULL)
+    {
+        put_escaped(w, key);
+        put_char(w, ':');
+    }
+}
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size)
+{
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->depth = 1;
+    w->has_items = 0;
+    w->overflow = (buf == NULL || size == 0);
+    put_char(w, '{');
+}
+
+void json_writer_string(json_writer_t *w, const char *key, const char *value)
+{
+    begin_item(w, key);
+    put_escaped(w, value != NULL ? value : "");
+}
+
+void json_writer_int(json_writer_t *w, const char *key, int64_t value)
+{
+    begin_item(w, key);
+    if (value < 0)
+    {
+        put_char(w, '-');
+        put_uint(w, (uint64_t)0 - (uint64_t)value);
+    }
+    else
+    {
+        put_uint(w, (uint64_t)value);
+    }
+}
+
+void json_writer_uint(json_writer_t *w, const char *key, uint64_t value)
+{
+    begin_item(w, key);
+    put_uint(w, value);
+}
+
+void json_writer_bool(json_writer_t *w, const char *key, bool value)
+{
+    begin_item(w, key);
+    put_raw(w, value ? "true" : "false");
+}
+
+void json_writer_begin_array(json_writer_t *w, const char *key)
+{
+    begin_item(w, key);
+    if (w->depth >= JSON_WRITER_MAX_DEPTH)
+    {
+        w->overflow = true;
+        return;
+    }
+    w->depth++;
+    w->has_items &= ~(1 << (w->depth - 1));
+    put_char(w, '[');
+}
+
+void json_writer_end_array(json_writer_t *w)
+{
+    if (w->depth <= 1)
+    {
+        w->overflow = true;
+        return;
+    }
+    w->depth--;
+    put_char(w, ']');
+}
+
+esp_err_t json_writer_finish(json_writer_t *w)
+{
+    if (w->depth != 1)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    put_char(w, '}');
+    if (w->overflow)
+    {
+        if (w->buf != NULL && w->size > 0)
+        {
+            w->buf[0] = '\0';
+        }
+        return ESP_ERR_INVALID_SIZE;
+    }
+    w->buf[w->len] = '\0';
+    return ESP_OK;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file json_writer.h
+ * @brief Streaming JSON encoder writing into a fixed buffer.
+ *
+ * Builds a JSON object in a single pass straight into a buffer supplied by
+ * the caller, without allocating memory. Numbers and booleans are written
+ * as JSON numbers and literals, strings are escaped. Fields are appended in
+ * call order, arrays may be nested.
+ *
+ * Usage:
+ * @code
+ * char buf[64];
+ * json_writer_t w;
+ * json_writer_init(&w, buf, sizeof(buf));
+ * json_writer_int(&w, "level", 87);
+ * if (json_writer_finish(&w) == ESP_OK) { ... buf holds {"level":87} ... }
+ * @endcode
+ *
+ * @version 1.0
+ * @date 2025-03-20
+ *
+ * @note
+ * - Writing past the end of the buffer only sets an overflow flag, the error
+ *   is reported once by `json_writer_finish`.
+ * - A NULL key appends a value to the array currently open.
+ */
+
+#ifndef _JSON_WRITER_H_
+#define _JSON_WRITER_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_WRITER_MAX_DEPTH 8 // Nesting levels, the root object included
+
+/**
+ * @brief Encoder state, lives on the caller's stack.
+ */
+typedef struct
+{
+    char *buf;          ///< Output buffer
+    size_t size;        ///< Size of the output buffer
+    size_t len;         ///< Characters written so far
+    uint8_t depth;      ///< Open containers
+    uint8_t has_items;  ///< Bit per level, set once the level has an item
+    bool overflow;      ///< Buffer or nesting exceeded
+} json_writer_t;
+
+/**
+ * @brief Starts a JSON object in the given buffer.
+ *
+ * @param[out] w Encoder state.
+ * @param[out] buf Output buffer.
+ * @param[in] size Size of the output buffer, the terminating null included.
+ */
+void json_writer_init(json_writer_t *w, char *buf, size_t size);
+
+/**
+ * @brief Appends an escaped string field.
+ */
+void json_writer_string(json_writer_t *w, const char *key, const char *value);
+
+/**
+ * @brief Appends a signed integer field.
+ */
+void json_writer_int(json_writer_t *w, const char *key, int64_t value);
+
+/**
+ * @brief Appends an unsigned integer field.
+ */
+void json_writer_uint(json_writer_t *w, const char *key, uint64_t value);
+
+/**
+ * @brief Appends a boolean field.
+ */
+void json_writer_bool(json_writer_t *w, const char *key, bool value);
+
+/**
+ * @brief Opens an array, the following NULL key values go into it.
+ */
+void json_writer_begin_array(json_writer_t *w, const char *key);
+
+/**
+ * @brief Closes the array opened last.
+ */
+void json_writer_end_array(json_writer_t *w);
+
+/**
+ * @brief Closes the root object and terminates the string.
+ *
+ * @param[in,out] w Encoder state.
+ * @return
+ *      - ESP_OK: The buffer holds a complete JSON object, `w->len` characters long.
+ *      - ESP_ERR_INVALID_SIZE: The object did not fit in the buffer.
+ *      - ESP_ERR_INVALID_STATE: An array is still open.
+ */
+esp_err_t json_writer_finish(json_writer_t *w);
+
+#endif // _JSON_WRITER_H_
@@ -0,0 +1,199 @@
+/**
+ * @file bench_instruction_decode.c
+ * @brief Host benchmark of the instruction decoder.
+ *
+ * Compares the old decoder, `json_scanf` with `%Q` on id, instruction and
+ * time followed by a copy of the name, against `json_find_string` +
+ * `instruction_lookup`. Both run on the messages the backend sends, and the
+ * benchmark reports the time and the heap allocations per message.
+ *
+ * Built with the host gcc, from the Microcontroller directory:
+ *
+ *     gcc -O2 -Itest/host/include -Ilib/utils -Ilib/core \
+ *         test/host/bench_instruction_decode.c lib/utils/frozen.c \
+ *         lib/utils/frozen_json_helper.c lib/core/instruction_set.c \
+ *         -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free \
+ *         -o /tmp/bench_instruction_decode && /tmp/bench_instruction_decode
+ *
+ * The allocator is wrapped by the linker (`--wrap`) to count the calls made
+ * by frozen, nothing else allocates while a decoder runs.
+ *
+ * @version 1.0
+ * @date 2025-03-22
+ */
+
+#include "frozen.h"
+#include "frozen_json_helper.h"
+#include "instruction_set.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ITERATIONS 200000
+#define INSTRUCTION_MAX_LEN 20  /* Size of the buffer the old path copied the name into */
+
+/* Messages as serialized by the backend InstructionService */
+static const char *const messages[] = {
+    "{\"id\":\"63f7b9a6e94b1e456d2a3c9f\",\"instruction\":\"Forward\",\"time\":\"2024-12-05T14:30:00\",\"read\":false}",
+    "{\"id\":\"63f7b9a6e94b1e456d2a3ca0\",\"instruction\":\"Brake\",\"time\":\"2024-12-05T14:30:01\",\"read\":false}",
+    "{\"id\":\"63f7b9a6e94b1e456d2a3ca1\",\"instruction\":\"ProfileAccurate\",\"time\":\"2024-12-05T14:30:02\",\"read\":false}",
+    "{\"id\":\"63f7b9a6e94b1e456d2a3ca2\",\"instruction\":\"SweepPeriod\",\"time\":\"2024-12-05T14:30:03\",\"read\":false,\"argument\":2500}",
+    "{\"id\":\"63f7b9a6e94b1e456d2a3ca3\",\"instruction\":\"ScanSector\",\"time\":\"2024-12-05T14:30:04\",\"read\":false,\"start\":90,\"end\":270}",
+};
+#define MESSAGE_COUNT (sizeof(messages) / sizeof(messages[0]))
+
+/* Allocator wrappers, see the build line */
+static uint64_t allocations = 0;
+static uint64_t frees = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr != NULL)
+    {
+        frees++;
+    }
+    __real_free(ptr);
+}
+
+/* Needed by frozen_json_helper.c, messages are not published on the host */
+void LOG_MESSAGE(int level, const char *TAG, char *fmt)
+{
+    (void)level;
+    (void)TAG;
+    (void)fmt;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Old decoder (deserialize_json_data before the in place decoder): every
+ * string field is heap allocated, the name is copied into a fixed buffer
+ * and then mapped to an opcode.
+ */
+static instruction_opcode_t decode_json_scanf(const char *data, size_t length)
+{
+    char *instruction = NULL;
+    char *id = NULL;
+    char *time = NULL;
+    bool read = false;
+    char msg[INSTRUCTION_MAX_LEN];
+
+    json_scanf(data, (int)length, "{id:%Q, instruction:%Q, time:%Q, read:%B}",
+               &id, &instruction, &time, &read);
+
+    instruction_opcode_t opcode = INST_UNKNOWN;
+    if (instruction != NULL && strlen(instruction) < sizeof(msg))
+    {
+        strncpy(msg, instruction, sizeof(msg) - 1);
+        msg[sizeof(msg) - 1] = '\0';
+        opcode = instruction_lookup(msg, strlen(msg));
+    }
+    free(id);
+    free(instruction);
+    free(time);
+    return opcode;
+}
+
+/**
+ * Current decoder (handleInstructionMessage): the name is found in place and
+ * mapped to an opcode without being copied.
+ */
+static instruction_opcode_t decode_in_place(const char *data, size_t length)
+{
+    const char *name = NULL;
+    size_t name_len = 0;
+    if (json_find_string(data, length, ".instruction", &name, &name_len) != ESP_OK)
+    {
+        return INST_UNKNOWN;
+    }
+    return instruction_lookup(name, name_len);
+}
+
+typedef instruction_opcode_t (*decoder_t)(const char *data, size_t length);
+
+/**
+ * Runs a decoder over all the messages and prints the time and allocations
+ * per message. The opcodes are accumulated so the calls are not optimized out.
+ * @return Sum of the decoded opcodes, equal for both decoders
+ */
+static unsigned run(const char *label, decoder_t decoder, const size_t lengths[])
+{
+    unsigned checksum = 0;
+    uint64_t start_allocations = allocations;
+    uint64_t start_frees = frees;
+    int64_t start_us = esp_timer_get_time();
+
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (size_t m = 0; m < MESSAGE_COUNT; m++)
+        {
+            checksum += decoder(messages[m], lengths[m]);
+        }
+    }
+
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    double decoded = (double)ITERATIONS * MESSAGE_COUNT;
+    printf("%-28s %8.1f ns/msg %10.0f msg/s %6.2f allocs/msg %6.2f frees/msg\n",
+           label, elapsed_us * 1000.0 / decoded, decoded * 1e6 / (double)elapsed_us,
+           (allocations - start_allocations) / decoded, (frees - start_frees) / decoded);
+    return checksum;
+}
+
+int main(void)
+{
+    size_t lengths[MESSAGE_COUNT];
+    for (size_t m = 0; m < MESSAGE_COUNT; m++)
+    {
+        lengths[m] = strlen(messages[m]);
+        instruction_opcode_t old_opcode = decode_json_scanf(messages[m], lengths[m]);
+        instruction_opcode_t new_opcode = decode_in_place(messages[m], lengths[m]);
+        if (old_opcode == INST_UNKNOWN || old_opcode != new_opcode)
+        {
+            fprintf(stderr, "Decoders disagree on %s: %s / %s\n", messages[m],
+                    instruction_name(old_opcode), instruction_name(new_opcode));
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%d iterations over %zu messages\n", ITERATIONS, MESSAGE_COUNT);
+    unsigned old_checksum = run("json_scanf + copy", decode_json_scanf, lengths);
+    unsigned new_checksum = run("json_find_string + lookup", decode_in_place, lengths);
+    if (old_checksum != new_checksum)
+    {
+        fprintf(stderr, "Checksum mismatch: %u / %u\n", old_checksum, new_checksum);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file check_tier_log.c
+ * @brief Host check of the rate limited console log of debug_helper.h.
+ *
+ * TIER_LOG_EVERY_MS must log on the first call of a call site, then at most
+ * once per period. The clock is driven by the check.
+ *
+ * Built with the host gcc, from the Microcontroller directory, at any
+ * optimization level:
+ *
+ *     gcc -O2 -Itest/host/include -Ilib/utils test/host/check_tier_log.c \
+ *         -o /tmp/check_tier_log && /tmp/check_tier_log
+ *
+ * @version 1.0
+ * @date 2025-03-22
+ */
+
+#define LOG_MODULE_LEVEL LOG_INFO
+#include "debug_helper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Count the lines instead of printing them */
+static int logged = 0;
+#undef ESP_LOG_LEVEL
+#define ESP_LOG_LEVEL(level, tag, format, ...) do { (void)(level); (void)(tag); logged++; } while (0)
+
+static int64_t now_us = 0;
+
+int64_t esp_timer_get_time(void)
+{
+    return now_us;
+}
+
+static void log_every_second(void)
+{
+    TIER_LOG_EVERY_MS(LOG_WARNING, "CHECK", 1000, "every second");
+}
+
+static int failures = 0;
+
+static void expect(int expected, const char *what)
+{
+    if (logged != expected)
+    {
+        fprintf(stderr, "FAIL %s: %d lines, expected %d\n", what, logged, expected);
+        failures++;
+    }
+}
+
+int main(void)
+{
+    /* Right after boot the clock is far below the period */
+    now_us = 10;
+    log_every_second();
+    expect(1, "first call");
+
+    now_us += 999999;
+    log_every_second();
+    expect(1, "call inside the period");
+
+    now_us += 1;
+    log_every_second();
+    expect(2, "call after the period");
+
+    for (int i = 0; i < 100; i++)
+    {
+        now_us += 100000;
+        log_every_second();
+    }
+    expect(12, "10 s of calls every 100 ms");
+
+    if (failures == 0)
+    {
+        printf("TIER_LOG_EVERY_MS OK\n");
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,14 @@
+/**
+ * @file esp_timer.h
+ * @brief Host replacement of the ESP-IDF timer, for the host benchmarks.
+ */
+
+#ifndef HOST_ESP_TIMER_H
+#define HOST_ESP_TIMER_H
+
+#include <stdint.h>
+
+/** @brief Microseconds since an arbitrary point, defined by the benchmark */
+int64_t esp_timer_get_time(void);
+
+#endif /* HOST_ESP_TIMER_H */
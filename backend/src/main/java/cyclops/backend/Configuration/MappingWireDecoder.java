@@ -0,0 +1,156 @@
+/**
+ * Decoder of the packed mapping messages published by the ESP32 on the
+ * "MappingBin" topic (see Microcontroller/lib/connection/mapping_wire.h).
+ */
+package cyclops.backend.Configuration;
+
+import java.util.ArrayList;
+import java.util.List;
+
+import cyclops.backend.models.MappingValue;
+
+public class MappingWireDecoder {
+
+    public static final int MAGIC = 0xC7;
+    public static final int VERSION = 1;
+    public static final int TYPE_SAMPLES = 1;
+    public static final int TYPE_FRAME = 2;
+    private static final int HEADER_SIZE = 8;
+
+    private long lastSequence = -1;
+    private long lostMessages = 0;
+
+    /**
+     * Decodes one message into mapping values, one per sample or per frame bin.
+     *
+     * @param payload The raw message.
+     * @return The decoded values, in angle order for frames.
+     * @throws IllegalArgumentException If the message is malformed or has an unknown version.
+     */
+    public synchronized List<MappingValue> decode(byte[] payload) {
+        Reader in = new Reader(payload);
+        if (payload.length < HEADER_SIZE || in.readByte() != MAGIC) {
+            throw new IllegalArgumentException("Mensaje de mapeo sin cabecera valida");
+        }
+        int version = in.readByte();
+        if (version != VERSION) {
+            throw new IllegalArgumentException("Version de mensaje de mapeo desconocida: " + version);
+        }
+        int type = in.readByte();
+        in.readByte(); // flags, only the sweep direction for now
+        long sequence = in.readUInt32();
+        trackSequence(sequence);
+
+        switch (type) {
+            case TYPE_SAMPLES:
+                return decodeSamples(in);
+            case TYPE_FRAME:
+                return decodeFrame(in);
+            default:
+                throw new IllegalArgumentException("Tipo de mensaje de mapeo desconocido: " + type);
+        }
+    }
+
+    /**
+     * @return The number of messages missing in the sequence so far.
+     */
+    public synchronized long getLostMessages() {
+        return lostMessages;
+    }
+
+    private List<MappingValue> decodeSamples(Reader in) {
+        int count = (int) in.readVarint();
+        in.readVarint(); // time of the first sample, ms since boot
+        List<MappingValue> values = new ArrayList<>(count);
+        int angle = 0;
+        int distance = 0;
+        for (int i = 0; i < count; i++) {
+            angle += in.readSVarint();
+            distance += in.readSVarint();
+            in.readVarint(); // ms since the previous sample
+            values.add(newValue(angle, distance));
+        }
+        return values;
+    }
+
+    private List<MappingValue> decodeFrame(Reader in) {
+        in.readVarint(); // sweep id
+        in.readVarint(); // start, ms since boot
+        in.readVarint(); // duration in ms
+        in.readVarint(); // samples in the sweep
+        int bins = (int) in.readVarint();
+        List<MappingValue> values = new ArrayList<>(bins);
+        int angle = 0;
+        int distance = 0;
+        for (int i = 0; i < bins; i++) {
+            angle += (int) in.readVarint();
+            distance += in.readSVarint();
+            in.readVarint(); // samples averaged in the bin
+            values.add(newValue(angle, distance));
+        }
+        return values;
+    }
+
+    private void trackSequence(long sequence) {
+        if (lastSequence >= 0) {
+            long gap = (sequence - lastSequence - 1) & 0xFFFFFFFFL;
+            // A large gap means the ESP32 restarted and the count began again
+            if (gap > 0 && gap < 0x80000000L) {
+                lostMessages += gap;
+                System.out.println("Mensajes de mapeo perdidos: " + gap + " (total " + lostMessages + ")");
+            }
+        }
+        lastSequence = sequence;
+    }
+
+    private static MappingValue newValue(int angle, int distance) {
+        MappingValue value = new MappingValue();
+        value.setAngle(angle);
+        value.setDistance(distance);
+        return value;
+    }
+
+    /**
+     * Cursor over the message, throws when reading past its end.
+     */
+    private static class Reader {
+        private final byte[] data;
+        private int pos = 0;
+
+        Reader(byte[] data) {
+            this.data = data;
+        }
+
+        int readByte() {
+            if (pos >= data.length) {
+                throw new IllegalArgumentException("Mensaje de mapeo truncado");
+            }
+            return data[pos++] & 0xFF;
+        }
+
+        long readUInt32() {
+            long value = 0;
+            for (int i = 0; i < 4; i++) {
+                value |= (long) readByte() << (8 * i);
+            }
+            return value;
+        }
+
+        long readVarint() {
+            long value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                int b = readByte();
+                value |= (long) (b & 0x7F) << shift;
+                if ((b & 0x80) == 0) {
+                    return value;
+                }
+            }
+            throw new IllegalArgumentException("Varint demasiado largo");
+        }
+
+        int readSVarint() {
+            long raw = readVarint();
+            return (int) ((raw >>> 1) ^ -(raw & 1));
+        }
+    }
+}
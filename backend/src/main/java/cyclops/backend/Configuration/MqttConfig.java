@@ -1,5 +1,7 @@
 package cyclops.backend.Configuration;
 
+import java.nio.charset.StandardCharsets;
+
 import org.eclipse.paho.client.mqttv3.MqttConnectOptions;
 import org.springframework.context.annotation.Bean;
 import org.springframework.context.annotation.Configuration;
@@ -10,10 +12,12 @@ import org.springframework.integration.mqtt.core.DefaultMqttPahoClientFactory;
 import org.springframework.integration.mqtt.core.MqttPahoClientFactory;
 import org.springframework.integration.mqtt.inbound.MqttPahoMessageDrivenChannelAdapter;
 import org.springframework.integration.mqtt.outbound.MqttPahoMessageHandler;
+import org.springframework.integration.mqtt.support.DefaultPahoMessageConverter;
 import org.springframework.messaging.MessageChannel;
 import org.springframework.messaging.handler.annotation.Header;
 
 import com.fasterxml.jackson.core.JsonProcessingException;
+import com.fasterxml.jackson.databind.JsonNode;
 import com.fasterxml.jackson.databind.ObjectMapper;
 
 import cyclops.backend.models.BatteryLevel;
@@ -36,11 +40,12 @@ public class MqttConfig {
     // MQTT Broker Information
     private static final String BACKEND_IP = "192.168.4.2";
     private static final String[] serverUri = { "tcp://" + BACKEND_IP + ":1883" };
-    private static final String[] RTOPICS = { "Mapping", "Messages", "Battery", "Barrier" };
+    private static final String[] RTOPICS = { "Mapping", "MappingBin", "Scan", "Messages", "Battery", "Barrier" };
     private static final String[] STOPICS = { "Instruction" };
     private static final String BACKEND_ID = "backend-service"; // Unique backend ID
     private static final int RETRY_INTERVAL_MS = 2000; // Retry interval in milliseconds
     private volatile boolean running = true;
+    private final MappingWireDecoder mappingWireDecoder = new MappingWireDecoder();
 
     private final MappingValueService mappingValueService;
     private final MessageService messageService;
@@ -121,6 +126,10 @@ public class MqttConfig {
     public MessageProducer inbound() {
         MqttPahoMessageDrivenChannelAdapter adapter = new MqttPahoMessageDrivenChannelAdapter(BACKEND_ID + "-inbound",
                 mqttClientFactory(), RTOPICS);
+        // Payloads arrive as raw bytes, "MappingBin" is binary
+        DefaultPahoMessageConverter converter = new DefaultPahoMessageConverter();
+        converter.setPayloadAsBytes(true);
+        adapter.setConverter(converter);
         adapter.setOutputChannel(mqttInputChannel());
         adapter.setQos(1);
         monitorConnection(adapter); // Inicia el monitoreo de la conexión
@@ -139,13 +148,22 @@ public class MqttConfig {
      * Handles incoming MQTT messages.
      */
     @ServiceActivator(inputChannel = "mqttInputChannel")
-    public void handleMqttMessage(@Header("mqtt_receivedTopic") String topic, String payload) {
+    public void handleMqttMessage(@Header("mqtt_receivedTopic") String topic, byte[] rawPayload) {
+        if (topic.equals("MappingBin")) {
+            saveMappingWire(rawPayload);
+            return;
+        }
+
+        String payload = new String(rawPayload, StandardCharsets.UTF_8);
         System.out.println("Tópico: " + topic + " - Mensaje recibido: " + payload);
 
         switch (topic) {
             case "Mapping":
                 saveMappingValue(payload);
                 break;
+            case "Scan":
+                saveScanFrame(payload);
+                break;
             case "Messages":
                 saveMessage(payload);
                 break;
@@ -168,6 +186,38 @@ public class MqttConfig {
 
     }
 
+    /**
+     * Stores every bin of a scan frame (one servo sweep) as a mapping value.
+     * Bins come as [angle, distance, count].
+     */
+    private void saveScanFrame(String payload) {
+        ObjectMapper mapper = new ObjectMapper();
+        try {
+            JsonNode frame = mapper.readTree(payload);
+            for (JsonNode bin : frame.path("bins")) {
+                MappingValue value = new MappingValue();
+                value.setAngle(bin.get(0).asInt());
+                value.setDistance(bin.get(1).asInt());
+                mappingValueService.saveSensorValue(value);
+            }
+        } catch (JsonProcessingException e) {
+            e.printStackTrace();
+        }
+    }
+
+    /**
+     * Stores the samples or frame bins of a packed mapping message.
+     */
+    private void saveMappingWire(byte[] payload) {
+        try {
+            for (MappingValue value : mappingWireDecoder.decode(payload)) {
+                mappingValueService.saveSensorValue(value);
+            }
+        } catch (IllegalArgumentException e) {
+            System.err.println("Mensaje de mapeo descartado: " + e.getMessage());
+        }
+    }
+
     private void saveMessage(String payload) {
         ObjectMapper mapper = new ObjectMapper();
         try {
@@ -35,9 +35,15 @@ public class InstructionController {
     @Operation(summary = "Save a new instruction", description = "Stores a new instruction in the database")
     @ApiResponses({
             @ApiResponse(responseCode = "200", description = "Instruction saved successfully"),
-            @ApiResponse(responseCode = "400", description = "Invalid request body", content = @Content)
+            @ApiResponse(responseCode = "400", description = "Invalid request body or sector", content = @Content)
     })
     public void saveInstruction(@RequestBody Instruction instruction) {
+        if (!instruction.hasValidSector()) {
+            throw new ResponseStatusException(HttpStatus.BAD_REQUEST,
+                    "Invalid sector: start and end must be between " + Instruction.SECTOR_MIN_DEG + " and "
+                            + Instruction.SECTOR_MAX_DEG + ", at least " + Instruction.SECTOR_MIN_WIDTH_DEG
+                            + " degrees apart and start < end");
+        }
         instructionService.saveInstruction(instruction);
     }
 
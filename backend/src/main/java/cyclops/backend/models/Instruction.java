@@ -6,13 +6,23 @@ import org.springframework.data.annotation.CreatedDate;
 import org.springframework.data.annotation.Id;
 import org.springframework.data.mongodb.core.mapping.TimeSeries;
 
+import com.fasterxml.jackson.annotation.JsonIgnore;
+
 import io.swagger.v3.oas.annotations.media.Schema;
+import jakarta.validation.constraints.Max;
+import jakarta.validation.constraints.Min;
 import jakarta.validation.constraints.NotBlank;
 
 @TimeSeries(collection = "Instruction", timeField = "time")
 @Schema(description = "Model representing an instruction sent to the system")
 public class Instruction {
 
+    /* Sector limits of the firmware (servo.h): the servo only sweeps between
+     * the limit switches and narrower sectors are rejected */
+    public static final int SECTOR_MIN_DEG = 30;
+    public static final int SECTOR_MAX_DEG = 330;
+    public static final int SECTOR_MIN_WIDTH_DEG = 20;
+
     @Id
     @Schema(description = "Unique identifier of the instruction", example = "63f7b9a6e94b1e456d2a3c9f")
     private String id;
@@ -28,6 +38,23 @@ public class Instruction {
     @Schema(description = "Indicates whether the instruction has been read", example = "false")
     private boolean read = false;
 
+    @Schema(description = "Optional numeric argument (SweepPeriod in ms, ScanDensity in points per degree x10)", example = "2500", nullable = true)
+    private Integer argument;
+
+    @Min(SECTOR_MIN_DEG)
+    @Max(SECTOR_MAX_DEG)
+    @Schema(description = "Start angle in degrees of the sector to scan (ScanSector only). "
+            + "Between 30 and 330, at least 20 degrees below end. Omit start and end to scan the full range",
+            example = "90", minimum = "30", maximum = "330", nullable = true)
+    private Integer start;
+
+    @Min(SECTOR_MIN_DEG)
+    @Max(SECTOR_MAX_DEG)
+    @Schema(description = "End angle in degrees of the sector to scan (ScanSector only). "
+            + "Between 30 and 330, at least 20 degrees above start. Omit start and end to scan the full range",
+            example = "270", minimum = "30", maximum = "330", nullable = true)
+    private Integer end;
+
     public LocalDateTime getTime() {
         return time;
     }
@@ -73,12 +100,56 @@ public class Instruction {
         return read;
     }
 
+    public Integer getArgument() {
+        return argument;
+    }
+
+    public void setArgument(Integer argument) {
+        this.argument = argument;
+    }
+
+    public Integer getStart() {
+        return start;
+    }
+
+    public void setStart(Integer start) {
+        this.start = start;
+    }
+
+    public Integer getEnd() {
+        return end;
+    }
+
+    public void setEnd(Integer end) {
+        this.end = end;
+    }
+
+    /**
+     * Checks the sector with the same rule as the firmware: both angles or
+     * none, between the limit switches and at least SECTOR_MIN_WIDTH_DEG wide.
+     *
+     * @return true if the sector can be sent to the robot.
+     */
+    @JsonIgnore
+    public boolean hasValidSector() {
+        if (start == null && end == null) {
+            return true;
+        }
+        if (start == null || end == null) {
+            return false;
+        }
+        return start >= SECTOR_MIN_DEG && end <= SECTOR_MAX_DEG && end - start >= SECTOR_MIN_WIDTH_DEG;
+    }
+
     @Override
     public String toString() {
         return "Instruction{" +
                 "id='" + id + '\'' +
                 ", instruction='" + instruction + '\'' +
                 ", date=" + time +
+                ", argument=" + argument +
+                ", start=" + start +
+                ", end=" + end +
                 '}';
     }
 
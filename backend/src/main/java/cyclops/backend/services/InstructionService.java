@@ -15,6 +15,7 @@ import org.springframework.messaging.support.MessageBuilder;
 import org.springframework.stereotype.Service;
 import org.springframework.transaction.annotation.Transactional;
 
+import com.fasterxml.jackson.annotation.JsonInclude;
 import com.fasterxml.jackson.core.JsonProcessingException;
 import com.fasterxml.jackson.databind.ObjectMapper;
 
@@ -70,6 +71,8 @@ public class InstructionService {
 
     /**
      * Convierte una instrucción en una cadena JSON.
+     * Los campos opcionales (argument, start, end) solo se incluyen si tienen
+     * valor; el microcontrolador usa 0 o el rango completo cuando faltan.
      * 
      * @param instruction La instrucción a convertir.
      * @return Representación JSON de la instrucción.
@@ -78,6 +81,7 @@ public class InstructionService {
         // Convertir la instrucción en formato adecuado para enviar (puede ser JSON, por
         // ejemplo)
         ObjectMapper mapper = new ObjectMapper();
+        mapper.setSerializationInclusion(JsonInclude.Include.NON_NULL);
         try {
             return mapper.writeValueAsString(instruction);
         } catch (JsonProcessingException e) {